@@ -4,29 +4,49 @@
 
 #include <unistd.h>
 #include <stdlib.h>
-#include <gtk/gtk.h>
+#include <string.h>
+#include <glib.h>
 #include <gst/gst.h>
+#if GST_VERSION_MAJOR != (0)
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#endif
 #include "mygstreamer.h"
 #include "audio.h"
-
-static inline GstStateChangeReturn _change_state (CustomData *data, GstState state) {
-    return gst_element_set_state (data->pipeline, state);
-}
-
-GstStateChangeReturn audio_stop_player (CustomData *data) {
-    return _change_state (data, GST_STATE_READY);
-}
-
-GstStateChangeReturn audio_pause_player (CustomData *data) {
-    return _change_state (data, GST_STATE_PAUSED);
-}
-
-GstStateChangeReturn audio_play_player (CustomData *data) {
-    return _change_state (data, GST_STATE_PLAYING);
-}
-
-static void pad_added_handler (GstElement *src, GstPad *new_pad, CustomData *data) {
-    GstPad *sink_pad = gst_element_get_static_pad (data->audioconvert, "sink");
+#include "engine.h"
+#include "jackclock.h"
+#include "metrics.h"
+#include "resample.h"
+#include "seektable.h"
+
+#define AUDIO_PREROLL_TIMEOUT (10 * GST_SECOND)
+#define AUDIO_PREBUFFER_WAIT_US (10 * G_USEC_PER_SEC)
+#define AUDIO_PREBUFFER_POLL_US 10000
+#define AUDIO_STREAM_TIMEOUT_S 5        /* A silent connection is a dropped one */
+#define AUDIO_SILENCE_URI "appsrc://4deckradio-silence"
+
+struct _AudioInit {
+    GThreadPool *pool;
+    CustomData *decks;
+    int autoconnect;
+    gint failed;
+};
+
+static gboolean accurate_seek;
+static gboolean null_sink;
+static guint prebuffer_ms = AUDIO_DEFAULT_PREBUFFER_MS;
+static gchar *silence_uri;
+static GMutex slot_lock;            /* Decks are built in parallel */
+
+/* A WAV header without any samples */
+static const guint8 silentwave[] = {0x52, 0x49, 0x46, 0x46, 0x24, 0x00, 0x00, 0x00, 0x57,
+        0x41, 0x56, 0x45, 0x66, 0x6D, 0x74, 0x20, 0x10, 0x00, 0x00, 0x00,
+        0x01, 0x00, 0x02, 0x00, 0x80, 0xBB, 0x00, 0x00, 0x00, 0xEE, 0x02,
+        0x00, 0x04, 0x00, 0x10, 0x00, 0x64, 0x61, 0x74, 0x61, 0x00, 0x00,
+        0x00, 0x00};
+
+static void pad_added_handler (GstElement *src, GstPad *new_pad, AudioChain *chain) {
+    GstPad *sink_pad = gst_element_get_static_pad (chain->audioconvert, "sink");
     GstPadLinkReturn ret;
     GstCaps *new_pad_caps = NULL;
     GstStructure *new_pad_struct = NULL;
@@ -81,28 +101,257 @@ static GstElement* create_gst_element (const gchar *what, const gchar *name) {
     return target;
 }
 
-void audio_set_uri(CustomData *data, const gchar *uri) {
-    data->is_network_stream = g_str_has_prefix(uri, "http://");
-    g_object_set (data->uridecodebin, "uri", uri, NULL);
-    data->duration = GST_CLOCK_TIME_NONE;
+/* HTTP, HTTPS and Icecast (icy://, icyx://) */
+gboolean audio_uri_is_stream(const gchar *uri) {
+    static const gchar *schemes[] = { "http://", "https://", "icy://", "icyx://" };
+
+    for (guint i = 0; i < G_N_ELEMENTS (schemes); i++) {
+        if (0 == g_ascii_strncasecmp (uri, schemes[i], strlen (schemes[i]))) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* The placeholder made by audio_make_silence() */
+gboolean audio_uri_is_silence(const gchar *uri) {
+    return NULL != silence_uri && 0 == g_strcmp0 (uri, silence_uri);
+}
+
+/* How much of a network stream to hold before it starts playing */
+void audio_set_prebuffer(guint ms) {
+    prebuffer_ms = ms;
 }
 
-gboolean audio_seek(CustomData *data, gdouble value) {
-    return gst_element_seek_simple (data->pipeline,
+/* Only touches the decoder, the gain stage and the resampler, so it's safe
+ * to call from the deck worker, with the chain in READY. gain is the
+ * track's loudness normalisation, seektable (may be NULL) is taken over.
+ */
+void audio_chain_set_uri(AudioChain *chain, const gchar *uri, gdouble gain,
+        SeekTable *seektable) {
+    gboolean stream = audio_uri_is_stream (uri);
+    ResampleQuality quality = resample_get_quality ((gint)chain->deck,
+            stream ? RESAMPLE_CLASS_STREAM : RESAMPLE_CLASS_FILE);
+
+    /* streams go through a queue2 in uridecodebin, which reports how full it is */
+    g_object_set (chain->uridecodebin, "uri", uri,
+            "use-buffering", stream,
+            "buffer-duration", stream ? (gint64)(prebuffer_ms * GST_MSECOND) : (gint64)-1,
+            NULL);
+    /* the engine applies it while converting, the gain stage passes through */
+    if (NULL != chain->slot) {
+        engine_slot_set_gain (chain->slot, gain);
+        engine_slot_set_quality (chain->slot, quality);
+        gain = 1.0;
+    }
+    g_object_set (chain->volume, "volume", gain, NULL);
+    g_object_set (chain->audioresample, "quality", resample_get_gst_quality (quality), NULL);
+
+    /* the first decoded buffer stops the clock, see metrics.c */
+    if (stream) {
+        metrics_timer_start (&chain->metrics->first_audio);
+    } else {
+        metrics_timer_cancel (&chain->metrics->first_audio);
+    }
+
+    seektable_unref (chain->seektable);
+    chain->seektable = seektable;
+}
+
+/* Decks built from now on play into a fakesink, unsynchronised: nothing
+ * is heard and no jackd is needed. For the soak test (soakbench.c).
+ */
+void audio_set_null_sink(gboolean null) {
+    null_sink = null;
+}
+
+/* Seek to exactly the requested sample instead of the closest keyframe */
+void audio_set_accurate_seek(gboolean accurate) {
+    accurate_seek = accurate;
+}
+
+/* Every seek keeps cue_out as the segment stop, so the pipeline posts EOS
+ * there and the deck moves on as if the file ended. The cues come from
+ * the caller: on the deck worker the chain's own are the main loop's.
+ */
+static gboolean chain_seek(AudioChain *chain, gint64 position, gint64 cue_out,
+        gboolean accurate) {
+    gboolean ret;
+
+    /* keep the old position out of the engine ring */
+    if (chain->slot) {
+        engine_slot_flush (chain->slot, TRUE);
+    }
+
+    metrics_timer_start (&chain->metrics->seek);
+    ret = gst_element_seek (chain->pipeline, 1.0,
             GST_FORMAT_TIME,
-            GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SKIP,
-            (gint64)(value * GST_SECOND));
+            accurate ? GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE :
+                GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SKIP,
+            GST_SEEK_TYPE_SET, position,
+            GST_CLOCK_TIME_IS_VALID (cue_out) ? GST_SEEK_TYPE_SET : GST_SEEK_TYPE_NONE,
+            cue_out);
+    if (!ret) {
+        metrics_timer_cancel (&chain->metrics->seek);
+    }
+
+    if (chain->slot) {
+        engine_slot_flush (chain->slot, FALSE);
+    }
+
+    return ret;
 }
 
-inline gboolean audio_is_playing(CustomData *data) {
-    return (data->state == GST_STATE_PLAYING);
+/* A seek by the user, to the keyframe unless --accurate-seek */
+gboolean audio_chain_seek(AudioChain *chain, gdouble value, gint64 cue_out) {
+    return chain_seek (chain, (gint64)(value * GST_SECOND), cue_out, accurate_seek);
 }
 
-void audio_pseudo_stop(CustomData *data) {
-    audio_seek (data, 0.0);
-    audio_pause_player (data);
+/* How full the stream buffer is, 100 if there is none */
+static gint chain_buffering(AudioChain *chain) {
+    GstQuery *query = gst_query_new_buffering (GST_FORMAT_TIME);
+    gint percent = 100;
+
+    if (gst_element_query (chain->pipeline, query)) {
+        gst_query_parse_buffering_percent (query, NULL, &percent);
+    }
+
+    gst_query_unref (query);
+    return percent;
+}
+
+/* Hold a network stream in PAUSED until its prebuffer is full. Gives up
+ * after AUDIO_PREBUFFER_WAIT_US, or as soon as another job is queued for
+ * the chain. For the deck worker.
+ */
+void audio_chain_prebuffer(AudioChain *chain) {
+    gint64 start = g_get_monotonic_time ();
+    gint percent;
+
+    audio_chain_set_state (chain, GST_STATE_PAUSED);
+
+    while ((percent = chain_buffering (chain)) < 100 &&
+            g_atomic_int_get (&chain->pending_jobs) <= 1 &&
+            g_get_monotonic_time () - start < AUDIO_PREBUFFER_WAIT_US) {
+        g_usleep (AUDIO_PREBUFFER_POLL_US);
+    }
+
+    if (percent < 100) {
+        g_printerr ("Starting %s with %d%% of its prebuffer\n", chain->uri, percent);
+    }
 }
 
+/* Wait for the preroll, then go to cue-in. Always to the sample: a
+ * keyframe would start the deck early, or skip the first notes. For the
+ * deck worker.
+ */
+gboolean audio_chain_cue(AudioChain *chain, gint64 cue_in, gint64 cue_out) {
+    gst_element_get_state (chain->pipeline, NULL, NULL, AUDIO_PREROLL_TIMEOUT);
+
+    return chain_seek (chain, cue_in, cue_out, TRUE);
+}
+
+/* On the main loop, which owns the chain's cues */
+gboolean audio_chain_has_cues(AudioChain *chain) {
+    return (chain->cue_in > 0 || GST_CLOCK_TIME_IS_VALID (chain->cue_out));
+}
+
+/* Wraps gst_element_set_state so the engine stops pulling from the ring
+ * before the pipeline leaves PLAYING, and starts after it got there.
+ */
+GstStateChangeReturn audio_chain_set_state(AudioChain *chain, GstState state) {
+    GstStateChangeReturn ret;
+    gboolean preroll = (state >= GST_STATE_PAUSED &&
+            GST_STATE (chain->pipeline) <= GST_STATE_READY);
+
+    /* ASYNC_DONE stops the clock, see metrics.c */
+    if (preroll) {
+        metrics_timer_start (&chain->metrics->preroll);
+    }
+
+    if (NULL != chain->slot) {
+        if (state < GST_STATE_PLAYING) {
+            /* leaving PAUSED drops the data in the pipeline, the ring too */
+            engine_slot_stop (chain->slot, state <= GST_STATE_READY);
+        } else {
+            engine_slot_start (chain->slot);
+        }
+    }
+
+    ret = gst_element_set_state (chain->pipeline, state);
+
+    if (NULL != chain->slot && state <= GST_STATE_READY) {
+        engine_slot_flush (chain->slot, FALSE);
+    }
+
+    /* stopped before the swapped in file got going */
+    if (state <= GST_STATE_READY) {
+        metrics_timer_cancel (&chain->metrics->follow_on);
+    }
+
+    /* live streams don't preroll */
+    if (preroll && GST_STATE_CHANGE_ASYNC != ret) {
+        metrics_timer_cancel (&chain->metrics->preroll);
+    }
+
+    return ret;
+}
+
+/* Make the standby chain the active one. Stopping the previously active
+ * chain is up to the caller.
+ */
+void audio_swap_standby(CustomData *data) {
+    AudioChain *old = data->active;
+
+    data->active = data->standby;
+    data->standby = old;
+    data->duration = GST_CLOCK_TIME_NONE;
+}
+
+AudioChain* audio_chain_from_bus(CustomData *data, GstBus *bus) {
+    if (bus == data->active->bus) {
+        return data->active;
+    }
+
+    return data->standby;
+}
+
+/* Network sources give up on a connection that went quiet, so the deck
+ * can reconnect instead of waiting forever
+ */
+static void source_setup_cb(GstElement *uridecodebin, GstElement *source, AudioChain *chain) {
+    GObjectClass *klass = G_OBJECT_GET_CLASS (source);
+
+#if GST_VERSION_MAJOR != (0)
+    /* the silence, see audio_make_silence() */
+    if (GST_IS_APP_SRC (source)) {
+        gst_app_src_push_buffer (GST_APP_SRC (source),
+                gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, (gpointer)silentwave,
+                    sizeof (silentwave), 0, sizeof (silentwave), NULL, NULL));
+        gst_app_src_end_of_stream (GST_APP_SRC (source));
+        return;
+    }
+#endif
+
+    if (NULL != g_object_class_find_property (klass, "timeout")) {
+        g_object_set (source, "timeout", AUDIO_STREAM_TIMEOUT_S, NULL);
+    }
+    if (NULL != g_object_class_find_property (klass, "user-agent")) {
+        g_object_set (source, "user-agent", "4deckradio", NULL);
+    }
+}
+
+#if GST_CHECK_VERSION (1, 10, 0)
+/* Give the file's parser the seek table. The table only changes in READY,
+ * when there is no streaming thread to add elements.
+ */
+static void deep_element_added_cb (GstBin *bin, GstBin *sub_bin, GstElement *element,
+        AudioChain *chain) {
+    seektable_watch_parser (chain->seektable, element);
+}
+#endif
+
 static gboolean link_elements_with_filter (GstElement *element1, GstElement *element2) {
     gboolean link_ok;
     GstCaps *caps;
@@ -129,32 +378,58 @@ static gboolean link_elements_with_filter (GstElement *element1, GstElement *ele
 }
 
 
-int init_audio(CustomData *data, guint decknumber, int autoconnect) {
-    data->duration = GST_CLOCK_TIME_NONE;
+static int init_chain(AudioChain *chain, guint decknumber, int autoconnect,
+        DeckMetrics *metrics) {
+    GstPad *pad;
 
-    /* Create the elements */
-    data->pipeline = gst_pipeline_new("test");
+    chain->cue_out = GST_CLOCK_TIME_NONE;
+    chain->deck = decknumber;
 
-    data->uridecodebin = create_gst_element ("uridecodebin", "uri_decodebin");
-    data->audioconvert = create_gst_element ("audioconvert", "audio_convert");
-    data->audioresample = create_gst_element ("audioresample", "audio_resample");
-    data->jackaudiosink = create_gst_element ("jackaudiosink", "jack_audiosink");
+    /* Create the elements */
+    chain->pipeline = gst_pipeline_new("test");
+
+    chain->uridecodebin = create_gst_element ("uridecodebin", "uri_decodebin");
+    chain->audioconvert = create_gst_element ("audioconvert", "audio_convert");
+    chain->volume = create_gst_element ("volume", "gain");
+    chain->audioresample = create_gst_element ("audioresample", "audio_resample");
+    if (null_sink) {
+        chain->audiosink = create_gst_element ("fakesink", "null_sink");
+    } else if (engine_is_running ()) {
+        chain->audiosink = create_gst_element ("appsink", "engine_sink");
+    } else {
+        chain->audiosink = create_gst_element ("jackaudiosink", "jack_audiosink");
+    }
 
-    if (!data->pipeline || !data->uridecodebin || !data->audioresample ||
-            !data->jackaudiosink) {
+    if (!chain->pipeline || !chain->uridecodebin || !chain->volume ||
+            !chain->audioresample || !chain->audiosink) {
         g_printerr ("Not all elements could be created.\n");
         return 1;
     }
 
 
-    gst_bin_add_many (GST_BIN (data->pipeline), data->uridecodebin,
-            data->audioconvert, data->audioresample, data->jackaudiosink, NULL);
-
-    {
-        /* settings that control interaction with jackd */
+    gst_bin_add_many (GST_BIN (chain->pipeline), chain->uridecodebin,
+            chain->audioconvert, chain->volume, chain->audioresample,
+            chain->audiosink, NULL);
+
+    if (null_sink) {
+        /* as fast as the decoder goes, an hour of audio takes seconds */
+        g_object_set (chain->audiosink, "sync", FALSE, NULL);
+    } else if (engine_is_running ()) {
+        /* the engine's ring buffer, its client owns the jack ports */
+        g_mutex_lock (&slot_lock);
+        chain->slot = engine_slot_new (decknumber, chain->audiosink);
+        g_mutex_unlock (&slot_lock);
+        if (NULL == chain->slot) {
+            g_printerr ("No engine slot left for deck %u\n", decknumber);
+            return 1;
+        }
+    } else {
+        /* settings that control interaction with jackd. Both chains of a
+         * deck use the same client name, so they share one jack client.
+         */
         gchar *name;
         name = g_strdup_printf("player-%u", decknumber);
-        g_object_set (data->jackaudiosink, "client-name", name, NULL);
+        g_object_set (chain->audiosink, "client-name", name, NULL);
         g_free (name);
 
         /*
@@ -164,23 +439,170 @@ Enum "GstJackConnect" Default: 1, "auto"
 (1): auto             - Automatically connect ports to physical ports
 (2): auto-forced      - Automatically connect ports to as many physical ports as possible
 */
-        g_object_set (data->jackaudiosink, "connect", autoconnect, NULL);
+        g_object_set (chain->audiosink, "connect", autoconnect, NULL);
     }
 
-    if (TRUE != gst_element_link_many (data->audioresample, data->jackaudiosink, NULL)) {
+    if (TRUE != gst_element_link_many (chain->audioconvert, chain->volume, NULL) ||
+            TRUE != gst_element_link_many (chain->audioresample, chain->audiosink, NULL)) {
         g_printerr ("Problems linking bins\n");
         exit (1);
     }
 
     /* Force the pipe to stereo */
-    if (TRUE != link_elements_with_filter (data->audioconvert,
-                data->audioresample)) {
+    if (TRUE != link_elements_with_filter (chain->volume,
+                chain->audioresample)) {
         exit (1);
     }
 
     /* Connect to the pad-added signal */
-    g_signal_connect (data->uridecodebin, "pad-added", G_CALLBACK (pad_added_handler), data);
+    g_signal_connect (chain->uridecodebin, "pad-added", G_CALLBACK (pad_added_handler), chain);
+    g_signal_connect (chain->uridecodebin, "source-setup", G_CALLBACK (source_setup_cb), chain);
+#if GST_CHECK_VERSION (1, 10, 0)
+    g_signal_connect (chain->pipeline, "deep-element-added", G_CALLBACK (deep_element_added_cb), chain);
+#endif
+
+    /* all decks count the same jack frames */
+    jackclock_use (chain->pipeline);
 
+    chain->bus = gst_element_get_bus (chain->pipeline);
+
+    pad = gst_element_get_static_pad (chain->audioconvert, "sink");
+    chain->metrics = metrics_chain_new (metrics, chain->bus, pad);
+    gst_object_unref (pad);
 
     return 0;
 }
+
+int init_audio(CustomData *data, guint decknumber, int autoconnect) {
+    data->duration = GST_CLOCK_TIME_NONE;
+    data->decknumber = decknumber;
+
+    data->active = g_new0 (AudioChain, 1);
+    data->standby = g_new0 (AudioChain, 1);
+    data->metrics = g_new0 (DeckMetrics, 1);
+
+    if (0 != init_chain (data->active, decknumber, autoconnect, data->metrics)) {
+        return 1;
+    }
+
+    return init_chain (data->standby, decknumber, autoconnect, data->metrics);
+}
+
+static void init_worker(CustomData *data, AudioInit *init) {
+    if (0 != init_audio (data, data - init->decks, init->autoconnect)) {
+        g_atomic_int_inc (&init->failed);
+    }
+}
+
+/* Build the pipelines of all decks on a thread per processor, while the
+ * caller goes on with something else. audio_init_decks_finish() waits
+ * for them.
+ */
+AudioInit* audio_init_decks_start(CustomData *decks, guint ndecks, int autoconnect) {
+    AudioInit *init = g_new0 (AudioInit, 1);
+
+    init->decks = decks;
+    init->autoconnect = autoconnect;
+    init->pool = g_thread_pool_new ((GFunc)init_worker, init,
+            MIN (g_get_num_processors (), ndecks), FALSE, NULL);
+
+    for (guint i = 0; i < ndecks; i++) {
+        g_thread_pool_push (init->pool, &decks[i], NULL);
+    }
+
+    return init;
+}
+
+/* FALSE if any deck couldn't be built */
+gboolean audio_init_decks_finish(AudioInit *init) {
+    gboolean ok;
+
+    g_thread_pool_free (init->pool, FALSE, TRUE);
+    ok = (0 == init->failed);
+    g_free (init);
+
+    return ok;
+}
+
+static void free_chain(AudioChain *chain) {
+    audio_chain_set_state (chain, GST_STATE_NULL);
+    gst_object_unref (chain->bus);
+    gst_object_unref (chain->pipeline);
+    if (chain->slot) {
+        engine_slot_free (chain->slot);
+    }
+    seektable_unref (chain->seektable);
+    metrics_chain_free (chain->metrics);
+    g_free (chain->uri);
+    g_free (chain);
+}
+
+void free_audio(CustomData *data) {
+    free_chain (data->active);
+    free_chain (data->standby);
+    data->active = data->standby = NULL;
+    g_free (data->metrics);
+    data->metrics = NULL;
+}
+
+#if GST_VERSION_MAJOR == (0)
+static gchar *dummyuri(void) {
+        return g_strdup_printf ("file:///");
+}
+
+static gchar* make_silence(void) {
+        GError *error = NULL;
+        gchar *tmpfilename;
+        GIOChannel *outfile;
+        gsize bytes_written;
+
+        g_clear_error (&error);
+        gint fd = g_file_open_tmp (NULL, &tmpfilename, &error);
+
+        if (-1 == fd) {
+                g_print ("Unable to create tmp file: %s\n", error->message);
+                g_error_free (error);
+                return dummyuri();
+        }
+
+        outfile = g_io_channel_unix_new (fd);
+
+        /* make it a binary channel */
+        if (G_IO_STATUS_NORMAL != g_io_channel_set_encoding (outfile, NULL, NULL)) {
+                g_print ("Unable to create tmpfile in binary mode\n");
+                return dummyuri();
+        }
+
+        g_print ("File is %lu\n", sizeof(*silentwave));
+
+        g_clear_error (&error);
+        if (G_IO_STATUS_NORMAL != g_io_channel_write_chars (outfile, (const gchar *)silentwave, sizeof(silentwave), &bytes_written, &error)) {
+                g_print ("Unable to write to tmpfile: %s\n", error->message);
+                g_error_free (error);
+                return dummyuri();
+        }
+
+        g_io_channel_shutdown (outfile, TRUE, NULL);
+        g_io_channel_unref (outfile);
+
+        close(fd);
+
+        return g_filename_to_uri (tmpfilename, NULL, NULL);
+}
+#endif
+
+/* A tiny silent WAV file, to get the jack ports of a deck up before
+ * anything is loaded. Served from memory by an appsrc; 0.10 writes it to
+ * the temp dir.
+ */
+gchar* audio_make_silence(void) {
+#if GST_VERSION_MAJOR == (0)
+        gchar *uri = make_silence ();
+#else
+        gchar *uri = g_strdup (AUDIO_SILENCE_URI);
+#endif
+
+        g_free (silence_uri);
+        silence_uri = g_strdup (uri);
+        return uri;
+}
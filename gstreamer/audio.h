@@ -5,13 +5,28 @@
 #ifndef _AUDIO_H
 #define _AUDIO_H
 
+#define AUDIO_DEFAULT_PREBUFFER_MS 1000
+
+typedef struct _AudioInit AudioInit;
+
 int init_audio(CustomData *data, guint decknumber, int autoconnect);
-void audio_set_uri(CustomData *data, const gchar *uri);
-void audio_pseudo_stop(CustomData *data);
-GstStateChangeReturn audio_stop_player (CustomData *data);
-GstStateChangeReturn audio_pause_player (CustomData *data);
-GstStateChangeReturn audio_play_player (CustomData *data);
-gboolean audio_seek(CustomData *data, gdouble value);
-gboolean audio_is_playing(CustomData *data);
+AudioInit* audio_init_decks_start(CustomData *decks, guint ndecks, int autoconnect);
+gboolean audio_init_decks_finish(AudioInit *init);
+void free_audio(CustomData *data);
+gboolean audio_uri_is_stream(const gchar *uri);
+gboolean audio_uri_is_silence(const gchar *uri);
+void audio_chain_set_uri(AudioChain *chain, const gchar *uri, gdouble gain,
+        struct _SeekTable *seektable);
+void audio_set_prebuffer(guint ms);
+void audio_set_accurate_seek(gboolean accurate);
+void audio_set_null_sink(gboolean null);
+gboolean audio_chain_seek(AudioChain *chain, gdouble value, gint64 cue_out);
+gboolean audio_chain_cue(AudioChain *chain, gint64 cue_in, gint64 cue_out);
+void audio_chain_prebuffer(AudioChain *chain);
+gboolean audio_chain_has_cues(AudioChain *chain);
+GstStateChangeReturn audio_chain_set_state(AudioChain *chain, GstState state);
+void audio_swap_standby(CustomData *data);
+AudioChain* audio_chain_from_bus(CustomData *data, GstBus *bus);
+gchar* audio_make_silence(void);
 
 #endif /* _AUDIO_H */
@@ -0,0 +1,516 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <jack/jack.h>
+#include "mygstreamer.h"
+#include "audio.h"
+#include "deck.h"
+#include "engine.h"
+#include "input.h"
+
+/*
+ * Button-to-first-sample latency benchmark.
+ *
+ * Synthetic input_event records go through a pipe into the same input
+ * thread the player uses. A jack client of our own listens to the deck's
+ * output and timestamps the first non-silent sample; the physical
+ * playback latency is added on top, so the result is press to sound
+ * leaving the box. Run it against a dummy backend to leave the sound card
+ * out of the picture:
+ *
+ *     jackd -d dummy -r 48000 -p 256 &
+ *     ./4deckradio-bench --engine --runs 50
+ */
+
+#define BENCH_TONE_SECONDS 2
+#define BENCH_SILENCE_SECONDS 30
+#define BENCH_THRESHOLD 1e-4f
+#define BENCH_SOUND_TIMEOUT_US (5 * G_USEC_PER_SEC)
+#define BENCH_STATE_TIMEOUT_US (30 * G_USEC_PER_SEC)
+
+typedef enum {
+    SCENARIO_COLD,                  /* Deck stopped in READY */
+    SCENARIO_PAUSED,                /* Deck prerolled */
+    SCENARIO_STREAM,                /* Prerolled network stream */
+    SCENARIO_QUEUED,                /* File prerolled on the standby chain, then swapped in */
+    NUM_SCENARIOS
+} Scenario;
+
+static const gchar *scenario_names[NUM_SCENARIOS] = {
+    "cold", "paused", "stream", "queued"
+};
+
+/* Our jack client, listening to the deck */
+typedef struct _Probe {
+    jack_client_t *client;
+    jack_port_t *in;
+    jack_nframes_t rate;
+    jack_time_t playback_latency;   /* Physical output latency, in microseconds */
+
+    gint armed;                     /* Set by the bench, cleared by the process callback */
+    jack_time_t detected;           /* Time of the first non-silent sample */
+} Probe;
+
+typedef struct _Bench {
+    CustomData deck;
+    Probe probe;
+    int pipe[2];                    /* Our "joystick" */
+    gchar *port_pattern;
+
+    gchar *tone_uri;
+    gchar *silence_uri;
+    gchar *stream_uri;
+    guint runs;
+
+    guint presses;                  /* Written by the input thread only */
+    gint64 dispatch_total_us;       /* Event timestamp to deck command */
+    gint64 dispatch_max_us;
+} Bench;
+
+static int probe_process_cb(jack_nframes_t nframes, void *arg) {
+    Probe *probe = arg;
+    const gfloat *in;
+
+    if (!g_atomic_int_get (&probe->armed)) {
+        return 0;
+    }
+
+    in = jack_port_get_buffer (probe->in, nframes);
+    for (jack_nframes_t i = 0; i < nframes; i++) {
+        if (fabsf (in[i]) > BENCH_THRESHOLD) {
+            jack_nframes_t frames;
+            jack_time_t current, next;
+            float period;
+
+            jack_get_cycle_times (probe->client, &frames, &current, &next, &period);
+            probe->detected = current + (jack_time_t)i * G_USEC_PER_SEC / probe->rate;
+            g_atomic_int_set (&probe->armed, FALSE);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int probe_init(Probe *probe) {
+    jack_status_t status;
+    const char **physical;
+
+    probe->client = jack_client_open ("4deckradio-bench", JackNoStartServer, &status);
+    if (NULL == probe->client) {
+        g_printerr ("Couldn't connect to jackd\n");
+        return 1;
+    }
+
+    probe->rate = jack_get_sample_rate (probe->client);
+    probe->in = jack_port_register (probe->client, "in",
+            JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+
+    jack_set_process_callback (probe->client, probe_process_cb, probe);
+    if (0 != jack_activate (probe->client)) {
+        g_printerr ("Couldn't activate the probe\n");
+        return 1;
+    }
+
+    physical = jack_get_ports (probe->client, NULL, NULL,
+            JackPortIsPhysical | JackPortIsInput);
+    if (NULL != physical) {
+        jack_latency_range_t range;
+
+        jack_port_get_latency_range (jack_port_by_name (probe->client, physical[0]),
+                JackPlaybackLatency, &range);
+        probe->playback_latency = (jack_time_t)range.max * G_USEC_PER_SEC / probe->rate;
+        jack_free (physical);
+    }
+
+    return 0;
+}
+
+/* Listen to every port of the deck, the chains come and go */
+static void probe_connect(Probe *probe, const gchar *pattern) {
+    const char **ports = jack_get_ports (probe->client, pattern,
+            JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput);
+
+    if (NULL == ports) {
+        return;
+    }
+
+    for (int i = 0; NULL != ports[i]; i++) {
+        if (!jack_port_connected_to (probe->in, ports[i])) {
+            jack_connect (probe->client, ports[i], jack_port_name (probe->in));
+        }
+    }
+
+    jack_free (ports);
+}
+
+static void probe_free(Probe *probe) {
+    if (NULL != probe->client) {
+        jack_deactivate (probe->client);
+        jack_client_close (probe->client);
+    }
+}
+
+/* A 16 bit stereo wav at the jack rate, silent if freq is 0 */
+static gchar* write_wav(guint rate, guint seconds, gdouble freq) {
+    guint32 frames = rate * seconds;
+    guint32 datasize = frames * 4;
+    GByteArray *wav = g_byte_array_sized_new (44 + datasize);
+    guint32 u32;
+    guint16 u16;
+    gchar *filename, *uri;
+    GError *error = NULL;
+    gint fd;
+
+#define PUT(bytes, n) g_byte_array_append (wav, (const guint8 *)(bytes), n)
+#define PUT32(v) (u32 = GUINT32_TO_LE (v), PUT (&u32, 4))
+#define PUT16(v) (u16 = GUINT16_TO_LE (v), PUT (&u16, 2))
+    PUT ("RIFF", 4); PUT32 (36 + datasize); PUT ("WAVE", 4);
+    PUT ("fmt ", 4); PUT32 (16); PUT16 (1); PUT16 (2);
+    PUT32 (rate); PUT32 (rate * 4); PUT16 (4); PUT16 (16);
+    PUT ("data", 4); PUT32 (datasize);
+
+    for (guint32 i = 0; i < frames; i++) {
+        gint16 sample = (gint16)(16384 * sin (2 * G_PI * freq * i / rate));
+
+        PUT16 ((guint16)sample);
+        PUT16 ((guint16)sample);
+    }
+#undef PUT16
+#undef PUT32
+#undef PUT
+
+    fd = g_file_open_tmp ("4deckradio-bench-XXXXXX.wav", &filename, &error);
+    if (-1 == fd) {
+        g_printerr ("Unable to create tmp file: %s\n", error->message);
+        g_error_free (error);
+        exit (1);
+    }
+    close (fd);
+
+    if (!g_file_set_contents (filename, (const gchar *)wav->data, wav->len, &error)) {
+        g_printerr ("Unable to write %s: %s\n", filename, error->message);
+        g_error_free (error);
+        exit (1);
+    }
+
+    g_byte_array_free (wav, TRUE);
+    uri = g_filename_to_uri (filename, NULL, NULL);
+    g_free (filename);
+
+    return uri;
+}
+
+static void remove_wav(gchar *uri) {
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+
+    g_unlink (filename);
+    g_free (filename);
+    g_free (uri);
+}
+
+/* The player's joystick mapping for a single deck, minus the labels.
+ * Runs on the input thread.
+ */
+static void bench_button_cb(guint number, gboolean pressed, gint64 time, Bench *bench) {
+    gint64 delay = g_get_monotonic_time () - time;
+
+    if (0 != number) {
+        return;
+    }
+
+    if (pressed) {
+        deck_play_async (&bench->deck);
+    } else {
+        deck_stop_async (&bench->deck, deck_stop);
+    }
+
+    bench->presses++;
+    bench->dispatch_total_us += delay;
+    bench->dispatch_max_us = MAX (bench->dispatch_max_us, delay);
+}
+
+/* Stamped like the kernel stamps them, see input_thread_add_fd() */
+static void press(Bench *bench, gboolean pressed) {
+    gint64 now = g_get_monotonic_time ();
+    struct input_event e;
+
+    memset (&e, 0, sizeof (e));
+    e.input_event_sec = now / G_USEC_PER_SEC;
+    e.input_event_usec = now % G_USEC_PER_SEC;
+    e.type = EV_KEY;
+    e.code = BTN_JOYSTICK;
+    e.value = pressed;
+
+    if (sizeof (e) != write (bench->pipe[1], &e, sizeof (e))) {
+        g_printerr ("Couldn't write joystick event\n");
+    }
+}
+
+/* Run the main loop until the deck reaches one of the given states.
+ * Returns FALSE if it ends up in DECK_ERROR instead.
+ */
+static gboolean wait_for(Bench *bench, guint states) {
+    gint64 deadline = g_get_monotonic_time () + BENCH_STATE_TIMEOUT_US;
+
+    while (!((states | (1 << DECK_ERROR)) & (1 << bench->deck.deckstate))) {
+        if (g_get_monotonic_time () > deadline) {
+            g_printerr ("Timeout, deck is %s\n", deck_state_get_name (bench->deck.deckstate));
+            return FALSE;
+        }
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    return DECK_ERROR != bench->deck.deckstate;
+}
+
+#define IDLE ((1 << DECK_PAUSED) | (1 << DECK_STOPPED) | (1 << DECK_ERROR))
+
+static gboolean standby_ready(Bench *bench) {
+    gint64 deadline = g_get_monotonic_time () + BENCH_STATE_TIMEOUT_US;
+    AudioChain *standby = bench->deck.standby;
+
+    while (0 != g_atomic_int_get (&standby->pending_jobs) ||
+            GST_STATE_PAUSED != standby->state) {
+        if (g_get_monotonic_time () > deadline) {
+            return FALSE;
+        }
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    return TRUE;
+}
+
+/* Press, wait for sound, release. Returns the latency in ms, or -1. */
+static gdouble measure(Bench *bench) {
+    Probe *probe = &bench->probe;
+    jack_time_t pressed;
+    gint64 deadline;
+
+    probe_connect (probe, bench->port_pattern);
+
+    g_atomic_int_set (&probe->armed, TRUE);
+    pressed = jack_get_time ();
+    press (bench, TRUE);
+
+    deadline = g_get_monotonic_time () + BENCH_SOUND_TIMEOUT_US;
+    while (g_atomic_int_get (&probe->armed)) {
+        if (g_get_monotonic_time () > deadline) {
+            g_atomic_int_set (&probe->armed, FALSE);
+            press (bench, FALSE);
+            wait_for (bench, IDLE);
+            return -1;
+        }
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    press (bench, FALSE);
+    wait_for (bench, IDLE);
+
+    return (probe->detected - pressed + probe->playback_latency) / 1000.0;
+}
+
+/* Get the deck into the scenario's starting point */
+static gboolean prepare(Bench *bench, Scenario scenario) {
+    CustomData *deck = &bench->deck;
+
+    switch (scenario) {
+        case SCENARIO_COLD:
+            if (DECK_PAUSED != deck->deckstate) {
+                deck_load (deck, bench->tone_uri);
+                if (!wait_for (bench, IDLE)) {
+                    return FALSE;
+                }
+            }
+            deck_stop (deck);
+            return wait_for (bench, 1 << DECK_STOPPED);
+        case SCENARIO_PAUSED:
+            if (DECK_PAUSED == deck->deckstate) {
+                return TRUE;
+            }
+            deck_load (deck, bench->tone_uri);
+            return wait_for (bench, 1 << DECK_PAUSED);
+        case SCENARIO_STREAM:
+            deck_load (deck, bench->stream_uri);
+            return wait_for (bench, 1 << DECK_PAUSED);
+        case SCENARIO_QUEUED:
+            deck_load (deck, bench->silence_uri);
+            if (!wait_for (bench, 1 << DECK_PAUSED)) {
+                return FALSE;
+            }
+            press (bench, TRUE);
+            if (!wait_for (bench, 1 << DECK_PLAYING)) {
+                return FALSE;
+            }
+            deck_queue (deck, bench->tone_uri);
+            if (!standby_ready (bench)) {
+                return FALSE;
+            }
+            press (bench, FALSE);
+            return wait_for (bench, 1 << DECK_PAUSED);
+        default:
+            return FALSE;
+    }
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank */
+static gdouble percentile(GArray *sorted, gdouble q) {
+    guint rank = (guint)ceil (q * sorted->len);
+
+    return g_array_index (sorted, gdouble, CLAMP (rank, 1, sorted->len) - 1);
+}
+
+static void run_scenario(Bench *bench, Scenario scenario) {
+    GArray *results = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    guint failed = 0;
+
+    for (guint i = 0; i < bench->runs; i++) {
+        gdouble latency;
+
+        if (!prepare (bench, scenario)) {
+            failed++;
+            continue;
+        }
+
+        latency = measure (bench);
+        if (latency < 0) {
+            failed++;
+        } else {
+            g_array_append_val (results, latency);
+        }
+    }
+
+    if (0 == results->len) {
+        g_print ("%-8s no sound in %u runs\n", scenario_names[scenario], bench->runs);
+    } else {
+        g_array_sort (results, compare_doubles);
+        g_print ("%-8s n=%-4u min %8.2f  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms  (%u failed)\n",
+                scenario_names[scenario], results->len,
+                g_array_index (results, gdouble, 0),
+                percentile (results, 0.50), percentile (results, 0.90),
+                percentile (results, 0.99),
+                g_array_index (results, gdouble, results->len - 1), failed);
+    }
+
+    g_array_free (results, TRUE);
+}
+
+/* Keeps the main loop ticking while we poll the deck state */
+static gboolean tick_cb(gpointer unused) {
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    Bench bench;
+    InputThread *input;
+    GOptionContext *context;
+    GError *error = NULL;
+    gboolean use_engine = FALSE;
+    gint runs = 20;
+    gchar *stream = NULL;
+
+    GOptionEntry option_entries[] = {
+        { "engine", 'e', 0, G_OPTION_ARG_NONE,
+            &use_engine, "Play through the single client engine", NULL },
+        { "runs", 'n', 0, G_OPTION_ARG_INT,
+            &runs, "Presses per scenario (20)", "N" },
+        { "stream", 's', 0, G_OPTION_ARG_STRING,
+            &stream, "Network stream for the stream scenario", "URI" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- button to first sample latency");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    gst_init (&argc, &argv);
+
+    memset (&bench, 0, sizeof (bench));
+    bench.runs = MAX (1, runs);
+    bench.stream_uri = stream;
+
+    if (0 != probe_init (&bench.probe)) {
+        return 1;
+    }
+
+    if (use_engine) {
+        if (0 != engine_init (1, FALSE)) {
+            return 1;
+        }
+        bench.port_pattern = g_strdup ("^4deckradio:deck1_out_1$");
+    } else {
+        /* both chains' jackaudiosinks, left channel */
+        bench.port_pattern = g_strdup ("^player-0:out_.*_1$");
+    }
+
+    bench.tone_uri = write_wav (bench.probe.rate, BENCH_TONE_SECONDS, 440.0);
+    bench.silence_uri = write_wav (bench.probe.rate, BENCH_SILENCE_SECONDS, 0.0);
+
+    if (0 != init_audio (&bench.deck, 0, FALSE)) {
+        return 1;
+    }
+    deck_init (&bench.deck);
+
+    if (0 != pipe (bench.pipe)) {
+        perror ("Couldn't create the joystick pipe");
+        return 1;
+    }
+    input = input_thread_new ((InputButtonFunc)bench_button_cb, &bench);
+    input_thread_add_fd (input, bench.pipe[0], "bench pipe");
+    input_thread_start (input);
+    g_timeout_add (5, tick_cb, NULL);
+
+    g_print ("%s mode, %u Hz, playback latency %.2f ms, %u runs per scenario\n",
+            use_engine ? "engine" : "jackaudiosink", bench.probe.rate,
+            bench.probe.playback_latency / 1000.0, bench.runs);
+
+    for (Scenario s = 0; s < NUM_SCENARIOS; s++) {
+        if (SCENARIO_STREAM == s && NULL == bench.stream_uri) {
+            g_print ("%-8s skipped, no --stream given\n", scenario_names[s]);
+            continue;
+        }
+        run_scenario (&bench, s);
+    }
+
+    close (bench.pipe[1]);
+    input_thread_free (input);
+
+    if (0 != bench.presses) {
+        g_print ("%-8s n=%-4u mean %7.3f  max %7.3f ms from the event's timestamp to its deck command\n",
+                "input", bench.presses, bench.dispatch_total_us / 1000.0 / bench.presses,
+                bench.dispatch_max_us / 1000.0);
+    }
+
+    engine_free ();
+    deck_free (&bench.deck);
+    deck_print_stats (&bench.deck);
+    free_audio (&bench.deck);
+    probe_free (&bench.probe);
+
+    remove_wav (bench.tone_uri);
+    remove_wav (bench.silence_uri);
+    g_free (bench.port_pattern);
+    g_free (stream);
+
+    return 0;
+}
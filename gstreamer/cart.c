@@ -0,0 +1,412 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <jack/jack.h>
+#include "cart.h"
+#include "engine.h"
+#include "resample.h"
+
+/*
+ * The cart bank holds short jingles and IDs fully decoded in RAM, as
+ * float PCM at the jack sample rate. They are played straight from our own
+ * jack process callback, so firing a cart is a single atomic store: no
+ * decoding, no file I/O and no allocation between the button and the next
+ * period.
+ *
+ * With the engine running, the carts are mixed by the engine's process
+ * callback instead and no second jack client is opened.
+ */
+
+enum {
+    CART_CMD_NONE,
+    CART_CMD_PLAY,
+    CART_CMD_STOP
+};
+
+typedef struct _Cart {
+    gchar *uri;
+    gfloat *left;                   /* Decoded samples, one array per channel */
+    gfloat *right;
+    jack_nframes_t frames;
+
+    gint loaded;                    /* Set once the samples above are complete */
+    gint command;                   /* CART_CMD_*, consumed by the process callback */
+    gint playing;                   /* Written by the process callback only */
+    jack_nframes_t position;        /* Owned by the process callback */
+} Cart;
+
+typedef struct _CartBank {
+    Cart *carts;
+    guint ncarts;
+
+    jack_client_t *client;          /* NULL if the engine plays the carts */
+    jack_port_t *ports[2];
+    jack_nframes_t rate;
+    gint ready;                     /* The carts array may be used */
+
+    GThread *loader;
+    gint cancel;                    /* Ask the loader to give up */
+} CartBank;
+
+static CartBank bank;
+
+/* The realtime side. Everything in here is lock and allocation free. */
+static gint take_command(Cart *cart) {
+    gint command;
+
+    do {
+        command = g_atomic_int_get (&cart->command);
+    } while (!g_atomic_int_compare_and_exchange (&cart->command, command, CART_CMD_NONE));
+
+    return command;
+}
+
+/* Add the playing carts to the given buffers, from a process callback */
+void cart_bank_mix(gfloat *out_l, gfloat *out_r, guint nframes) {
+    if (!g_atomic_int_get (&bank.ready)) {
+        return;
+    }
+
+    for (guint i = 0; i < bank.ncarts; i++) {
+        Cart *cart = &bank.carts[i];
+        jack_nframes_t n;
+
+        if (!g_atomic_int_get (&cart->loaded)) {
+            continue;
+        }
+
+        switch (take_command (cart)) {
+            case CART_CMD_PLAY:
+                cart->position = 0;
+                g_atomic_int_set (&cart->playing, TRUE);
+                break;
+            case CART_CMD_STOP:
+                g_atomic_int_set (&cart->playing, FALSE);
+                break;
+            default:
+                break;
+        }
+
+        if (!cart->playing) {
+            continue;
+        }
+
+        n = MIN (nframes, cart->frames - cart->position);
+        for (jack_nframes_t j = 0; j < n; j++) {
+            out_l[j] += cart->left[cart->position + j];
+            out_r[j] += cart->right[cart->position + j];
+        }
+
+        cart->position += n;
+        if (cart->position >= cart->frames) {
+            g_atomic_int_set (&cart->playing, FALSE);
+        }
+    }
+}
+
+static int process_cb(jack_nframes_t nframes, void *arg) {
+    gfloat *out_l = jack_port_get_buffer (bank.ports[0], nframes);
+    gfloat *out_r = jack_port_get_buffer (bank.ports[1], nframes);
+
+    memset (out_l, 0, nframes * sizeof (gfloat));
+    memset (out_r, 0, nframes * sizeof (gfloat));
+
+    cart_bank_mix (out_l, out_r, nframes);
+
+    return 0;
+}
+
+/* The non-realtime side */
+static gchar* cart_uri(const gchar *file) {
+    if (NULL != strstr (file, "://")) {
+        return g_strdup (file);
+    }
+
+    if (g_path_is_absolute (file)) {
+        return g_filename_to_uri (file, NULL, NULL);
+    } else {
+        gchar *cwd = g_get_current_dir ();
+        gchar *path = g_build_filename (cwd, file, NULL);
+        gchar *uri = g_filename_to_uri (path, NULL, NULL);
+
+        g_free (path);
+        g_free (cwd);
+        return uri;
+    }
+}
+
+#if GST_VERSION_MAJOR == (0)
+static gboolean decode_cart(Cart *cart) {
+    g_printerr ("The cart bank needs gstreamer-1.0, not loading %s\n", cart->uri);
+    return FALSE;
+}
+#else
+#define CART_CAPS "audio/x-raw, format=(string)%s, layout=(string)interleaved, channels=(int)2, rate=(int)%u"
+
+/* Decode a whole file to interleaved stereo floats at the jack rate */
+static gboolean decode_cart(Cart *cart) {
+    GstElement *pipeline, *decoder, *sink;
+    GstBus *bus;
+    GArray *samples;
+    gchar *description;
+    GError *error = NULL;
+    gboolean ok = TRUE;
+
+    description = g_strdup_printf ("uridecodebin name=decoder ! audioconvert ! "
+            "audioresample quality=%d ! " CART_CAPS " ! appsink name=sink sync=false",
+            resample_get_gst_quality (resample_get_quality (-1, RESAMPLE_CLASS_CART)),
+            G_BYTE_ORDER == G_BIG_ENDIAN ? "F32BE" : "F32LE", bank.rate);
+    pipeline = gst_parse_launch (description, &error);
+    g_free (description);
+
+    if (NULL == pipeline) {
+        g_printerr ("Couldn't create cart decoder: %s\n", error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+
+    decoder = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    g_object_set (decoder, "uri", cart->uri, NULL);
+    bus = gst_element_get_bus (pipeline);
+
+    samples = g_array_new (FALSE, FALSE, sizeof (gfloat));
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+    while (!g_atomic_int_get (&bank.cancel)) {
+        GstSample *sample = gst_app_sink_try_pull_sample (GST_APP_SINK (sink),
+                100 * GST_MSECOND);
+        GstMessage *msg;
+
+        if (NULL != sample) {
+            GstBuffer *buffer = gst_sample_get_buffer (sample);
+            GstMapInfo map;
+
+            if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+                g_array_append_vals (samples, map.data, map.size / sizeof (gfloat));
+                gst_buffer_unmap (buffer, &map);
+            }
+            gst_sample_unref (sample);
+            continue;
+        }
+
+        if (gst_app_sink_is_eos (GST_APP_SINK (sink))) {
+            break;
+        }
+
+        msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+        if (NULL != msg) {
+            gst_message_parse_error (msg, &error, NULL);
+            g_printerr ("Couldn't decode cart %s: %s\n", cart->uri, error->message);
+            g_clear_error (&error);
+            gst_message_unref (msg);
+            ok = FALSE;
+            break;
+        }
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (bus);
+    gst_object_unref (sink);
+    gst_object_unref (decoder);
+    gst_object_unref (pipeline);
+
+    if (ok && !g_atomic_int_get (&bank.cancel) && samples->len >= 2) {
+        const gfloat *interleaved = (const gfloat *)samples->data;
+
+        cart->frames = samples->len / 2;
+        cart->left = g_new (gfloat, cart->frames);
+        cart->right = g_new (gfloat, cart->frames);
+
+        for (jack_nframes_t i = 0; i < cart->frames; i++) {
+            cart->left[i] = interleaved[2 * i];
+            cart->right[i] = interleaved[2 * i + 1];
+        }
+
+        /* keep the process callback clear of page faults */
+        mlock (cart->left, cart->frames * sizeof (gfloat));
+        mlock (cart->right, cart->frames * sizeof (gfloat));
+    } else {
+        ok = FALSE;
+    }
+
+    g_array_free (samples, TRUE);
+
+    return ok;
+}
+#endif
+
+static gpointer loader_thread(gpointer unused) {
+    for (guint i = 0; i < bank.ncarts && !g_atomic_int_get (&bank.cancel); i++) {
+        Cart *cart = &bank.carts[i];
+        gint64 start = g_get_monotonic_time ();
+
+        if (!decode_cart (cart)) {
+            continue;
+        }
+
+        g_atomic_int_set (&cart->loaded, TRUE);
+        g_print ("Cart %u loaded in %.0f ms: %s (%.1f s, %.1f MB)\n", i + 1,
+                (g_get_monotonic_time () - start) / 1000.0, cart->uri,
+                (gdouble)cart->frames / bank.rate,
+                2.0 * cart->frames * sizeof (gfloat) / (1024 * 1024));
+    }
+
+    return NULL;
+}
+
+static void connect_physical(void) {
+    const char **physical = jack_get_ports (bank.client, NULL, NULL,
+            JackPortIsPhysical | JackPortIsInput);
+
+    if (NULL == physical) {
+        return;
+    }
+
+    for (int i = 0; i < 2 && NULL != physical[i]; i++) {
+        jack_connect (bank.client, jack_port_name (bank.ports[i]), physical[i]);
+    }
+
+    jack_free (physical);
+}
+
+static int open_client(void) {
+    jack_status_t status;
+
+    bank.client = jack_client_open ("carts", JackNoStartServer, &status);
+    if (NULL == bank.client) {
+        g_printerr ("Couldn't connect to jackd, cart bank disabled\n");
+        return 1;
+    }
+
+    bank.rate = jack_get_sample_rate (bank.client);
+    bank.ports[0] = jack_port_register (bank.client, "out_1",
+            JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    bank.ports[1] = jack_port_register (bank.client, "out_2",
+            JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+
+    return 0;
+}
+
+/* Start the jack client (unless the engine runs) and decode the given
+ * files in the background. Returns 0 on success, or if there is nothing
+ * to do.
+ */
+int cart_bank_init(gchar **files, int autoconnect) {
+    if (NULL == files || NULL == files[0]) {
+        return 0;
+    }
+
+    if (engine_is_running ()) {
+        bank.rate = engine_get_rate ();
+    } else if (0 != open_client ()) {
+        return 1;
+    }
+
+    bank.ncarts = g_strv_length (files);
+    bank.carts = g_new0 (Cart, bank.ncarts);
+    for (guint i = 0; i < bank.ncarts; i++) {
+        bank.carts[i].uri = cart_uri (files[i]);
+    }
+    g_atomic_int_set (&bank.ready, TRUE);
+
+    bank.loader = g_thread_new ("cartloader", loader_thread, NULL);
+
+    if (NULL == bank.client) {
+        return 0;
+    }
+
+    jack_set_process_callback (bank.client, process_cb, NULL);
+    if (0 != jack_activate (bank.client)) {
+        g_printerr ("Couldn't activate the cart bank\n");
+        jack_client_close (bank.client);
+        bank.client = NULL;
+        return 1;
+    }
+
+    if (autoconnect) {
+        connect_physical ();
+    }
+
+    return 0;
+}
+
+/* Call after engine_free(), the engine may still be mixing the carts */
+void cart_bank_free(void) {
+    if (!g_atomic_int_get (&bank.ready)) {
+        return;
+    }
+
+    g_atomic_int_set (&bank.cancel, TRUE);
+    g_thread_join (bank.loader);
+
+    if (NULL != bank.client) {
+        jack_deactivate (bank.client);
+        jack_client_close (bank.client);
+        bank.client = NULL;
+    }
+    g_atomic_int_set (&bank.ready, FALSE);
+
+    for (guint i = 0; i < bank.ncarts; i++) {
+        Cart *cart = &bank.carts[i];
+
+        if (NULL != cart->left) {
+            munlock (cart->left, cart->frames * sizeof (gfloat));
+            munlock (cart->right, cart->frames * sizeof (gfloat));
+        }
+        g_free (cart->left);
+        g_free (cart->right);
+        g_free (cart->uri);
+    }
+    g_free (bank.carts);
+    bank.carts = NULL;
+    bank.ncarts = 0;
+}
+
+guint cart_bank_size(void) {
+    return g_atomic_int_get (&bank.ready) ? bank.ncarts : 0;
+}
+
+/* (Re)start a cart from the beginning */
+void cart_fire(guint index) {
+    Cart *cart;
+
+    if (index >= cart_bank_size ()) {
+        return;
+    }
+
+    cart = &bank.carts[index];
+    if (!g_atomic_int_get (&cart->loaded)) {
+        g_print ("Cart %u is not loaded (yet)\n", index + 1);
+        return;
+    }
+
+    g_atomic_int_set (&cart->command, CART_CMD_PLAY);
+}
+
+void cart_toggle(guint index) {
+    if (index >= cart_bank_size ()) {
+        return;
+    }
+
+    if (cart_is_playing (index)) {
+        g_atomic_int_set (&bank.carts[index].command, CART_CMD_STOP);
+    } else {
+        cart_fire (index);
+    }
+}
+
+gboolean cart_is_playing(guint index) {
+    if (index >= cart_bank_size ()) {
+        return FALSE;
+    }
+
+    return g_atomic_int_get (&bank.carts[index].playing);
+}
@@ -0,0 +1,16 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _CART_H
+#define _CART_H
+
+int cart_bank_init(gchar **files, int autoconnect);
+void cart_bank_free(void);
+guint cart_bank_size(void);
+void cart_fire(guint index);
+void cart_toggle(guint index);
+gboolean cart_is_playing(guint index);
+void cart_bank_mix(gfloat *out_l, gfloat *out_r, guint nframes);
+
+#endif /* _CART_H */
@@ -0,0 +1,370 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "control.h"
+#include "deck.h"
+#include "schedule.h"
+
+/*
+ * Local control of the decks, for automation and remote front ends.
+ *
+ * Clients talk to a SOCK_SEQPACKET Unix socket: every request is one
+ * datagram of a ControlRequest, and gets exactly one ControlReply with
+ * the same serial, so a client can pipeline requests and match the
+ * replies up. Nothing is parsed beyond a fixed header and a URI.
+ *
+ * The server thread answers STATUS on its own, straight from the
+ * pipeline, and starts decks with deck_play_async() like the joystick
+ * does. Everything else is handed to the main loop ahead of redraws,
+ * which replies once the command has been issued. None of the commands
+ * wait for a pipeline, they only move the deck state machine along.
+ */
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_RT_PRIORITY 10
+
+typedef struct _ControlClient {
+    gint refcount;                  /* Server thread, and each command in flight */
+    int fd;
+} ControlClient;
+
+typedef struct _ControlServer {
+    gchar *path;
+    int listenfd;
+    int stopfd;
+    GThread *thread;
+    CustomData *decks;
+    guint ndecks;
+    ControlCallbacks callbacks;
+    ControlClient *clients[CONTROL_MAX_CLIENTS];
+    guint nclients;
+} ControlServer;
+
+typedef struct _ControlJob {
+    ControlClient *client;
+    ControlRequest request;
+    gchar *uri;
+} ControlJob;
+
+static ControlServer server = { .listenfd = -1, .stopfd = -1 };
+
+static ControlClient* client_ref(ControlClient *client) {
+    g_atomic_int_inc (&client->refcount);
+    return client;
+}
+
+static void client_unref(ControlClient *client) {
+    if (g_atomic_int_dec_and_test (&client->refcount)) {
+        close (client->fd);
+        g_free (client);
+    }
+}
+
+/* From any thread, the socket keeps datagrams whole */
+static void send_reply(ControlClient *client, const ControlRequest *request,
+        ControlStatus status, DeckState state, gint64 position, gint64 duration) {
+    ControlReply reply;
+
+    memset (&reply, 0, sizeof (reply));
+    reply.serial = request->serial;
+    reply.status = status;
+    reply.deckstate = state;
+    reply.position = position;
+    reply.duration = duration;
+
+    /* a client that doesn't read its replies only loses them */
+    if (send (client->fd, &reply, sizeof (reply), MSG_NOSIGNAL | MSG_DONTWAIT) < 0 &&
+            EAGAIN != errno && EPIPE != errno) {
+        perror ("Control reply");
+    }
+}
+
+/* Runs on the main loop */
+static gboolean job_cb(ControlJob *job) {
+    CustomData *data = &server.decks[job->request.deck];
+    ControlStatus status = CONTROL_OK;
+
+    switch (job->request.command) {
+        case CONTROL_STOP:
+            if (NULL != server.callbacks.stop) {
+                server.callbacks.stop (data);
+            } else {
+                deck_stop (data);
+            }
+            break;
+        case CONTROL_PAUSE:
+            deck_pause (data);
+            break;
+        case CONTROL_LOAD:
+        case CONTROL_QUEUE:
+            if (NULL != server.callbacks.load) {
+                server.callbacks.load (data, job->uri, CONTROL_QUEUE == job->request.command);
+            } else if (CONTROL_QUEUE == job->request.command) {
+                deck_queue (data, job->uri);
+            } else {
+                deck_load (data, job->uri);
+            }
+            break;
+        case CONTROL_SEEK:
+            deck_seek (data, (gdouble)job->request.position / GST_SECOND);
+            break;
+        case CONTROL_START_AT:
+            if (!schedule_start (data, job->request.position / 1000)) {
+                status = CONTROL_BAD_REQUEST;
+            }
+            break;
+    }
+
+    send_reply (job->client, &job->request, status, data->deckstate, -1, -1);
+
+    client_unref (job->client);
+    g_free (job->uri);
+    g_free (job);
+    return FALSE;
+}
+
+static void handle_request(ControlClient *client, const gchar *buffer, gssize length) {
+    ControlRequest request;
+    ControlJob *job;
+    CustomData *data;
+    gint64 position, duration;
+    DeckState state;
+
+    if (length < (gssize)sizeof (request)) {
+        memset (&request, 0, sizeof (request));
+        memcpy (&request, buffer, MAX (length, 0));
+        send_reply (client, &request, CONTROL_BAD_REQUEST, DECK_EMPTY, -1, -1);
+        return;
+    }
+    memcpy (&request, buffer, sizeof (request));
+
+    if (request.deck >= server.ndecks) {
+        send_reply (client, &request, CONTROL_NO_SUCH_DECK, DECK_EMPTY, -1, -1);
+        return;
+    }
+    data = &server.decks[request.deck];
+
+    switch (request.command) {
+        case CONTROL_STATUS:
+            state = deck_get_status (data, &position, &duration);
+            send_reply (client, &request, CONTROL_OK, state, position, duration);
+            return;
+        case CONTROL_PLAY:
+            /* the main loop catches up on its own */
+            deck_play_async (data);
+            send_reply (client, &request, CONTROL_OK,
+                    g_atomic_int_get ((gint *)&data->deckstate), -1, -1);
+            return;
+        case CONTROL_LOAD:
+        case CONTROL_QUEUE:
+            if (length == (gssize)sizeof (request)) {
+                send_reply (client, &request, CONTROL_BAD_REQUEST,
+                        g_atomic_int_get ((gint *)&data->deckstate), -1, -1);
+                return;
+            }
+            break;
+        case CONTROL_STOP:
+        case CONTROL_PAUSE:
+        case CONTROL_SEEK:
+        case CONTROL_START_AT:
+            break;
+        default:
+            send_reply (client, &request, CONTROL_BAD_REQUEST,
+                    g_atomic_int_get ((gint *)&data->deckstate), -1, -1);
+            return;
+    }
+
+    job = g_new0 (ControlJob, 1);
+    job->client = client_ref (client);
+    job->request = request;
+    if (length > (gssize)sizeof (request)) {
+        job->uri = g_strndup (buffer + sizeof (request), length - sizeof (request));
+    }
+
+    g_main_context_invoke_full (NULL, G_PRIORITY_HIGH,
+            (GSourceFunc)job_cb, job, NULL);
+}
+
+static void accept_client(void) {
+    ControlClient *client;
+    int fd = accept (server.listenfd, NULL, NULL);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (server.nclients == CONTROL_MAX_CLIENTS) {
+        g_printerr ("Too many control clients\n");
+        close (fd);
+        return;
+    }
+
+    client = g_new0 (ControlClient, 1);
+    client->refcount = 1;
+    client->fd = fd;
+    server.clients[server.nclients++] = client;
+}
+
+static void drop_client(guint i) {
+    client_unref (server.clients[i]);
+    server.clients[i] = server.clients[--server.nclients];
+}
+
+static void raise_priority(void) {
+    struct sched_param param;
+
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = CONTROL_RT_PRIORITY;
+
+    if (0 != pthread_setschedparam (pthread_self (), SCHED_FIFO, &param)) {
+        g_print ("Control thread runs without realtime priority\n");
+    }
+}
+
+static gpointer server_thread(gpointer unused) {
+    struct pollfd fds[CONTROL_MAX_CLIENTS + 2];
+    gchar *buffer = g_malloc (sizeof (ControlRequest) + CONTROL_MAX_URI);
+
+    raise_priority ();
+
+    for (;;) {
+        guint nclients = server.nclients;
+
+        fds[0].fd = server.stopfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server.listenfd;
+        fds[1].events = POLLIN;
+        for (guint i = 0; i < nclients; i++) {
+            fds[i + 2].fd = server.clients[i]->fd;
+            fds[i + 2].events = POLLIN;
+        }
+
+        if (poll (fds, nclients + 2, -1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror ("Control server");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+
+        /* backwards, dropping a client moves the last one into its place */
+        for (guint i = nclients; i-- > 0; ) {
+            gssize length;
+
+            if (0 == fds[i + 2].revents) {
+                continue;
+            }
+
+            length = recv (server.clients[i]->fd, buffer,
+                    sizeof (ControlRequest) + CONTROL_MAX_URI, MSG_DONTWAIT);
+            if (length > 0) {
+                handle_request (server.clients[i], buffer, length);
+            } else if (0 == length || (EAGAIN != errno && EINTR != errno)) {
+                drop_client (i);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            accept_client ();
+        }
+    }
+
+    while (server.nclients > 0) {
+        drop_client (server.nclients - 1);
+    }
+    g_free (buffer);
+    return NULL;
+}
+
+static gboolean make_address(const gchar *path, struct sockaddr_un *addr) {
+    if (strlen (path) >= sizeof (addr->sun_path)) {
+        g_printerr ("Control socket path too long: %s\n", path);
+        return FALSE;
+    }
+
+    memset (addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy (addr->sun_path, path);
+    return TRUE;
+}
+
+/* Take commands for the decks on a Unix socket at path. Call after the
+ * decks are set up, with the main loop about to run.
+ */
+gboolean control_init(const gchar *path, CustomData *decks, guint ndecks,
+        const ControlCallbacks *callbacks) {
+    struct sockaddr_un addr;
+
+    if (!make_address (path, &addr)) {
+        return FALSE;
+    }
+
+    server.listenfd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (server.listenfd < 0) {
+        perror ("Couldn't create the control socket");
+        return FALSE;
+    }
+
+    /* left over from a crash */
+    g_unlink (path);
+    if (0 != bind (server.listenfd, (struct sockaddr *)&addr, sizeof (addr)) ||
+            0 != listen (server.listenfd, CONTROL_MAX_CLIENTS)) {
+        g_printerr ("Couldn't listen on %s: %s\n", path, g_strerror (errno));
+        close (server.listenfd);
+        server.listenfd = -1;
+        return FALSE;
+    }
+
+    server.path = g_strdup (path);
+    server.decks = decks;
+    server.ndecks = ndecks;
+    if (NULL != callbacks) {
+        server.callbacks = *callbacks;
+    }
+    server.stopfd = eventfd (0, EFD_CLOEXEC);
+    server.thread = g_thread_new ("control", server_thread, NULL);
+
+    g_print ("Control socket on %s\n", path);
+    return TRUE;
+}
+
+/* Before the decks go away. Commands already handed to the main loop
+ * still run if it does.
+ */
+void control_shutdown(void) {
+    guint64 one = 1;
+
+    if (NULL == server.thread) {
+        return;
+    }
+
+    if (sizeof (one) != write (server.stopfd, &one, sizeof (one))) {
+        perror ("Couldn't stop the control server");
+    }
+    g_thread_join (server.thread);
+    server.thread = NULL;
+
+    close (server.listenfd);
+    close (server.stopfd);
+    g_unlink (server.path);
+    g_free (server.path);
+    server.path = NULL;
+}
@@ -0,0 +1,62 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+/* The server side, for clients see controlclient.c.
+ *
+ * One request per datagram, in host byte order: the socket never leaves
+ * the machine. LOAD and QUEUE append the URI, without a terminating NUL.
+ */
+typedef enum {
+    CONTROL_PLAY = 1,
+    CONTROL_STOP,
+    CONTROL_PAUSE,
+    CONTROL_LOAD,
+    CONTROL_QUEUE,
+    CONTROL_SEEK,                   /* To position */
+    CONTROL_STATUS,
+    CONTROL_START_AT                /* Prerolled deck heard from position on, engine only */
+} ControlCommand;
+
+typedef enum {
+    CONTROL_OK,
+    CONTROL_BAD_REQUEST,
+    CONTROL_NO_SUCH_DECK
+} ControlStatus;
+
+#define CONTROL_MAX_URI 4096
+
+typedef struct _ControlRequest {
+    guint32 serial;                 /* Echoed in the reply */
+    guint8 command;                 /* ControlCommand */
+    guint8 deck;                    /* Counted from 0 */
+    guint16 reserved;
+    gint64 position;                /* Nanoseconds: into the file for CONTROL_SEEK, */
+                                    /* since the epoch for CONTROL_START_AT */
+} ControlRequest;
+
+typedef struct _ControlReply {
+    guint32 serial;
+    guint8 status;                  /* ControlStatus */
+    guint8 deckstate;               /* DeckState after the command */
+    guint16 reserved;
+    gint64 position;                /* Nanoseconds, -1 if unknown. CONTROL_STATUS only */
+    gint64 duration;
+} ControlReply;
+
+/* How the driver of the decks loads and stops them, so it can follow
+ * along. Called on the main loop. NULL runs the deck API directly.
+ */
+typedef struct _ControlCallbacks {
+    void (*load) (CustomData *data, const gchar *uri, gboolean queue);
+    void (*stop) (CustomData *data);
+} ControlCallbacks;
+
+gboolean control_init(const gchar *path, CustomData *decks, guint ndecks,
+        const ControlCallbacks *callbacks);
+void control_shutdown(void);
+
+#endif /* _CONTROL_H */
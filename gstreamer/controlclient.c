@@ -0,0 +1,89 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "controlclient.h"
+
+/*
+ * The client end of the control socket (control.c), for the benchmarks
+ * and anything else that wants to drive the decks.
+ */
+
+/* $XDG_RUNTIME_DIR/4deckradio.control */
+gchar* control_default_path(void) {
+    return g_build_filename (g_get_user_runtime_dir (), "4deckradio.control", NULL);
+}
+
+/* A connected socket, or -1 */
+int control_connect(const gchar *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        g_printerr ("Control socket path too long: %s\n", path);
+        return -1;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror ("Couldn't create a control socket");
+        return -1;
+    }
+
+    if (0 != connect (fd, (struct sockaddr *)&addr, sizeof (addr))) {
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+gboolean control_send(int fd, guint32 serial, ControlCommand command, guint deck,
+        gint64 position, const gchar *uri) {
+    gsize urilen = (NULL != uri) ? strlen (uri) : 0;
+    gchar buffer[sizeof (ControlRequest) + CONTROL_MAX_URI];
+    ControlRequest request;
+
+    memset (&request, 0, sizeof (request));
+    request.serial = serial;
+    request.command = command;
+    request.deck = deck;
+    request.position = position;
+
+    urilen = MIN (urilen, CONTROL_MAX_URI);
+    memcpy (buffer, &request, sizeof (request));
+    memcpy (buffer + sizeof (request), uri, urilen);
+
+    return send (fd, buffer, sizeof (request) + urilen, MSG_NOSIGNAL) > 0;
+}
+
+/* Wait for the reply to serial, skipping stale ones */
+gboolean control_wait_reply(int fd, guint32 serial, ControlReply *reply, gint timeout_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    for (;;) {
+        if (poll (&pfd, 1, timeout_ms) <= 0) {
+            return FALSE;
+        }
+        if (recv (fd, reply, sizeof (*reply), 0) != sizeof (*reply)) {
+            return FALSE;
+        }
+        if (reply->serial == serial) {
+            return TRUE;
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _CONTROLCLIENT_H
+#define _CONTROLCLIENT_H
+
+#include "control.h"
+
+gchar* control_default_path(void);
+int control_connect(const gchar *path);
+gboolean control_send(int fd, guint32 serial, ControlCommand command, guint deck,
+        gint64 position, const gchar *uri);
+gboolean control_wait_reply(int fd, guint32 serial, ControlReply *reply, gint timeout_ms);
+
+#endif /* _CONTROLCLIENT_H */
@@ -0,0 +1,359 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <gst/gst.h>
+#if GST_VERSION_MAJOR != (0)
+#include <gst/app/gstappsink.h>
+#include <gst/base/gstbasetransform.h>
+#endif
+#include "dsp.h"
+#include "resample.h"
+#include "ringbuffer.h"
+
+/*
+ * Conversion benchmark.
+ *
+ * Decodes --seconds of generated audio through the engine's chain
+ * (audioconvert, volume, channels=2, audioresample, appsink) and into a
+ * ring buffer that is read back the way the process callback does it, as
+ * fast as it goes. Per source format and rate it prints the CPU time per
+ * deck as a share of one core, for both ways to feed the engine:
+ *
+ *     fixed    the appsink only takes F32, the gain is the volume element
+ *              and audioresample runs at the --quality it maps to
+ *     native   the appsink takes DSP_FORMATS at the common rates, the
+ *              gain is applied while converting to float (see dsp.c) and
+ *              the engine's resampler does the rest, at --quality
+ *
+ * The cost of generating the audio is measured on its own and taken off.
+ * Next to each figure are the elements that didn't pass through.
+ *
+ *     ./4deckradio-convbench --seconds 60 --rate 48000 --gain 0.5 --quality medium
+ */
+
+#define CONVBENCH_BUFFER_FRAMES 1024
+
+typedef enum {
+    MODE_SOURCE,                    /* Just the generator, for the baseline */
+    MODE_FIXED,
+    MODE_NATIVE
+} Mode;
+
+typedef struct _Consumer {
+    RingBuffer *ring;
+    gfloat *convert;
+    guint convert_size;
+    Resampler *resampler;
+    gfloat *resampled;
+    guint resampled_size;
+    guint rate_out;
+    gfloat left[CONVBENCH_BUFFER_FRAMES];
+    gfloat right[CONVBENCH_BUFFER_FRAMES];
+} Consumer;
+
+static ResampleQuality quality = RESAMPLE_MEDIUM;
+
+static inline gdouble cpu_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#if GST_VERSION_MAJOR != (0)
+/* What new_sample_cb() and process_cb() in engine.c do with a buffer */
+static void consume(Consumer *consumer, GstSample *sample, gfloat gain) {
+    GstBuffer *buffer = gst_sample_get_buffer (sample);
+    GstCaps *caps = gst_sample_get_caps (sample);
+    GstStructure *structure = gst_caps_get_structure (caps, 0);
+    DspFormat format;
+    const gfloat *frames;
+    GstMapInfo map;
+    guint n, width;
+    gint rate = 0;
+
+    format = dsp_format_from_string (gst_structure_get_string (structure, "format"));
+    gst_structure_get_int (structure, "rate", &rate);
+    width = dsp_format_width (format);
+    if (0 == width || !gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        return;
+    }
+
+    n = map.size / (2 * width);
+    if (DSP_FORMAT_F32 == format && 1.0f == gain) {
+        frames = (const gfloat *)map.data;
+    } else {
+        if (n > consumer->convert_size) {
+            consumer->convert_size = n;
+            consumer->convert = g_renew (gfloat, consumer->convert, 2 * n);
+        }
+        dsp_to_f32 (format, consumer->convert, map.data, 2 * n, gain);
+        frames = consumer->convert;
+    }
+
+    if ((guint)rate != consumer->rate_out) {
+        guint max;
+
+        resampler_configure (consumer->resampler, rate, consumer->rate_out, quality);
+        max = resampler_get_max_out (consumer->resampler, n);
+        if (max > consumer->resampled_size) {
+            consumer->resampled_size = max;
+            consumer->resampled = g_renew (gfloat, consumer->resampled, 2 * max);
+        }
+        n = resampler_process (consumer->resampler, frames, n, consumer->resampled);
+        frames = consumer->resampled;
+    }
+
+    while (n > 0) {
+        guint written = ringbuffer_write (consumer->ring, frames, n);
+
+        frames += 2 * written;
+        n -= written;
+
+        while (ringbuffer_fill (consumer->ring) > 0) {
+            memset (consumer->left, 0, sizeof (consumer->left));
+            memset (consumer->right, 0, sizeof (consumer->right));
+            ringbuffer_read_add (consumer->ring, consumer->left, consumer->right,
+                    CONVBENCH_BUFFER_FRAMES);
+        }
+    }
+
+    gst_buffer_unmap (buffer, &map);
+}
+
+/* "convert gain resample", or "passthrough" */
+static gchar* describe(GstElement *pipeline) {
+    const gchar *names[] = { "convert", "gain", "resample" };
+    GString *active = g_string_new (NULL);
+
+    for (guint i = 0; i < G_N_ELEMENTS (names); i++) {
+        GstElement *element = gst_bin_get_by_name (GST_BIN (pipeline), names[i]);
+
+        if (!gst_base_transform_is_passthrough (GST_BASE_TRANSFORM (element))) {
+            g_string_append_printf (active, "%s%s", active->len > 0 ? " " : "", names[i]);
+        }
+        gst_object_unref (element);
+    }
+
+    if (0 == active->len) {
+        g_string_append (active, "passthrough");
+    }
+    return g_string_free (active, FALSE);
+}
+
+/* CPU seconds for the whole run, -1 if it failed. active gets what
+ * describe() says, except for MODE_SOURCE.
+ */
+static gdouble run(Mode mode, const gchar *format, gint rate, gint rate_out,
+        gdouble seconds, gdouble gain, gchar **active) {
+    GstElement *pipeline, *sink;
+    GError *error = NULL;
+    GstCaps *caps;
+    GstSample *sample;
+    Consumer consumer;
+    gchar *description, *rates;
+    gdouble start, used;
+
+    description = g_strdup_printf ("audiotestsrc wave=white-noise samplesperbuffer=%d "
+            "num-buffers=%u ! audio/x-raw, format=(string)%s, layout=(string)interleaved, "
+            "rate=(int)%d, channels=(int)2 ! %s",
+            CONVBENCH_BUFFER_FRAMES,
+            (guint)(seconds * rate / CONVBENCH_BUFFER_FRAMES) + 1, format, rate,
+            (MODE_SOURCE == mode) ? "appsink name=sink sync=false" :
+                "audioconvert name=convert ! volume name=gain ! audio/x-raw, channels=(int)2 ! "
+                "audioresample name=resample ! appsink name=sink sync=false");
+    pipeline = gst_parse_launch (description, &error);
+    g_free (description);
+    if (NULL == pipeline) {
+        g_printerr ("Couldn't create pipeline: %s\n", error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    if (MODE_FIXED == mode) {
+        GstElement *volume = gst_bin_get_by_name (GST_BIN (pipeline), "gain");
+        GstElement *resample;
+
+        g_object_set (volume, "volume", gain, NULL);
+        gst_object_unref (volume);
+        resample = gst_bin_get_by_name (GST_BIN (pipeline), "resample");
+        g_object_set (resample, "quality", resample_get_gst_quality (quality), NULL);
+        gst_object_unref (resample);
+        caps = gst_caps_new_simple ("audio/x-raw",
+                "format", G_TYPE_STRING, G_BYTE_ORDER == G_BIG_ENDIAN ? "F32BE" : "F32LE",
+                "layout", G_TYPE_STRING, "interleaved",
+                "channels", G_TYPE_INT, 2,
+                "rate", G_TYPE_INT, rate_out,
+                NULL);
+        gst_app_sink_set_caps (GST_APP_SINK (sink), caps);
+        gst_caps_unref (caps);
+    } else if (MODE_NATIVE == mode) {
+        rates = resample_get_rates (rate_out);
+        description = g_strdup_printf ("audio/x-raw, format=(string)" DSP_FORMATS ", "
+                "layout=(string)interleaved, channels=(int)2, rate=(int){ %s }", rates);
+        caps = gst_caps_from_string (description);
+        g_free (description);
+        g_free (rates);
+        gst_app_sink_set_caps (GST_APP_SINK (sink), caps);
+        gst_caps_unref (caps);
+    }
+
+    memset (&consumer, 0, sizeof (consumer));
+    consumer.ring = ringbuffer_new (8192);
+    consumer.resampler = resampler_new ();
+    consumer.rate_out = rate_out;
+
+    start = cpu_seconds ();
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    while (NULL != (sample = gst_app_sink_pull_sample (GST_APP_SINK (sink)))) {
+        if (MODE_SOURCE != mode) {
+            consume (&consumer, sample, (MODE_NATIVE == mode) ? (gfloat)gain : 1.0f);
+        }
+        gst_sample_unref (sample);
+    }
+    used = cpu_seconds () - start;
+
+    if (MODE_SOURCE != mode) {
+        *active = describe (pipeline);
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (sink);
+    gst_object_unref (pipeline);
+    ringbuffer_free (consumer.ring);
+    g_free (consumer.convert);
+    resampler_free (consumer.resampler);
+    g_free (consumer.resampled);
+
+    return used;
+}
+
+/* The lowest of runs, in percent of one core per deck */
+static gdouble measure(Mode mode, const gchar *format, gint rate, gint rate_out,
+        gdouble seconds, gdouble gain, gint runs, gdouble baseline, gchar **active) {
+    gdouble best = -1;
+
+    for (gint i = 0; i < runs; i++) {
+        gchar *what = NULL;
+        gdouble used = run (mode, format, rate, rate_out, seconds, gain, &what);
+
+        if (used >= 0 && (best < 0 || used < best)) {
+            best = used;
+        }
+        if (NULL != active) {
+            g_free (*active);
+            *active = what;
+        } else {
+            g_free (what);
+        }
+    }
+
+    if (best < 0) {
+        return -1;
+    }
+    return 100.0 * MAX (0, best - baseline) / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar **formats;
+    gint rates[2];
+
+    gchar *format_list = NULL;
+    gchar *quality_name = NULL;
+    gdouble seconds = 60;
+    gdouble gain = 0.5;
+    gint rate_out = 48000;
+    gint runs = 3;
+
+    GOptionEntry option_entries[] = {
+        { "formats", 'f', 0, G_OPTION_ARG_STRING,
+            &format_list, "Source formats (S16LE,S24LE,S32LE,F32LE)", "LIST" },
+        { "seconds", 's', 0, G_OPTION_ARG_DOUBLE,
+            &seconds, "Audio per run (60)", "S" },
+        { "rate", 'r', 0, G_OPTION_ARG_INT,
+            &rate_out, "The jack rate (48000)", "HZ" },
+        { "gain", 'g', 0, G_OPTION_ARG_DOUBLE,
+            &gain, "Track gain, 1.0 lets F32 through untouched (0.5)", "G" },
+        { "runs", 'n', 0, G_OPTION_ARG_INT,
+            &runs, "Best of N runs (3)", "N" },
+        { "quality", 'q', 0, G_OPTION_ARG_STRING,
+            &quality_name, "Of the engine's resampler, low, medium or high (medium)", "Q" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- per deck CPU of the engine's conversion");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (NULL != quality_name) {
+        if (!resample_config_parse (quality_name)) {
+            g_printerr ("Unknown resampler quality: %s\n", quality_name);
+            return 1;
+        }
+        quality = resample_get_quality (-1, RESAMPLE_CLASS_FILE);
+    }
+
+    gst_init (&argc, &argv);
+
+    formats = g_strsplit ((NULL != format_list) ? format_list : "S16LE,S24LE,S32LE,F32LE", ",", -1);
+    rates[0] = 44100;
+    rates[1] = rate_out;
+    seconds = MAX (seconds, 1);
+    runs = MAX (runs, 1);
+
+    g_print ("kernels %s, %s resampler, %.0f s per run, gain %.2f, %% of one core per deck\n",
+            dsp_get_kernels (), resample_quality_get_name (quality), seconds, gain);
+
+    for (guint i = 0; NULL != formats[i]; i++) {
+        for (guint j = 0; j < G_N_ELEMENTS (rates); j++) {
+            gchar *fixed_active = NULL, *native_active = NULL;
+            gdouble baseline, fixed, native;
+
+            if (j > 0 && rates[j] == rates[0]) {
+                continue;
+            }
+
+            baseline = measure (MODE_SOURCE, formats[i], rates[j], rate_out,
+                    seconds, gain, runs, 0, NULL) * seconds / 100.0;
+            fixed = measure (MODE_FIXED, formats[i], rates[j], rate_out,
+                    seconds, gain, runs, baseline, &fixed_active);
+            native = measure (MODE_NATIVE, formats[i], rates[j], rate_out,
+                    seconds, gain, runs, baseline, &native_active);
+
+            if (baseline < 0 || fixed < 0 || native < 0) {
+                g_printerr ("%s at %d Hz failed\n", formats[i], rates[j]);
+            } else {
+                g_print ("%-8s %6d -> %-6d  fixed %6.3f%% (%s)  native %6.3f%% (%s)\n",
+                        formats[i], rates[j], rate_out, fixed, fixed_active,
+                        native, native_active);
+            }
+
+            g_free (fixed_active);
+            g_free (native_active);
+        }
+    }
+
+    g_strfreev (formats);
+    g_free (format_list);
+    g_free (quality_name);
+    return 0;
+}
+#else
+int main(int argc, char *argv[]) {
+    g_printerr ("The conversion benchmark needs GStreamer 1.x\n");
+    return 1;
+}
+#endif
@@ -0,0 +1,200 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "control.h"
+#include "controlclient.h"
+
+/*
+ * One command for a running 4deckradiod (or 4deckradio --control) from
+ * the shell, for cron jobs and scripts:
+ *
+ *     4deckradioctl 2 load /music/news-jingle.flac
+ *     4deckradioctl 2 start-at 12:59:55.000
+ *     4deckradioctl 2 status
+ */
+
+#define CTL_REPLY_TIMEOUT_MS 5000
+
+static const gchar *command_names[] = {
+    NULL, "play", "stop", "pause", "load", "queue", "seek", "status", "start-at"
+};
+
+static const gchar *state_names[DECK_NUM_STATES] = {
+    "EMPTY", "STOPPED", "LOADING", "PAUSED", "STARTING", "PLAYING",
+    "PAUSING", "STOPPING", "ERROR"
+};
+
+static const gchar *status_names[] = {
+    "ok", "refused", "no such deck"
+};
+
+/* Files are sent as file:// URIs */
+static gchar* make_uri(const gchar *argument) {
+    gchar *path, *uri;
+
+    if (NULL != strstr (argument, "://")) {
+        return g_strdup (argument);
+    }
+
+    if (g_path_is_absolute (argument)) {
+        path = g_strdup (argument);
+    } else {
+        gchar *cwd = g_get_current_dir ();
+
+        path = g_build_filename (cwd, argument, NULL);
+        g_free (cwd);
+    }
+
+    uri = g_filename_to_uri (path, NULL, NULL);
+    g_free (path);
+    return uri;
+}
+
+/* HH:MM:SS[.mmm] today, local time, in nanoseconds since the epoch. -1 if
+ * it doesn't parse or has passed.
+ */
+static gint64 parse_time(const gchar *argument) {
+    GDateTime *now = g_date_time_new_now_local ();
+    GDateTime *time;
+    guint hours, minutes;
+    gdouble seconds;
+    gint64 ns = -1;
+
+    if (3 == sscanf (argument, "%u:%u:%lf", &hours, &minutes, &seconds) &&
+            hours < 24 && minutes < 60 && seconds >= 0 && seconds < 60) {
+        time = g_date_time_new_local (g_date_time_get_year (now),
+                g_date_time_get_month (now), g_date_time_get_day_of_month (now),
+                hours, minutes, seconds);
+        if (NULL != time) {
+            ns = g_date_time_to_unix (time) * GST_SECOND +
+                    (gint64)g_date_time_get_microsecond (time) * GST_USECOND;
+            g_date_time_unref (time);
+        }
+    }
+
+    if (ns >= 0 && ns <= g_get_real_time () * (gint64)GST_USECOND) {
+        g_printerr ("%s has passed\n", argument);
+        ns = -1;
+    }
+
+    g_date_time_unref (now);
+    return ns;
+}
+
+static gint find_command(const gchar *name) {
+    for (guint i = 1; i < G_N_ELEMENTS (command_names); i++) {
+        if (0 == g_strcmp0 (name, command_names[i])) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    ControlReply reply;
+    gchar *uri = NULL;
+    gint64 position = 0;
+    gint command, deck;
+    gboolean ok;
+    int fd;
+
+    gchar *path = NULL;
+
+    GOptionEntry option_entries[] = {
+        { "socket", 'k', 0, G_OPTION_ARG_FILENAME,
+            &path, "Control socket ($XDG_RUNTIME_DIR/4deckradio.control)", "SOCKET" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("DECK COMMAND [ARGUMENT] - drive a deck");
+    g_option_context_set_description (context,
+            "Commands: play, stop, pause, status, load FILE|URI, queue FILE|URI,\n"
+            "seek SECONDS, start-at HH:MM:SS[.mmm]\n");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (argc < 3) {
+        g_printerr ("Usage: %s [--socket SOCKET] DECK COMMAND [ARGUMENT]\n", argv[0]);
+        return 1;
+    }
+
+    deck = atoi (argv[1]);
+    command = find_command (argv[2]);
+    if (deck < 1 || deck > G_MAXUINT8 || command < 0) {
+        g_printerr ("No such deck or command: %s %s\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    switch (command) {
+        case CONTROL_LOAD:
+        case CONTROL_QUEUE:
+        case CONTROL_SEEK:
+        case CONTROL_START_AT:
+            if (argc < 4) {
+                g_printerr ("%s needs an argument\n", argv[2]);
+                return 1;
+            }
+            break;
+    }
+
+    if (CONTROL_LOAD == command || CONTROL_QUEUE == command) {
+        uri = make_uri (argv[3]);
+    } else if (CONTROL_SEEK == command) {
+        position = (gint64)(g_ascii_strtod (argv[3], NULL) * GST_SECOND);
+    } else if (CONTROL_START_AT == command) {
+        position = parse_time (argv[3]);
+        if (position < 0) {
+            return 1;
+        }
+    }
+
+    if (NULL == path) {
+        path = control_default_path ();
+    }
+
+    fd = control_connect (path);
+    if (fd < 0) {
+        g_printerr ("Couldn't connect to %s\n", path);
+        return 1;
+    }
+
+    ok = control_send (fd, 1, command, deck - 1, position, uri) &&
+            control_wait_reply (fd, 1, &reply, CTL_REPLY_TIMEOUT_MS);
+    close (fd);
+
+    if (!ok) {
+        g_printerr ("No reply from %s\n", path);
+    } else {
+        g_print ("%s: deck %d %s", (reply.status < G_N_ELEMENTS (status_names)) ?
+                status_names[reply.status] : "?", deck,
+                (reply.deckstate < DECK_NUM_STATES) ? state_names[reply.deckstate] : "?");
+        if (CONTROL_STATUS == command && reply.position >= 0) {
+            g_print (" %.3f", (gdouble)reply.position / GST_SECOND);
+            if (reply.duration >= 0) {
+                g_print (" / %.3f", (gdouble)reply.duration / GST_SECOND);
+            }
+        }
+        g_print ("\n");
+        ok = (CONTROL_OK == reply.status);
+    }
+
+    g_free (uri);
+    g_free (path);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "control.h"
+#include "controlclient.h"
+
+/*
+ * Control socket round trip benchmark.
+ *
+ * Sends each command to a running 4deckradiod (or 4deckradio --control)
+ * and times it from send() to its reply, one at a time. Meanwhile burner
+ * threads keep every CPU busy and flooding clients hammer another deck
+ * with STATUS requests, so the numbers show what a command costs when
+ * the box has other things to do:
+ *
+ *     ./4deckradiod --engine &
+ *     ./4deckradio-ctlbench --requests 1000 --burners 4 --flooders 2 \
+ *         --uri file:///music/song.flac
+ *
+ * The deck under test is loaded, played, sought, paused and stopped in
+ * a loop; it's audible, so use a deck nobody's listening to.
+ */
+
+#define CTLBENCH_REPLY_TIMEOUT_MS 5000
+
+static const ControlCommand commands[] = {
+    CONTROL_LOAD, CONTROL_PLAY, CONTROL_STATUS, CONTROL_SEEK, CONTROL_PAUSE,
+    CONTROL_STOP
+};
+
+static const gchar *command_names[] = {
+    NULL, "play", "stop", "pause", "load", "queue", "seek", "status"
+};
+
+typedef struct _Load {
+    gint stop;
+    const gchar *path;
+    guint deck;
+    gint flooded;                   /* Requests the flooders got answered */
+} Load;
+
+static gpointer burner_thread(Load *load) {
+    volatile gdouble x = 1.0;
+
+    while (!g_atomic_int_get (&load->stop)) {
+        for (int i = 0; i < 10000; i++) {
+            x = sqrt (x + i);
+        }
+    }
+    return NULL;
+}
+
+/* Keeps a window of STATUS requests in flight */
+static gpointer flooder_thread(Load *load) {
+    int fd = control_connect (load->path);
+    guint32 serial = 0;
+    ControlReply reply;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        control_send (fd, serial++, CONTROL_STATUS, load->deck, 0, NULL);
+    }
+
+    while (!g_atomic_int_get (&load->stop)) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        if (poll (&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        if (recv (fd, &reply, sizeof (reply), 0) <= 0) {
+            break;
+        }
+        g_atomic_int_inc (&load->flooded);
+        control_send (fd, serial++, CONTROL_STATUS, load->deck, 0, NULL);
+    }
+
+    close (fd);
+    return NULL;
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank */
+static gdouble percentile(GArray *sorted, gdouble q) {
+    guint rank = (guint)ceil (q * sorted->len);
+
+    return g_array_index (sorted, gdouble, CLAMP (rank, 1, sorted->len) - 1);
+}
+
+static void print_results(ControlCommand command, GArray *results, guint failed) {
+    if (0 == results->len) {
+        g_print ("%-8s no replies (%u failed)\n", command_names[command], failed);
+        return;
+    }
+
+    g_array_sort (results, compare_doubles);
+    g_print ("%-8s n=%-5u p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us  (%u failed)\n",
+            command_names[command], results->len,
+            percentile (results, 0.50), percentile (results, 0.90),
+            percentile (results, 0.99),
+            g_array_index (results, gdouble, results->len - 1), failed);
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    GArray *results[G_N_ELEMENTS (commands)];
+    guint failed[G_N_ELEMENTS (commands)];
+    GThread **threads;
+    Load load;
+    guint32 serial = 0;
+    int fd;
+
+    gchar *path = NULL;
+    gchar *uri = NULL;
+    gint requests = 200;
+    gint deck = 4;
+    gint burners = g_get_num_processors ();
+    gint flooders = 2;
+
+    GOptionEntry option_entries[] = {
+        { "socket", 'k', 0, G_OPTION_ARG_FILENAME,
+            &path, "Control socket ($XDG_RUNTIME_DIR/4deckradio.control)", "SOCKET" },
+        { "requests", 'n', 0, G_OPTION_ARG_INT,
+            &requests, "Rounds of commands (200)", "N" },
+        { "deck", 'd', 0, G_OPTION_ARG_INT,
+            &deck, "Deck to drive, counted from 1 (4)", "DECK" },
+        { "uri", 'u', 0, G_OPTION_ARG_STRING,
+            &uri, "File to load, LOAD isn't measured without it", "URI" },
+        { "burners", 'b', 0, G_OPTION_ARG_INT,
+            &burners, "Threads spinning on the CPUs (one per CPU)", "N" },
+        { "flooders", 'f', 0, G_OPTION_ARG_INT,
+            &flooders, "Clients flooding another deck with STATUS (2)", "N" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- control socket round trip latency under load");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (deck < 1 || deck > G_MAXUINT8) {
+        g_printerr ("No such deck: %d\n", deck);
+        return 1;
+    }
+
+    if (NULL == path) {
+        path = control_default_path ();
+    }
+
+    fd = control_connect (path);
+    if (fd < 0) {
+        g_printerr ("Couldn't connect to %s\n", path);
+        return 1;
+    }
+
+    memset (&load, 0, sizeof (load));
+    load.path = path;
+    /* the deck before the one under test */
+    load.deck = (deck > 1) ? deck - 2 : 1;
+
+    threads = g_new0 (GThread *, MAX (burners, 0) + MAX (flooders, 0));
+    for (gint i = 0; i < burners; i++) {
+        threads[i] = g_thread_new ("burner", (GThreadFunc)burner_thread, &load);
+    }
+    for (gint i = 0; i < flooders; i++) {
+        threads[MAX (burners, 0) + i] = g_thread_new ("flooder", (GThreadFunc)flooder_thread, &load);
+    }
+
+    for (guint c = 0; c < G_N_ELEMENTS (commands); c++) {
+        results[c] = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        failed[c] = 0;
+    }
+
+    for (gint n = 0; n < requests; n++) {
+        for (guint c = 0; c < G_N_ELEMENTS (commands); c++) {
+            ControlReply reply;
+            gint64 start;
+
+            if (CONTROL_LOAD == commands[c] && NULL == uri) {
+                continue;
+            }
+
+            start = g_get_monotonic_time ();
+            if (control_send (fd, ++serial, commands[c], deck - 1, 0, uri) &&
+                    control_wait_reply (fd, serial, &reply, CTLBENCH_REPLY_TIMEOUT_MS) &&
+                    CONTROL_OK == reply.status) {
+                gdouble us = g_get_monotonic_time () - start;
+
+                g_array_append_val (results[c], us);
+            } else {
+                failed[c]++;
+            }
+
+            /* let the deck move on, the next command is no stress test */
+            g_usleep (2000);
+        }
+    }
+
+    g_atomic_int_set (&load.stop, TRUE);
+    for (gint i = 0; i < MAX (burners, 0) + MAX (flooders, 0); i++) {
+        g_thread_join (threads[i]);
+    }
+
+    g_print ("deck %d, %d burners, %d flooders (%d STATUS answered)\n",
+            deck, burners, flooders, g_atomic_int_get (&load.flooded));
+    for (guint c = 0; c < G_N_ELEMENTS (commands); c++) {
+        if (CONTROL_LOAD != commands[c] || NULL != uri) {
+            print_results (commands[c], results[c], failed[c]);
+        }
+        g_array_free (results[c], TRUE);
+    }
+
+    close (fd);
+    g_free (threads);
+    g_free (path);
+    g_free (uri);
+    return 0;
+}
@@ -0,0 +1,353 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <signal.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "audio.h"
+#include "cart.h"
+#include "control.h"
+#include "controlclient.h"
+#include "deck.h"
+#include "engine.h"
+#include "input.h"
+#include "jackclock.h"
+#include "library.h"
+#include "metrics.h"
+#include "playlist.h"
+#include "resample.h"
+#include "schedule.h"
+#include "seektable.h"
+#include "segue.h"
+#include "session.h"
+#include "startup.h"
+#include "waveform.h"
+
+/*
+ * The decks without a window. Everything that moves them comes in over
+ * the control socket (control.c) or from the joysticks, and the main loop
+ * runs nothing but the deck state machines and their bus watches, so no
+ * redraw ever sits between a command and the pipeline.
+ */
+
+static CustomData *decks;
+static guint num_decks = DECK_DEFAULT_COUNT;
+static GMainLoop *loop;
+
+static void deck_error_cb(CustomData *data, const gchar *message) {
+    g_printerr ("Deck %u: %s\n", data->decknumber + 1, message);
+}
+
+/* A file got analysed, its cues may move */
+static void waveform_ready_cb(const gchar *uri, gpointer unused) {
+    for (guint i = 0; i < num_decks; i++) {
+        deck_cues_ready (&decks[i], uri);
+    }
+}
+
+/* The decks start and end files at the cues found by the analysis */
+static void analyse(const gchar *uri) {
+    Waveform *waveform = waveform_lookup (uri);
+
+    if (NULL == waveform) {
+        waveform_request (uri, (WaveformReadyFunc)waveform_ready_cb, NULL);
+    }
+    waveform_free (waveform);
+}
+
+/* Playlists play through on the deck, entry by entry */
+static void load_playlist(CustomData *data, const gchar *uri, gboolean queue) {
+    Playlist *playlist = playlist_open (uri);
+    const gchar *first;
+
+    if (NULL == playlist) {
+        g_printerr ("Deck %u: can't read %s\n", data->decknumber + 1, uri);
+        return;
+    }
+
+    first = deck_load_playlist (data, playlist, queue);
+    if (NULL == first) {
+        g_printerr ("Deck %u: nothing to play in %s\n", data->decknumber + 1, uri);
+        return;
+    }
+    analyse (first);
+}
+
+static void control_load_cb(CustomData *data, const gchar *uri, gboolean queue) {
+    g_print ("Deck %u: %s %s\n", data->decknumber + 1, queue ? "queue" : "load", uri);
+    if (playlist_is_playlist (uri)) {
+        load_playlist (data, uri, queue);
+        return;
+    }
+
+    if (queue) {
+        deck_queue (data, uri);
+    } else {
+        deck_load (data, uri);
+    }
+    analyse (uri);
+}
+
+/* The next entry of a playlist */
+static void deck_queued_cb(CustomData *data, const gchar *uri) {
+    analyse (uri);
+}
+
+/* Back from the session journal, analyse what it loaded */
+static void session_restored_cb(CustomData *data, gpointer unused) {
+    analyse (data->active->uri);
+    if (NULL != data->nextfile_uri) {
+        analyse (data->nextfile_uri);
+    }
+}
+
+/* Runs on the input thread */
+static void joystick_button_cb(guint number, gboolean pressed, gint64 time, gpointer unused) {
+    if (number < num_decks) {
+        if (pressed) {
+            deck_play_async (&decks[number]);
+        } else {
+            deck_stop_async (&decks[number], deck_stop);
+        }
+    } else if (pressed) {
+        cart_fire (number - num_decks);
+    }
+}
+
+static gboolean quit_cb(gpointer unused) {
+    g_main_loop_quit (loop);
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    InputThread *input;
+    AudioInit *audio_init;
+    gchar *silence;
+    gint ndecks = DECK_DEFAULT_COUNT;
+
+    int autoconnect = 0;
+    gboolean use_engine = FALSE;
+    gboolean jack_stats = FALSE;
+    gboolean no_restore = FALSE;
+    gchar **carts = NULL;
+    gchar **library_dirs = NULL;
+    gdouble cue_threshold = WAVEFORM_DEFAULT_CUE_THRESHOLD;
+    gboolean accurate_seek = FALSE;
+    gint prebuffer_ms = AUDIO_DEFAULT_PREBUFFER_MS;
+    gint reconnect_s = DECK_DEFAULT_RECONNECT_S;
+    gchar *metrics_socket = NULL;
+    gchar *control_socket = NULL;
+    gint segue_ms = -1;
+    gint fade_ms = -1;
+    gchar *fade_curve = NULL;
+    gchar *resample = NULL;
+    EngineFadeCurve curve = ENGINE_FADE_EQUAL_POWER;
+
+    GOptionEntry option_entries[] = {
+        { "decks", 'n', 0, G_OPTION_ARG_INT,
+            &ndecks, "Number of decks (4)", "N" },
+        { "autoconnect", 'a', 0, G_OPTION_ARG_NONE,
+            &autoconnect, "Autoconnect to jackd", NULL },
+        { "cart", 'c', 0, G_OPTION_ARG_FILENAME_ARRAY,
+            &carts, "Keep FILE decoded in the cart bank (repeatable)", "FILE" },
+        { "library", 'l', 0, G_OPTION_ARG_FILENAME_ARRAY,
+            &library_dirs, "Keep the index of the audio files below DIR up to date (repeatable)", "DIR" },
+        { "cue-threshold", 't', 0, G_OPTION_ARG_DOUBLE,
+            &cue_threshold, "Start and end files where they are louder than DB dBFS (-50)", "DB" },
+        { "accurate-seek", 'x', 0, G_OPTION_ARG_NONE,
+            &accurate_seek, "Seek to the exact sample, with seek tables built in the background", NULL },
+        { "prebuffer", 'b', 0, G_OPTION_ARG_INT,
+            &prebuffer_ms, "Hold MS of a network stream before playing it (1000)", "MS" },
+        { "reconnect", 'R', 0, G_OPTION_ARG_INT,
+            &reconnect_s, "Keep reconnecting a stream that dropped on air for S seconds (30)", "S" },
+        { "engine", 'e', 0, G_OPTION_ARG_NONE,
+            &use_engine, "Play all decks through a single jack client", NULL },
+        { "segue", 'o', 0, G_OPTION_ARG_INT,
+            &segue_ms, "Start the next prerolled deck MS before the playing one ends (engine only)", "MS" },
+        { "fade", 0, 0, G_OPTION_ARG_INT,
+            &fade_ms, "Crossfade over MS, the whole overlap by default", "MS" },
+        { "fade-curve", 0, 0, G_OPTION_ARG_STRING,
+            &fade_curve, "linear, equal-power or s-curve (equal-power)", "CURVE" },
+        { "resample", 0, 0, G_OPTION_ARG_STRING,
+            &resample, "Resampler quality, low, medium or high, for all or per file, stream, "
+                "cart, analysis or deckN (medium)", "[CLASS=]QUALITY,..." },
+        { "no-restore", 0, 0, G_OPTION_ARG_NONE,
+            &no_restore, "Start with empty decks instead of the last session", NULL },
+        { "jack-stats", 's', 0, G_OPTION_ARG_NONE,
+            &jack_stats, "Print jack xruns, DSP load and deck drift every few seconds", NULL },
+        { "metrics", 'm', 0, G_OPTION_ARG_FILENAME,
+            &metrics_socket, "Serve per-deck counters on the Unix socket SOCKET", "SOCKET" },
+        { "control", 'k', 0, G_OPTION_ARG_FILENAME,
+            &control_socket, "Take commands on the Unix socket SOCKET "
+                "($XDG_RUNTIME_DIR/4deckradio.control)", "SOCKET" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    startup_mark ("before main");
+
+    context = g_option_context_new ("- the 4deckradio decks, controlled over a socket");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\nTry --help to see a full list of available command line options.\n",
+                error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (ndecks < 1 || ndecks > DECK_MAX_COUNT) {
+        g_printerr ("Between 1 and %d decks, please\n", DECK_MAX_COUNT);
+        return 1;
+    }
+    num_decks = ndecks;
+
+    if (NULL != fade_curve && !engine_fade_curve_parse (fade_curve, &curve)) {
+        g_printerr ("Unknown fade curve: %s\n", fade_curve);
+        return 1;
+    }
+
+    if (NULL != resample && !resample_config_parse (resample)) {
+        g_printerr ("Unknown resampler quality: %s\n", resample);
+        return 1;
+    }
+
+    startup_mark ("options");
+
+    gst_init (&argc, &argv);
+    startup_mark ("gst_init");
+
+    if (NULL == control_socket) {
+        control_socket = control_default_path ();
+    }
+
+    if (use_engine) {
+        engine_init (num_decks, autoconnect);
+    }
+
+    if (jack_stats) {
+        engine_stats_init ();
+    }
+
+    /* before the pipelines, they all get the shared clock */
+    jackclock_init ();
+    startup_mark ("engine and clock");
+
+    /* built on other threads while the rest starts up */
+    decks = g_new0 (CustomData, num_decks);
+    audio_init = audio_init_decks_start (decks, num_decks, autoconnect);
+
+    cart_bank_init (carts, autoconnect);
+
+    waveform_init ();
+    waveform_set_cue_threshold (cue_threshold);
+
+    if (accurate_seek) {
+        audio_set_accurate_seek (TRUE);
+        seektable_init ();
+    }
+
+    audio_set_prebuffer (MAX (prebuffer_ms, 0));
+    deck_set_reconnect_window (MAX (reconnect_s, 0));
+
+    /* the decks look up loudness in the index */
+    if (NULL != library_dirs) {
+        library_init (library_dirs, NULL, NULL);
+    }
+
+    {
+        DeckCallbacks callbacks = { NULL, deck_error_cb, NULL, NULL, deck_queued_cb };
+        deck_set_callbacks (&callbacks);
+    }
+    startup_mark ("background services");
+
+    if (!audio_init_decks_finish (audio_init)) {
+        g_printerr ("Not all decks could be set up\n");
+    }
+
+    /* expose the jack ports, as the player does. Engine decks stay idle
+     * until something is loaded. */
+    silence = engine_is_running () ? NULL : audio_make_silence ();
+    for (guint i = 0; i < num_decks; i++) {
+        deck_init (&decks[i]);
+        if (NULL != silence) {
+            deck_load (&decks[i], silence);
+        }
+    }
+    g_free (silence);
+    startup_mark ("pipelines");
+
+    if (NULL != metrics_socket) {
+        metrics_init (metrics_socket, decks, num_decks);
+    }
+
+    if (jack_stats) {
+        jackclock_report_start (decks, num_decks);
+    }
+
+    if (segue_ms >= 0) {
+        segue_init (decks, num_decks, segue_ms, (fade_ms >= 0) ? fade_ms : segue_ms, curve);
+    }
+
+    /* the decks preroll what they had while the rest starts up */
+    session_init ("4deckradiod", decks, num_decks, !no_restore, session_restored_cb, NULL);
+    startup_mark ("session");
+
+    {
+        ControlCallbacks callbacks = { control_load_cb, NULL };
+
+        if (!control_init (control_socket, decks, num_decks, &callbacks)) {
+            return 1;
+        }
+    }
+
+    input = input_thread_new (joystick_button_cb, NULL);
+    input_thread_watch_dir (input, "/dev/input");
+    input_thread_start (input);
+    startup_mark ("control socket and joysticks");
+
+    loop = g_main_loop_new (NULL, FALSE);
+    g_unix_signal_add (SIGINT, quit_cb, NULL);
+    g_unix_signal_add (SIGTERM, quit_cb, NULL);
+
+    startup_report ("4deckradiod");
+
+    g_main_loop_run (loop);
+
+    /* no more deck commands from here on */
+    input_thread_free (input);
+    control_shutdown ();
+    metrics_shutdown ();
+    segue_shutdown ();
+    schedule_shutdown ();
+    session_shutdown ();
+
+    engine_stats_free ();
+    engine_free ();
+    waveform_shutdown ();
+    seektable_shutdown ();
+    library_shutdown ();
+
+    for (guint i = 0; i < num_decks; i++) {
+        deck_free (&decks[i]);
+        deck_print_stats (&decks[i]);
+        free_audio (&decks[i]);
+    }
+
+    jackclock_shutdown ();
+    g_main_loop_unref (loop);
+    g_free (decks);
+    cart_bank_free ();
+    g_strfreev (carts);
+    g_strfreev (library_dirs);
+    g_free (metrics_socket);
+    g_free (control_socket);
+    g_free (fade_curve);
+    g_free (resample);
+    return 0;
+}
@@ -0,0 +1,1187 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "audio.h"
+#include "deck.h"
+#include "library.h"
+#include "loudness.h"
+#include "metrics.h"
+#include "playlist.h"
+#include "schedule.h"
+#include "seektable.h"
+#include "segue.h"
+#include "session.h"
+#include "waveform.h"
+
+/*
+ * Every deck runs a small state machine on the main loop. Commands only
+ * queue a job for the deck's worker thread and move the deck into a
+ * transitional state, so nothing on the main loop ever waits for a
+ * pipeline. The transition completes when the bus tells us the pipeline
+ * got there (ASYNC_DONE, state-changed, or the worker's job-done message),
+ * or fails when DECK_TIMEOUT_MS expires.
+ *
+ * Each deck has its own worker (a thread pool with a single thread, so
+ * jobs run in order), which means a stalled network stream on one deck
+ * only ever delays that deck.
+ *
+ * Network streams start once their prebuffer is full, and go back to
+ * PAUSED to refill it when they run dry. A stream that drops or stalls
+ * on air is reconnected, at once and then backing off, for
+ * reconnect_window seconds before the deck gives up with DECK_ERROR.
+ *
+ * Local files start at their cue-in and end at their cue-out, taken from
+ * the waveform analysis. A file that hasn't been analysed yet is loaded
+ * from the start and moved to its cue-in when the analysis comes in,
+ * unless it has been played or sought meanwhile.
+ *
+ * A deck with a playlist queues its next entry whenever the one before
+ * becomes active, and an entry that ends starts the next one.
+ *
+ * Every change worth keeping across a crash is handed to the session
+ * journal (session.c), and deck_restore() brings a deck back from it.
+ *
+ * The input thread may start and stop a deck without waiting for the main
+ * loop: deck_play_async() and deck_stop_async() queue the job right away,
+ * under input_lock, and let the main loop catch the state machine up
+ * afterwards.
+ */
+
+#define DECK_TIMEOUT_MS 10000
+#define DECK_STREAM_TIMEOUT_MS 30000
+#define DECK_RECONNECT_MIN_MS 250
+#define DECK_RECONNECT_MAX_MS 4000
+#define DECK_SEEK_PREROLL_WAIT (5 * GST_SECOND)
+
+typedef struct _DeckJob {
+    AudioChain *chain;
+    gchar *uri;                     /* If set, go to READY and load it first */
+    gdouble gain;                   /* Loudness normalisation of uri */
+    SeekTable *seektable;           /* Of uri, if it has been built */
+    GstState target;                /* GST_STATE_VOID_PENDING keeps the state */
+    gboolean rewind;                /* Seek back to the start afterwards */
+    gboolean seek;                  /* Only seek to position */
+    gboolean stop;                  /* Rewind a file to PAUSED, take a stream to READY */
+    gdouble position;
+    gint64 cue_in;                  /* The chain's cues when the job was queued, */
+    gint64 cue_out;                 /* the worker never reads the chain's own */
+} DeckJob;
+
+static DeckCallbacks callbacks;
+static guint reconnect_window = DECK_DEFAULT_RECONNECT_S;
+
+static const gchar *state_names[DECK_NUM_STATES] = {
+    "EMPTY", "STOPPED", "LOADING", "PAUSED", "STARTING", "PLAYING",
+    "PAUSING", "STOPPING", "ERROR"
+};
+
+const gchar* deck_state_get_name(DeckState state) {
+    return state_names[state];
+}
+
+void deck_set_callbacks(const DeckCallbacks *cb) {
+    callbacks = *cb;
+}
+
+/* How long to keep reconnecting a stream that dropped on air */
+void deck_set_reconnect_window(guint seconds) {
+    reconnect_window = seconds;
+}
+
+static gboolean is_transitional(DeckState state) {
+    return (state == DECK_LOADING || state == DECK_STARTING ||
+            state == DECK_PAUSING || state == DECK_STOPPING);
+}
+
+/* The pipeline state a transitional deck state is waiting for */
+static GstState transition_target(DeckState state) {
+    switch (state) {
+        case DECK_LOADING:
+        case DECK_PAUSING:
+            return GST_STATE_PAUSED;
+        case DECK_STARTING:
+            return GST_STATE_PLAYING;
+        case DECK_STOPPING:
+            return GST_STATE_READY;
+        default:
+            return GST_STATE_VOID_PENDING;
+    }
+}
+
+/* This runs on the deck's worker thread */
+static void deck_worker(DeckJob *job, CustomData *data) {
+    AudioChain *chain = job->chain;
+    gboolean failed = FALSE;
+    gboolean moved = job->seek || job->rewind;
+
+    if (job->seek) {
+        /* Only the most recent seek matters, skip the ones overtaken by it */
+        if (g_atomic_int_dec_and_test (&data->queued_seeks)) {
+            /* right after a load, the preroll has to be done first */
+            gst_element_get_state (chain->pipeline, NULL, NULL, DECK_SEEK_PREROLL_WAIT);
+            audio_chain_seek (chain, job->position, job->cue_out);
+        }
+    } else {
+        if (NULL != job->uri) {
+            audio_chain_set_state (chain, GST_STATE_READY);
+            audio_chain_set_uri (chain, job->uri, job->gain, job->seektable);
+
+            /* anything the chain posts after this is about job->uri */
+            gst_element_post_message (chain->pipeline,
+                    gst_message_new_application (GST_OBJECT (chain->pipeline),
+                        gst_structure_new ("deck-job-loaded", NULL)));
+        }
+
+        /* what deck_next() would have asked for, see deck_stop_async() */
+        if (job->stop) {
+            job->target = chain->is_network_stream ? GST_STATE_READY : GST_STATE_PAUSED;
+            job->rewind = !chain->is_network_stream;
+        }
+
+        if (GST_STATE_VOID_PENDING != job->target) {
+            GstState current = GST_STATE_NULL;
+
+            /* leaving READY, the cue points need a prerolled pipeline */
+            gst_element_get_state (chain->pipeline, &current, NULL, 0);
+            if (current <= GST_STATE_READY && job->target >= GST_STATE_PAUSED &&
+                    (job->cue_in > 0 || GST_CLOCK_TIME_IS_VALID (job->cue_out))) {
+                audio_chain_set_state (chain, GST_STATE_PAUSED);
+                audio_chain_cue (chain, job->cue_in, job->cue_out);
+                moved = TRUE;
+            }
+
+            /* a stream plays once its prebuffer is full */
+            if (GST_STATE_PLAYING == job->target && chain->is_network_stream) {
+                audio_chain_prebuffer (chain);
+            }
+
+            failed = (GST_STATE_CHANGE_FAILURE ==
+                    audio_chain_set_state (chain, job->target));
+        }
+
+        if (job->rewind) {
+            audio_chain_cue (chain, job->cue_in, job->cue_out);
+        }
+    }
+
+    g_atomic_int_add (&chain->pending_jobs, -1);
+
+    /* wake up the state machine, whatever the pipeline did meanwhile */
+    gst_element_post_message (chain->pipeline,
+            gst_message_new_application (GST_OBJECT (chain->pipeline),
+                gst_structure_new ("deck-job-done",
+                    "failed", G_TYPE_BOOLEAN, failed,
+                    "moved", G_TYPE_BOOLEAN, moved, NULL)));
+
+    g_free (job->uri);
+    g_free (job);
+}
+
+/* Whatever the library measured, unity gain if it didn't (yet). Never
+ * waits for a measurement.
+ */
+static gdouble track_gain(const gchar *uri) {
+    gdouble loudness, true_peak;
+
+    if (!library_lookup_loudness (uri, &loudness, &true_peak)) {
+        return 1.0;
+    }
+
+    return loudness_gain (loudness, true_peak);
+}
+
+/* Hand job to the worker, with the cues its chain has now. From the main
+ * loop, which writes them, or under input_lock.
+ */
+static void queue_job(CustomData *data, DeckJob *job) {
+    job->cue_in = job->chain->cue_in;
+    job->cue_out = job->chain->cue_out;
+
+    g_atomic_int_inc (&job->chain->pending_jobs);
+    g_thread_pool_push (data->worker, job, NULL);
+}
+
+static void push_job(CustomData *data, AudioChain *chain, const gchar *uri,
+        GstState target, gboolean rewind) {
+    DeckJob *job = g_new0 (DeckJob, 1);
+
+    job->chain = chain;
+    job->uri = g_strdup (uri);
+    job->gain = (NULL != uri) ? track_gain (uri) : 1.0;
+    if (NULL != uri) {
+        job->seektable = seektable_lookup (uri);
+        if (NULL == job->seektable) {
+            seektable_request (uri);
+        }
+    }
+    job->target = target;
+    job->rewind = rewind;
+
+    if (NULL != uri) {
+        chain->loads_pending++;
+    }
+    queue_job (data, job);
+}
+
+static gboolean transition_timeout_cb(CustomData *data);
+
+static void set_deckstate(CustomData *data, DeckState state) {
+    gint64 now = g_get_monotonic_time ();
+    gint64 elapsed = now - data->state_since;
+    DeckEdgeStats *edge = &data->edges[data->deckstate][state];
+
+    edge->count++;
+    edge->total_us += elapsed;
+    edge->max_us = MAX (edge->max_us, elapsed);
+
+    if (is_transitional (data->deckstate)) {
+        g_print ("Deck %u: %s -> %s in %.3f ms\n", data->decknumber + 1,
+                deck_state_get_name (data->deckstate),
+                deck_state_get_name (state), elapsed / 1000.0);
+        metrics_observe (&data->metrics->transitions[data->deckstate], elapsed);
+    }
+
+    if (0 != data->timeout_id) {
+        g_source_remove (data->timeout_id);
+        data->timeout_id = 0;
+    }
+
+    g_mutex_lock (&data->input_lock);
+    data->deckstate = state;
+    data->state_serial++;
+    g_mutex_unlock (&data->input_lock);
+    data->state_since = now;
+
+    /* the swapped in file got where the stop/EOS sent it, see deck_next() */
+    if (0 != data->swapped_at && !is_transitional (state) &&
+            !(DECK_PAUSED == state && data->play_when_ready)) {
+        if (DECK_ERROR != state) {
+            g_print ("Deck %u: swapped in file %s %.3f ms after the stop/EOS\n",
+                    data->decknumber + 1, deck_state_get_name (state),
+                    (now - data->swapped_at) / 1000.0);
+        }
+        data->swapped_at = 0;
+    }
+
+    if (is_transitional (state)) {
+        data->timeout_id = g_timeout_add (data->active->is_network_stream ?
+                DECK_STREAM_TIMEOUT_MS : DECK_TIMEOUT_MS,
+                (GSourceFunc)transition_timeout_cb, data);
+    }
+
+    if (NULL != callbacks.state_changed) {
+        callbacks.state_changed (data);
+    }
+
+    segue_deck_changed (data);
+    schedule_deck_changed (data);
+    session_deck_changed (data);
+}
+
+/* The user moved the deck on, or it's back on air */
+static void forget_stream_lost(CustomData *data) {
+    if (0 != data->reconnect_id) {
+        g_source_remove (data->reconnect_id);
+        data->reconnect_id = 0;
+    }
+    data->stream_lost = 0;
+    data->rebuffering_since = 0;
+}
+
+static void deck_fail(CustomData *data, const gchar *message) {
+    g_printerr ("Deck %u: %s\n", data->decknumber + 1, message);
+
+    forget_stream_lost (data);
+    data->play_when_ready = FALSE;
+    push_job (data, data->active, NULL, GST_STATE_READY, FALSE);
+    set_deckstate (data, DECK_ERROR);
+
+    if (NULL != callbacks.error) {
+        callbacks.error (data, message);
+    }
+}
+
+/* A network stream that was on air is kept there, by reconnecting */
+static gboolean stream_on_air(CustomData *data) {
+    return data->active->is_network_stream &&
+            (DECK_PLAYING == data->deckstate || 0 != data->stream_lost);
+}
+
+static gboolean reconnect_cb(CustomData *data) {
+    data->reconnect_id = 0;
+    data->reconnects++;
+
+    /* READY and back up, the worker holds it until the prebuffer is full */
+    push_job (data, data->active, data->active->uri, GST_STATE_PLAYING, FALSE);
+    set_deckstate (data, DECK_STARTING);
+
+    return FALSE;
+}
+
+/* The stream on air dropped, stalled or couldn't be reached again. Try
+ * right away, then back off, until reconnect_window has passed.
+ */
+static void stream_lost(CustomData *data, const gchar *reason) {
+    gint64 now = g_get_monotonic_time ();
+    guint delay;
+
+    if (0 == data->stream_lost) {
+        data->stream_lost = now;
+        data->reconnects = 0;
+        g_atomic_int_inc (&data->metrics->stream_drops);
+    }
+
+    if (now - data->stream_lost > (gint64)reconnect_window * G_USEC_PER_SEC) {
+        gchar *message = g_strdup_printf ("%s, gave up after %u attempts",
+                reason, data->reconnects);
+
+        deck_fail (data, message);
+        g_free (message);
+        return;
+    }
+
+    /* one attempt at a time */
+    if (0 != data->reconnect_id) {
+        return;
+    }
+
+    delay = (0 == data->reconnects) ? 0 :
+            MIN (DECK_RECONNECT_MIN_MS << MIN (data->reconnects - 1, 8), DECK_RECONNECT_MAX_MS);
+    g_printerr ("Deck %u: %s, reconnecting in %u ms\n", data->decknumber + 1, reason, delay);
+    data->reconnect_id = g_timeout_add (delay, (GSourceFunc)reconnect_cb, data);
+}
+
+static void stream_back(CustomData *data) {
+    gint64 gap = g_get_monotonic_time () - data->stream_lost;
+
+    g_print ("Deck %u: stream back after %.0f ms, %u attempts\n", data->decknumber + 1,
+            gap / 1000.0, data->reconnects);
+    metrics_observe (&data->metrics->reconnect, gap);
+    forget_stream_lost (data);
+}
+
+static gboolean transition_timeout_cb(CustomData *data) {
+    gchar *message = g_strdup_printf ("Timeout while %s",
+            deck_state_get_name (data->deckstate));
+
+    /* returning FALSE removes the source */
+    data->timeout_id = 0;
+    if (0 != data->stream_lost) {
+        stream_lost (data, message);
+    } else {
+        deck_fail (data, message);
+    }
+    g_free (message);
+
+    return FALSE;
+}
+
+/* Complete the pending transition if the pipeline has arrived */
+static void check_transition(CustomData *data) {
+    GstState state, pending;
+    GstState target = transition_target (data->deckstate);
+
+    if (GST_STATE_VOID_PENDING == target) {
+        return;
+    }
+
+    /* more jobs to come, they'll wake us up again */
+    if (0 != g_atomic_int_get (&data->active->pending_jobs)) {
+        return;
+    }
+
+    if (GST_STATE_CHANGE_SUCCESS != gst_element_get_state (data->active->pipeline,
+                &state, &pending, 0) || state != target) {
+        return;
+    }
+
+    switch (target) {
+        case GST_STATE_PAUSED:
+            set_deckstate (data, DECK_PAUSED);
+            if (data->play_when_ready) {
+                data->play_when_ready = FALSE;
+                deck_play (data);
+            }
+            break;
+        case GST_STATE_PLAYING:
+            if (0 != data->stream_lost) {
+                stream_back (data);
+            }
+            set_deckstate (data, DECK_PLAYING);
+            break;
+        default:
+            set_deckstate (data, DECK_STOPPED);
+            break;
+    }
+}
+
+/* The input thread reads them for its jobs, see deck_play_async() */
+static void store_cues(CustomData *data, AudioChain *chain, gint64 cue_in, gint64 cue_out) {
+    g_mutex_lock (&data->input_lock);
+    chain->cue_in = cue_in;
+    chain->cue_out = cue_out;
+    g_mutex_unlock (&data->input_lock);
+}
+
+/* Take chain's cue points from the analysis of uri, or start to end if
+ * there is none yet
+ */
+static void set_cues(CustomData *data, AudioChain *chain, const gchar *uri) {
+    Waveform *waveform = waveform_lookup (uri);
+    gint64 cue_in = 0;
+    gint64 cue_out = GST_CLOCK_TIME_NONE;
+
+    chain->cues_unknown = (NULL == waveform && !audio_uri_is_stream (uri));
+
+    if (NULL != waveform && !waveform_get_cues (waveform, &cue_in, &cue_out)) {
+        /* all silence, just play it */
+        cue_in = 0;
+        cue_out = GST_CLOCK_TIME_NONE;
+    }
+    waveform_free (waveform);
+
+    store_cues (data, chain, cue_in, cue_out);
+}
+
+static void set_chain_uri(CustomData *data, AudioChain *chain, const gchar *uri) {
+    g_free (chain->uri);
+    chain->uri = g_strdup (uri);
+    chain->is_network_stream = audio_uri_is_stream (uri);
+    set_cues (data, chain, uri);
+}
+
+static void drop_playlist(CustomData *data) {
+    playlist_free (data->playlist);
+    data->playlist = NULL;
+    data->next_from_playlist = FALSE;
+}
+
+static void load_uri(CustomData *data, const gchar *uri) {
+    forget_stream_lost (data);
+    data->play_when_ready = FALSE;
+    data->swapped_at = 0;
+    data->duration = GST_CLOCK_TIME_NONE;
+    set_chain_uri (data, data->active, uri);
+
+    /* load new file by putting the player into pause state */
+    push_job (data, data->active, uri, GST_STATE_PAUSED, FALSE);
+    set_deckstate (data, DECK_LOADING);
+}
+
+static void deck_unqueue(CustomData *data);
+
+void deck_load(CustomData *data, const gchar *uri) {
+    /* done with the playlist, and with the entry it queued */
+    if (data->next_from_playlist) {
+        deck_unqueue (data);
+    }
+    drop_playlist (data);
+    load_uri (data, uri);
+}
+
+static void queue_uri(CustomData *data, const gchar *uri) {
+    gchar *old = data->nextfile_uri;
+
+    g_mutex_lock (&data->input_lock);
+    data->nextfile_uri = g_strdup (uri);
+    g_mutex_unlock (&data->input_lock);
+    g_free (old);
+
+    set_chain_uri (data, data->standby, uri);
+    push_job (data, data->standby, uri, GST_STATE_PAUSED, FALSE);
+    session_deck_changed (data);
+}
+
+/* Preroll uri on the standby chain. It becomes active on the next stop/EOS. */
+void deck_queue(CustomData *data, const gchar *uri) {
+    /* it goes first, the playlist carries on after it */
+    if (data->next_from_playlist) {
+        playlist_unread (data->playlist);
+        data->next_from_playlist = FALSE;
+    }
+
+    queue_uri (data, uri);
+}
+
+/* Queue the playlist's next entry, FALSE at its end */
+static gboolean queue_from_playlist(CustomData *data) {
+    gchar *uri;
+
+    if (NULL == data->playlist) {
+        return FALSE;
+    }
+
+    uri = playlist_next (data->playlist);
+    if (NULL == uri) {
+        g_print ("Deck %u: end of %s\n", data->decknumber + 1,
+                playlist_get_uri (data->playlist));
+        return FALSE;
+    }
+
+    g_print ("Deck %u: entry %u of %s is next\n", data->decknumber + 1,
+            playlist_get_position (data->playlist), playlist_get_uri (data->playlist));
+    queue_uri (data, uri);
+    data->next_from_playlist = TRUE;
+    if (NULL != callbacks.queued) {
+        callbacks.queued (data, uri);
+    }
+
+    g_free (uri);
+    return TRUE;
+}
+
+/* Play through playlist, which is taken over. Its first entry is loaded,
+ * or queued if queue is set; every later one is queued as the one before
+ * it becomes active. Returns the first entry's URI, NULL if there is none.
+ */
+const gchar* deck_load_playlist(CustomData *data, Playlist *playlist, gboolean queue) {
+    gchar *uri;
+
+    if (data->next_from_playlist) {
+        deck_unqueue (data);
+    }
+    drop_playlist (data);
+    data->playlist = playlist;
+
+    if (queue) {
+        if (!queue_from_playlist (data)) {
+            drop_playlist (data);
+            return NULL;
+        }
+        return data->nextfile_uri;
+    }
+
+    uri = playlist_next (playlist);
+    if (NULL == uri) {
+        drop_playlist (data);
+        return NULL;
+    }
+
+    load_uri (data, uri);
+    g_free (uri);
+    queue_from_playlist (data);
+    return data->active->uri;
+}
+
+/* The analysis of uri is done. Move whichever chain has it loaded and
+ * hasn't been heard yet to the cue-in.
+ */
+void deck_cues_ready(CustomData *data, const gchar *uri) {
+    AudioChain *chains[] = { data->active, data->standby };
+
+    for (int i = 0; i < 2; i++) {
+        AudioChain *chain = chains[i];
+
+        if (!chain->cues_unknown || 0 != g_strcmp0 (chain->uri, uri)) {
+            continue;
+        }
+
+        set_cues (data, chain, uri);
+        session_deck_changed (data);
+        if (!audio_chain_has_cues (chain)) {
+            continue;
+        }
+
+        /* a stopped deck cues when it starts */
+        if ((chain == data->standby && NULL != data->nextfile_uri) ||
+                DECK_LOADING == data->deckstate ||
+                DECK_PAUSED == data->deckstate) {
+            push_job (data, chain, NULL, GST_STATE_VOID_PENDING, TRUE);
+        }
+    }
+}
+
+static void deck_unqueue(CustomData *data) {
+    gchar *old = data->nextfile_uri;
+
+    g_mutex_lock (&data->input_lock);
+    data->nextfile_uri = NULL;
+    g_mutex_unlock (&data->input_lock);
+    g_free (old);
+
+    push_job (data, data->standby, NULL, GST_STATE_READY, FALSE);
+    session_deck_changed (data);
+}
+
+void deck_play(CustomData *data) {
+    switch (data->deckstate) {
+        case DECK_EMPTY:
+        case DECK_STARTING:
+        case DECK_PLAYING:
+            break;
+        case DECK_LOADING:
+            data->play_when_ready = TRUE;
+            break;
+        default:
+            data->active->cues_unknown = FALSE;
+            push_job (data, data->active, NULL, GST_STATE_PLAYING, FALSE);
+            set_deckstate (data, DECK_STARTING);
+            break;
+    }
+}
+
+typedef struct _DeckRequest {
+    CustomData *data;
+    guint serial;                   /* state_serial when the job was queued */
+    DeckFunc func;                  /* Runs instead if it wasn't, or the deck moved on */
+} DeckRequest;
+
+static gboolean play_request_cb(DeckRequest *request) {
+    CustomData *data = request->data;
+
+    if (request->serial == data->state_serial) {
+        /* nothing happened in between, the job is the last one queued */
+        data->active->cues_unknown = FALSE;
+        set_deckstate (data, DECK_STARTING);
+        check_transition (data);
+    } else {
+        /* the deck moved on meanwhile, decide again on the current state */
+        deck_play (data);
+    }
+
+    g_free (request);
+    return FALSE;
+}
+
+/* deck_play() for any thread. A PAUSED or STOPPED deck gets its job
+ * queued immediately, everything else goes through the main loop.
+ */
+void deck_play_async(CustomData *data) {
+    DeckRequest *request = g_new0 (DeckRequest, 1);
+
+    request->data = data;
+
+    g_mutex_lock (&data->input_lock);
+    if (DECK_PAUSED == data->deckstate || DECK_STOPPED == data->deckstate) {
+        push_job (data, data->active, NULL, GST_STATE_PLAYING, FALSE);
+        request->serial = data->state_serial;
+    } else {
+        /* never matches, so the main loop runs deck_play() */
+        request->serial = data->state_serial - 1;
+    }
+    g_mutex_unlock (&data->input_lock);
+
+    /* ahead of redraws */
+    g_main_context_invoke_full (NULL, G_PRIORITY_HIGH,
+            (GSourceFunc)play_request_cb, request, NULL);
+}
+
+static gboolean stop_request_cb(DeckRequest *request) {
+    CustomData *data = request->data;
+
+    if (request->serial == data->state_serial) {
+        /* the rest of deck_next() without a queued file */
+        forget_stream_lost (data);
+        data->play_when_ready = FALSE;
+        set_deckstate (data, data->active->is_network_stream ? DECK_STOPPING : DECK_LOADING);
+        check_transition (data);
+    } else {
+        request->func (data);
+    }
+
+    g_free (request);
+    return FALSE;
+}
+
+/* deck_stop() for any thread. A PLAYING deck with nothing queued gets its
+ * job queued immediately; otherwise the main loop runs func, deck_stop()
+ * or something that calls it.
+ */
+void deck_stop_async(CustomData *data, DeckFunc func) {
+    DeckRequest *request = g_new0 (DeckRequest, 1);
+
+    request->data = data;
+    request->func = func;
+
+    g_mutex_lock (&data->input_lock);
+    if (DECK_PLAYING == data->deckstate && NULL == data->nextfile_uri) {
+        DeckJob *job = g_new0 (DeckJob, 1);
+
+        job->chain = data->active;
+        job->gain = 1.0;
+        job->stop = TRUE;
+        queue_job (data, job);
+        request->serial = data->state_serial;
+    } else {
+        /* never matches, so the main loop runs func */
+        request->serial = data->state_serial - 1;
+    }
+    g_mutex_unlock (&data->input_lock);
+
+    /* ahead of redraws */
+    g_main_context_invoke_full (NULL, G_PRIORITY_HIGH,
+            (GSourceFunc)stop_request_cb, request, NULL);
+}
+
+typedef struct _DeckInvocation {
+    CustomData *data;
+    DeckFunc func;
+} DeckInvocation;
+
+static gboolean invocation_cb(DeckInvocation *invocation) {
+    invocation->func (invocation->data);
+    g_free (invocation);
+    return FALSE;
+}
+
+/* Run func on the main loop, ahead of redraws. For any thread. */
+void deck_invoke(CustomData *data, DeckFunc func) {
+    DeckInvocation *invocation = g_new0 (DeckInvocation, 1);
+
+    invocation->data = data;
+    invocation->func = func;
+
+    g_main_context_invoke_full (NULL, G_PRIORITY_HIGH,
+            (GSourceFunc)invocation_cb, invocation, NULL);
+}
+
+void deck_pause(CustomData *data) {
+    if (deck_is_playing (data)) {
+        forget_stream_lost (data);
+        push_job (data, data->active, NULL, GST_STATE_PAUSED, FALSE);
+        set_deckstate (data, DECK_PAUSING);
+    }
+}
+
+static void deck_real_stop(CustomData *data) {
+    forget_stream_lost (data);
+    data->play_when_ready = FALSE;
+    push_job (data, data->active, NULL, GST_STATE_READY, FALSE);
+    set_deckstate (data, DECK_STOPPING);
+}
+
+/* Move on to the queued file, or rewind the current one. A playlist
+ * entry that ended starts the next one.
+ */
+static void deck_next(CustomData *data, gboolean ended) {
+    gboolean follow_on = ended && data->next_from_playlist;
+
+    forget_stream_lost (data);
+    data->play_when_ready = FALSE;
+    data->swapped_at = 0;
+
+    if (NULL != data->nextfile_uri) {
+        gchar *uri = data->nextfile_uri;
+
+        /* timed until the deck settles, PLAYING for a follow-on */
+        data->swapped_at = g_get_monotonic_time ();
+
+        /* The standby chain has been prerolling the next file since it was
+         * queued, so all that's left to do is to swap the chains */
+        g_mutex_lock (&data->input_lock);
+        data->nextfile_uri = NULL;
+        audio_swap_standby (data);
+        g_mutex_unlock (&data->input_lock);
+        push_job (data, data->standby, NULL, GST_STATE_READY, FALSE);
+        g_atomic_int_inc (&data->metrics->swaps);
+
+        g_print ("Deck %u: swapped to %s\n", data->decknumber + 1, uri);
+        if (NULL != callbacks.swapped) {
+            callbacks.swapped (data, uri);
+        }
+        g_free (uri);
+
+        data->next_from_playlist = FALSE;
+        queue_from_playlist (data);
+
+        if (data->active->is_network_stream && follow_on) {
+            /* connect afresh, what it buffered meanwhile is stale */
+            push_job (data, data->active, data->active->uri, GST_STATE_PLAYING, FALSE);
+            set_deckstate (data, DECK_STARTING);
+        } else if (data->active->is_network_stream) {
+            deck_real_stop (data);
+        } else {
+            /* the prerolled buffer already went by, the next one is
+             * decoded once the swapped in chain plays, see metrics.c */
+            if (follow_on) {
+                metrics_timer_start (&data->active->metrics->follow_on);
+            }
+            /* completes right away if the preroll is already done */
+            data->play_when_ready = follow_on;
+            set_deckstate (data, DECK_LOADING);
+            check_transition (data);
+        }
+        return;
+    }
+
+    if (data->active->is_network_stream) {
+        deck_real_stop (data);
+    } else {
+        push_job (data, data->active, NULL, GST_STATE_PAUSED, TRUE);
+        set_deckstate (data, DECK_LOADING);
+    }
+}
+
+void deck_stop(CustomData *data) {
+    if (deck_is_playing (data)) {
+        deck_next (data, FALSE);
+    } else {
+        deck_real_stop (data);
+    }
+}
+
+void deck_seek(CustomData *data, gdouble value) {
+    DeckJob *job = g_new0 (DeckJob, 1);
+
+    /* the user picked the position, a late cue-in mustn't override it */
+    data->active->cues_unknown = FALSE;
+
+    job->chain = data->active;
+    job->seek = TRUE;
+    job->position = value;
+    job->target = GST_STATE_VOID_PENDING;
+
+    g_atomic_int_inc (&data->queued_seeks);
+    queue_job (data, job);
+}
+
+gboolean deck_is_playing(CustomData *data) {
+    return (data->deckstate == DECK_PLAYING || data->deckstate == DECK_STARTING);
+}
+
+gboolean deck_is_stopped(CustomData *data) {
+    return (data->deckstate == DECK_STOPPED || data->deckstate == DECK_EMPTY ||
+            data->deckstate == DECK_ERROR);
+}
+
+/* The deck's state, and position and duration of the active chain in
+ * nanoseconds (-1 if unknown). For any thread, the queries go straight
+ * to the pipeline and never wait for the main loop.
+ */
+DeckState deck_get_status(CustomData *data, gint64 *position, gint64 *duration) {
+    GstElement *pipeline;
+    DeckState state;
+    GstFormat fmt = GST_FORMAT_TIME;
+
+    g_mutex_lock (&data->input_lock);
+    state = data->deckstate;
+    pipeline = gst_object_ref (data->active->pipeline);
+    g_mutex_unlock (&data->input_lock);
+
+#if GST_VERSION_MAJOR == (0)
+    if (!gst_element_query_position (pipeline, &fmt, position))
+#else
+    if (!gst_element_query_position (pipeline, fmt, position))
+#endif
+    {
+        *position = -1;
+    }
+
+#if GST_VERSION_MAJOR == (0)
+    if (!gst_element_query_duration (pipeline, &fmt, duration))
+#else
+    if (!gst_element_query_duration (pipeline, fmt, duration))
+#endif
+    {
+        *duration = -1;
+    }
+
+    gst_object_unref (pipeline);
+    return state;
+}
+
+/* "current / -remaining / duration" for the time label, into buffer.
+ * Runs on every frame, so it doesn't allocate. Returns what g_snprintf()
+ * does.
+ */
+gint deck_format_time(gchar *buffer, gsize size, gint64 current, gint64 remaining,
+        gint64 duration) {
+    return g_snprintf (buffer, size,
+            "%" HMS_TENTHS_FORMAT " / -%" HMS_TENTHS_FORMAT " / %" HMS_TENTHS_FORMAT,
+            HMS_TENTHS_ARGS (current), HMS_TENTHS_ARGS (remaining), HMS_TENTHS_ARGS (duration));
+}
+
+/* What the session journal keeps of the deck, for the main loop. Free
+ * with deck_session_clear().
+ */
+void deck_get_session(CustomData *data, DeckSession *session) {
+    AudioChain *chain = data->active;
+    gint64 duration;
+
+    memset (session, 0, sizeof (*session));
+    session->state = deck_get_status (data, &session->position, &duration);
+
+    /* the placeholder that holds the jack ports isn't worth restoring */
+    if (DECK_EMPTY != data->deckstate && !audio_uri_is_silence (chain->uri)) {
+        session->uri = g_strdup (chain->uri);
+    }
+    session->cue_in = chain->cue_in;
+    session->cue_out = GST_CLOCK_TIME_IS_VALID (chain->cue_out) ? chain->cue_out : -1;
+    session->next_uri = g_strdup (data->nextfile_uri);
+
+    if (NULL != data->playlist) {
+        session->playlist_uri = g_strdup (playlist_get_uri (data->playlist));
+        session->playlist_offset = playlist_get_offset (data->playlist);
+        session->playlist_position = playlist_get_position (data->playlist);
+        session->next_from_playlist = data->next_from_playlist;
+    }
+}
+
+void deck_session_clear(DeckSession *session) {
+    g_free (session->uri);
+    g_free (session->next_uri);
+    g_free (session->playlist_uri);
+    memset (session, 0, sizeof (*session));
+}
+
+/* Load the deck as session left it, prerolled at its position with its
+ * queue and playlist, and with the cues it had if the analysis isn't
+ * cached. The deck never starts on its own, even if it was playing.
+ */
+void deck_restore(CustomData *data, const DeckSession *session) {
+    AudioChain *chain = data->active;
+
+    if (NULL == session->uri) {
+        return;
+    }
+
+    if (data->next_from_playlist) {
+        deck_unqueue (data);
+    }
+    drop_playlist (data);
+
+    forget_stream_lost (data);
+    data->play_when_ready = FALSE;
+    data->duration = GST_CLOCK_TIME_NONE;
+    set_chain_uri (data, chain, session->uri);
+    if (chain->cues_unknown && (session->cue_in > 0 || session->cue_out >= 0)) {
+        store_cues (data, chain, session->cue_in,
+                (session->cue_out >= 0) ? session->cue_out : (gint64)GST_CLOCK_TIME_NONE);
+        chain->cues_unknown = FALSE;
+    }
+
+    push_job (data, chain, session->uri, GST_STATE_PAUSED, FALSE);
+    set_deckstate (data, DECK_LOADING);
+
+    /* queued behind the load, on the same worker */
+    if (session->position > 0 && !chain->is_network_stream) {
+        deck_seek (data, (gdouble)session->position / GST_SECOND);
+    }
+
+    if (NULL != session->next_uri) {
+        queue_uri (data, session->next_uri);
+    }
+
+    if (NULL != session->playlist_uri) {
+        data->playlist = playlist_open (session->playlist_uri);
+        if (NULL != data->playlist) {
+            playlist_set_cursor (data->playlist, session->playlist_offset,
+                    session->playlist_position);
+            data->next_from_playlist = session->next_from_playlist &&
+                NULL != session->next_uri;
+        } else {
+            g_printerr ("Deck %u: can't read %s any more\n", data->decknumber + 1,
+                    session->playlist_uri);
+        }
+    }
+
+    g_print ("Deck %u: restored %s at %.3f s, was %s\n", data->decknumber + 1,
+            session->uri, MAX (session->position, 0) / (gdouble)GST_SECOND,
+            deck_state_get_name (session->state));
+}
+
+static void state_changed_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+    GstState old_state, new_state, pending_state;
+    AudioChain *chain = audio_chain_from_bus (data, bus);
+
+    if (GST_MESSAGE_SRC (msg) != GST_OBJECT (chain->pipeline)) {
+        return;
+    }
+
+    gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
+    chain->state = new_state;
+
+    if (chain == data->active) {
+        check_transition (data);
+    }
+}
+
+static void async_done_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+    if (audio_chain_from_bus (data, bus) == data->active) {
+        check_transition (data);
+    }
+}
+
+static void application_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+    const GstStructure *s = gst_message_get_structure (msg);
+    gboolean failed = FALSE;
+    gboolean moved = FALSE;
+
+    if (gst_structure_has_name (s, "deck-job-loaded")) {
+        audio_chain_from_bus (data, bus)->loads_pending--;
+        return;
+    }
+
+    if (!gst_structure_has_name (s, "deck-job-done")) {
+        return;
+    }
+
+    if (audio_chain_from_bus (data, bus) != data->active) {
+        return;
+    }
+
+    gst_structure_get_boolean (s, "moved", &moved);
+    if (moved && NULL != callbacks.seeked) {
+        callbacks.seeked (data);
+    }
+    if (moved) {
+        session_deck_changed (data);
+    }
+
+    gst_structure_get_boolean (s, "failed", &failed);
+    if (failed && 0 != data->stream_lost) {
+        stream_lost (data, "Couldn't connect");
+        return;
+    } else if (failed && is_transitional (data->deckstate)) {
+        deck_fail (data, "State change failed");
+        return;
+    }
+
+    check_transition (data);
+}
+
+/* A radio stream has no duration, if it ends the connection dropped */
+static gboolean stream_has_end(AudioChain *chain) {
+    gint64 duration;
+    GstFormat fmt = GST_FORMAT_TIME;
+
+#if GST_VERSION_MAJOR == (0)
+    return gst_element_query_duration (chain->pipeline, &fmt, &duration) && duration > 0;
+#else
+    return gst_element_query_duration (chain->pipeline, fmt, &duration) && duration > 0;
+#endif
+}
+
+static void eos_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+    if (audio_chain_from_bus (data, bus) != data->active) {
+        return;
+    }
+
+    g_print ("End-Of-Stream reached.\n");
+    if (stream_on_air (data) && !stream_has_end (data->active)) {
+        stream_lost (data, "Stream ended");
+    } else {
+        deck_next (data, TRUE);
+    }
+}
+
+/* Hold a stream on air that ran dry until it has its prebuffer back. The
+ * PLAYING job waits for it, see deck_worker().
+ */
+static void buffering_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+    gint percent;
+
+    if (audio_chain_from_bus (data, bus) != data->active) {
+        return;
+    }
+
+    gst_message_parse_buffering (msg, &percent);
+
+    if (percent < 100 && DECK_PLAYING == data->deckstate && 0 == data->rebuffering_since) {
+        g_printerr ("Deck %u: stream ran dry, rebuffering\n", data->decknumber + 1);
+        data->rebuffering_since = g_get_monotonic_time ();
+        push_job (data, data->active, NULL, GST_STATE_PAUSED, FALSE);
+        push_job (data, data->active, NULL, GST_STATE_PLAYING, FALSE);
+    } else if (100 == percent && 0 != data->rebuffering_since) {
+        g_print ("Deck %u: rebuffered in %.0f ms\n", data->decknumber + 1,
+                (g_get_monotonic_time () - data->rebuffering_since) / 1000.0);
+        data->rebuffering_since = 0;
+    }
+}
+
+static void error_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+    AudioChain *chain = audio_chain_from_bus (data, bus);
+    GError *err;
+    gchar *debug_info;
+
+    /* Print error details on the screen */
+    gst_message_parse_error (msg, &err, &debug_info);
+    g_printerr ("Error received from element %s: %s\n", GST_OBJECT_NAME (msg->src), err->message);
+    g_printerr ("Debugging information: %s\n", debug_info ? debug_info : "none");
+
+    if (chain != data->active && (0 != chain->loads_pending ||
+                0 != g_strcmp0 (chain->uri, data->nextfile_uri))) {
+        /* what the chain had before, swapped out or unqueued, going away */
+        g_printerr ("Deck %u: ignoring the error of an unloaded file\n", data->decknumber + 1);
+    } else if (chain != data->active) {
+        /* The queued file is broken. Forget about it, but keep on playing */
+        g_printerr ("Deck %u: dropping queued file %s\n", data->decknumber + 1,
+                data->nextfile_uri);
+        deck_unqueue (data);
+        if (data->next_from_playlist) {
+            data->next_from_playlist = FALSE;
+            queue_from_playlist (data);
+        }
+    } else if (stream_on_air (data)) {
+        stream_lost (data, err->message);
+    } else {
+        deck_fail (data, err->message);
+    }
+
+    g_clear_error (&err);
+    g_free (debug_info);
+}
+
+static void watch_bus(GstBus *bus, CustomData *data) {
+    gst_bus_add_signal_watch (bus);
+    g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)error_cb, data);
+    g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback)eos_cb, data);
+    g_signal_connect (G_OBJECT (bus), "message::state-changed", (GCallback)state_changed_cb, data);
+    g_signal_connect (G_OBJECT (bus), "message::async-done", (GCallback)async_done_cb, data);
+    g_signal_connect (G_OBJECT (bus), "message::application", (GCallback)application_cb, data);
+    g_signal_connect (G_OBJECT (bus), "message::buffering", (GCallback)buffering_cb, data);
+}
+
+void deck_init(CustomData *data) {
+    data->deckstate = DECK_EMPTY;
+    data->state_since = g_get_monotonic_time ();
+    g_mutex_init (&data->input_lock);
+
+    /* a single thread keeps the jobs of this deck in order */
+    data->worker = g_thread_pool_new ((GFunc)deck_worker, data, 1, FALSE, NULL);
+
+    /* Both chains report to the same callbacks, which tell them apart by their bus */
+    watch_bus (data->active->bus, data);
+    watch_bus (data->standby->bus, data);
+}
+
+void deck_free(CustomData *data) {
+    if (0 != data->timeout_id) {
+        g_source_remove (data->timeout_id);
+        data->timeout_id = 0;
+    }
+    forget_stream_lost (data);
+    drop_playlist (data);
+    g_free (data->nextfile_uri);
+    data->nextfile_uri = NULL;
+
+    /* let the worker finish whatever it's doing */
+    g_thread_pool_free (data->worker, FALSE, TRUE);
+    data->worker = NULL;
+    g_mutex_clear (&data->input_lock);
+}
+
+void deck_print_stats(CustomData *data) {
+    g_print ("Deck %u transitions:\n", data->decknumber + 1);
+
+    for (int from = 0; from < DECK_NUM_STATES; from++) {
+        for (int to = 0; to < DECK_NUM_STATES; to++) {
+            DeckEdgeStats *edge = &data->edges[from][to];
+
+            if (0 == edge->count) {
+                continue;
+            }
+
+            g_print ("  %-8s -> %-8s %6u x  avg %9.3f ms  max %9.3f ms\n",
+                    deck_state_get_name (from), deck_state_get_name (to),
+                    edge->count,
+                    edge->total_us / 1000.0 / edge->count,
+                    edge->max_us / 1000.0);
+        }
+    }
+}
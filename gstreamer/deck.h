@@ -0,0 +1,62 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _DECK_H
+#define _DECK_H
+
+/* Hooks for the user interface, all called from the main loop */
+typedef struct _DeckCallbacks {
+    void (*state_changed) (CustomData *data);
+    void (*error) (CustomData *data, const gchar *message);
+    void (*swapped) (CustomData *data, const gchar *uri);
+    void (*seeked) (CustomData *data);   /* A seek or rewind has been done */
+    void (*queued) (CustomData *data, const gchar *uri);    /* The playlist moved on */
+} DeckCallbacks;
+
+typedef void (*DeckFunc) (CustomData *data);
+
+/* What the session journal keeps of a deck, see session.c */
+typedef struct _DeckSession {
+    DeckState state;
+    gchar *uri;                     /* Of the active chain, NULL if none */
+    gint64 position;                /* Nanoseconds, -1 if unknown */
+    gint64 cue_in;
+    gint64 cue_out;                 /* -1 if unknown */
+    gchar *next_uri;                /* Queued */
+    gchar *playlist_uri;            /* Played through */
+    gsize playlist_offset;          /* See playlist_get_offset() */
+    guint playlist_position;
+    gboolean next_from_playlist;
+} DeckSession;
+
+#define DECK_DEFAULT_RECONNECT_S 30
+#define DECK_TIME_LENGTH 64         /* Always enough for deck_format_time() */
+
+void deck_set_callbacks(const DeckCallbacks *callbacks);
+void deck_set_reconnect_window(guint seconds);
+void deck_init(CustomData *data);
+void deck_free(CustomData *data);
+void deck_load(CustomData *data, const gchar *uri);
+void deck_queue(CustomData *data, const gchar *uri);
+const gchar* deck_load_playlist(CustomData *data, struct _Playlist *playlist, gboolean queue);
+void deck_cues_ready(CustomData *data, const gchar *uri);
+void deck_play(CustomData *data);
+void deck_play_async(CustomData *data);
+void deck_stop_async(CustomData *data, DeckFunc func);
+void deck_invoke(CustomData *data, DeckFunc func);
+void deck_pause(CustomData *data);
+void deck_stop(CustomData *data);
+void deck_seek(CustomData *data, gdouble value);
+gboolean deck_is_playing(CustomData *data);
+gboolean deck_is_stopped(CustomData *data);
+DeckState deck_get_status(CustomData *data, gint64 *position, gint64 *duration);
+gint deck_format_time(gchar *buffer, gsize size, gint64 current, gint64 remaining,
+        gint64 duration);
+void deck_get_session(CustomData *data, DeckSession *session);
+void deck_restore(CustomData *data, const DeckSession *session);
+void deck_session_clear(DeckSession *session);
+const gchar* deck_state_get_name(DeckState state);
+void deck_print_stats(CustomData *data);
+
+#endif /* _DECK_H */
@@ -0,0 +1,275 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <glib.h>
+#include "dsp.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined (__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Sample kernels for the engine: integer to float conversion with the
+ * track gain folded in, deinterleaving into the port buffers, the mix
+ * bus sum and the resampler's FIR (see resample.c). Each one does four samples (or frames) at a time with SSE2,
+ * which every x86-64 has, and leaves the tail to a plain loop. Elsewhere
+ * the plain loops get the whole buffer and it's up to the compiler to
+ * vectorize them.
+ *
+ * Integer samples are scaled so that full scale is 1.0.
+ */
+
+#define DSP_S16_SCALE (1.0f / 32768.0f)
+#define DSP_S24_32_SCALE (1.0f / 8388608.0f)
+#define DSP_S32_SCALE (1.0f / 2147483648.0f)
+
+/* Native endian names only, see DSP_FORMATS */
+DspFormat dsp_format_from_string(const gchar *format) {
+    static const struct {
+        const gchar *name;
+        DspFormat format;
+    } formats[] = {
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+        { "F32BE", DSP_FORMAT_F32 },
+        { "S16BE", DSP_FORMAT_S16 },
+        { "S24_32BE", DSP_FORMAT_S24_32 },
+        { "S32BE", DSP_FORMAT_S32 },
+#else
+        { "F32LE", DSP_FORMAT_F32 },
+        { "S16LE", DSP_FORMAT_S16 },
+        { "S24LE", DSP_FORMAT_S24 },
+        { "S24_32LE", DSP_FORMAT_S24_32 },
+        { "S32LE", DSP_FORMAT_S32 },
+#endif
+    };
+
+    if (NULL == format) {
+        return DSP_FORMAT_UNKNOWN;
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS (formats); i++) {
+        if (0 == strcmp (format, formats[i].name)) {
+            return formats[i].format;
+        }
+    }
+
+    return DSP_FORMAT_UNKNOWN;
+}
+
+/* Bytes per sample, 0 if unknown */
+guint dsp_format_width(DspFormat format) {
+    switch (format) {
+        case DSP_FORMAT_S16:
+            return 2;
+        case DSP_FORMAT_S24:
+            return 3;
+        case DSP_FORMAT_F32:
+        case DSP_FORMAT_S24_32:
+        case DSP_FORMAT_S32:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+static void f32_scale(gfloat *restrict dst, const gfloat *restrict src, guint n, gfloat k) {
+    guint i = 0;
+
+#if defined (__SSE2__)
+    __m128 kk = _mm_set1_ps (k);
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps (dst + i, _mm_mul_ps (_mm_loadu_ps (src + i), kk));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] = src[i] * k;
+    }
+}
+
+static void s16_to_f32(gfloat *restrict dst, const gint16 *restrict src, guint n, gfloat k) {
+    guint i = 0;
+
+#if defined (__SSE2__)
+    __m128 kk = _mm_set1_ps (k);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *)(src + i));
+        /* each sample paired with itself, shifted back down with its sign */
+        __m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (x, x), 16);
+        __m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (x, x), 16);
+
+        _mm_storeu_ps (dst + i, _mm_mul_ps (_mm_cvtepi32_ps (lo), kk));
+        _mm_storeu_ps (dst + i + 4, _mm_mul_ps (_mm_cvtepi32_ps (hi), kk));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] = src[i] * k;
+    }
+}
+
+static void s32_to_f32(gfloat *restrict dst, const gint32 *restrict src, guint n, gfloat k) {
+    guint i = 0;
+
+#if defined (__SSE2__)
+    __m128 kk = _mm_set1_ps (k);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *)(src + i));
+
+        _mm_storeu_ps (dst + i, _mm_mul_ps (_mm_cvtepi32_ps (x), kk));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] = src[i] * k;
+    }
+}
+
+/* Little endian, the three bytes go to the top of an int32, so k is the
+ * S32 scale
+ */
+static void s24_to_f32(gfloat *restrict dst, const guint8 *restrict src, guint n, gfloat k) {
+    guint i = 0;
+
+#if defined (__SSSE3__)
+    const __m128i spread = _mm_setr_epi8 (-1, 0, 1, 2, -1, 3, 4, 5,
+            -1, 6, 7, 8, -1, 9, 10, 11);
+    __m128 kk = _mm_set1_ps (k);
+
+    /* a load takes 16 bytes for the 12 it uses, keep it inside the buffer */
+    for (; i + 6 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *)(src + 3 * i));
+
+        _mm_storeu_ps (dst + i, _mm_mul_ps (_mm_cvtepi32_ps (_mm_shuffle_epi8 (x, spread)), kk));
+    }
+#endif
+
+    for (; i < n; i++) {
+        const guint8 *s = src + 3 * i;
+
+        dst[i] = (gint32)((guint32)s[0] << 8 | (guint32)s[1] << 16 | (guint32)s[2] << 24) * k;
+    }
+}
+
+/* n samples of format from src to float in dst, times gain. dst and src
+ * may only be the same for F32.
+ */
+void dsp_to_f32(DspFormat format, gfloat *dst, gconstpointer src, guint n, gfloat gain) {
+    switch (format) {
+        case DSP_FORMAT_F32:
+            if (1.0f == gain) {
+                if (dst != src) {
+                    memcpy (dst, src, n * sizeof (gfloat));
+                }
+            } else {
+                f32_scale (dst, src, n, gain);
+            }
+            break;
+        case DSP_FORMAT_S16:
+            s16_to_f32 (dst, src, n, gain * DSP_S16_SCALE);
+            break;
+        case DSP_FORMAT_S24:
+            s24_to_f32 (dst, src, n, gain * DSP_S32_SCALE);
+            break;
+        case DSP_FORMAT_S24_32:
+            s32_to_f32 (dst, src, n, gain * DSP_S24_32_SCALE);
+            break;
+        case DSP_FORMAT_S32:
+            s32_to_f32 (dst, src, n, gain * DSP_S32_SCALE);
+            break;
+        default:
+            memset (dst, 0, n * sizeof (gfloat));
+            break;
+    }
+}
+
+/* n interleaved stereo frames, added to left and right */
+void dsp_deinterleave_add(gfloat *restrict left, gfloat *restrict right,
+        const gfloat *restrict frames, guint n) {
+    guint i = 0;
+
+#if defined (__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_loadu_ps (frames + 2 * i);
+        __m128 b = _mm_loadu_ps (frames + 2 * i + 4);
+
+        _mm_storeu_ps (left + i, _mm_add_ps (_mm_loadu_ps (left + i),
+                    _mm_shuffle_ps (a, b, _MM_SHUFFLE (2, 0, 2, 0))));
+        _mm_storeu_ps (right + i, _mm_add_ps (_mm_loadu_ps (right + i),
+                    _mm_shuffle_ps (a, b, _MM_SHUFFLE (3, 1, 3, 1))));
+    }
+#endif
+
+    for (; i < n; i++) {
+        left[i] += frames[2 * i];
+        right[i] += frames[2 * i + 1];
+    }
+}
+
+void dsp_mix_add(gfloat *restrict dst, const gfloat *restrict src, guint n) {
+    guint i = 0;
+
+#if defined (__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps (dst + i, _mm_add_ps (_mm_loadu_ps (dst + i), _mm_loadu_ps (src + i)));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] += src[i];
+    }
+}
+
+/* One output frame of a FIR filter: h over left and right, into
+ * out[0] and out[1]
+ */
+void dsp_dot_stereo(const gfloat *restrict left, const gfloat *restrict right,
+        const gfloat *restrict h, guint n, gfloat *restrict out) {
+    gfloat l = 0.0f, r = 0.0f;
+    guint i = 0;
+
+#if defined (__SSE2__)
+    __m128 al = _mm_setzero_ps ();
+    __m128 ar = _mm_setzero_ps ();
+    gfloat sums[4];
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 hh = _mm_loadu_ps (h + i);
+
+        al = _mm_add_ps (al, _mm_mul_ps (_mm_loadu_ps (left + i), hh));
+        ar = _mm_add_ps (ar, _mm_mul_ps (_mm_loadu_ps (right + i), hh));
+    }
+
+    _mm_storeu_ps (sums, al);
+    l = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    _mm_storeu_ps (sums, ar);
+    r = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+#endif
+
+    for (; i < n; i++) {
+        l += left[i] * h[i];
+        r += right[i] * h[i];
+    }
+
+    out[0] = l;
+    out[1] = r;
+}
+
+/* What the kernels were built with, for the benchmark */
+const gchar* dsp_get_kernels(void) {
+#if defined (__SSSE3__)
+    return "sse2+ssse3";
+#elif defined (__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,35 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _DSP_H
+#define _DSP_H
+
+/* Sample formats the engine takes from a decoder as they are, in the
+ * order it prefers them. Anything else goes through audioconvert.
+ */
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+#define DSP_FORMATS "{ F32BE, S16BE, S32BE, S24_32BE }"
+#else
+#define DSP_FORMATS "{ F32LE, S16LE, S32LE, S24_32LE, S24LE }"
+#endif
+
+typedef enum {
+    DSP_FORMAT_UNKNOWN,
+    DSP_FORMAT_F32,
+    DSP_FORMAT_S16,
+    DSP_FORMAT_S24,                 /* Packed in three bytes */
+    DSP_FORMAT_S24_32,              /* Sign extended to 32 bits */
+    DSP_FORMAT_S32
+} DspFormat;
+
+DspFormat dsp_format_from_string(const gchar *format);
+guint dsp_format_width(DspFormat format);
+void dsp_to_f32(DspFormat format, gfloat *dst, gconstpointer src, guint n, gfloat gain);
+void dsp_deinterleave_add(gfloat *left, gfloat *right, const gfloat *frames, guint n);
+void dsp_mix_add(gfloat *dst, const gfloat *src, guint n);
+void dsp_dot_stereo(const gfloat *left, const gfloat *right, const gfloat *h, guint n,
+        gfloat *out);
+const gchar* dsp_get_kernels(void);
+
+#endif /* _DSP_H */
@@ -0,0 +1,991 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <jack/jack.h>
+#include "engine.h"
+#include "cart.h"
+#include "dsp.h"
+
+/*
+ * Engine mode: instead of one jackaudiosink (and thus one jack client) per
+ * deck, a single jack client owns all output ports. Every decoding chain
+ * ends in an appsink whose streaming thread feeds a wait-free SPSC ring,
+ * and the process callback mixes the rings into the deck ports, adds the
+ * cart bank and sums everything into a mix bus.
+ *
+ * Ports: deckN_out_1/2 per deck, carts_out_1/2 and mix_out_1/2. With
+ * --autoconnect only the mix bus is connected to the physical outputs.
+ *
+ * All rings are read on the same jack period, which makes the process
+ * callback the one clock every deck runs on. A segue uses that: once
+ * armed, the callback starts the held incoming slot on the exact frame at
+ * which the outgoing slot reaches the segue point, and fades both in the
+ * mix, per frame. Stream positions come from the buffer timestamps, the
+ * producer anchors the first buffer after every flush to its ring index.
+ *
+ * The appsink takes F32 and the common integer formats at the jack rate,
+ * so a decoder that already delivers one of them isn't touched by
+ * audioconvert, volume or audioresample. The producer converts to float
+ * and applies the track gain in one pass (see dsp.c) as it fills the ring.
+ * It also takes the common rates, and resamples those itself with the
+ * filter banks all slots share (see resample.c). Only decoders at the
+ * jack rate skip resampling altogether.
+ *
+ * A slot can also be held until a given time: the callback starts it so
+ * that its first frame reaches the outputs at that jack time, taking the
+ * playback latency of our ports into account.
+ */
+
+/* About 170 ms at 48 kHz, enough to ride out a slow decoder wakeup */
+#define ENGINE_RING_FRAMES 8192
+#define ENGINE_MAX_SLOTS_PER_DECK 2
+#define ENGINE_SCRATCH_FRAMES 1024
+
+#define STATS_INTERVAL_SECONDS 10
+
+/* Fields are written by the main loop before it stores ARMED */
+typedef struct _EngineSegue {
+    gint state;                     /* EngineSegueState */
+    EngineSlot *out;
+    EngineSlot *in;
+    gint64 at;                      /* Stream position of out where in starts */
+    guint fade_frames;
+    EngineFadeCurve curve;
+} EngineSegue;
+
+typedef struct _Engine {
+    jack_client_t *client;
+    jack_nframes_t rate;
+    jack_nframes_t period;
+    jack_nframes_t latency;         /* Playback latency of the outputs */
+    guint ndecks;
+
+    jack_port_t **ports;            /* Two per deck, then carts, then mix */
+    gfloat **buffers;               /* Port buffers of the current period */
+    guint nports;
+    gboolean *live;                 /* Deck ports a ring was read into this period */
+
+    EngineSlot **slots;
+    gint nslots;                    /* Published with an atomic store */
+    guint maxslots;
+
+    EngineSegue segue;
+    gfloat *scratch_l;              /* Process callback only, for the fades */
+    gfloat *scratch_r;
+
+    /* Written by the process callback, read racily for the report */
+    guint64 periods;
+    guint64 busy_ns;
+    guint64 busy_ns_max;
+} Engine;
+
+/* Works for both modes: in the old one it's a passive client of its own */
+typedef struct _JackStats {
+    jack_client_t *client;
+    gboolean own_client;
+    gint xruns;
+    guint timeout_id;
+} JackStats;
+
+static Engine engine;
+static JackStats stats;
+
+static inline guint64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Gain of a fade in at t, from 0 to 1. A fade out runs it backwards. */
+static inline gfloat fade_curve(EngineFadeCurve curve, gfloat t) {
+    switch (curve) {
+        case ENGINE_FADE_EQUAL_POWER:
+            return sinf (t * (gfloat)G_PI_2);
+        case ENGINE_FADE_S_CURVE:
+            return 0.5f - 0.5f * cosf (t * (gfloat)G_PI);
+        default:
+            return t;
+    }
+}
+
+static inline gfloat fade_gain(EngineSlot *slot) {
+    gfloat t;
+
+    if (slot->fade_delay > 0) {
+        slot->fade_delay--;
+        return slot->fade_in ? 0.0f : 1.0f;
+    }
+
+    t = (slot->fade_pos + 0.5f) / slot->fade_frames;
+    if (++slot->fade_pos == slot->fade_frames) {
+        slot->fade_frames = 0;
+        slot->muted = !slot->fade_in;
+    }
+
+    return fade_curve (slot->fade_curve, slot->fade_in ? t : 1.0f - t);
+}
+
+/* ringbuffer_read_add() for a slot that is starting, fading or muted */
+static guint read_faded(EngineSlot *slot, gfloat *left, gfloat *right, guint n) {
+    guint skip = MIN (slot->skip, n);
+    guint done = skip;
+
+    slot->skip -= skip;
+
+    while (done < n) {
+        guint chunk = MIN (n - done, ENGINE_SCRATCH_FRAMES);
+        guint got;
+
+        memset (engine.scratch_l, 0, chunk * sizeof (gfloat));
+        memset (engine.scratch_r, 0, chunk * sizeof (gfloat));
+        got = ringbuffer_read_add (slot->ring, engine.scratch_l, engine.scratch_r, chunk);
+
+        for (guint i = 0; i < got; i++) {
+            gfloat gain = (slot->fade_frames > 0) ? fade_gain (slot) :
+                    (slot->muted ? 0.0f : 1.0f);
+
+            left[done + i] += gain * engine.scratch_l[i];
+            right[done + i] += gain * engine.scratch_r[i];
+        }
+
+        done += got;
+        if (got < chunk) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+static gint64 slot_position(EngineSlot *slot) {
+    if (!g_atomic_int_get (&slot->anchored)) {
+        return -1;
+    }
+
+    return (guint)g_atomic_int_get (&slot->ring->read) + (guint)g_atomic_int_get (&slot->offset);
+}
+
+static void start_fade(EngineSlot *slot, guint delay, guint frames, EngineFadeCurve curve,
+        gboolean in) {
+    slot->fade_delay = delay;
+    slot->fade_pos = 0;
+    slot->fade_frames = MAX (frames, 1);
+    slot->fade_curve = curve;
+    slot->fade_in = in;
+    slot->muted = FALSE;
+}
+
+/* Start the incoming slot if the outgoing one gets to the segue point
+ * within this period. The incoming ring has been filling while held.
+ */
+static void segue_period(jack_nframes_t nframes) {
+    EngineSegue *segue = &engine.segue;
+    gint64 position, until;
+
+    if (ENGINE_SEGUE_ARMED != g_atomic_int_get (&segue->state) ||
+            !g_atomic_int_get (&segue->out->running)) {
+        return;
+    }
+
+    position = slot_position (segue->out);
+    if (position < 0 || segue->at - position >= nframes) {
+        return;
+    }
+    until = MAX (segue->at - position, 0);
+
+    /* stopped or released meanwhile, nothing to start */
+    if (!g_atomic_int_compare_and_exchange (&segue->in->held, TRUE, FALSE)) {
+        g_atomic_int_compare_and_exchange (&segue->state, ENGINE_SEGUE_ARMED, ENGINE_SEGUE_IDLE);
+        return;
+    }
+
+    g_atomic_int_set (&segue->in->running, TRUE);
+    if (!g_atomic_int_compare_and_exchange (&segue->state, ENGINE_SEGUE_ARMED, ENGINE_SEGUE_BEGUN)) {
+        /* cancelled, which would have started it anyway */
+        return;
+    }
+
+    start_fade (segue->out, until, segue->fade_frames, segue->curve, FALSE);
+    start_fade (segue->in, 0, segue->fade_frames, segue->curve, TRUE);
+    segue->in->skip = until;
+}
+
+/* Start a held slot if its first frame is due at the outputs within this
+ * period, given the period's start and length by jack's DLL.
+ */
+static void timed_start(EngineSlot *slot, jack_nframes_t nframes, jack_time_t now,
+        gfloat period_us) {
+    gint64 offset = (gint64)floor ((slot->start_at - (gint64)now) * nframes / period_us + 0.5) -
+            engine.latency;
+
+    if (offset >= nframes) {
+        return;
+    }
+    offset = MAX (offset, 0);
+
+    if (!g_atomic_int_compare_and_exchange (&slot->held, TRUE, FALSE)) {
+        /* stopped meanwhile */
+        g_atomic_int_set (&slot->start_state, ENGINE_START_NONE);
+        return;
+    }
+
+    slot->skip = offset;
+    g_atomic_int_set (&slot->running, TRUE);
+
+    slot->started_at = now + (gint64)((offset + engine.latency) * period_us / nframes + 0.5);
+    g_atomic_int_set (&slot->start_state, ENGINE_START_DONE);
+}
+
+static int process_cb(jack_nframes_t nframes, void *arg) {
+    guint64 start = now_ns ();
+    guint64 busy;
+    gint nslots = g_atomic_int_get (&engine.nslots);
+    gfloat *carts_l, *carts_r, *mix_l, *mix_r;
+    jack_nframes_t frame;
+    jack_time_t now, next;
+    gfloat period_us;
+
+    jack_get_cycle_times (engine.client, &frame, &now, &next, &period_us);
+
+    for (guint i = 0; i < engine.nports; i++) {
+        engine.buffers[i] = jack_port_get_buffer (engine.ports[i], nframes);
+        memset (engine.buffers[i], 0, nframes * sizeof (gfloat));
+    }
+
+    segue_period (nframes);
+
+    for (gint i = 0; i < nslots; i++) {
+        EngineSlot *slot = engine.slots[i];
+        guint got;
+
+        if (g_atomic_int_get (&slot->drop) &&
+                g_atomic_int_compare_and_exchange (&slot->drop, TRUE, FALSE)) {
+            ringbuffer_drop (slot->ring);
+            g_atomic_int_set (&slot->primed, FALSE);
+            slot->muted = FALSE;
+        }
+
+        if (ENGINE_START_PENDING == g_atomic_int_get (&slot->start_state)) {
+            timed_start (slot, nframes, now, period_us);
+        }
+
+        if (!g_atomic_int_get (&slot->running)) {
+            /* a fade doesn't survive a pause */
+            slot->skip = 0;
+            slot->fade_frames = 0;
+            slot->muted = FALSE;
+            continue;
+        }
+
+        if (0 == slot->skip && 0 == slot->fade_frames && !slot->muted) {
+            got = ringbuffer_read_add (slot->ring, engine.buffers[2 * slot->deck],
+                    engine.buffers[2 * slot->deck + 1], nframes);
+        } else {
+            got = read_faded (slot, engine.buffers[2 * slot->deck],
+                    engine.buffers[2 * slot->deck + 1], nframes);
+        }
+        engine.live[slot->deck] |= (got > 0);
+
+        if (got == nframes) {
+            g_atomic_int_set (&slot->primed, TRUE);
+        } else if (g_atomic_int_get (&slot->primed) && !g_atomic_int_get (&slot->draining)) {
+            /* the decoder didn't keep up, count each gap once */
+            g_atomic_int_set (&slot->primed, FALSE);
+            g_atomic_int_inc (&slot->underruns);
+        }
+    }
+
+    carts_l = engine.buffers[2 * engine.ndecks];
+    carts_r = engine.buffers[2 * engine.ndecks + 1];
+    mix_l = engine.buffers[2 * engine.ndecks + 2];
+    mix_r = engine.buffers[2 * engine.ndecks + 3];
+
+    cart_bank_mix (carts_l, carts_r, nframes);
+
+    /* idle decks only cost their memset, however many there are */
+    for (guint port = 0; port < engine.ndecks + 1; port++) {
+        const gfloat *l = engine.buffers[2 * port];
+        const gfloat *r = engine.buffers[2 * port + 1];
+
+        if (port < engine.ndecks) {
+            if (!engine.live[port]) {
+                continue;
+            }
+            engine.live[port] = FALSE;
+        }
+
+        dsp_mix_add (mix_l, l, nframes);
+        dsp_mix_add (mix_r, r, nframes);
+    }
+
+    busy = now_ns () - start;
+    engine.periods++;
+    engine.busy_ns += busy;
+    engine.busy_ns_max = MAX (engine.busy_ns_max, busy);
+
+    return 0;
+}
+
+static int xrun_cb(void *arg) {
+    g_atomic_int_inc (&stats.xruns);
+    return 0;
+}
+
+static int buffer_size_cb(jack_nframes_t nframes, void *arg) {
+    engine.period = nframes;
+    return 0;
+}
+
+static void latency_cb(jack_latency_callback_mode_t mode, void *arg) {
+    jack_nframes_t latency = 0;
+
+    if (JackPlaybackLatency != mode) {
+        return;
+    }
+
+    /* whichever ports are connected, mostly the mix bus */
+    for (guint i = 0; i < engine.nports; i++) {
+        jack_latency_range_t range;
+
+        jack_port_get_latency_range (engine.ports[i], JackPlaybackLatency, &range);
+        latency = MAX (latency, range.max);
+    }
+    engine.latency = latency;
+}
+
+static void register_pair(guint index, const gchar *prefix) {
+    for (guint ch = 0; ch < 2; ch++) {
+        gchar *name = g_strdup_printf ("%s_out_%u", prefix, ch + 1);
+
+        engine.ports[2 * index + ch] = jack_port_register (engine.client, name,
+                JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        g_free (name);
+    }
+}
+
+static void connect_mix(void) {
+    const char **physical = jack_get_ports (engine.client, NULL, NULL,
+            JackPortIsPhysical | JackPortIsInput);
+
+    if (NULL == physical) {
+        return;
+    }
+
+    for (guint ch = 0; ch < 2 && NULL != physical[ch]; ch++) {
+        jack_connect (engine.client,
+                jack_port_name (engine.ports[2 * engine.ndecks + 2 + ch]), physical[ch]);
+    }
+
+    jack_free (physical);
+}
+
+/* Open the shared jack client. Returns 0 on success. */
+int engine_init(guint ndecks, int autoconnect) {
+#if GST_VERSION_MAJOR == (0)
+    g_printerr ("The engine needs gstreamer-1.0\n");
+    return 1;
+#else
+    jack_status_t status;
+
+    engine.client = jack_client_open ("4deckradio", JackNoStartServer, &status);
+    if (NULL == engine.client) {
+        g_printerr ("Couldn't connect to jackd, engine disabled\n");
+        return 1;
+    }
+
+    engine.rate = jack_get_sample_rate (engine.client);
+    engine.period = jack_get_buffer_size (engine.client);
+    engine.ndecks = ndecks;
+
+    /* before any decoder can ask for them */
+    resample_prepare (engine.rate);
+
+    /* decks, carts and the mix bus */
+    engine.nports = 2 * (ndecks + 2);
+    engine.ports = g_new0 (jack_port_t *, engine.nports);
+    engine.buffers = g_new0 (gfloat *, engine.nports);
+    engine.live = g_new0 (gboolean, ndecks);
+
+    for (guint i = 0; i < ndecks; i++) {
+        gchar *prefix = g_strdup_printf ("deck%u", i + 1);
+
+        register_pair (i, prefix);
+        g_free (prefix);
+    }
+    register_pair (ndecks, "carts");
+    register_pair (ndecks + 1, "mix");
+
+    engine.maxslots = ENGINE_MAX_SLOTS_PER_DECK * ndecks;
+    engine.slots = g_new0 (EngineSlot *, engine.maxslots);
+    engine.scratch_l = g_new0 (gfloat, ENGINE_SCRATCH_FRAMES);
+    engine.scratch_r = g_new0 (gfloat, ENGINE_SCRATCH_FRAMES);
+
+    jack_set_process_callback (engine.client, process_cb, NULL);
+    jack_set_buffer_size_callback (engine.client, buffer_size_cb, NULL);
+    jack_set_latency_callback (engine.client, latency_cb, NULL);
+    jack_set_xrun_callback (engine.client, xrun_cb, NULL);
+
+    if (0 != jack_activate (engine.client)) {
+        g_printerr ("Couldn't activate the engine\n");
+        jack_client_close (engine.client);
+        engine.client = NULL;
+        return 1;
+    }
+
+    if (autoconnect) {
+        connect_mix ();
+    }
+
+    g_print ("Engine running: %u decks, %u frames @ %u Hz\n", ndecks,
+            engine.period, engine.rate);
+
+    return 0;
+#endif
+}
+
+/* Stops the process callback. The slots are freed by their chains later. */
+void engine_free(void) {
+    if (NULL == engine.client) {
+        return;
+    }
+
+    jack_deactivate (engine.client);
+    jack_client_close (engine.client);
+    engine.client = NULL;
+
+    g_atomic_int_set (&engine.nslots, 0);
+    g_free (engine.slots);
+    engine.slots = NULL;
+    g_free (engine.ports);
+    g_free (engine.buffers);
+    g_free (engine.live);
+    g_free (engine.scratch_l);
+    g_free (engine.scratch_r);
+}
+
+gboolean engine_is_running(void) {
+    return (NULL != engine.client);
+}
+
+guint engine_get_rate(void) {
+    return engine.rate;
+}
+
+/* The producer side, running on the chain's streaming thread */
+#if GST_VERSION_MAJOR != (0)
+
+static gulong nap_us(void) {
+    return MAX (1, (gulong)engine.period * G_USEC_PER_SEC / engine.rate / 2);
+}
+
+/* Write frames, waiting for the process callback to make room. Returns the
+ * number of frames left over because the slot was paused.
+ */
+static guint write_blocking(EngineSlot *slot, const gfloat *frames, guint n) {
+    while (n > 0) {
+        guint written;
+
+        if (g_atomic_int_get (&slot->flushing)) {
+            return 0;
+        }
+
+        written = ringbuffer_write (slot->ring, frames, n);
+        frames += 2 * written;
+        n -= written;
+
+        if (n > 0) {
+            /* a held slot is about to be heard, keep the decoder waiting */
+            if (!g_atomic_int_get (&slot->running) && !g_atomic_int_get (&slot->held)) {
+                return n;
+            }
+            g_usleep (nap_us ());
+        }
+    }
+
+    return 0;
+}
+
+static void stash(EngineSlot *slot, const gfloat *frames, guint n) {
+    if (slot->spill_frames + n > slot->spill_size) {
+        slot->spill_size = slot->spill_frames + n;
+        slot->spill = g_renew (gfloat, slot->spill, 2 * slot->spill_size);
+    }
+
+    memcpy (slot->spill + 2 * slot->spill_frames, frames, 2 * n * sizeof (gfloat));
+    slot->spill_frames += n;
+}
+
+/* position is the stream position of the first frame, -1 if unknown */
+static void push_frames(EngineSlot *slot, const gfloat *frames, guint n, gint64 position) {
+    gint epoch = g_atomic_int_get (&slot->epoch);
+    guint left;
+
+    /* whatever was left over belongs to the time before the last flush */
+    if (slot->spill_epoch != epoch) {
+        slot->spill_frames = 0;
+        slot->spill_epoch = epoch;
+    }
+
+    /* the stream runs on without gaps from here until the next flush */
+    if (slot->anchor_epoch != epoch && position >= 0) {
+        guint index = (guint)slot->ring->write + slot->spill_frames;
+
+        g_atomic_int_set (&slot->offset, (gint)((guint)position - index));
+        g_atomic_int_set (&slot->anchored, TRUE);
+        slot->anchor_epoch = epoch;
+    }
+
+    if (slot->spill_frames > 0) {
+        left = write_blocking (slot, slot->spill, slot->spill_frames);
+        memmove (slot->spill, slot->spill + 2 * (slot->spill_frames - left),
+                2 * left * sizeof (gfloat));
+        slot->spill_frames = left;
+
+        if (left > 0) {
+            stash (slot, frames, n);
+            return;
+        }
+    }
+
+    left = write_blocking (slot, frames, n);
+    if (left > 0) {
+        stash (slot, frames + 2 * (n - left), left);
+    }
+}
+
+static void reserve_frames(gfloat **frames, guint *size, guint n) {
+    if (n > *size) {
+        *size = n;
+        *frames = g_renew (gfloat, *frames, 2 * n);
+    }
+}
+
+/* Whatever the appsink negotiated, to gain-adjusted float frames at the
+ * jack rate. Returns the buffer itself when there is nothing to do, NULL
+ * if it can't be done. n may come back 0 while the resampler fills up.
+ */
+static const gfloat* convert_frames(EngineSlot *slot, GstSample *sample,
+        const GstMapInfo *map, guint *n) {
+    GstCaps *caps = gst_sample_get_caps (sample);
+    DspFormat format = DSP_FORMAT_UNKNOWN;
+    gint rate = (gint)engine.rate;
+    gint epoch = g_atomic_int_get (&slot->epoch);
+    const gfloat *frames;
+    guint width;
+
+    if (NULL != caps && gst_caps_get_size (caps) > 0) {
+        GstStructure *structure = gst_caps_get_structure (caps, 0);
+
+        format = dsp_format_from_string (gst_structure_get_string (structure, "format"));
+        gst_structure_get_int (structure, "rate", &rate);
+    }
+
+    width = dsp_format_width (format);
+    if (0 == width) {
+        *n = 0;
+        return NULL;
+    }
+
+    *n = map->size / (2 * width);
+    if (DSP_FORMAT_F32 == format && 1.0f == slot->gain) {
+        frames = (const gfloat *)map->data;
+    } else {
+        reserve_frames (&slot->convert, &slot->convert_size, *n);
+        dsp_to_f32 (format, slot->convert, map->data, 2 * *n, slot->gain);
+        frames = slot->convert;
+    }
+
+    /* a flush starts a new stream, without the old one's history */
+    if (slot->resample_epoch != epoch) {
+        resampler_reset (slot->resampler);
+        slot->resample_epoch = epoch;
+    }
+    resampler_configure (slot->resampler, (guint)rate, engine.rate, slot->quality);
+
+    if ((guint)rate == engine.rate) {
+        return frames;
+    }
+
+    reserve_frames (&slot->resampled, &slot->resampled_size,
+            resampler_get_max_out (slot->resampler, *n));
+    *n = resampler_process (slot->resampler, frames, *n, slot->resampled);
+
+    return slot->resampled;
+}
+
+static GstFlowReturn new_sample_cb(GstAppSink *sink, gpointer user_data) {
+    EngineSlot *slot = user_data;
+    GstSample *sample = gst_app_sink_pull_sample (sink);
+    GstSegment *segment;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gint64 position = -1;
+    const gfloat *frames;
+    guint n;
+
+    if (NULL == sample) {
+        return GST_FLOW_FLUSHING;
+    }
+
+    buffer = gst_sample_get_buffer (sample);
+    segment = gst_sample_get_segment (sample);
+    if (NULL != segment && GST_BUFFER_PTS_IS_VALID (buffer)) {
+        guint64 time = gst_segment_to_stream_time (segment, GST_FORMAT_TIME,
+                GST_BUFFER_PTS (buffer));
+
+        if (GST_CLOCK_TIME_IS_VALID (time)) {
+            position = (gint64)gst_util_uint64_scale_int (time, engine.rate, GST_SECOND);
+        }
+    }
+
+    if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        /* even without frames yet, the first buffer anchors the stream */
+        frames = convert_frames (slot, sample, &map, &n);
+        if (NULL != frames) {
+            push_frames (slot, frames, n, position);
+        }
+        gst_buffer_unmap (buffer, &map);
+    }
+    gst_sample_unref (sample);
+
+    return GST_FLOW_OK;
+}
+
+/* Hold back the EOS message until the listener has heard everything */
+static void eos_cb(GstAppSink *sink, gpointer user_data) {
+    EngineSlot *slot = user_data;
+    guint n;
+
+    /* the last few frames are still in the resampler's history */
+    reserve_frames (&slot->resampled, &slot->resampled_size,
+            resampler_get_max_out (slot->resampler, 0));
+    n = resampler_drain (slot->resampler, slot->resampled);
+    if (n > 0) {
+        push_frames (slot, slot->resampled, n, -1);
+    }
+
+    g_atomic_int_set (&slot->draining, TRUE);
+    while (ringbuffer_fill (slot->ring) > 0 &&
+            (g_atomic_int_get (&slot->running) || g_atomic_int_get (&slot->held)) &&
+            !g_atomic_int_get (&slot->flushing)) {
+        g_usleep (nap_us ());
+    }
+    g_atomic_int_set (&slot->draining, FALSE);
+}
+#endif
+
+EngineSlot* engine_slot_new(guint deck, GstElement *appsink) {
+#if GST_VERSION_MAJOR == (0)
+    return NULL;
+#else
+    GstAppSinkCallbacks callbacks = { .eos = eos_cb, .new_sample = new_sample_cb };
+    EngineSlot *slot;
+    GstCaps *caps;
+    gchar *rates, *description;
+
+    if (!engine_is_running () || (guint)engine.nslots >= engine.maxslots) {
+        return NULL;
+    }
+
+    slot = g_new0 (EngineSlot, 1);
+    slot->ring = ringbuffer_new (ENGINE_RING_FRAMES);
+    slot->deck = deck;
+    slot->anchor_epoch = -1;
+    slot->gain = 1.0f;
+    slot->resampler = resampler_new ();
+    slot->resample_epoch = -1;
+    slot->quality = resample_get_quality ((gint)deck, RESAMPLE_CLASS_FILE);
+
+    /* everything the producer converts itself, so audioconvert and
+     * audioresample can pass through */
+    rates = resample_get_rates (engine.rate);
+    description = g_strdup_printf ("audio/x-raw, format=(string)" DSP_FORMATS ", "
+            "layout=(string)interleaved, channels=(int)2, rate=(int){ %s }", rates);
+    caps = gst_caps_from_string (description);
+    g_free (description);
+    g_free (rates);
+    gst_app_sink_set_caps (GST_APP_SINK (appsink), caps);
+    gst_caps_unref (caps);
+
+    /* the ring paces the decoder, not the clock */
+    g_object_set (appsink, "sync", FALSE, NULL);
+    gst_app_sink_set_callbacks (GST_APP_SINK (appsink), &callbacks, slot, NULL);
+
+    engine.slots[engine.nslots] = slot;
+    g_atomic_int_inc (&engine.nslots);
+
+    return slot;
+#endif
+}
+
+/* Only call this once the engine is stopped */
+void engine_slot_free(EngineSlot *slot) {
+    ringbuffer_free (slot->ring);
+    g_free (slot->spill);
+    g_free (slot->convert);
+    resampler_free (slot->resampler);
+    g_free (slot->resampled);
+    g_free (slot);
+}
+
+/* The track's loudness normalisation, applied while converting. Only
+ * while the chain is in READY, the streaming thread reads it.
+ */
+void engine_slot_set_gain(EngineSlot *slot, gdouble gain) {
+    slot->gain = (gfloat)gain;
+}
+
+/* Of the slot's resampler, like engine_slot_set_gain() */
+void engine_slot_set_quality(EngineSlot *slot, ResampleQuality quality) {
+    slot->quality = quality;
+}
+
+/* A held slot fills its ring, but stays silent until its segue begins or
+ * it is released.
+ */
+void engine_slot_start(EngineSlot *slot) {
+    ringbuffer_lock (slot->ring);
+    g_atomic_int_set (&slot->flushing, FALSE);
+    g_atomic_int_set (&slot->primed, FALSE);
+    g_atomic_int_set (&slot->started, TRUE);
+    if (!g_atomic_int_get (&slot->held)) {
+        g_atomic_int_set (&slot->running, TRUE);
+    }
+}
+
+/* Pause keeps the ring for later, a flushing stop empties it. Either one
+ * lets go of a hold.
+ */
+void engine_slot_stop(EngineSlot *slot, gboolean flush) {
+    g_atomic_int_set (&slot->held, FALSE);
+    g_atomic_int_set (&slot->started, FALSE);
+    g_atomic_int_set (&slot->running, FALSE);
+
+    if (flush) {
+        engine_slot_flush (slot, TRUE);
+    }
+}
+
+void engine_slot_flush(EngineSlot *slot, gboolean flushing) {
+    if (flushing) {
+        g_atomic_int_set (&slot->anchored, FALSE);
+        g_atomic_int_inc (&slot->epoch);
+    }
+    g_atomic_int_set (&slot->flushing, flushing);
+    g_atomic_int_set (&slot->drop, TRUE);
+}
+
+/* Keep the slot silent once started, before it is started */
+void engine_slot_hold(EngineSlot *slot) {
+    g_atomic_int_set (&slot->held, TRUE);
+}
+
+/* Play a held slot right away. Whoever takes the hold starts the slot,
+ * this or the process callback.
+ */
+void engine_slot_release(EngineSlot *slot) {
+    if (g_atomic_int_compare_and_exchange (&slot->held, TRUE, FALSE) &&
+            g_atomic_int_get (&slot->started)) {
+        g_atomic_int_set (&slot->running, TRUE);
+    }
+}
+
+/* Stream position of the next frame to be heard, in frames at the engine
+ * rate. -1 until the slot has had a timestamped buffer since its last flush.
+ */
+gint64 engine_slot_get_position(EngineSlot *slot) {
+    return slot_position (slot);
+}
+
+/* Hold the slot and start it when its first frame reaches the outputs at
+ * wall_us (microseconds, g_get_real_time). The pipeline has to go to
+ * PLAYING early enough to fill the ring. For the main loop.
+ */
+gboolean engine_slot_start_at(EngineSlot *slot, gint64 wall_us) {
+    if (!engine_is_running () ||
+            ENGINE_START_PENDING == g_atomic_int_get (&slot->start_state)) {
+        return FALSE;
+    }
+
+    /* the jack clock doesn't step, so this holds for the next second or so */
+    slot->clock_offset = g_get_real_time () - (gint64)jack_get_time ();
+    slot->start_at = wall_us - slot->clock_offset;
+    engine_slot_hold (slot);
+    g_atomic_int_set (&slot->start_state, ENGINE_START_PENDING);
+
+    return TRUE;
+}
+
+void engine_slot_cancel_start(EngineSlot *slot) {
+    if (g_atomic_int_compare_and_exchange (&slot->start_state, ENGINE_START_PENDING,
+                ENGINE_START_NONE)) {
+        engine_slot_release (slot);
+    }
+}
+
+/* When the first frame of a timed start reached the outputs, in wall
+ * clock microseconds. -1 if it hasn't yet.
+ */
+gint64 engine_slot_get_start_time(EngineSlot *slot) {
+    if (ENGINE_START_DONE != g_atomic_int_get (&slot->start_state)) {
+        return -1;
+    }
+
+    return slot->started_at + slot->clock_offset;
+}
+
+/* Start the held slot in when out gets to stream position at, and fade
+ * between them over fade_frames. One segue at a time. For the main loop.
+ */
+gboolean engine_segue_arm(EngineSlot *out, EngineSlot *in, gint64 at,
+        guint fade_frames, EngineFadeCurve curve) {
+    EngineSegue *segue = &engine.segue;
+
+    if (!engine_is_running () || out == in ||
+            ENGINE_SEGUE_ARMED == g_atomic_int_get (&segue->state)) {
+        return FALSE;
+    }
+
+    segue->out = out;
+    segue->in = in;
+    segue->at = at;
+    segue->fade_frames = fade_frames;
+    segue->curve = curve;
+    g_atomic_int_set (&segue->state, ENGINE_SEGUE_ARMED);
+
+    return TRUE;
+}
+
+/* Call off an armed segue and release its incoming slot. FALSE if the
+ * segue had already begun, or there was none.
+ */
+gboolean engine_segue_cancel(void) {
+    EngineSegue *segue = &engine.segue;
+
+    if (!g_atomic_int_compare_and_exchange (&segue->state, ENGINE_SEGUE_ARMED, ENGINE_SEGUE_IDLE)) {
+        return FALSE;
+    }
+
+    engine_slot_release (segue->in);
+    return TRUE;
+}
+
+EngineSegueState engine_segue_get_state(void) {
+    return g_atomic_int_get (&engine.segue.state);
+}
+
+gboolean engine_fade_curve_parse(const gchar *name, EngineFadeCurve *curve) {
+    static const gchar *names[] = { "linear", "equal-power", "s-curve" };
+
+    for (guint i = 0; i < G_N_ELEMENTS (names); i++) {
+        if (0 == g_strcmp0 (name, names[i])) {
+            *curve = (EngineFadeCurve)i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Engine periods in which deck's rings ran dry */
+gint engine_get_underruns(guint deck) {
+    gint underruns = 0;
+
+    for (gint i = 0; i < g_atomic_int_get (&engine.nslots); i++) {
+        if (engine.slots[i]->deck == deck) {
+            underruns += g_atomic_int_get (&engine.slots[i]->underruns);
+        }
+    }
+
+    return underruns;
+}
+
+/* jack statistics, for comparing the engine with the jackaudiosink mode */
+
+/* -1 if nobody listens for xruns (neither the engine nor --jack-stats) */
+gint engine_get_xruns(void) {
+    if (!engine_is_running () && NULL == stats.client) {
+        return -1;
+    }
+
+    return g_atomic_int_get (&stats.xruns);
+}
+
+void engine_stats_print(void) {
+    if (NULL == stats.client) {
+        return;
+    }
+
+    g_print ("jack (%s mode): %u frames @ %u Hz, DSP load %.1f%%, %d xruns",
+            engine_is_running () ? "engine" : "jackaudiosink",
+            jack_get_buffer_size (stats.client), jack_get_sample_rate (stats.client),
+            jack_cpu_load (stats.client), g_atomic_int_get (&stats.xruns));
+
+    if (engine_is_running () && engine.periods > 0) {
+        gdouble period_us = 1e6 * engine.period / engine.rate;
+        gdouble avg_us = engine.busy_ns / 1e3 / engine.periods;
+        gint underruns = 0;
+
+        for (gint i = 0; i < g_atomic_int_get (&engine.nslots); i++) {
+            underruns += g_atomic_int_get (&engine.slots[i]->underruns);
+        }
+
+        g_print (", process avg %.1f us (%.2f%% of a period), max %.1f us, %d underruns",
+                avg_us, 100.0 * avg_us / period_us, engine.busy_ns_max / 1e3, underruns);
+    }
+
+    g_print ("\n");
+}
+
+static gboolean stats_timeout_cb(gpointer unused) {
+    engine_stats_print ();
+    return TRUE;
+}
+
+/* Report xruns and load every STATS_INTERVAL_SECONDS. Call after engine_init(). */
+void engine_stats_init(void) {
+    jack_status_t status;
+
+    if (engine_is_running ()) {
+        stats.client = engine.client;
+        stats.own_client = FALSE;
+    } else {
+        stats.client = jack_client_open ("4deckradio-stats", JackNoStartServer, &status);
+        stats.own_client = TRUE;
+        if (NULL == stats.client) {
+            g_printerr ("Couldn't connect to jackd, no statistics\n");
+            return;
+        }
+    }
+
+    /* callbacks must be set before activation */
+    if (stats.own_client) {
+        jack_set_xrun_callback (stats.client, xrun_cb, NULL);
+        jack_activate (stats.client);
+    }
+
+    stats.timeout_id = g_timeout_add_seconds (STATS_INTERVAL_SECONDS, stats_timeout_cb, NULL);
+}
+
+void engine_stats_free(void) {
+    if (NULL == stats.client) {
+        return;
+    }
+
+    engine_stats_print ();
+    g_source_remove (stats.timeout_id);
+
+    if (stats.own_client) {
+        jack_deactivate (stats.client);
+        jack_client_close (stats.client);
+    }
+    stats.client = NULL;
+}
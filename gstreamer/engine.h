@@ -0,0 +1,100 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+#include "resample.h"
+#include "ringbuffer.h"
+
+typedef enum {
+    ENGINE_FADE_LINEAR,
+    ENGINE_FADE_EQUAL_POWER,        /* Constant loudness across the fade */
+    ENGINE_FADE_S_CURVE
+} EngineFadeCurve;
+
+typedef enum {
+    ENGINE_SEGUE_IDLE,
+    ENGINE_SEGUE_ARMED,             /* Waiting for the outgoing slot to get there */
+    ENGINE_SEGUE_BEGUN
+} EngineSegueState;
+
+typedef enum {
+    ENGINE_START_NONE,
+    ENGINE_START_PENDING,           /* Held until start_at */
+    ENGINE_START_DONE
+} EngineStartState;
+
+/* The link between one decoding chain and the engine's jack client */
+typedef struct _EngineSlot {
+    RingBuffer *ring;
+    guint deck;                     /* Port pair the slot plays on */
+    gint running;                   /* The process callback consumes the ring */
+    gint flushing;                  /* Producer discards everything it gets */
+    gint drop;                      /* Asks the process callback to empty the ring */
+    gint draining;                  /* Waiting for the ring to run dry at EOS */
+    gint primed;                    /* Ring had data since the last (re)start */
+    gint epoch;                     /* Bumped on every flush */
+    gint underruns;
+    gint started;                   /* Between engine_slot_start() and engine_slot_stop() */
+    gint held;                      /* Started, but waits for a segue to begin */
+    gint anchored;                  /* offset is valid since the last flush */
+    gint offset;                    /* Stream position of ring frame 0, in frames, wrapping */
+    gint start_state;               /* EngineStartState */
+    gint64 start_at;                /* jack time its first frame is due at the outputs */
+    gint64 started_at;              /* jack time it got there, set before DONE */
+    gint64 clock_offset;            /* Wall clock minus jack time, when scheduled */
+
+    gfloat *spill;                  /* Producer only: frames that didn't fit while paused */
+    guint spill_frames;
+    guint spill_size;
+    gint spill_epoch;
+    gint anchor_epoch;              /* Producer only */
+    gfloat *convert;                /* Producer only: buffers converted to float */
+    guint convert_size;
+    gfloat gain;                    /* See engine_slot_set_gain() */
+    Resampler *resampler;           /* Producer only, for decoders not at the jack rate */
+    gfloat *resampled;
+    guint resampled_size;
+    gint resample_epoch;
+    ResampleQuality quality;        /* See engine_slot_set_quality() */
+
+    guint skip;                     /* Process callback only: silence before the first frame */
+    guint fade_delay;               /* Frames left before the fade starts */
+    guint fade_pos;
+    guint fade_frames;              /* 0 when not fading */
+    gboolean fade_in;
+    EngineFadeCurve fade_curve;
+    gboolean muted;                 /* Faded out */
+} EngineSlot;
+
+int engine_init(guint ndecks, int autoconnect);
+void engine_free(void);
+gboolean engine_is_running(void);
+guint engine_get_rate(void);
+EngineSlot* engine_slot_new(guint deck, GstElement *appsink);
+void engine_slot_free(EngineSlot *slot);
+void engine_slot_set_gain(EngineSlot *slot, gdouble gain);
+void engine_slot_set_quality(EngineSlot *slot, ResampleQuality quality);
+void engine_slot_start(EngineSlot *slot);
+void engine_slot_stop(EngineSlot *slot, gboolean flush);
+void engine_slot_flush(EngineSlot *slot, gboolean flushing);
+void engine_slot_hold(EngineSlot *slot);
+void engine_slot_release(EngineSlot *slot);
+gint64 engine_slot_get_position(EngineSlot *slot);
+gboolean engine_slot_start_at(EngineSlot *slot, gint64 wall_us);
+void engine_slot_cancel_start(EngineSlot *slot);
+gint64 engine_slot_get_start_time(EngineSlot *slot);
+gboolean engine_segue_arm(EngineSlot *out, EngineSlot *in, gint64 at,
+        guint fade_frames, EngineFadeCurve curve);
+gboolean engine_segue_cancel(void);
+EngineSegueState engine_segue_get_state(void);
+gboolean engine_fade_curve_parse(const gchar *name, EngineFadeCurve *curve);
+gint engine_get_underruns(guint deck);
+gint engine_get_xruns(void);
+void engine_stats_init(void);
+void engine_stats_print(void);
+void engine_stats_free(void);
+
+#endif /* _ENGINE_H */
@@ -0,0 +1,390 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <glib.h>
+#include "input.h"
+
+/*
+ * Controller input runs on a thread of its own, away from GTK: a file
+ * chooser redraw or a modal dialog on the main loop can't delay a button
+ * press any more. The thread sleeps in epoll on every joystick under the
+ * watched directory, drains whatever arrived in one go and hands the
+ * buttons to the callback. New joysticks are picked up through inotify,
+ * unplugged ones dropped when their read fails.
+ *
+ * Controllers are read through their evdev nodes rather than the js
+ * interface, whose timestamps count jiffies: evdev stamps every event
+ * with CLOCK_MONOTONIC once asked to, the clock g_get_monotonic_time()
+ * reads. Buttons are numbered the way the js interface numbers them, so
+ * a controller keeps its mapping.
+ */
+
+/* Well below jackd's default of 70+, the audio must win */
+#define INPUT_RT_PRIORITY 10
+#define INPUT_BATCH 64
+#define INPUT_MAX_WAKEUPS 16
+#define INPUT_NUM_KEYS (KEY_MAX - BTN_MISC + 1)
+
+typedef enum {
+    SOURCE_DEVICE,
+    SOURCE_INOTIFY,
+    SOURCE_STOP
+} SourceType;
+
+typedef struct _InputSource {
+    SourceType type;
+    int fd;
+    gchar *name;
+    gint16 *keymap;                 /* Button number by key code from BTN_MISC, -1 if none */
+} InputSource;
+
+struct _InputThread {
+    InputButtonFunc func;
+    gpointer user_data;
+
+    int epollfd;
+    InputSource stop;               /* An eventfd, written by input_thread_free() */
+    InputSource inotify;
+    gchar *dir;
+
+    GList *devices;                 /* InputSource, owned by the thread once it runs */
+    GThread *thread;
+};
+
+static InputSource* source_new(SourceType type, int fd, const gchar *name) {
+    InputSource *source = g_new0 (InputSource, 1);
+
+    source->type = type;
+    source->fd = fd;
+    source->name = g_strdup (name);
+
+    return source;
+}
+
+static void watch_source(InputThread *input, InputSource *source) {
+    struct epoll_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = source;
+
+    epoll_ctl (input->epollfd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+static gboolean test_key(const unsigned long *keys, guint code) {
+    return 0 != (keys[code / (8 * sizeof (long))] & (1UL << (code % (8 * sizeof (long)))));
+}
+
+/* Number the buttons like the joydev driver does: from BTN_JOYSTICK up,
+ * then the ones from BTN_MISC below it. Something that isn't an input
+ * device, like the bench's pipe, is taken to have all of them.
+ */
+static gint16* build_keymap(int fd) {
+    unsigned long keys[KEY_MAX / (8 * sizeof (long)) + 1];
+    gint16 *keymap = g_new (gint16, INPUT_NUM_KEYS);
+    gint16 number = 0;
+
+    if (ioctl (fd, EVIOCGBIT (EV_KEY, sizeof (keys)), keys) < 0) {
+        memset (keys, 0xff, sizeof (keys));
+    }
+
+    for (guint code = BTN_JOYSTICK; code <= KEY_MAX; code++) {
+        keymap[code - BTN_MISC] = test_key (keys, code) ? number++ : -1;
+    }
+    for (guint code = BTN_MISC; code < BTN_JOYSTICK; code++) {
+        keymap[code - BTN_MISC] = test_key (keys, code) ? number++ : -1;
+    }
+
+    return keymap;
+}
+
+static void add_device(InputThread *input, int fd, const gchar *name) {
+    InputSource *source = source_new (SOURCE_DEVICE, fd, name);
+
+    source->keymap = build_keymap (fd);
+    input->devices = g_list_prepend (input->devices, source);
+    watch_source (input, source);
+    g_print ("Controller %s connected\n", name);
+}
+
+static void remove_device(InputThread *input, InputSource *source) {
+    g_print ("Controller %s disconnected\n", source->name);
+
+    epoll_ctl (input->epollfd, EPOLL_CTL_DEL, source->fd, NULL);
+    close (source->fd);
+
+    input->devices = g_list_remove (input->devices, source);
+    g_free (source->keymap);
+    g_free (source->name);
+    g_free (source);
+}
+
+static gboolean is_open(InputThread *input, const gchar *path) {
+    for (GList *l = input->devices; NULL != l; l = l->next) {
+        if (0 == g_strcmp0 (((InputSource *)l->data)->name, path)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* What the joydev driver would take: something with joystick or gamepad
+ * buttons, not a keyboard or a mouse
+ */
+static gboolean is_joystick(int fd) {
+    unsigned long keys[KEY_MAX / (8 * sizeof (long)) + 1];
+
+    if (ioctl (fd, EVIOCGBIT (EV_KEY, sizeof (keys)), keys) < 0) {
+        return FALSE;
+    }
+
+    for (guint code = BTN_JOYSTICK; code < BTN_DIGI; code++) {
+        if (test_key (keys, code)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Returns -1 if path isn't a joystick we can read */
+static int open_joystick(const gchar *path) {
+    int clock = CLOCK_MONOTONIC;
+    int fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (-1 == fd) {
+        return -1;
+    }
+
+    if (!is_joystick (fd)) {
+        close (fd);
+        return -1;
+    }
+
+    if (0 != ioctl (fd, EVIOCSCLOCKID, &clock)) {
+        g_printerr ("Controller %s can't timestamp on the monotonic clock\n", path);
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void open_device(InputThread *input, const gchar *name) {
+    gchar *path;
+    int fd;
+
+    /* the evdev nodes only, not the js interface next to them */
+    if (!g_str_has_prefix (name, "event")) {
+        return;
+    }
+
+    path = g_build_filename (input->dir, name, NULL);
+    if (!is_open (input, path)) {
+        fd = open_joystick (path);
+        if (-1 != fd) {
+            add_device (input, fd, path);
+        }
+    }
+    g_free (path);
+}
+
+/* Returns FALSE once the device is gone */
+static gboolean drain_device(InputThread *input, InputSource *source) {
+    struct input_event events[INPUT_BATCH];
+
+    for (;;) {
+        ssize_t len = read (source->fd, events, sizeof (events));
+
+        if (len < 0) {
+            return (EAGAIN == errno || EINTR == errno);
+        }
+        if (0 == len) {
+            /* end of file, the writing end of a pipe closed */
+            return FALSE;
+        }
+
+        for (size_t i = 0; i < len / sizeof (struct input_event); i++) {
+            const struct input_event *event = &events[i];
+            gint16 number;
+
+            /* 2 is autorepeat, the button is still down */
+            if (EV_KEY != event->type || event->code < BTN_MISC ||
+                    event->code > KEY_MAX || event->value > 1) {
+                continue;
+            }
+
+            number = source->keymap[event->code - BTN_MISC];
+            if (number >= 0) {
+                input->func ((guint)number, 0 != event->value,
+                        (gint64)event->input_event_sec * G_USEC_PER_SEC + event->input_event_usec,
+                        input->user_data);
+            }
+        }
+
+        if (len < (ssize_t)sizeof (events)) {
+            return TRUE;
+        }
+    }
+}
+
+static void drain_inotify(InputThread *input) {
+    gchar buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read (input->inotify.fd, buffer, sizeof (buffer))) > 0) {
+        for (gchar *p = buffer; p < buffer + len;
+                p += sizeof (struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+
+            /* udev fixes the permissions after creating the node */
+            if (event->len > 0) {
+                open_device (input, event->name);
+            }
+        }
+    }
+}
+
+static void raise_priority(void) {
+    struct sched_param param;
+
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = INPUT_RT_PRIORITY;
+
+    if (0 != pthread_setschedparam (pthread_self (), SCHED_FIFO, &param)) {
+        g_print ("Input thread runs without realtime priority\n");
+    }
+}
+
+static gpointer input_thread(InputThread *input) {
+    struct epoll_event events[INPUT_MAX_WAKEUPS];
+
+    raise_priority ();
+
+    for (;;) {
+        int n = epoll_wait (input->epollfd, events, INPUT_MAX_WAKEUPS, -1);
+
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror ("epoll_wait");
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            InputSource *source = events[i].data.ptr;
+
+            switch (source->type) {
+                case SOURCE_STOP:
+                    return NULL;
+                case SOURCE_INOTIFY:
+                    drain_inotify (input);
+                    break;
+                case SOURCE_DEVICE:
+                    if (!drain_device (input, source) ||
+                            (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                        remove_device (input, source);
+                    }
+                    break;
+            }
+        }
+    }
+}
+
+InputThread* input_thread_new(InputButtonFunc func, gpointer user_data) {
+    InputThread *input = g_new0 (InputThread, 1);
+
+    input->func = func;
+    input->user_data = user_data;
+    input->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+    input->inotify.fd = -1;
+
+    input->stop.type = SOURCE_STOP;
+    input->stop.fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    watch_source (input, &input->stop);
+
+    return input;
+}
+
+/* Open every joystick in dir, now and whenever one is plugged in */
+void input_thread_watch_dir(InputThread *input, const gchar *dir) {
+    GDir *gdir;
+    const gchar *name;
+
+    input->dir = g_strdup (dir);
+
+    input->inotify.type = SOURCE_INOTIFY;
+    input->inotify.fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (-1 == input->inotify.fd ||
+            -1 == inotify_add_watch (input->inotify.fd, dir, IN_CREATE | IN_ATTRIB)) {
+        perror ("Couldn't watch for new controllers");
+    } else {
+        watch_source (input, &input->inotify);
+    }
+
+    gdir = g_dir_open (dir, 0, NULL);
+    if (NULL == gdir) {
+        return;
+    }
+
+    while (NULL != (name = g_dir_read_name (gdir))) {
+        open_device (input, name);
+    }
+    g_dir_close (gdir);
+}
+
+/* Anything that delivers input_event records will do, the bench uses a
+ * pipe. Their timestamps have to be on the monotonic clock. The input
+ * thread takes over fd.
+ */
+void input_thread_add_fd(InputThread *input, int fd, const gchar *name) {
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    add_device (input, fd, name);
+}
+
+void input_thread_start(InputThread *input) {
+    input->thread = g_thread_new ("input", (GThreadFunc)input_thread, input);
+}
+
+void input_thread_free(InputThread *input) {
+    guint64 one = 1;
+
+    if (NULL == input) {
+        return;
+    }
+
+    if (NULL != input->thread) {
+        if (sizeof (one) != write (input->stop.fd, &one, sizeof (one))) {
+            perror ("Couldn't stop the input thread");
+        }
+        g_thread_join (input->thread);
+    }
+
+    while (NULL != input->devices) {
+        remove_device (input, input->devices->data);
+    }
+
+    if (-1 != input->inotify.fd) {
+        close (input->inotify.fd);
+    }
+    close (input->stop.fd);
+    close (input->epollfd);
+
+    g_free (input->dir);
+    g_free (input);
+}
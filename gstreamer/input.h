@@ -0,0 +1,30 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+/* Not _INPUT_H, <linux/input.h> guards itself with that */
+#ifndef _INPUT_THREAD_H
+#define _INPUT_THREAD_H
+
+#include <linux/input.h>
+
+/* Older headers only have the timeval */
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+typedef struct _InputThread InputThread;
+
+/* Called on the input thread, so only thread-safe calls in here. time is
+ * the kernel's timestamp of the event, on the g_get_monotonic_time() clock.
+ */
+typedef void (*InputButtonFunc) (guint number, gboolean pressed, gint64 time, gpointer user_data);
+
+InputThread* input_thread_new(InputButtonFunc func, gpointer user_data);
+void input_thread_watch_dir(InputThread *input, const gchar *dir);
+void input_thread_add_fd(InputThread *input, int fd, const gchar *name);
+void input_thread_start(InputThread *input);
+void input_thread_free(InputThread *input);
+
+#endif /* _INPUT_THREAD_H */
@@ -0,0 +1,214 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <jack/jack.h>
+#include "mygstreamer.h"
+#include "deck.h"
+#include "engine.h"
+#include "jackclock.h"
+
+/*
+ * One clock for every deck pipeline, counting jack frames.
+ *
+ * Left alone, each pipeline picks its own clock (its jackaudiosink's, or
+ * the system clock behind an appsink), and over hours the decks drift
+ * apart and away from jack. This clock is jack's frame counter, as
+ * estimated by jack for the current moment, in nanoseconds. The
+ * jackaudiosinks slave to it, which means no correction at all, since
+ * their own clocks count the same frames.
+ *
+ * With --jack-stats the drift report prints, for every deck that has
+ * played uninterrupted since the last report, how far its position moved
+ * against the clock, in ppm and milliseconds.
+ */
+
+#define JACKCLOCK_REPORT_SECONDS 10
+/* A deck that moved this much more or less than the clock was sought */
+#define JACKCLOCK_JUMP_NS (100 * GST_MSECOND)
+
+typedef struct _JackClock {
+    GstSystemClock parent;
+} JackClock;
+
+typedef struct _JackClockClass {
+    GstSystemClockClass parent_class;
+} JackClockClass;
+
+/* Where a deck's drift is measured from */
+typedef struct _DriftBase {
+    gboolean valid;
+    guint state_serial;             /* Playing since, without a state change */
+    GstClockTime clock;
+    gint64 position;
+} DriftBase;
+
+typedef struct _SharedClock {
+    jack_client_t *client;
+    jack_nframes_t rate;
+    GstClock *clock;
+
+    GMutex lock;                    /* For the frame count below */
+    jack_nframes_t last_frames;
+    guint64 wraps;                  /* Of the 32 bit frame counter */
+    GstClockTime last_time;
+
+    CustomData *decks;
+    guint ndecks;
+    DriftBase *bases;
+    guint timeout_id;
+} SharedClock;
+
+static SharedClock shared;
+
+static GType jack_clock_get_type(void);
+
+G_DEFINE_TYPE (JackClock, jack_clock, GST_TYPE_SYSTEM_CLOCK);
+
+/* jack's estimate interpolates within the period, and may step back a
+ * little when the next period starts
+ */
+static GstClockTime jack_clock_get_internal_time(GstClock *clock) {
+    jack_nframes_t frames;
+    GstClockTime time;
+
+    g_mutex_lock (&shared.lock);
+
+    frames = jack_frame_time (shared.client);
+    if (frames < shared.last_frames && shared.last_frames - frames > G_MAXUINT32 / 2) {
+        shared.wraps++;
+    }
+    shared.last_frames = frames;
+
+    time = gst_util_uint64_scale_int ((shared.wraps << 32) | frames, GST_SECOND, shared.rate);
+    time = MAX (time, shared.last_time);
+    shared.last_time = time;
+
+    g_mutex_unlock (&shared.lock);
+
+    return time;
+}
+
+static void jack_clock_class_init(JackClockClass *klass) {
+    GST_CLOCK_CLASS (klass)->get_internal_time = jack_clock_get_internal_time;
+}
+
+static void jack_clock_init(JackClock *clock) {
+}
+
+/* Open a passive jack client for the frame counter. Without jackd the
+ * pipelines keep choosing their own clocks.
+ */
+void jackclock_init(void) {
+    jack_status_t status;
+
+    shared.client = jack_client_open ("4deckradio-clock", JackNoStartServer, &status);
+    if (NULL == shared.client) {
+        g_printerr ("Couldn't connect to jackd, the decks run on their own clocks\n");
+        return;
+    }
+
+    if (0 != jack_activate (shared.client)) {
+        g_printerr ("Couldn't activate the clock client\n");
+        jack_client_close (shared.client);
+        shared.client = NULL;
+        return;
+    }
+
+    g_mutex_init (&shared.lock);
+    shared.rate = jack_get_sample_rate (shared.client);
+    shared.clock = g_object_new (jack_clock_get_type (), "name", "jack-frame-clock", NULL);
+}
+
+/* After the decks have been freed */
+void jackclock_shutdown(void) {
+    if (0 != shared.timeout_id) {
+        g_source_remove (shared.timeout_id);
+        shared.timeout_id = 0;
+    }
+    g_free (shared.bases);
+    shared.bases = NULL;
+
+    if (NULL == shared.client) {
+        return;
+    }
+
+    gst_object_unref (shared.clock);
+    shared.clock = NULL;
+    jack_deactivate (shared.client);
+    jack_client_close (shared.client);
+    shared.client = NULL;
+    g_mutex_clear (&shared.lock);
+}
+
+/* Make the pipeline run on the shared clock, whatever its sink offers */
+void jackclock_use(GstElement *pipeline) {
+    if (NULL != shared.clock) {
+        gst_pipeline_use_clock (GST_PIPELINE (pipeline), shared.clock);
+    }
+}
+
+/* What the listener hears, in nanoseconds: straight from the engine
+ * ring, or from the pipeline with a jackaudiosink. -1 if unknown.
+ */
+static gint64 heard_position(CustomData *data) {
+    gint64 position, duration;
+    EngineSlot *slot = data->active->slot;
+
+    if (NULL != slot) {
+        position = engine_slot_get_position (slot);
+        return (position < 0) ? -1 :
+                (gint64)gst_util_uint64_scale_int (position, GST_SECOND, engine_get_rate ());
+    }
+
+    deck_get_status (data, &position, &duration);
+    return position;
+}
+
+static gboolean report_cb(gpointer unused) {
+    GstClockTime now = gst_clock_get_time (shared.clock);
+
+    for (guint i = 0; i < shared.ndecks; i++) {
+        CustomData *data = &shared.decks[i];
+        DriftBase *base = &shared.bases[i];
+        gint64 position = heard_position (data);
+        gint64 elapsed, moved;
+
+        if (DECK_PLAYING != data->deckstate || position < 0) {
+            base->valid = FALSE;
+            continue;
+        }
+
+        elapsed = GST_CLOCK_DIFF (base->clock, now);
+        moved = position - base->position;
+
+        if (!base->valid || base->state_serial != data->state_serial ||
+                ABS (moved - elapsed) > JACKCLOCK_JUMP_NS) {
+            base->valid = TRUE;
+            base->state_serial = data->state_serial;
+            base->clock = now;
+            base->position = position;
+            continue;
+        }
+
+        g_print ("Deck %u drift: %+.1f ppm, %+.3f ms over %.0f s\n", data->decknumber + 1,
+                1e6 * (moved - elapsed) / elapsed, (moved - elapsed) / 1e6,
+                (gdouble)elapsed / GST_SECOND);
+    }
+
+    return TRUE;
+}
+
+/* Print the drift of the playing decks every few seconds */
+void jackclock_report_start(CustomData *decks, guint ndecks) {
+    if (NULL == shared.clock) {
+        return;
+    }
+
+    shared.decks = decks;
+    shared.ndecks = ndecks;
+    shared.bases = g_new0 (DriftBase, ndecks);
+    shared.timeout_id = g_timeout_add_seconds (JACKCLOCK_REPORT_SECONDS, report_cb, NULL);
+}
@@ -0,0 +1,13 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _JACKCLOCK_H
+#define _JACKCLOCK_H
+
+void jackclock_init(void);
+void jackclock_shutdown(void);
+void jackclock_use(GstElement *pipeline);
+void jackclock_report_start(CustomData *decks, guint ndecks);
+
+#endif /* _JACKCLOCK_H */
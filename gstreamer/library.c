@@ -0,0 +1,1047 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/pbutils/pbutils.h>
+#include "library.h"
+#include "loudness.h"
+
+/*
+ * The music library: every audio file under the --library folders, with
+ * its tags and duration, in one index file the decks search through.
+ *
+ * The scanner thread walks the folders, hands new and changed files (by
+ * mtime) to a pool of GstDiscoverers and writes the index; after that it
+ * follows the folders with inotify and rewrites the index once things
+ * have settled for LIBRARY_SETTLE_MS. The main loop only ever maps the
+ * latest index read-only, so searching never waits for the scanner.
+ *
+ * Once the tags are in, the scanner measures the loudness of every track
+ * that hasn't been measured yet on a second pool, one thread per core, and
+ * saves the index every LIBRARY_SAVE_INTERVAL_S while it's at it. A deck
+ * loading a track that isn't measured yet just plays it at unity gain.
+ *
+ * Index file: a LibraryHeader, the LibraryRecords sorted by path, the
+ * string pool and the search block. The search block holds one casefolded
+ * line per record ("artist title album filename\n"), in record order, so
+ * a single strstr() over the whole block finds candidates and a binary
+ * search over the line offsets tells which record they belong to.
+ */
+
+#define LIBRARY_MAGIC "4DLB"
+#define LIBRARY_VERSION 2
+#define LIBRARY_DISCOVER_TIMEOUT (5 * GST_SECOND)
+#define LIBRARY_SETTLE_MS 2000          /* Let copies finish before indexing */
+#define LIBRARY_SAVE_INTERVAL_S 30       /* While measuring loudness */
+#define LIBRARY_MEASURE_ATTEMPTS 3      /* Per track and run, then wait for the next start */
+#define LIBRARY_TRACK_BROKEN 0x1        /* Not playable, kept so it isn't analysed again */
+#define LIBRARY_TRACK_MEASURED 0x2      /* loudness and true_peak are set */
+#define LIBRARY_LOUDNESS_UNKNOWN G_MININT32     /* Measured, but silent */
+
+#define LIBRARY_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+        IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct _LibraryHeader {
+    gchar magic[4];
+    guint32 version;
+    guint32 ntracks;
+    guint32 reserved;
+    guint64 strings_size;
+    guint64 search_size;
+} LibraryHeader;
+
+typedef struct _LibraryRecord {
+    guint32 path;                       /* Offsets into the string pool */
+    guint32 title;
+    guint32 artist;
+    guint32 album;
+    guint32 line;                       /* Offset into the search block */
+    guint32 duration_ms;
+    guint32 flags;
+    gint32 loudness;                    /* Integrated, in 1/1000 LUFS */
+    gint32 true_peak;                   /* In 1/1000 dBTP */
+    guint32 reserved;
+    gint64 mtime;
+} LibraryRecord;
+
+/* A mapped index file */
+typedef struct _LibraryIndex {
+    GMappedFile *file;
+    const LibraryHeader *header;
+    const LibraryRecord *records;
+    const gchar *strings;
+    const gchar *search;
+} LibraryIndex;
+
+/* The scanner's view of a file */
+typedef struct _LibraryTrack {
+    gchar *path;
+    gchar *title;
+    gchar *artist;
+    gchar *album;
+    guint32 duration_ms;
+    guint32 flags;
+    gint32 loudness;
+    gint32 true_peak;
+    gint64 mtime;
+    guint failures;                     /* Loudness measurements that failed, not saved */
+} LibraryTrack;
+
+/* A loudness measurement, from the meter pool */
+typedef struct _LibraryMeasurement {
+    gchar *path;
+    gint64 mtime;                       /* Of the file that was measured */
+    gboolean ok;
+    LoudnessResult result;
+} LibraryMeasurement;
+
+typedef struct _Library {
+    gchar **roots;
+    gchar *index_path;
+    LibraryChangedFunc func;
+    gpointer user_data;
+
+    LibraryIndex *index;                /* Main loop only */
+
+    /* Scanner thread only */
+    GHashTable *tracks;                 /* path -> LibraryTrack */
+    GHashTable *watches;                /* inotify wd -> directory */
+    GHashTable *dirty;                  /* Paths to discover */
+    GHashTable *seen;                   /* Paths found by the current walk */
+    GQueue *unmeasured;                 /* Paths waiting for a loudness measurement */
+    guint measured_count;               /* Since the queue was last empty */
+    gint64 measure_start;
+    gint64 saved_at;
+    int inotifyfd;
+
+    GThread *scanner;
+    GThreadPool *discoverers;
+    GAsyncQueue *discovered;            /* LibraryTrack, from the discoverers */
+    GThreadPool *meters;
+    GAsyncQueue *measured;              /* LibraryMeasurement, from the meters */
+    int stopfd;
+    gint cancel;
+} Library;
+
+static Library library;
+
+static const gchar *audio_extensions[] = {
+    ".mp3", ".ogg", ".oga", ".opus", ".flac", ".wav", ".m4a", ".aac",
+    ".mp2", ".wma", ".aif", ".aiff", NULL
+};
+
+/* Reading the index, on either side */
+
+static void index_free(LibraryIndex *index) {
+    if (NULL == index) {
+        return;
+    }
+
+    g_mapped_file_unref (index->file);
+    g_free (index);
+}
+
+/* Whether every size and offset in the mapped index stays inside it: the
+ * file may have been cut short or overwritten by something else.
+ */
+static gboolean index_valid(const gchar *contents, gsize length) {
+    const LibraryHeader *header = (const LibraryHeader *)contents;
+    const LibraryRecord *records = (const LibraryRecord *)(contents + sizeof (LibraryHeader));
+    const gchar *strings, *search;
+    gsize left;
+
+    if (length < sizeof (LibraryHeader) ||
+            0 != memcmp (header->magic, LIBRARY_MAGIC, 4) ||
+            LIBRARY_VERSION != header->version) {
+        return FALSE;
+    }
+
+    left = length - sizeof (LibraryHeader);
+    if (header->ntracks > left / sizeof (LibraryRecord)) {
+        return FALSE;
+    }
+    left -= (gsize)header->ntracks * sizeof (LibraryRecord);
+
+    /* both blocks end in a NUL, the search block is one string */
+    if (0 == header->strings_size || header->strings_size > left ||
+            header->strings_size > G_MAXUINT32 ||
+            header->search_size != left - header->strings_size ||
+            0 == header->search_size || header->search_size > G_MAXUINT32) {
+        return FALSE;
+    }
+
+    strings = contents + length - left;
+    search = strings + header->strings_size;
+    if ('\0' != strings[header->strings_size - 1] ||
+            NULL != memchr (search, '\0', header->search_size - 1) ||
+            '\0' != search[header->search_size - 1] ||
+            (header->ntracks > 0 && (header->search_size < 2 ||
+                '\n' != search[header->search_size - 2]))) {
+        return FALSE;
+    }
+
+    /* the lines are in record order, see record_at() */
+    for (guint i = 0; i < header->ntracks; i++) {
+        const LibraryRecord *record = &records[i];
+
+        if (record->path >= header->strings_size || record->title >= header->strings_size ||
+                record->artist >= header->strings_size ||
+                record->album >= header->strings_size ||
+                record->line >= header->search_size ||
+                (i > 0 && record->line < records[i - 1].line)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static LibraryIndex* index_open(const gchar *path) {
+    GMappedFile *file = g_mapped_file_new (path, FALSE, NULL);
+    const gchar *contents;
+    const LibraryHeader *header;
+    gsize records_size;
+    LibraryIndex *index;
+
+    if (NULL == file) {
+        return NULL;
+    }
+
+    contents = g_mapped_file_get_contents (file);
+    if (!index_valid (contents, g_mapped_file_get_length (file))) {
+        g_printerr ("Ignoring the damaged library index %s\n", path);
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    header = (const LibraryHeader *)contents;
+    records_size = (gsize)header->ntracks * sizeof (LibraryRecord);
+
+    index = g_new0 (LibraryIndex, 1);
+    index->file = file;
+    index->header = header;
+    index->records = (const LibraryRecord *)(contents + sizeof (LibraryHeader));
+    index->strings = contents + sizeof (LibraryHeader) + records_size;
+    index->search = index->strings + header->strings_size;
+
+    return index;
+}
+
+/* The scanner thread */
+
+static void track_free(LibraryTrack *track) {
+    g_free (track->path);
+    g_free (track->title);
+    g_free (track->artist);
+    g_free (track->album);
+    g_free (track);
+}
+
+static gboolean is_audio_file(const gchar *name) {
+    gchar *lower = g_ascii_strdown (name, -1);
+    gboolean audio = FALSE;
+
+    for (int i = 0; NULL != audio_extensions[i] && !audio; i++) {
+        audio = g_str_has_suffix (lower, audio_extensions[i]);
+    }
+
+    g_free (lower);
+    return audio;
+}
+
+/* Pick up where the last run left off */
+static void load_tracks(void) {
+    LibraryIndex *index = index_open (library.index_path);
+
+    if (NULL == index) {
+        return;
+    }
+
+    for (guint i = 0; i < index->header->ntracks; i++) {
+        const LibraryRecord *record = &index->records[i];
+        LibraryTrack *track = g_new0 (LibraryTrack, 1);
+
+        track->path = g_strdup (index->strings + record->path);
+        track->title = g_strdup (index->strings + record->title);
+        track->artist = g_strdup (index->strings + record->artist);
+        track->album = g_strdup (index->strings + record->album);
+        track->duration_ms = record->duration_ms;
+        track->flags = record->flags;
+        track->loudness = record->loudness;
+        track->true_peak = record->true_peak;
+        track->mtime = record->mtime;
+
+        g_hash_table_replace (library.tracks, track->path, track);
+    }
+
+    index_free (index);
+}
+
+static void check_file(const gchar *path, const GStatBuf *st) {
+    LibraryTrack *track = g_hash_table_lookup (library.tracks, path);
+
+    if (NULL != library.seen) {
+        g_hash_table_add (library.seen, g_strdup (path));
+    }
+
+    if (NULL == track || track->mtime != (gint64)st->st_mtime) {
+        g_hash_table_add (library.dirty, g_strdup (path));
+    }
+}
+
+/* Watch dir and everything below it, queueing new and changed files */
+static void walk(const gchar *dir) {
+    GDir *gdir = g_dir_open (dir, 0, NULL);
+    const gchar *name;
+    int wd;
+
+    if (NULL == gdir) {
+        return;
+    }
+
+    wd = inotify_add_watch (library.inotifyfd, dir, LIBRARY_WATCH_MASK);
+    if (-1 != wd) {
+        g_hash_table_replace (library.watches, GINT_TO_POINTER (wd), g_strdup (dir));
+    }
+
+    while (NULL != (name = g_dir_read_name (gdir)) && !g_atomic_int_get (&library.cancel)) {
+        gchar *path;
+        GStatBuf st;
+
+        if ('.' == name[0]) {
+            continue;
+        }
+
+        path = g_build_filename (dir, name, NULL);
+
+        /* lstat, so a symlink can't send us round in circles */
+        if (0 == g_lstat (path, &st)) {
+            if (S_ISDIR (st.st_mode)) {
+                walk (path);
+            } else if (S_ISREG (st.st_mode) && is_audio_file (name)) {
+                check_file (path, &st);
+            }
+        }
+
+        g_free (path);
+    }
+
+    g_dir_close (gdir);
+}
+
+/* Walk all roots, forgetting files that are gone */
+static void full_scan(void) {
+    GHashTableIter iter;
+    gpointer path;
+
+    library.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (int i = 0; NULL != library.roots[i]; i++) {
+        walk (library.roots[i]);
+    }
+
+    g_hash_table_iter_init (&iter, library.tracks);
+    while (g_hash_table_iter_next (&iter, &path, NULL)) {
+        if (!g_hash_table_contains (library.seen, path)) {
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+    g_hash_table_destroy (library.seen);
+    library.seen = NULL;
+}
+
+/* Runs on the discoverer pool */
+static void discover_worker(gchar *path, gpointer unused) {
+    LibraryTrack *track = g_new0 (LibraryTrack, 1);
+    GstDiscoverer *discoverer;
+    GstDiscovererInfo *info = NULL;
+    gchar *uri = g_filename_to_uri (path, NULL, NULL);
+    GStatBuf st;
+
+    track->path = path;
+    track->flags = LIBRARY_TRACK_BROKEN;
+    if (0 == g_stat (path, &st)) {
+        track->mtime = st.st_mtime;
+    }
+
+    discoverer = gst_discoverer_new (LIBRARY_DISCOVER_TIMEOUT, NULL);
+    if (NULL != discoverer && NULL != uri && !g_atomic_int_get (&library.cancel)) {
+        info = gst_discoverer_discover_uri (discoverer, uri, NULL);
+    }
+
+    if (NULL != info && GST_DISCOVERER_OK == gst_discoverer_info_get_result (info)) {
+        const GstTagList *tags = gst_discoverer_info_get_tags (info);
+
+        track->duration_ms = gst_discoverer_info_get_duration (info) / GST_MSECOND;
+        track->flags = 0;
+
+        if (NULL != tags) {
+            gst_tag_list_get_string (tags, GST_TAG_TITLE, &track->title);
+            gst_tag_list_get_string (tags, GST_TAG_ARTIST, &track->artist);
+            gst_tag_list_get_string (tags, GST_TAG_ALBUM, &track->album);
+        }
+    }
+
+    if (NULL == track->title) {
+        track->title = g_path_get_basename (path);
+    }
+
+    if (NULL != info) {
+        gst_discoverer_info_unref (info);
+    }
+    if (NULL != discoverer) {
+        g_object_unref (discoverer);
+    }
+    g_free (uri);
+
+    g_async_queue_push (library.discovered, track);
+}
+
+/* Discover the dirty files in parallel. Returns FALSE if cancelled. */
+static gboolean discover_dirty(void) {
+    GHashTableIter iter;
+    gpointer path;
+    guint pending = 0;
+    gint64 start = g_get_monotonic_time ();
+
+    g_hash_table_iter_init (&iter, library.dirty);
+    while (g_hash_table_iter_next (&iter, &path, NULL)) {
+        g_hash_table_iter_steal (&iter);
+        g_thread_pool_push (library.discoverers, path, NULL);
+        pending++;
+    }
+
+    for (guint done = 0; done < pending; ) {
+        LibraryTrack *track = g_async_queue_timeout_pop (library.discovered,
+                100 * G_TIME_SPAN_MILLISECOND);
+
+        if (g_atomic_int_get (&library.cancel)) {
+            if (NULL != track) {
+                track_free (track);
+            }
+            return FALSE;
+        }
+
+        if (NULL != track) {
+            g_hash_table_replace (library.tracks, track->path, track);
+            done++;
+        }
+    }
+
+    if (pending > 0) {
+        g_print ("Library: analysed %u files in %.1f s\n", pending,
+                (g_get_monotonic_time () - start) / 1e6);
+    }
+
+    return TRUE;
+}
+
+/* Queue every track without a loudness measurement */
+static void queue_unmeasured(void) {
+    GHashTableIter iter;
+    gpointer path, value;
+
+    g_queue_free_full (library.unmeasured, g_free);
+    library.unmeasured = g_queue_new ();
+
+    g_hash_table_iter_init (&iter, library.tracks);
+    while (g_hash_table_iter_next (&iter, &path, &value)) {
+        LibraryTrack *track = value;
+
+        if (!(track->flags & (LIBRARY_TRACK_BROKEN | LIBRARY_TRACK_MEASURED)) &&
+                track->failures < LIBRARY_MEASURE_ATTEMPTS) {
+            g_queue_push_tail (library.unmeasured, g_strdup (path));
+        }
+    }
+
+    if (0 == library.measured_count && !g_queue_is_empty (library.unmeasured)) {
+        library.measure_start = g_get_monotonic_time ();
+    }
+}
+
+/* Runs on the meter pool */
+static void measure_worker(gchar *path, gpointer unused) {
+    LibraryMeasurement *measurement = g_new0 (LibraryMeasurement, 1);
+    gchar *uri = g_filename_to_uri (path, NULL, NULL);
+    GStatBuf st;
+
+    measurement->path = path;
+    if (0 == g_stat (path, &st)) {
+        measurement->mtime = st.st_mtime;
+    }
+
+    if (NULL != uri) {
+        measurement->ok = loudness_analyse (uri, &library.cancel, &measurement->result);
+    }
+    g_free (uri);
+
+    g_async_queue_push (library.measured, measurement);
+}
+
+/* Measure the next few queued tracks, a couple per core. Returns FALSE if
+ * cancelled.
+ */
+static gboolean measure_batch(void) {
+    guint batch = 2 * g_get_num_processors ();
+    guint pending = 0;
+
+    while (pending < batch && !g_queue_is_empty (library.unmeasured)) {
+        gchar *path = g_queue_pop_head (library.unmeasured);
+        LibraryTrack *track = g_hash_table_lookup (library.tracks, path);
+
+        /* it may have gone or been replaced since it was queued */
+        if (NULL != track && !(track->flags & (LIBRARY_TRACK_BROKEN | LIBRARY_TRACK_MEASURED))) {
+            g_thread_pool_push (library.meters, path, NULL);
+            pending++;
+        } else {
+            g_free (path);
+        }
+    }
+
+    for (guint done = 0; done < pending; ) {
+        LibraryMeasurement *measurement = g_async_queue_timeout_pop (library.measured,
+                100 * G_TIME_SPAN_MILLISECOND);
+        LibraryTrack *track;
+
+        if (NULL != measurement && !g_atomic_int_get (&library.cancel)) {
+            track = g_hash_table_lookup (library.tracks, measurement->path);
+
+            if (NULL != track && track->mtime == measurement->mtime && measurement->ok) {
+                gboolean silent = !isfinite (measurement->result.integrated);
+
+                track->flags |= LIBRARY_TRACK_MEASURED;
+                track->loudness = silent ? LIBRARY_LOUDNESS_UNKNOWN :
+                    (gint32)(measurement->result.integrated * 1000);
+                track->true_peak = silent ? LIBRARY_LOUDNESS_UNKNOWN :
+                    (gint32)(measurement->result.true_peak * 1000);
+            } else if (NULL != track && track->mtime == measurement->mtime) {
+                /* a decode or I/O error may pass, try again after the others */
+                if (++track->failures < LIBRARY_MEASURE_ATTEMPTS) {
+                    g_queue_push_tail (library.unmeasured, g_strdup (measurement->path));
+                }
+            }
+            library.measured_count++;
+            done++;
+        }
+
+        if (NULL != measurement) {
+            g_free (measurement->path);
+            g_free (measurement);
+        }
+
+        if (g_atomic_int_get (&library.cancel)) {
+            return FALSE;
+        }
+    }
+
+    if (g_queue_is_empty (library.unmeasured) && library.measured_count > 0) {
+        gdouble elapsed = (g_get_monotonic_time () - library.measure_start) / 1e6;
+
+        g_print ("Library: measured the loudness of %u tracks in %.1f s, "
+                "%.2f tracks/s per core\n", library.measured_count, elapsed,
+                library.measured_count / MAX (elapsed, 1e-3) / g_get_num_processors ());
+        library.measured_count = 0;
+    }
+
+    return TRUE;
+}
+
+static guint32 pool_add(GString *pool, const gchar *str) {
+    guint32 offset = pool->len;
+
+    /* offset 0 is the empty string */
+    if (NULL == str || '\0' == str[0]) {
+        return 0;
+    }
+
+    g_string_append_len (pool, str, strlen (str) + 1);
+    return offset;
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b) {
+    return strcmp (*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+static void write_index(void) {
+    GPtrArray *paths = g_ptr_array_new ();
+    GArray *records = g_array_new (FALSE, TRUE, sizeof (LibraryRecord));
+    GString *strings = g_string_new_len ("", 1);
+    GString *search = g_string_new (NULL);
+    GByteArray *contents = g_byte_array_new ();
+    LibraryHeader header;
+    GHashTableIter iter;
+    gpointer path;
+    gchar *dir;
+
+    g_hash_table_iter_init (&iter, library.tracks);
+    while (g_hash_table_iter_next (&iter, &path, NULL)) {
+        g_ptr_array_add (paths, path);
+    }
+    g_ptr_array_sort (paths, compare_paths);
+
+    for (guint i = 0; i < paths->len; i++) {
+        LibraryTrack *track = g_hash_table_lookup (library.tracks, paths->pdata[i]);
+        LibraryRecord record;
+
+        memset (&record, 0, sizeof (record));
+        record.path = pool_add (strings, track->path);
+        record.title = pool_add (strings, track->title);
+        record.artist = pool_add (strings, track->artist);
+        record.album = pool_add (strings, track->album);
+        record.duration_ms = track->duration_ms;
+        record.flags = track->flags;
+        record.loudness = track->loudness;
+        record.true_peak = track->true_peak;
+        record.mtime = track->mtime;
+        record.line = search->len;
+
+        if (!(track->flags & LIBRARY_TRACK_BROKEN)) {
+            gchar *basename = g_path_get_basename (track->path);
+            gchar *line = g_strjoin (" ", track->artist ? track->artist : "",
+                    track->title, track->album ? track->album : "", basename, NULL);
+            gchar *folded = g_utf8_casefold (line, -1);
+
+            /* a line break inside a tag would split the line */
+            g_strdelimit (folded, "\n", ' ');
+            g_string_append (search, folded);
+
+            g_free (folded);
+            g_free (line);
+            g_free (basename);
+        }
+        g_string_append_c (search, '\n');
+
+        g_array_append_val (records, record);
+    }
+    /* the whole block is a single C string for strstr() */
+    g_string_append_c (search, '\0');
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, LIBRARY_MAGIC, 4);
+    header.version = LIBRARY_VERSION;
+    header.ntracks = records->len;
+    header.strings_size = strings->len;
+    header.search_size = search->len;
+
+    g_byte_array_append (contents, (const guint8 *)&header, sizeof (header));
+    g_byte_array_append (contents, (const guint8 *)records->data,
+            records->len * sizeof (LibraryRecord));
+    g_byte_array_append (contents, (const guint8 *)strings->str, strings->len);
+    g_byte_array_append (contents, (const guint8 *)search->str, search->len);
+
+    dir = g_path_get_dirname (library.index_path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    /* renamed into place, the main loop's mapping of the old one stays valid */
+    if (!g_file_set_contents (library.index_path, (const gchar *)contents->data,
+                contents->len, NULL)) {
+        g_printerr ("Couldn't write the library index %s\n", library.index_path);
+    }
+    library.saved_at = g_get_monotonic_time ();
+
+    g_byte_array_free (contents, TRUE);
+    g_string_free (search, TRUE);
+    g_string_free (strings, TRUE);
+    g_array_free (records, TRUE);
+    g_ptr_array_free (paths, TRUE);
+}
+
+static gboolean index_changed_cb(gpointer unused) {
+    LibraryIndex *index = index_open (library.index_path);
+
+    if (NULL != index) {
+        index_free (library.index);
+        library.index = index;
+        g_print ("Library: %u tracks\n", library_size ());
+
+        if (NULL != library.func) {
+            library.func (library.user_data);
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean forget_below(gpointer path, gpointer track, gpointer prefix) {
+    return g_str_has_prefix (path, prefix);
+}
+
+/* Returns TRUE if the index needs rewriting */
+static gboolean handle_inotify(gboolean *rescan) {
+    gchar buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    gboolean changed = FALSE;
+    ssize_t len;
+
+    while ((len = read (library.inotifyfd, buffer, sizeof (buffer))) > 0) {
+        for (gchar *p = buffer; p < buffer + len;
+                p += sizeof (struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            const gchar *dir;
+            gchar *path;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                *rescan = TRUE;
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                g_hash_table_remove (library.watches, GINT_TO_POINTER (event->wd));
+                continue;
+            }
+
+            dir = g_hash_table_lookup (library.watches, GINT_TO_POINTER (event->wd));
+            if (NULL == dir || 0 == event->len || '.' == event->name[0]) {
+                continue;
+            }
+
+            path = g_build_filename (dir, event->name, NULL);
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    walk (path);
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    gchar *prefix = g_strconcat (path, G_DIR_SEPARATOR_S, NULL);
+
+                    g_hash_table_foreach_remove (library.tracks, forget_below, prefix);
+                    g_free (prefix);
+                }
+                changed = TRUE;
+            } else if (is_audio_file (event->name)) {
+                /* a file being created shows up again once it's closed */
+                if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    g_hash_table_add (library.dirty, g_strdup (path));
+                    changed = TRUE;
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    g_hash_table_remove (library.dirty, path);
+                    g_hash_table_remove (library.tracks, path);
+                    changed = TRUE;
+                }
+            }
+
+            g_free (path);
+        }
+    }
+
+    return changed;
+}
+
+static gpointer scanner_thread(gpointer unused) {
+    struct pollfd fds[2];
+    gint64 settle_until = 0;
+    gboolean rescan = FALSE;
+
+    load_tracks ();
+    full_scan ();
+    if (!discover_dirty ()) {
+        return NULL;
+    }
+    queue_unmeasured ();
+    write_index ();
+    g_idle_add (index_changed_cb, NULL);
+
+    fds[0].fd = library.inotifyfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = library.stopfd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        gboolean measuring = !g_queue_is_empty (library.unmeasured);
+        int timeout = -1;
+
+        if (0 != settle_until) {
+            timeout = MAX (0, (settle_until - g_get_monotonic_time ()) / 1000);
+        } else if (measuring) {
+            /* only look for events between batches */
+            timeout = 0;
+        }
+
+        if (poll (fds, 2, timeout) < 0 && EINTR != errno) {
+            perror ("Library scanner");
+            return NULL;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            return NULL;
+        }
+
+        if ((fds[0].revents & POLLIN) && handle_inotify (&rescan)) {
+            settle_until = g_get_monotonic_time () + LIBRARY_SETTLE_MS * 1000;
+        } else if (0 != settle_until && g_get_monotonic_time () >= settle_until) {
+            settle_until = 0;
+
+            if (rescan) {
+                /* inotify lost events, fall back to comparing mtimes */
+                rescan = FALSE;
+                full_scan ();
+            }
+
+            if (!discover_dirty ()) {
+                return NULL;
+            }
+            queue_unmeasured ();
+            write_index ();
+            g_idle_add (index_changed_cb, NULL);
+        } else if (0 == settle_until && measuring) {
+            if (!measure_batch ()) {
+                return NULL;
+            }
+
+            if (g_queue_is_empty (library.unmeasured) || g_get_monotonic_time () -
+                    library.saved_at > LIBRARY_SAVE_INTERVAL_S * G_USEC_PER_SEC) {
+                write_index ();
+                g_idle_add (index_changed_cb, NULL);
+            }
+        }
+
+        if (rescan && 0 == settle_until) {
+            settle_until = g_get_monotonic_time () + LIBRARY_SETTLE_MS * 1000;
+        }
+    }
+}
+
+/* Index the given folders in the background. The last index is available
+ * right away, func is called whenever a newer one replaces it.
+ */
+void library_init(gchar **roots, LibraryChangedFunc func, gpointer user_data) {
+    gchar *cwd = g_get_current_dir ();
+    guint n = g_strv_length (roots);
+
+    library.roots = g_new0 (gchar *, n + 1);
+    for (guint i = 0; i < n; i++) {
+        library.roots[i] = g_path_is_absolute (roots[i]) ?
+            g_strdup (roots[i]) : g_build_filename (cwd, roots[i], NULL);
+    }
+    g_free (cwd);
+
+    library.func = func;
+    library.user_data = user_data;
+    library.index_path = g_build_filename (g_get_user_cache_dir (), "4deckradio",
+            "library.idx", NULL);
+    library.index = index_open (library.index_path);
+
+    library.tracks = g_hash_table_new_full (g_str_hash, g_str_equal,
+            NULL, (GDestroyNotify)track_free);
+    library.watches = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    library.dirty = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    library.unmeasured = g_queue_new ();
+
+    library.inotifyfd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    library.stopfd = eventfd (0, EFD_CLOEXEC);
+
+    library.discovered = g_async_queue_new ();
+    library.discoverers = g_thread_pool_new ((GFunc)discover_worker, NULL,
+            g_get_num_processors (), FALSE, NULL);
+    library.measured = g_async_queue_new ();
+    library.meters = g_thread_pool_new ((GFunc)measure_worker, NULL,
+            g_get_num_processors (), FALSE, NULL);
+
+    library.scanner = g_thread_new ("library", scanner_thread, NULL);
+}
+
+void library_shutdown(void) {
+    guint64 one = 1;
+
+    if (NULL == library.scanner) {
+        return;
+    }
+
+    g_atomic_int_set (&library.cancel, TRUE);
+    if (sizeof (one) != write (library.stopfd, &one, sizeof (one))) {
+        perror ("Couldn't stop the library scanner");
+    }
+    g_thread_join (library.scanner);
+    library.scanner = NULL;
+
+    /* unanalysed files are picked up again next time */
+    g_thread_pool_free (library.discoverers, TRUE, TRUE);
+    g_async_queue_unref (library.discovered);
+    g_thread_pool_free (library.meters, TRUE, TRUE);
+    g_async_queue_unref (library.measured);
+
+    close (library.inotifyfd);
+    close (library.stopfd);
+
+    g_queue_free_full (library.unmeasured, g_free);
+    g_hash_table_destroy (library.dirty);
+    g_hash_table_destroy (library.watches);
+    g_hash_table_destroy (library.tracks);
+    index_free (library.index);
+    library.index = NULL;
+
+    g_strfreev (library.roots);
+    g_free (library.index_path);
+}
+
+/* The main loop side */
+
+gboolean library_is_enabled(void) {
+    return (NULL != library.roots);
+}
+
+guint library_size(void) {
+    return (NULL != library.index) ? library.index->header->ntracks : 0;
+}
+
+/* The record whose line contains offset */
+static guint record_at(const LibraryIndex *index, guint32 offset) {
+    guint low = 0, high = index->header->ntracks - 1;
+
+    while (low < high) {
+        guint mid = (low + high + 1) / 2;
+
+        if (index->records[mid].line <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return low;
+}
+
+static gboolean line_contains(const gchar *line, const gchar *end, const gchar *token) {
+    gsize len = strlen (token);
+
+    for (const gchar *p = line; p + len <= end; p++) {
+        if (0 == memcmp (p, token, len)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Tracks matching every word of query, in path order. Returns how many
+ * were stored in results.
+ */
+guint library_search(const gchar *query, guint *results, guint max_results) {
+    const LibraryIndex *index = library.index;
+    gchar *folded;
+    gchar **tokens;
+    const gchar *key = NULL;
+    const gchar *pos;
+    guint n = 0;
+
+    if (NULL == index || 0 == index->header->ntracks) {
+        return 0;
+    }
+
+    folded = g_utf8_casefold (query, -1);
+    tokens = g_strsplit_set (folded, " \t", -1);
+    g_free (folded);
+
+    /* the longest word gives the fewest candidates */
+    for (int i = 0; NULL != tokens[i]; i++) {
+        if (NULL == key || strlen (tokens[i]) > strlen (key)) {
+            key = tokens[i];
+        }
+    }
+
+    if (NULL == key || '\0' == key[0]) {
+        g_strfreev (tokens);
+        return 0;
+    }
+
+    pos = index->search;
+    while (n < max_results) {
+        const gchar *hit = strstr (pos, key);
+        const gchar *line, *end;
+        guint track;
+        gboolean match = TRUE;
+
+        if (NULL == hit) {
+            break;
+        }
+
+        track = record_at (index, hit - index->search);
+        line = index->search + index->records[track].line;
+        end = strchr (hit, '\n');
+
+        for (int i = 0; NULL != tokens[i] && match; i++) {
+            match = ('\0' == tokens[i][0]) || line_contains (line, end, tokens[i]);
+        }
+
+        if (match) {
+            results[n++] = track;
+        }
+
+        pos = end + 1;
+    }
+
+    g_strfreev (tokens);
+    return n;
+}
+
+/* The loudness of the file behind uri, if the library measured it */
+gboolean library_lookup_loudness(const gchar *uri, gdouble *loudness, gdouble *true_peak) {
+    const LibraryIndex *index = library.index;
+    gchar *path;
+    guint low = 0, high;
+    gboolean found = FALSE;
+
+    if (NULL == index || NULL == (path = g_filename_from_uri (uri, NULL, NULL))) {
+        return FALSE;
+    }
+
+    /* the records are sorted by path */
+    high = index->header->ntracks;
+    while (low < high) {
+        guint mid = (low + high) / 2;
+        const LibraryRecord *record = &index->records[mid];
+        gint cmp = strcmp (path, index->strings + record->path);
+
+        if (0 == cmp) {
+            found = (record->flags & LIBRARY_TRACK_MEASURED) &&
+                LIBRARY_LOUDNESS_UNKNOWN != record->loudness;
+            if (found) {
+                *loudness = record->loudness / 1000.0;
+                *true_peak = record->true_peak / 1000.0;
+            }
+            break;
+        } else if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    g_free (path);
+    return found;
+}
+
+gchar* library_track_uri(guint track) {
+    const LibraryIndex *index = library.index;
+
+    return g_filename_to_uri (index->strings + index->records[track].path, NULL, NULL);
+}
+
+const gchar* library_track_title(guint track) {
+    return library.index->strings + library.index->records[track].title;
+}
+
+const gchar* library_track_artist(guint track) {
+    return library.index->strings + library.index->records[track].artist;
+}
+
+const gchar* library_track_album(guint track) {
+    return library.index->strings + library.index->records[track].album;
+}
+
+guint32 library_track_duration_ms(guint track) {
+    return library.index->records[track].duration_ms;
+}
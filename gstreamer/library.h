@@ -0,0 +1,23 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _LIBRARY_H
+#define _LIBRARY_H
+
+/* Called on the main loop whenever a new index has been mapped */
+typedef void (*LibraryChangedFunc) (gpointer user_data);
+
+void library_init(gchar **roots, LibraryChangedFunc func, gpointer user_data);
+void library_shutdown(void);
+gboolean library_is_enabled(void);
+guint library_size(void);
+guint library_search(const gchar *query, guint *results, guint max_results);
+gchar* library_track_uri(guint track);
+const gchar* library_track_title(guint track);
+const gchar* library_track_artist(guint track);
+const gchar* library_track_album(guint track);
+guint32 library_track_duration_ms(guint track);
+gboolean library_lookup_loudness(const gchar *uri, gdouble *loudness, gdouble *true_peak);
+
+#endif /* _LIBRARY_H */
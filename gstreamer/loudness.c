@@ -0,0 +1,292 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include <gst/gst.h>
+#if GST_VERSION_MAJOR != (0)
+#include <gst/app/gstappsink.h>
+#endif
+#include "loudness.h"
+#include "resample.h"
+
+/*
+ * Offline loudness measurement after ITU-R BS.1770 / EBU R128.
+ *
+ * The file is decoded the way a deck plays it (stereo) at 48 kHz, so the
+ * K-weighting filters can use the coefficients from the standard. The mean
+ * square of every 100 ms goes into a list; integrated loudness is gated
+ * over the overlapping 400 ms blocks built from it afterwards. The true
+ * peak is the highest sample after 4x oversampling.
+ *
+ * Nothing here keeps state between calls, any number of threads can
+ * measure at once.
+ */
+
+#define LOUDNESS_RATE 48000
+#define LOUDNESS_SEGMENT_FRAMES (LOUDNESS_RATE / 10)   /* 100 ms */
+#define LOUDNESS_BLOCK_SEGMENTS 4                       /* 400 ms blocks, 75% overlap */
+#define LOUDNESS_ABSOLUTE_GATE (-70.0)
+#define LOUDNESS_RELATIVE_GATE (-10.0)
+#define LOUDNESS_MAX_BOOST_DB 12.0
+#define LOUDNESS_OVERSAMPLE 4
+#define LOUDNESS_TP_TAPS 12                             /* Per oversampling phase */
+
+typedef struct _Biquad {
+    gdouble b0, b1, b2, a1, a2;
+    gdouble z1, z2;
+} Biquad;
+
+typedef struct _Meter {
+    Biquad shelf[2];                /* K-weighting, per channel */
+    Biquad highpass[2];
+    gdouble segment_sum;
+    guint segment_frames;
+    GArray *segments;               /* gdouble mean square per 100 ms */
+
+    gfloat history[2][2 * LOUDNESS_TP_TAPS];    /* Doubled, so the taps are contiguous */
+    guint history_pos;
+    gdouble peak;                   /* Linear, oversampled */
+} Meter;
+
+/* BS.1770 stage 1 (high shelf) and stage 2 (high pass), at 48 kHz */
+static const Biquad shelf_48k = {
+    1.53512485958697, -2.69169618940638, 1.19839281085285,
+    -1.69065929318241, 0.73248077421585, 0, 0
+};
+static const Biquad highpass_48k = {
+    1.0, -2.0, 1.0,
+    -1.99004745483398, 0.99007225036621, 0, 0
+};
+
+static gdouble tp_coeffs[LOUDNESS_OVERSAMPLE][LOUDNESS_TP_TAPS];
+
+/* Windowed sinc interpolator, split into one filter per phase */
+static gpointer init_true_peak(gpointer unused) {
+    const guint taps = LOUDNESS_OVERSAMPLE * LOUDNESS_TP_TAPS;
+
+    for (guint k = 0; k < taps; k++) {
+        gdouble t = (k - (taps - 1) / 2.0) / LOUDNESS_OVERSAMPLE;
+        gdouble sinc = (0.0 == t) ? 1.0 : sin (G_PI * t) / (G_PI * t);
+        gdouble window = 0.5 - 0.5 * cos (2 * G_PI * (k + 0.5) / taps);
+
+        tp_coeffs[k % LOUDNESS_OVERSAMPLE][k / LOUDNESS_OVERSAMPLE] = sinc * window;
+    }
+
+    /* unity gain in every phase, so a full scale DC doesn't overshoot */
+    for (guint p = 0; p < LOUDNESS_OVERSAMPLE; p++) {
+        gdouble sum = 0;
+
+        for (guint j = 0; j < LOUDNESS_TP_TAPS; j++) {
+            sum += tp_coeffs[p][j];
+        }
+        for (guint j = 0; j < LOUDNESS_TP_TAPS; j++) {
+            tp_coeffs[p][j] /= sum;
+        }
+    }
+
+    return NULL;
+}
+
+static inline gdouble biquad_run(Biquad *f, gdouble x) {
+    gdouble y = f->b0 * x + f->z1;
+
+    f->z1 = f->b1 * x - f->a1 * y + f->z2;
+    f->z2 = f->b2 * x - f->a2 * y;
+    return y;
+}
+
+static inline void true_peak_run(Meter *meter, guint channel, gfloat x) {
+    gfloat *window = &meter->history[channel][meter->history_pos];
+
+    window[0] = window[LOUDNESS_TP_TAPS] = x;
+
+    for (guint p = 0; p < LOUDNESS_OVERSAMPLE; p++) {
+        gdouble y = 0;
+
+        for (guint j = 0; j < LOUDNESS_TP_TAPS; j++) {
+            y += tp_coeffs[p][j] * window[j];
+        }
+        meter->peak = MAX (meter->peak, fabs (y));
+    }
+}
+
+static void meter_run(Meter *meter, const gfloat *samples, gsize frames) {
+    for (gsize i = 0; i < frames; i++) {
+        /* the newest sample goes in front of the previous ones */
+        meter->history_pos = (0 == meter->history_pos) ?
+            LOUDNESS_TP_TAPS - 1 : meter->history_pos - 1;
+
+        for (guint c = 0; c < 2; c++) {
+            gfloat x = samples[2 * i + c];
+            gdouble k = biquad_run (&meter->highpass[c], biquad_run (&meter->shelf[c], x));
+
+            meter->segment_sum += k * k;
+            meter->peak = MAX (meter->peak, fabsf (x));
+            true_peak_run (meter, c, x);
+        }
+
+        if (++meter->segment_frames == LOUDNESS_SEGMENT_FRAMES) {
+            gdouble mean_square = meter->segment_sum / LOUDNESS_SEGMENT_FRAMES;
+
+            g_array_append_val (meter->segments, mean_square);
+            meter->segment_sum = 0;
+            meter->segment_frames = 0;
+        }
+    }
+}
+
+static inline gdouble to_lufs(gdouble mean_square) {
+    return -0.691 + 10 * log10 (mean_square);
+}
+
+/* Two pass gating over the 400 ms blocks. FALSE if nothing is above the
+ * absolute gate (silence, or shorter than a block).
+ */
+static gboolean integrate(const GArray *segments, gdouble *lufs) {
+    const gdouble *seg = (const gdouble *)segments->data;
+    gdouble gate = pow (10, (LOUDNESS_ABSOLUTE_GATE + 0.691) / 10);
+    guint nblocks = (segments->len >= LOUDNESS_BLOCK_SEGMENTS) ?
+        segments->len - LOUDNESS_BLOCK_SEGMENTS + 1 : 0;
+
+    for (guint pass = 0; pass < 2; pass++) {
+        gdouble sum = 0;
+        guint count = 0;
+
+        for (guint b = 0; b < nblocks; b++) {
+            gdouble z = (seg[b] + seg[b + 1] + seg[b + 2] + seg[b + 3]) / LOUDNESS_BLOCK_SEGMENTS;
+
+            if (z > gate) {
+                sum += z;
+                count++;
+            }
+        }
+
+        if (0 == count) {
+            return FALSE;
+        }
+
+        if (0 == pass) {
+            gate = MAX (gate, sum / count * pow (10, LOUDNESS_RELATIVE_GATE / 10));
+        } else {
+            *lufs = to_lufs (sum / count);
+        }
+    }
+
+    return TRUE;
+}
+
+#if GST_VERSION_MAJOR == (0)
+gboolean loudness_analyse(const gchar *uri, gint *cancel, LoudnessResult *result) {
+    return FALSE;
+}
+#else
+/* Decode uri as fast as possible and measure it. Blocks until done, or
+ * until *cancel gets set. FALSE if it couldn't be decoded; all silence
+ * is a measurement, with -INFINITY for the loudness.
+ */
+gboolean loudness_analyse(const gchar *uri, gint *cancel, LoudnessResult *result) {
+    static GOnce once = G_ONCE_INIT;
+    GstElement *pipeline, *decoder, *sink;
+    GstBus *bus;
+    GError *error = NULL;
+    gchar *description;
+    gboolean ok = TRUE;
+    Meter meter;
+
+    g_once (&once, init_true_peak, NULL);
+
+    memset (&meter, 0, sizeof (meter));
+    for (guint c = 0; c < 2; c++) {
+        meter.shelf[c] = shelf_48k;
+        meter.highpass[c] = highpass_48k;
+    }
+
+    description = g_strdup_printf ("uridecodebin name=decoder ! audioconvert ! "
+            "audioresample quality=%d ! "
+            "audio/x-raw, format=(string)%s, rate=(int)%d, channels=(int)2 ! "
+            "appsink name=sink sync=false",
+            resample_get_gst_quality (resample_get_quality (-1, RESAMPLE_CLASS_ANALYSIS)),
+            G_BYTE_ORDER == G_BIG_ENDIAN ? "F32BE" : "F32LE", LOUDNESS_RATE);
+    pipeline = gst_parse_launch (description, &error);
+    g_free (description);
+    if (NULL == pipeline) {
+        g_printerr ("Couldn't create loudness decoder: %s\n", error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+
+    meter.segments = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+    decoder = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    g_object_set (decoder, "uri", uri, NULL);
+    bus = gst_element_get_bus (pipeline);
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+    while (!g_atomic_int_get (cancel)) {
+        GstSample *sample = gst_app_sink_try_pull_sample (GST_APP_SINK (sink),
+                100 * GST_MSECOND);
+        GstMessage *msg;
+
+        if (NULL != sample) {
+            GstBuffer *buffer = gst_sample_get_buffer (sample);
+            GstMapInfo map;
+
+            if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+                meter_run (&meter, (const gfloat *)map.data, map.size / (2 * sizeof (gfloat)));
+                gst_buffer_unmap (buffer, &map);
+            }
+            gst_sample_unref (sample);
+            continue;
+        }
+
+        if (gst_app_sink_is_eos (GST_APP_SINK (sink))) {
+            break;
+        }
+
+        msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+        if (NULL != msg) {
+            gst_message_parse_error (msg, &error, NULL);
+            g_printerr ("Couldn't measure %s: %s\n", uri, error->message);
+            g_clear_error (&error);
+            gst_message_unref (msg);
+            ok = FALSE;
+            break;
+        }
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (bus);
+    gst_object_unref (sink);
+    gst_object_unref (decoder);
+    gst_object_unref (pipeline);
+
+    ok = ok && !g_atomic_int_get (cancel);
+    if (ok) {
+        /* nothing above the gate */
+        if (!integrate (meter.segments, &result->integrated)) {
+            result->integrated = -INFINITY;
+        }
+        result->true_peak = 20 * log10 (MAX (meter.peak, 1e-10));
+    }
+
+    g_array_free (meter.segments, TRUE);
+    return ok;
+}
+#endif
+
+/* The linear gain that brings a track to the target loudness, as far as
+ * its true peak allows
+ */
+gdouble loudness_gain(gdouble integrated, gdouble true_peak) {
+    gdouble gain_db = LOUDNESS_TARGET_LUFS - integrated;
+
+    gain_db = MIN (gain_db, LOUDNESS_MAX_TRUE_PEAK_DBTP - true_peak);
+    gain_db = MIN (gain_db, LOUDNESS_MAX_BOOST_DB);
+
+    return pow (10, gain_db / 20);
+}
@@ -0,0 +1,20 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _LOUDNESS_H
+#define _LOUDNESS_H
+
+/* What EBU R128 asks for */
+#define LOUDNESS_TARGET_LUFS (-23.0)
+#define LOUDNESS_MAX_TRUE_PEAK_DBTP (-1.0)
+
+typedef struct _LoudnessResult {
+    gdouble integrated;             /* Gated loudness, LUFS, -INFINITY if silent */
+    gdouble true_peak;              /* dBTP */
+} LoudnessResult;
+
+gboolean loudness_analyse(const gchar *uri, gint *cancel, LoudnessResult *result);
+gdouble loudness_gain(gdouble integrated, gdouble true_peak);
+
+#endif /* _LOUDNESS_H */
@@ -0,0 +1,447 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "deck.h"
+#include "engine.h"
+#include "metrics.h"
+
+/*
+ * Per deck counters and histograms, scraped over a Unix domain socket.
+ *
+ * Everything that counts (the deck state machine on the main loop, the
+ * deck workers, the bus sync handlers and buffer probes on the streaming
+ * threads) only does atomic adds on a DeckMetrics. The scraper thread
+ * reads them the same way, so a scrape never takes a lock anybody else
+ * could be waiting for.
+ *
+ * Every connection gets one report in the Prometheus text format and is
+ * closed. Clients that start with an HTTP request get a response header
+ * first, so both of these work:
+ *
+ *     socat - UNIX-CONNECT:/run/user/1000/4deckradio.metrics
+ *     curl --unix-socket /run/user/1000/4deckradio.metrics http://localhost/metrics
+ */
+
+#define METRICS_PREFIX "fourdeckradio_"
+#define METRICS_REQUEST_TIMEOUT_MS 100
+
+typedef struct _MetricsServer {
+    gchar *path;
+    int listenfd;
+    int stopfd;
+    GThread *thread;
+    CustomData *decks;
+    guint ndecks;
+} MetricsServer;
+
+static MetricsServer server = { .listenfd = -1, .stopfd = -1 };
+
+/* Upper bounds, in microseconds */
+static const gint64 bucket_bounds[METRICS_NUM_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+
+static const DeckState transitional_states[] = {
+    DECK_LOADING, DECK_STARTING, DECK_PAUSING, DECK_STOPPING
+};
+
+void metrics_observe(MetricsHistogram *histogram, gint64 us) {
+    guint i = 0;
+
+    while (i < METRICS_NUM_BUCKETS && us > bucket_bounds[i]) {
+        i++;
+    }
+
+    g_atomic_int_inc (&histogram->buckets[i]);
+    g_atomic_pointer_add (&histogram->sum_us, (gssize)us);
+}
+
+void metrics_timer_start(MetricsTimer *timer) {
+    g_atomic_int_set (&timer->started, (gint)g_get_monotonic_time ());
+    g_atomic_int_set (&timer->pending, TRUE);
+}
+
+/* Only the first stop after a start counts */
+void metrics_timer_stop(MetricsTimer *timer, MetricsHistogram *histogram) {
+    if (g_atomic_int_compare_and_exchange (&timer->pending, TRUE, FALSE)) {
+        guint elapsed = (guint)g_get_monotonic_time () -
+            (guint)g_atomic_int_get (&timer->started);
+
+        metrics_observe (histogram, elapsed);
+    }
+}
+
+void metrics_timer_cancel(MetricsTimer *timer) {
+    g_atomic_int_set (&timer->pending, FALSE);
+}
+
+/* Runs on whichever thread posts, before the message is queued */
+#if GST_VERSION_MAJOR == (0)
+static GstBusSyncReply bus_sync_handler(GstBus *bus, GstMessage *msg, ChainMetrics *metrics) {
+#else
+static GstBusSyncReply bus_sync_handler(GstBus *bus, GstMessage *msg, gpointer user_data) {
+    ChainMetrics *metrics = user_data;
+#endif
+    g_atomic_int_inc (&metrics->deck->bus_messages);
+
+    /* a preroll, or the re-preroll after a flushing seek */
+    if (GST_MESSAGE_ASYNC_DONE == GST_MESSAGE_TYPE (msg)) {
+        metrics_timer_stop (&metrics->preroll, &metrics->deck->preroll);
+        metrics_timer_stop (&metrics->seek, &metrics->deck->seek);
+    }
+
+    return GST_BUS_PASS;
+}
+
+#if GST_VERSION_MAJOR != (0)
+static gint64 thread_cpu_us(void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* The streaming thread's CPU time from one buffer to the next is decoding
+ * this one and pushing the last one down to the sink. Task threads go
+ * back to a shared pool when a stream stops, so start over on every new
+ * stream and after flushes.
+ */
+static GstPadProbeReturn cpu_probe(GstPad *pad, GstPadProbeInfo *info, ChainMetrics *metrics) {
+    GThread *self = g_thread_self ();
+    gint64 now;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEventType type = GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info));
+
+        if (GST_EVENT_FLUSH_STOP == type || GST_EVENT_STREAM_START == type) {
+            metrics->cpu_thread = NULL;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    metrics_timer_stop (&metrics->first_audio, &metrics->deck->first_audio);
+    metrics_timer_stop (&metrics->follow_on, &metrics->deck->follow_on);
+
+    now = thread_cpu_us ();
+    if (metrics->cpu_thread == self) {
+        g_atomic_pointer_add (&metrics->deck->decode_cpu_us, (gssize)(now - metrics->cpu_last));
+    }
+    metrics->cpu_thread = self;
+    metrics->cpu_last = now;
+
+    return GST_PAD_PROBE_OK;
+}
+#endif
+
+/* Count what goes over bus, and the decoding done in front of pad */
+ChainMetrics* metrics_chain_new(DeckMetrics *deck, GstBus *bus, GstPad *pad) {
+    ChainMetrics *metrics = g_new0 (ChainMetrics, 1);
+
+    metrics->deck = deck;
+
+#if GST_VERSION_MAJOR == (0)
+    gst_bus_set_sync_handler (bus, (GstBusSyncHandler)bus_sync_handler, metrics);
+#else
+    gst_bus_set_sync_handler (bus, bus_sync_handler, metrics, NULL);
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+            (GstPadProbeCallback)cpu_probe, metrics, NULL);
+#endif
+
+    return metrics;
+}
+
+/* Only after the pipeline is gone */
+void metrics_chain_free(ChainMetrics *metrics) {
+    g_free (metrics);
+}
+
+static void append_histogram(GString *out, const gchar *name, const gchar *labels,
+        MetricsHistogram *histogram) {
+    gint count = 0;
+
+    for (guint i = 0; i <= METRICS_NUM_BUCKETS; i++) {
+        count += g_atomic_int_get (&histogram->buckets[i]);
+
+        if (i < METRICS_NUM_BUCKETS) {
+            g_string_append_printf (out, METRICS_PREFIX "%s_bucket{%s,le=\"%g\"} %d\n",
+                    name, labels, bucket_bounds[i] / 1e6, count);
+        } else {
+            g_string_append_printf (out, METRICS_PREFIX "%s_bucket{%s,le=\"+Inf\"} %d\n",
+                    name, labels, count);
+        }
+    }
+
+    g_string_append_printf (out, METRICS_PREFIX "%s_sum{%s} %.6f\n", name, labels,
+            (gssize)g_atomic_pointer_get (&histogram->sum_us) / 1e6);
+    g_string_append_printf (out, METRICS_PREFIX "%s_count{%s} %d\n", name, labels, count);
+}
+
+static void append_header(GString *out, const gchar *name, const gchar *type,
+        const gchar *help) {
+    g_string_append_printf (out, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+    g_string_append_printf (out, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+}
+
+static GString* build_report(void) {
+    GString *out = g_string_sized_new (16384);
+    gint xruns = engine_get_xruns ();
+
+    append_header (out, "deck_state", "gauge", "1 for the state the deck is in");
+    for (guint d = 0; d < server.ndecks; d++) {
+        DeckState state = g_atomic_int_get ((gint *)&server.decks[d].deckstate);
+
+        g_string_append_printf (out, METRICS_PREFIX "deck_state{deck=\"%u\",state=\"%s\"} 1\n",
+                d + 1, deck_state_get_name (state));
+    }
+
+    append_header (out, "transition_seconds", "histogram",
+            "Time spent in a transitional deck state");
+    for (guint d = 0; d < server.ndecks; d++) {
+        for (guint i = 0; i < G_N_ELEMENTS (transitional_states); i++) {
+            DeckState state = transitional_states[i];
+            gchar *labels = g_strdup_printf ("deck=\"%u\",state=\"%s\"", d + 1,
+                    deck_state_get_name (state));
+
+            append_histogram (out, "transition_seconds", labels,
+                    &server.decks[d].metrics->transitions[state]);
+            g_free (labels);
+        }
+    }
+
+    append_header (out, "preroll_seconds", "histogram",
+            "From leaving READY to prerolled, current and queued files");
+    for (guint d = 0; d < server.ndecks; d++) {
+        gchar *labels = g_strdup_printf ("deck=\"%u\"", d + 1);
+
+        append_histogram (out, "preroll_seconds", labels, &server.decks[d].metrics->preroll);
+        g_free (labels);
+    }
+
+    append_header (out, "seek_seconds", "histogram",
+            "From a flushing seek to prerolled at the new position");
+    for (guint d = 0; d < server.ndecks; d++) {
+        gchar *labels = g_strdup_printf ("deck=\"%u\"", d + 1);
+
+        append_histogram (out, "seek_seconds", labels, &server.decks[d].metrics->seek);
+        g_free (labels);
+    }
+
+    append_header (out, "stream_first_audio_seconds", "histogram",
+            "From connecting to a network stream to its first decoded audio");
+    for (guint d = 0; d < server.ndecks; d++) {
+        gchar *labels = g_strdup_printf ("deck=\"%u\"", d + 1);
+
+        append_histogram (out, "stream_first_audio_seconds", labels,
+                &server.decks[d].metrics->first_audio);
+        g_free (labels);
+    }
+
+    append_header (out, "stream_reconnect_seconds", "histogram",
+            "From a stream dropping on air to playing again");
+    for (guint d = 0; d < server.ndecks; d++) {
+        gchar *labels = g_strdup_printf ("deck=\"%u\"", d + 1);
+
+        append_histogram (out, "stream_reconnect_seconds", labels,
+                &server.decks[d].metrics->reconnect);
+        g_free (labels);
+    }
+
+    append_header (out, "follow_on_seconds", "histogram",
+            "From a playlist file ending to the next one's first decoded audio");
+    for (guint d = 0; d < server.ndecks; d++) {
+        gchar *labels = g_strdup_printf ("deck=\"%u\"", d + 1);
+
+        append_histogram (out, "follow_on_seconds", labels, &server.decks[d].metrics->follow_on);
+        g_free (labels);
+    }
+
+    append_header (out, "stream_drops_total", "counter", "Streams lost while on air");
+    for (guint d = 0; d < server.ndecks; d++) {
+        g_string_append_printf (out, METRICS_PREFIX "stream_drops_total{deck=\"%u\"} %d\n",
+                d + 1, g_atomic_int_get (&server.decks[d].metrics->stream_drops));
+    }
+
+    append_header (out, "decode_cpu_seconds_total", "counter",
+            "CPU time of the streaming threads");
+    for (guint d = 0; d < server.ndecks; d++) {
+        g_string_append_printf (out, METRICS_PREFIX "decode_cpu_seconds_total{deck=\"%u\"} %.6f\n",
+                d + 1, (gssize)g_atomic_pointer_get (&server.decks[d].metrics->decode_cpu_us) / 1e6);
+    }
+
+    append_header (out, "queue_swaps_total", "counter", "Queued files swapped in");
+    for (guint d = 0; d < server.ndecks; d++) {
+        g_string_append_printf (out, METRICS_PREFIX "queue_swaps_total{deck=\"%u\"} %d\n",
+                d + 1, g_atomic_int_get (&server.decks[d].metrics->swaps));
+    }
+
+    append_header (out, "bus_messages_total", "counter", "Messages posted on both buses");
+    for (guint d = 0; d < server.ndecks; d++) {
+        g_string_append_printf (out, METRICS_PREFIX "bus_messages_total{deck=\"%u\"} %d\n",
+                d + 1, g_atomic_int_get (&server.decks[d].metrics->bus_messages));
+    }
+
+    /* the engine's rings are the only buffers we can see run dry */
+    if (engine_is_running ()) {
+        append_header (out, "underruns_total", "counter",
+                "Engine periods the deck's ring couldn't fill");
+        for (guint d = 0; d < server.ndecks; d++) {
+            g_string_append_printf (out, METRICS_PREFIX "underruns_total{deck=\"%u\"} %d\n",
+                    d + 1, engine_get_underruns (d));
+        }
+    }
+
+    if (xruns >= 0) {
+        append_header (out, "jack_xruns_total", "counter", "xruns reported by jackd");
+        g_string_append_printf (out, METRICS_PREFIX "jack_xruns_total %d\n", xruns);
+    }
+
+    return out;
+}
+
+static void write_all(int fd, const gchar *data, gsize length) {
+    while (length > 0) {
+        ssize_t written = send (fd, data, length, MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+static void serve(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    gchar request[256];
+    ssize_t length = 0;
+    GString *report;
+
+    /* plain readers send nothing, don't wait long for them */
+    if (poll (&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0) {
+        length = recv (fd, request, sizeof (request), MSG_DONTWAIT);
+    }
+
+    report = build_report ();
+    if (length >= 4 && 0 == memcmp (request, "GET ", 4)) {
+        gchar *header = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n", report->len);
+
+        write_all (fd, header, strlen (header));
+        g_free (header);
+    }
+    write_all (fd, report->str, report->len);
+
+    g_string_free (report, TRUE);
+}
+
+static gpointer server_thread(gpointer unused) {
+    struct pollfd fds[2];
+
+    fds[0].fd = server.listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server.stopfd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        int fd;
+
+        if (poll (fds, 2, -1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror ("Metrics server");
+            return NULL;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            return NULL;
+        }
+
+        fd = accept (server.listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve (fd);
+        close (fd);
+    }
+}
+
+/* Serve the metrics of the decks on a Unix socket at path. Call after
+ * the decks are set up.
+ */
+gboolean metrics_init(const gchar *path, CustomData *decks, guint ndecks) {
+    struct sockaddr_un addr;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        g_printerr ("Metrics socket path too long: %s\n", path);
+        return FALSE;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    server.listenfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listenfd < 0) {
+        perror ("Couldn't create the metrics socket");
+        return FALSE;
+    }
+
+    /* left over from a crash */
+    g_unlink (path);
+    if (0 != bind (server.listenfd, (struct sockaddr *)&addr, sizeof (addr)) ||
+            0 != listen (server.listenfd, 8)) {
+        g_printerr ("Couldn't listen on %s: %s\n", path, g_strerror (errno));
+        close (server.listenfd);
+        server.listenfd = -1;
+        return FALSE;
+    }
+
+    server.path = g_strdup (path);
+    server.decks = decks;
+    server.ndecks = ndecks;
+    server.stopfd = eventfd (0, EFD_CLOEXEC);
+    server.thread = g_thread_new ("metrics", server_thread, NULL);
+
+    g_print ("Metrics on %s\n", path);
+    return TRUE;
+}
+
+/* Before the decks go away */
+void metrics_shutdown(void) {
+    guint64 one = 1;
+
+    if (NULL == server.thread) {
+        return;
+    }
+
+    if (sizeof (one) != write (server.stopfd, &one, sizeof (one))) {
+        perror ("Couldn't stop the metrics server");
+    }
+    g_thread_join (server.thread);
+    server.thread = NULL;
+
+    close (server.listenfd);
+    close (server.stopfd);
+    g_unlink (server.path);
+    g_free (server.path);
+    server.path = NULL;
+}
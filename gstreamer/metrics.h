@@ -0,0 +1,56 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#define METRICS_NUM_BUCKETS 13
+
+/* Fixed buckets, each counted on its own. Cumulated only when scraped. */
+typedef struct _MetricsHistogram {
+    gint buckets[METRICS_NUM_BUCKETS + 1];  /* The last one is +Inf */
+    gssize sum_us;
+} MetricsHistogram;
+
+/* Started on one thread, stopped on another */
+typedef struct _MetricsTimer {
+    gint pending;
+    gint started;                   /* Monotonic microseconds, wraps */
+} MetricsTimer;
+
+/* Written from any thread with atomic adds, never locked */
+typedef struct _DeckMetrics {
+    MetricsHistogram transitions[DECK_NUM_STATES];  /* Time in each transitional state */
+    MetricsHistogram preroll;       /* READY -> PAUSED of either chain */
+    MetricsHistogram seek;          /* Flushing seek -> ASYNC_DONE */
+    MetricsHistogram first_audio;   /* Stream URI set -> first decoded buffer */
+    MetricsHistogram reconnect;     /* Stream on air dropped -> PLAYING again */
+    MetricsHistogram follow_on;     /* Playlist file ended -> next one's first buffer */
+    gssize decode_cpu_us;           /* Of the streaming threads */
+    gint swaps;                     /* Queued file swapped in */
+    gint stream_drops;              /* Streams lost on air */
+    gint bus_messages;
+} DeckMetrics;
+
+/* What one chain reports into its deck's metrics */
+typedef struct _ChainMetrics {
+    DeckMetrics *deck;
+    MetricsTimer preroll;
+    MetricsTimer seek;
+    MetricsTimer first_audio;
+    MetricsTimer follow_on;
+    GThread *cpu_thread;            /* Streaming thread only */
+    gint64 cpu_last;
+} ChainMetrics;
+
+void metrics_observe(MetricsHistogram *histogram, gint64 us);
+void metrics_timer_start(MetricsTimer *timer);
+void metrics_timer_stop(MetricsTimer *timer, MetricsHistogram *histogram);
+void metrics_timer_cancel(MetricsTimer *timer);
+ChainMetrics* metrics_chain_new(DeckMetrics *deck, GstBus *bus, GstPad *pad);
+void metrics_chain_free(ChainMetrics *metrics);
+gboolean metrics_init(const gchar *path, CustomData *decks, guint ndecks);
+void metrics_shutdown(void);
+
+#endif /* _METRICS_H */
@@ -28,8 +28,65 @@
 
 #include "mygstreamer.h"
 #include "audio.h"
-
-#define NUM_PLAYERS 4
+#include "deck.h"
+#include "cart.h"
+#include "control.h"
+#include "engine.h"
+#include "input.h"
+#include "jackclock.h"
+#include "library.h"
+#include "metrics.h"
+#include "playlist.h"
+#include "resample.h"
+#include "schedule.h"
+#include "seektable.h"
+#include "segue.h"
+#include "session.h"
+#include "startup.h"
+#include "timedisplay.h"
+#include "waveform.h"
+
+#define MAX_CART_HOTKEYS 12
+#define SLIDER_HEIGHT 48
+#define LIBRARY_MAX_RESULTS 200
+#define DECK_HOTKEYS 16
+
+/* Columns of a deck's search results */
+enum {
+    RESULT_ARTIST,
+    RESULT_TITLE,
+    RESULT_DURATION,
+    RESULT_URI,
+    RESULT_COLUMNS
+};
+
+/* The widgets of one deck, and what they show. The deck itself knows
+ * nothing about them, see deck.c.
+ */
+typedef struct _DeckUI {
+    CustomData *deck;
+
+    GtkWidget *slider;              /* Slider widget to keep track of current position */
+    GtkWidget *taglabel;
+    GtkWidget *timelabel;
+    GtkWidget *playPauseButton;
+    GtkWidget *filechooser;         /* Without --library */
+    GtkWidget *searchentry;         /* With --library */
+    GtkListStore *results;          /* Matches of searchentry */
+    GtkWidget *mainwindow;
+
+    gchar *last_folder_uri;         /* URI of the last selected folder */
+    Waveform *waveform;             /* Overview drawn in the slider, if known */
+    gchar *waveform_uri;            /* File the slider shows, or waits for */
+    gulong slider_update_signal_id; /* Signal ID for the slider update signal */
+
+    gulong file_selection_signal_id;
+
+    TimeDisplay time;               /* What timelabel and slider show, see refresh_ui() */
+} DeckUI;
+
+static guint num_decks = DECK_DEFAULT_COUNT;
+static DeckUI *all_decks;           /* num_decks of them, for the analysis callbacks */
 
 gchar *green = "green";        /* Colour to be used for "green" timelabel */
 gchar *yellow = "yellow";      /* Colour to be used for "yellow" timelabel */
@@ -41,159 +98,322 @@ static void get_tag(GstTagList *tags, const gchar *tag, gchar **target) {
         }
 }
 
-static void _update_timelabel(CustomData *data, const gchar *str, const gchar *fmt) {
+static void _update_timelabel(DeckUI *ui, const gchar *str, const gchar *fmt) {
     char *markup;
     gchar *format = g_strdup_printf("<span size=\"x-large\" %s>%%s</span>", fmt);
     markup = g_markup_printf_escaped (format, str);
-    gtk_label_set_markup (GTK_LABEL (data->timelabel), markup);
+    gtk_label_set_markup (GTK_LABEL (ui->timelabel), markup);
     g_free (markup);
     g_free (format);
 }
 
-static void update_timelabel_bg(CustomData *data, const gchar *str, const gchar *color) {
-    gchar *format = g_strdup_printf("bgcolor=\"%s\"", color);
-    _update_timelabel(data, str, format);
-    g_free (format);
+static void update_timelabel(DeckUI *ui, const gchar *str) {
+    _update_timelabel(ui, str, "");
 }
 
-static void update_timelabel(CustomData *data, const gchar *str) {
-    _update_timelabel(data, str, "");
+/* For the refresh on every frame, without allocating: a time has nothing
+ * to escape. color may be NULL.
+ */
+static void update_timelabel_time(DeckUI *ui, const gchar *time, const gchar *color) {
+    gchar markup[DECK_TIME_LENGTH + 64];
+
+    if (NULL == color) {
+        g_snprintf (markup, sizeof (markup), "<span size=\"x-large\">%s</span>", time);
+    } else {
+        g_snprintf (markup, sizeof (markup), "<span size=\"x-large\" bgcolor=\"%s\">%s</span>",
+                color, time);
+    }
+    gtk_label_set_markup (GTK_LABEL (ui->timelabel), markup);
 }
 
 /* currently unused, but might come in handy later */
 #if 0
-static void unset_background(CustomData *data) {
-    gtk_label_set_attributes(GTK_LABEL (data->timelabel), NULL);
+static void unset_background(DeckUI *ui) {
+    gtk_label_set_attributes(GTK_LABEL (ui->timelabel), NULL);
 }
 
-static void set_background(CustomData *data) {
+static void set_background(DeckUI *ui) {
     PangoAttrList *attrs;
 
     attrs = pango_attr_list_new();
     pango_attr_list_insert (attrs, pango_attr_background_new (65535, 0, 0));
-    gtk_label_set_attributes(GTK_LABEL (data->timelabel), attrs);
+    gtk_label_set_attributes(GTK_LABEL (ui->timelabel), attrs);
     pango_attr_list_unref (attrs);
 }
 #endif
 
-static inline void update_taglabel(CustomData *data, const gchar *str) {
-    gtk_label_set_text (GTK_LABEL (data->taglabel), str);
+static inline void update_taglabel(DeckUI *ui, const gchar *str) {
+    gtk_label_set_text (GTK_LABEL (ui->taglabel), str);
 }
 
-static void wait_for_statechange(CustomData *data) {
-    GstStateChangeReturn rc = -1;
-    while ((rc != GST_STATE_CHANGE_SUCCESS) && (rc !=
-                GST_STATE_CHANGE_FAILURE)) {
-        GstState state, pending;
-        rc = gst_element_get_state(data->pipeline, &state, &pending,
-                GST_CLOCK_TIME_NONE);
-        g_print ("Wait-State is %i, pending is %i rc is %i\n", state, pending, rc);
+
+static void playpause_cb(GtkButton *button, DeckUI *ui) {
+    if (deck_is_playing(ui->deck)) {
+        deck_pause (ui->deck);
+    } else {
+        deck_play (ui->deck);
     }
 }
 
+/* A file got analysed. ui is the array of all decks. */
+static void waveform_ready_cb (const gchar *uri, DeckUI *ui) {
+    for (guint i = 0; i < num_decks; i++) {
+        deck_cues_ready (ui[i].deck, uri);
 
-static void maybe_load_nextfile(CustomData *data) {
-    if (NULL != data->nextfile_uri) {
-        audio_stop_player (data);
-        gchar *filename = g_filename_from_uri (data->nextfile_uri,
-                NULL, NULL);
-        update_taglabel(data, g_filename_display_basename(filename));
-        audio_set_uri (data, data->nextfile_uri);
-        data->nextfile_uri = NULL;
-        g_free (filename);
-        audio_pause_player (data);
-        wait_for_statechange(data);
+        if (NULL == ui[i].waveform && 0 == g_strcmp0 (ui[i].waveform_uri, uri)) {
+            ui[i].waveform = waveform_lookup (uri);
+            gtk_widget_queue_draw (ui[i].slider);
+        }
     }
+}
 
-    if (data->is_network_stream) {
-        audio_stop_player(data);
-    } else {
-        audio_pseudo_stop(data);
+/* Prepare the overview of uri, without showing it yet */
+static void prefetch_waveform (DeckUI *ui, const gchar *uri) {
+    Waveform *waveform = waveform_lookup (uri);
+
+    if (NULL == waveform) {
+        waveform_request (uri, (WaveformReadyFunc)waveform_ready_cb, all_decks);
     }
+    waveform_free (waveform);
 }
 
+/* Show the overview of uri in the slider, straight from the cache if it's
+ * been seen before, otherwise as soon as the analysis is done
+ */
+static void show_waveform (DeckUI *ui, const gchar *uri) {
+    waveform_free (ui->waveform);
+    g_free (ui->waveform_uri);
+
+    ui->waveform_uri = g_strdup (uri);
+    ui->waveform = waveform_lookup (uri);
+    if (NULL == ui->waveform) {
+        waveform_request (uri, (WaveformReadyFunc)waveform_ready_cb, all_decks);
+    }
 
-static void playpause_cb(GtkButton *button, CustomData *data) {
-    if (data->state == GST_STATE_PLAYING) {
-        gst_element_set_state (data->pipeline, GST_STATE_PAUSED);
-    } else {
-        gst_element_set_state (data->pipeline, GST_STATE_PLAYING);
+    gtk_widget_queue_draw (ui->slider);
+}
+
+/* Load uri into the deck, or queue it if the deck is playing */
+static void select_file (DeckUI *ui, const gchar *uri, const gchar *label) {
+    if (deck_is_playing(ui->deck)) {
+            /* Don't load the file, only store its filename in
+             * ui->deck->nextfile_uri, so it is loaded when the pipe finishes
+             */
+            g_print ("Next file URI: %s\n", uri);
+            deck_queue (ui->deck, uri);
+            prefetch_waveform (ui, uri);
+            return;
+    }
+
+
+    g_print ("File URI: %s\n", uri);
+    update_taglabel(ui, label);
+
+    deck_load (ui->deck, uri);
+    show_waveform (ui, uri);
+}
+
+/* Play through the playlist at uri, or queue its first entry. The deck
+ * queues the ones after that by itself.
+ */
+static void load_playlist (DeckUI *ui, const gchar *uri, gboolean queue) {
+    Playlist *playlist = playlist_open (uri);
+    const gchar *first;
+    gchar *filename, *basename;
+
+    if (NULL == playlist) {
+        g_printerr ("Can't read the playlist %s\n", uri);
+        return;
+    }
+
+    first = deck_load_playlist (ui->deck, playlist, queue);
+    if (NULL == first) {
+        g_printerr ("Nothing to play in %s\n", uri);
+        return;
+    }
+    g_print ("Playlist URI: %s\n", uri);
+
+    /* a queued entry is shown when it becomes active */
+    if (queue) {
+        return;
     }
+
+    filename = g_filename_from_uri (first, NULL, NULL);
+    basename = (NULL != filename) ?
+        g_filename_display_basename (filename) : g_strdup (first);
+    update_taglabel (ui, basename);
+    show_waveform (ui, first);
+    g_free (basename);
+    g_free (filename);
 }
 
-static void file_selection_cb (GtkFileChooser *chooser, CustomData *data) {
+static void file_selection_cb (GtkFileChooser *chooser, DeckUI *ui) {
     gchar *fileURI = gtk_file_chooser_get_uri (chooser);
     gchar *fileName = gtk_file_chooser_get_filename (chooser);
 
-    if (NULL == fileURI) {
-        return;
+    /* only local files have a name */
+    if (NULL == fileURI || NULL == fileName) {
+        goto out;
     }
 
-    data->last_folder_uri = gtk_file_chooser_get_current_folder_uri (chooser);
+    g_free (ui->last_folder_uri);
+    ui->last_folder_uri = gtk_file_chooser_get_current_folder_uri (chooser);
 
     if (g_file_test(fileName, G_FILE_TEST_IS_DIR)) {
-        return;
+        goto out;
     }
 
-    if (g_str_has_suffix (fileName, ".m3u")) {
-        gchar *content;
-        g_printf ("m3u selected\n");
-        if (!g_file_get_contents (fileName, &content, NULL, NULL)) {
-            /* error reading m3u, just do nothing */
-            return;
-        }
-        fileURI = g_strstrip(g_strdup (content));
-        g_free (content);
+    if (playlist_is_playlist (fileName)) {
+        load_playlist (ui, fileURI, deck_is_playing (ui->deck));
+        goto out;
     }
 
-    if (audio_is_playing(data)) {
-            /* Don't load the file, only store its filename in
-             * data->nextfile_uri, so it is loaded when the pipe finishes
-             */
-            g_print ("Next file URI: %s\n", fileURI);
-            data->nextfile_uri = fileURI;
-            return;
+    {
+        gchar *basename = g_filename_display_basename (fileName);
+
+        select_file (ui, fileURI, basename);
+        g_free (basename);
     }
 
+out:
+    g_free (fileName);
+    g_free (fileURI);
+}
+
+/* Show what matches the deck's search entry */
+static void refresh_results (DeckUI *ui) {
+    const gchar *query = gtk_entry_get_text (GTK_ENTRY (ui->searchentry));
+    guint results[LIBRARY_MAX_RESULTS];
+    guint n = library_search (query, results, LIBRARY_MAX_RESULTS);
+
+    gtk_list_store_clear (ui->results);
+
+    for (guint i = 0; i < n; i++) {
+        guint32 seconds = library_track_duration_ms (results[i]) / 1000;
+        gchar *duration = g_strdup_printf ("%u:%02u", seconds / 60, seconds % 60);
+        gchar *uri = library_track_uri (results[i]);
 
-    audio_stop_player (data);
-    g_print ("File URI: %s\n", fileURI);
-    update_taglabel(data, g_filename_display_basename(fileName));
+        gtk_list_store_insert_with_values (ui->results, NULL, -1,
+                RESULT_ARTIST, library_track_artist (results[i]),
+                RESULT_TITLE, library_track_title (results[i]),
+                RESULT_DURATION, duration,
+                RESULT_URI, uri,
+                -1);
 
-    audio_set_uri (data, fileURI);
+        g_free (uri);
+        g_free (duration);
+    }
+}
 
-    /* load new file by putting the player into pause state */
-    audio_pause_player (data);
+static void search_changed_cb (GtkSearchEntry *entry, DeckUI *ui) {
+    refresh_results (ui);
+}
+
+/* The scanner wrote a new index. ui is the array of all decks. */
+static void library_changed_cb (DeckUI *ui) {
+    for (guint i = 0; i < num_decks; i++) {
+        refresh_results (&ui[i]);
+    }
+}
+
+static void select_result (DeckUI *ui, GtkTreeIter *iter) {
+    gchar *uri, *title, *artist, *label;
+
+    gtk_tree_model_get (GTK_TREE_MODEL (ui->results), iter,
+            RESULT_URI, &uri, RESULT_TITLE, &title, RESULT_ARTIST, &artist, -1);
+
+    label = ('\0' != artist[0]) ? g_strdup_printf ("%s - %s", artist, title) : g_strdup (title);
+    select_file (ui, uri, label);
+
+    g_free (label);
+    g_free (artist);
+    g_free (title);
+    g_free (uri);
+}
+
+static void result_activated_cb (GtkTreeView *view, GtkTreePath *path,
+        GtkTreeViewColumn *column, DeckUI *ui) {
+    GtkTreeIter iter;
+
+    if (gtk_tree_model_get_iter (GTK_TREE_MODEL (ui->results), &iter, path)) {
+        select_result (ui, &iter);
+    }
+}
+
+/* Enter in the search entry takes the first match */
+static void search_activated_cb (GtkEntry *entry, DeckUI *ui) {
+    GtkTreeIter iter;
+
+    if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (ui->results), &iter)) {
+        select_result (ui, &iter);
+    }
+}
+
+/* A search entry with its results, replacing the filechooser with --library */
+static GtkWidget* create_library_browser (DeckUI *ui) {
+    GtkWidget *box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+    GtkWidget *scrolled = gtk_scrolled_window_new (NULL, NULL);
+    GtkWidget *view;
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new ();
+    const gchar *titles[] = { "Artist", "Title", "Length" };
+
+    ui->searchentry = gtk_search_entry_new ();
+    g_signal_connect (G_OBJECT (ui->searchentry), "search-changed", G_CALLBACK (search_changed_cb), ui);
+    g_signal_connect (G_OBJECT (ui->searchentry), "activate", G_CALLBACK (search_activated_cb), ui);
+
+    ui->results = gtk_list_store_new (RESULT_COLUMNS,
+            G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    view = gtk_tree_view_new_with_model (GTK_TREE_MODEL (ui->results));
+    /* the view keeps the store alive */
+    g_object_unref (ui->results);
+    g_signal_connect (G_OBJECT (view), "row-activated", G_CALLBACK (result_activated_cb), ui);
+
+    /* long titles mustn't widen the deck */
+    g_object_set (renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+    for (int i = RESULT_ARTIST; i <= RESULT_DURATION; i++) {
+        GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes (titles[i],
+                renderer, "text", i, NULL);
+
+        gtk_tree_view_column_set_expand (column, RESULT_DURATION != i);
+        gtk_tree_view_append_column (GTK_TREE_VIEW (view), column);
+    }
+
+    gtk_container_add (GTK_CONTAINER (scrolled), view);
+    gtk_widget_set_vexpand (scrolled, TRUE);
+
+    gtk_box_pack_start (GTK_BOX (box), ui->searchentry, FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (box), scrolled, TRUE, TRUE, 0);
+
+    return box;
 }
 
 /* This function is called when the STOP button is clicked */
-static void stop_cb (GtkButton *button, CustomData *data) {
-    if (audio_is_playing(data)) {
-        maybe_load_nextfile (data);
-    } else {
+static void stop_cb (GtkButton *button, DeckUI *ui) {
+    if (!deck_is_playing(ui->deck)) {
         /* real stop */
-        update_timelabel(data, "Stopped");
-        audio_stop_player (data);
+        update_timelabel(ui, "Stopped");
     }
+
+    deck_stop (ui->deck);
 }
 
-static void quit_all (CustomData *data) {
+static void quit_all (DeckUI *ui) {
     GtkWidget *dialog;
 
     gboolean all_in_readystate = TRUE;
 
-    for (int i = 0; i < NUM_PLAYERS; i++) {
-            all_in_readystate = all_in_readystate && (GST_STATE_READY == data[i].state);
+    for (guint i = 0; i < num_decks; i++) {
+            all_in_readystate = all_in_readystate && deck_is_stopped(ui[i].deck);
     }
 
     if (all_in_readystate) {
-            dialog = gtk_message_dialog_new (GTK_WINDOW (data[0].mainwindow),
+            dialog = gtk_message_dialog_new (GTK_WINDOW (ui[0].mainwindow),
                             GTK_DIALOG_DESTROY_WITH_PARENT,
                             GTK_MESSAGE_QUESTION,
                             GTK_BUTTONS_YES_NO,
                             "Really quit?");
     } else {
-            dialog = gtk_message_dialog_new (GTK_WINDOW (data[0].mainwindow),
+            dialog = gtk_message_dialog_new (GTK_WINDOW (ui[0].mainwindow),
                             GTK_DIALOG_DESTROY_WITH_PARENT,
                             GTK_MESSAGE_INFO,
                             GTK_BUTTONS_OK,
@@ -217,15 +437,14 @@ static void delete_event_cb (GtkWidget *widget, GdkEvent *event, void *argp) {
 
 /* This function is called when the slider changes its position. We perform a seek to the
  * new position here. */
-static void slider_cb (GtkRange *range, CustomData *data) {
-    gchar *time;
+static void slider_cb (GtkRange *range, DeckUI *ui) {
+    gchar time[DECK_TIME_LENGTH];
 
-    gdouble value = gtk_range_get_value (GTK_RANGE (data->slider));
-    time = g_strdup_printf("%" HMS_TIME_FORMAT, HMS_TIME_ARGS((gint64)(value * GST_SECOND)));
-    update_timelabel(data, time);
-    g_free (time);
+    gdouble value = gtk_range_get_value (GTK_RANGE (ui->slider));
+    g_snprintf (time, sizeof (time), "%" HMS_TIME_FORMAT, HMS_TIME_ARGS((gint64)(value * GST_SECOND)));
+    update_timelabel_time (ui, time, NULL);
 
-    audio_seek(data, value);
+    deck_seek(ui->deck, value);
 }
 
 /* Creates a button with an icon but no text */
@@ -239,53 +458,96 @@ static GtkWidget* _create_media_button (const gchar *stockid) {
         return button;
 }
 
+/* Paint one column per pixel, the peaks lighter than the RMS */
+static void draw_waveform_layer (cairo_t *cr, const WaveformBin *bins, guint nbins,
+        int width, int height, gboolean rms) {
+    gdouble middle = height / 2.0;
+
+    for (int x = 0; x < width; x++) {
+        guint from = (guint64)x * nbins / width;
+        guint to = MAX (from + 1, (guint64)(x + 1) * nbins / width);
+        guint8 value = 0;
+        gdouble h;
+
+        for (guint i = from; i < to && i < nbins; i++) {
+            value = MAX (value, rms ? bins[i].rms : bins[i].peak);
+        }
+
+        h = middle * value / 255.0;
+        cairo_rectangle (cr, x, middle - h, 1, 2 * h);
+    }
+
+    cairo_fill (cr);
+}
+
+/* Draws the overview over the slider's trough */
+static gboolean slider_draw_cb (GtkWidget *widget, cairo_t *cr, DeckUI *ui) {
+    int width = gtk_widget_get_allocated_width (widget);
+    int height = gtk_widget_get_allocated_height (widget);
+    const WaveformBin *bins;
+    guint nbins;
+
+    if (NULL == ui->waveform || width <= 0) {
+        return FALSE;
+    }
+
+    bins = waveform_get_bins (ui->waveform, width, &nbins);
+
+    cairo_set_source_rgba (cr, 0.2, 0.4, 0.8, 0.3);
+    draw_waveform_layer (cr, bins, nbins, width, height, FALSE);
+    cairo_set_source_rgba (cr, 0.1, 0.2, 0.6, 0.5);
+    draw_waveform_layer (cr, bins, nbins, width, height, TRUE);
+
+    return FALSE;
+}
+
 /* This creates all the GTK+ widgets that compose our application, and registers the callbacks */
-static GtkWidget* create_player_ui (CustomData *data, guint decknumber) {
+static GtkWidget* create_player_ui (DeckUI *ui, guint decknumber) {
     GtkWidget *stop_button; /* Buttons */
     GtkWidget *title;
+    GtkWidget *browser;
     GtkWidget *myGrid;
 
 
     myGrid = gtk_grid_new();
 
-    data->playPauseButton = _create_media_button (GTK_STOCK_MEDIA_PAUSE);
-    g_signal_connect (G_OBJECT (data->playPauseButton), "clicked", G_CALLBACK (playpause_cb), data);
+    ui->playPauseButton = _create_media_button (GTK_STOCK_MEDIA_PAUSE);
+    g_signal_connect (G_OBJECT (ui->playPauseButton), "clicked", G_CALLBACK (playpause_cb), ui);
 
     stop_button = _create_media_button (GTK_STOCK_MEDIA_STOP);
-    g_signal_connect (G_OBJECT (stop_button), "clicked", G_CALLBACK (stop_cb), data);
-
-    data->slider = gtk_scale_new_with_range (GTK_ORIENTATION_HORIZONTAL, 0, 100, 1);
-    gtk_scale_set_draw_value (GTK_SCALE (data->slider), 0);
-    data->slider_update_signal_id = g_signal_connect (G_OBJECT (data->slider), "value-changed", G_CALLBACK (slider_cb), data);
-    g_signal_connect (G_OBJECT (data->slider), "move-slider", G_CALLBACK (slider_cb), data);
+    g_signal_connect (G_OBJECT (stop_button), "clicked", G_CALLBACK (stop_cb), ui);
+
+    ui->slider = gtk_scale_new_with_range (GTK_ORIENTATION_HORIZONTAL, 0, 100, 1);
+    gtk_scale_set_draw_value (GTK_SCALE (ui->slider), 0);
+    ui->slider_update_signal_id = g_signal_connect (G_OBJECT (ui->slider), "value-changed", G_CALLBACK (slider_cb), ui);
+    g_signal_connect (G_OBJECT (ui->slider), "move-slider", G_CALLBACK (slider_cb), ui);
+    g_signal_connect_after (G_OBJECT (ui->slider), "draw", G_CALLBACK (slider_draw_cb), ui);
+    gtk_widget_set_size_request (ui->slider, -1, SLIDER_HEIGHT);
+
+    ui->timelabel = gtk_label_new ("");
+    update_timelabel(ui, "Time remaining");
+    ui->taglabel = gtk_label_new ("Selected filename");
+    if (library_is_enabled ()) {
+        browser = create_library_browser (ui);
+    } else {
+        ui->filechooser = gtk_file_chooser_widget_new (GTK_FILE_CHOOSER_ACTION_OPEN);
+        gtk_file_chooser_set_local_only (GTK_FILE_CHOOSER (ui->filechooser), TRUE);
+        gtk_file_chooser_set_select_multiple (GTK_FILE_CHOOSER (ui->filechooser), FALSE);
+        gtk_file_chooser_set_use_preview_label (GTK_FILE_CHOOSER (ui->filechooser), FALSE);
 
-    data->timelabel = gtk_label_new ("");
-    update_timelabel(data, "Time remaining");
-    data->taglabel = gtk_label_new ("Selected filename");
-    {
-        data->filechooser = gtk_file_chooser_widget_new (GTK_FILE_CHOOSER_ACTION_OPEN);
-        gtk_file_chooser_set_local_only (GTK_FILE_CHOOSER (data->filechooser), TRUE);
-        gtk_file_chooser_set_select_multiple (GTK_FILE_CHOOSER (data->filechooser), FALSE);
-        gtk_file_chooser_set_use_preview_label (GTK_FILE_CHOOSER (data->filechooser), FALSE);
-
-        if (NULL != data->last_folder_uri) {
-            gtk_file_chooser_set_current_folder_uri (GTK_FILE_CHOOSER (data->filechooser),
-                    data->last_folder_uri);
-        } else {
-            gtk_file_chooser_set_current_folder (GTK_FILE_CHOOSER (data->filechooser),
-                    g_get_home_dir());
-        }
+        /* the folder is listed once the window is up, see populate_browsers_cb() */
 
         GtkFileFilter *filter = gtk_file_filter_new();
 
         gtk_file_filter_add_mime_type (filter, "audio/*");
-        gtk_file_chooser_set_filter (GTK_FILE_CHOOSER (data->filechooser), filter);
+        gtk_file_chooser_set_filter (GTK_FILE_CHOOSER (ui->filechooser), filter);
 
-        data->file_selection_signal_id = 
-            g_signal_connect (G_OBJECT (data->filechooser), "selection-changed", G_CALLBACK (file_selection_cb), data);
+        ui->file_selection_signal_id = 
+            g_signal_connect (G_OBJECT (ui->filechooser), "selection-changed", G_CALLBACK (file_selection_cb), ui);
 
         /* block signal to prevent false selection on startup*/
-        g_signal_handler_block (data->filechooser, data->file_selection_signal_id);
+        g_signal_handler_block (ui->filechooser, ui->file_selection_signal_id);
+        browser = ui->filechooser;
     }
 
     {
@@ -296,105 +558,69 @@ static GtkWidget* create_player_ui (CustomData *data, guint decknumber) {
 
 
     /* arrange all elements into myGrid */
-    gtk_grid_attach (GTK_GRID (myGrid), data->filechooser, 0, 0, 1, 3);
-    gtk_grid_attach_next_to (GTK_GRID (myGrid), title, data->filechooser, GTK_POS_TOP, 1, 3);
-    gtk_grid_attach_next_to (GTK_GRID (myGrid), data->playPauseButton, data->filechooser, GTK_POS_RIGHT, 1, 1);
-    gtk_grid_attach_next_to (GTK_GRID (myGrid), stop_button, data->playPauseButton, GTK_POS_BOTTOM, 1, 1);
+    gtk_grid_attach (GTK_GRID (myGrid), browser, 0, 0, 1, 3);
+    gtk_grid_attach_next_to (GTK_GRID (myGrid), title, browser, GTK_POS_TOP, 1, 3);
+    gtk_grid_attach_next_to (GTK_GRID (myGrid), ui->playPauseButton, browser, GTK_POS_RIGHT, 1, 1);
+    gtk_grid_attach_next_to (GTK_GRID (myGrid), stop_button, ui->playPauseButton, GTK_POS_BOTTOM, 1, 1);
 
-    gtk_grid_attach_next_to (GTK_GRID (myGrid), data->taglabel, data->filechooser, GTK_POS_BOTTOM, 2, 1);
-    gtk_grid_attach_next_to (GTK_GRID (myGrid), data->timelabel, data->taglabel, GTK_POS_BOTTOM, 2, 1);
+    gtk_grid_attach_next_to (GTK_GRID (myGrid), ui->taglabel, browser, GTK_POS_BOTTOM, 2, 1);
+    gtk_grid_attach_next_to (GTK_GRID (myGrid), ui->timelabel, ui->taglabel, GTK_POS_BOTTOM, 2, 1);
 
-    gtk_grid_attach_next_to (GTK_GRID (myGrid), data->slider, data->timelabel, GTK_POS_BOTTOM, 2, 1);
+    gtk_grid_attach_next_to (GTK_GRID (myGrid), ui->slider, ui->timelabel, GTK_POS_BOTTOM, 2, 1);
 
 
     /* allow at least one expanding child, so all uppper widgets will resize
      * when maximising the window
      */
-    gtk_widget_set_hexpand (data->filechooser, TRUE);
-    gtk_widget_set_vexpand (data->filechooser, TRUE);
+    gtk_widget_set_hexpand (browser, TRUE);
+    gtk_widget_set_vexpand (browser, TRUE);
 
-    gtk_label_set_line_wrap(GTK_LABEL (data->taglabel), TRUE);
+    gtk_label_set_line_wrap(GTK_LABEL (ui->taglabel), TRUE);
 
     return myGrid;
 }
 
 
 
-/* This function is called periodically to refresh the GUI */
-static gboolean refresh_ui (CustomData *data) {
-    GstFormat fmt = GST_FORMAT_TIME;
-    gint64 current = -1;
+/* This function is called on every frame to refresh the GUI */
+static void refresh_ui (DeckUI *ui) {
+    const gchar *colors[] = { NULL, green, yellow, red };
+    guint changed = time_display_update (&ui->time);
 
-    /* We do not want to update anything unless we are in the PAUSED or PLAYING states */
-    if (data->state < GST_STATE_PAUSED)
-        return TRUE;
-
-    /* If we didn't know it yet, query the stream duration */
-    if (!GST_CLOCK_TIME_IS_VALID (data->duration)) {
-#if GST_VERSION_MAJOR == (0)
-        if (!gst_element_query_duration (data->pipeline, &fmt, &data->duration))
-#else
-        if (!gst_element_query_duration (data->pipeline, fmt, &data->duration))
-#endif
-    {
-            g_printerr ("Could not query current duration.\n");
-        } else {
-            /* Set the range of the slider to the clip duration, in SECONDS */
-            g_signal_handler_block (data->slider, data->slider_update_signal_id);
-            if (!data->is_network_stream) {
-                gtk_range_set_range (GTK_RANGE (data->slider), 0,
-                                (gdouble)data->duration / GST_SECOND);
-            }
-            g_signal_handler_unblock (data->slider, data->slider_update_signal_id);
-        }
+    if ((changed & TIME_DISPLAY_DURATION) && !ui->deck->active->is_network_stream) {
+        /* Set the range of the slider to the clip duration, in SECONDS */
+        g_signal_handler_block (ui->slider, ui->slider_update_signal_id);
+        gtk_range_set_range (GTK_RANGE (ui->slider), 0, (gdouble)ui->deck->duration / GST_SECOND);
+        g_signal_handler_unblock (ui->slider, ui->slider_update_signal_id);
     }
 
-#if GST_VERSION_MAJOR == (0)
-    if (gst_element_query_position (data->pipeline, &fmt, &current))
-#else
-    if (gst_element_query_position (data->pipeline, fmt, &current))
-#endif
-    {
+    if ((changed & TIME_DISPLAY_SECONDS) && !ui->deck->active->is_network_stream) {
         /* Block the "value-changed" signal, so the slider_cb function is not called
          * (which would trigger a seek the user has not requested) */
-        g_signal_handler_block (data->slider, data->slider_update_signal_id);
-        /* Set the position of the slider to the current pipeline positoin, in SECONDS */
-        if (!data->is_network_stream) {
-            gtk_range_set_value (GTK_RANGE (data->slider), (gdouble)current / GST_SECOND);
-        }
+        g_signal_handler_block (ui->slider, ui->slider_update_signal_id);
+        /* Set the position of the slider to the current pipeline position, in SECONDS */
+        gtk_range_set_value (GTK_RANGE (ui->slider), (gdouble)ui->time.current / GST_SECOND);
         /* Re-enable the signal */
-        g_signal_handler_unblock (data->slider, data->slider_update_signal_id);
-        {
-            gchar *time;
-            GstClockTimeDiff remaining = data->duration-current;
-
-            time = g_strdup_printf("%" HMS_TIME_FORMAT " / -%" HMS_TIME_FORMAT " / %" HMS_TIME_FORMAT,
-                    HMS_TIME_ARGS(current),
-                    HMS_TIME_ARGS(remaining),
-                    HMS_TIME_ARGS(data->duration));
-
-            if (!audio_is_playing(data)) {
-                update_timelabel (data, time);
-            } else {
-                if (remaining < 0.5 * data->duration) {
-                    if (remaining < 0.25 * data->duration) {
-                        update_timelabel_bg (data, time, red);
-                    } else {
-                        update_timelabel_bg (data, time, yellow);
-                    }
-                } else {
-                    update_timelabel_bg (data, time, green);
-                }
-            }
+        g_signal_handler_unblock (ui->slider, ui->slider_update_signal_id);
+    }
 
-            g_free (time);
-        }
+    /* Only touch the label if what it shows changes */
+    if (changed & TIME_DISPLAY_TEXT) {
+        update_timelabel_time (ui, ui->time.text, colors[ui->time.color]);
     }
-    return TRUE;
+}
+
+/* One frame clock tick callback refreshes all decks */
+static gboolean ui_tick_cb (GtkWidget *widget, GdkFrameClock *frame_clock, DeckUI *ui) {
+    for (guint i = 0; i < num_decks; i++) {
+        refresh_ui (&ui[i]);
+    }
+
+    return G_SOURCE_CONTINUE;
 }
 
 /* This function is called when new metadata is discovered in the stream */
-static void tags_cb (GstElement *pipeline, gint stream, CustomData *data) {
+static void tags_cb (GstElement *pipeline, gint stream, DeckUI *ui) {
     /* We are possibly in a GStreamer working thread, so we notify the main
      * thread of this event through a message in the bus */
     gst_element_post_message (pipeline,
@@ -402,61 +628,87 @@ static void tags_cb (GstElement *pipeline, gint stream, CustomData *data) {
                 gst_structure_new ("tags-changed", NULL, NULL)));
 }
 
-/* This function is called when an error message is posted on the bus */
-static void error_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
-    GError *err;
-    gchar *debug_info;
+static void _set_playPauseImage (DeckUI *ui, const gchar *stockid) {
+        gtk_image_set_from_stock(
+                        GTK_IMAGE (gtk_button_get_image (GTK_BUTTON (ui->playPauseButton))),
+                        stockid, GTK_ICON_SIZE_BUTTON);
+}
+
+static void update_playPauseImage (DeckUI *ui) {
+    if (!deck_is_playing (ui->deck)) {
+            _set_playPauseImage(ui, GTK_STOCK_MEDIA_PLAY);
+    } else {
+            _set_playPauseImage(ui, GTK_STOCK_MEDIA_PAUSE);
+    }
+}
+
+/* Called by the deck state machine whenever the deck changes its state */
+static void deck_state_cb (CustomData *data) {
+    DeckUI *ui = data->user_data;
 
-    /* Print error details on the screen */
-    gst_message_parse_error (msg, &err, &debug_info);
-    g_printerr ("Error received from element %s: %s\n", GST_OBJECT_NAME (msg->src), err->message);
-    update_timelabel (data, err->message);
-    g_printerr ("Debugging information: %s\n", debug_info ? debug_info : "none");
-    g_clear_error (&err);
-    g_free (debug_info);
+    g_print ("Deck %u state set to %s\n", ui->deck->decknumber + 1,
+            deck_state_get_name (ui->deck->deckstate));
 
-    /* Set the pipeline to READY (which stops playback) */
-    audio_stop_player (data);
+    update_playPauseImage (ui);
+
+    /* The clock starts or stops running: read the position again */
+    time_display_invalidate (&ui->time);
 }
 
-/* This function is called when an End-Of-Stream message is posted on the bus.
- * We just set the pipeline to READY (which stops playback) */
-static void eos_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
-    g_print ("End-Of-Stream reached.\n");
-    maybe_load_nextfile (data);
+static void deck_seeked_cb (CustomData *data) {
+    DeckUI *ui = data->user_data;
+
+    time_display_invalidate (&ui->time);
 }
 
-static void _set_playPauseImage (CustomData *data, const gchar *stockid) {
-        gtk_image_set_from_stock(
-                        GTK_IMAGE (gtk_button_get_image (GTK_BUTTON (data->playPauseButton))),
-                        stockid, GTK_ICON_SIZE_BUTTON);
+static void deck_error_cb (CustomData *data, const gchar *message) {
+    update_timelabel (data->user_data, message);
 }
 
-/* This function is called when the pipeline changes states. We use it to
- * keep track of the current state. */
-static void state_changed_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
-    GstState old_state, new_state, pending_state;
-    gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
-    if (GST_MESSAGE_SRC (msg) == GST_OBJECT (data->pipeline)) {
-        data->state = new_state;
-        g_print ("State set to %s\n", gst_element_state_get_name (new_state));
+/* The playlist queued its next entry */
+static void deck_queued_cb (CustomData *data, const gchar *uri) {
+    prefetch_waveform (data->user_data, uri);
+}
 
-        /* update playPauseImage */
-        if (data->state == GST_STATE_PAUSED || data->state == GST_STATE_READY) {
-                _set_playPauseImage(data, GTK_STOCK_MEDIA_PLAY);
-        } else {
-                _set_playPauseImage(data, GTK_STOCK_MEDIA_PAUSE);
-        }
+/* The queued file just became the active one */
+static void deck_swapped_cb (CustomData *data, const gchar *uri) {
+    DeckUI *ui = data->user_data;
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+    gchar *basename = (NULL != filename) ?
+        g_filename_display_basename (filename) : g_strdup (uri);
 
-        if (old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED) {
-            /* For extra responsiveness, we refresh the GUI as soon as we reach the PAUSED state */
-            refresh_ui (data);
-        }
+    update_taglabel (ui, basename);
+    g_free (basename);
+    g_free (filename);
+
+    show_waveform (ui, uri);
+    time_display_invalidate (&ui->time);
+}
+
+/* A deck came back from the session journal */
+static void session_restored_cb (CustomData *data, DeckUI *ui) {
+    gchar *filename = g_filename_from_uri (data->active->uri, NULL, NULL);
+    gchar *basename = (NULL != filename) ?
+        g_filename_display_basename (filename) : g_strdup (data->active->uri);
+
+    ui = &ui[data->decknumber];
+    update_taglabel (ui, basename);
+    show_waveform (ui, data->active->uri);
+    if (NULL != data->nextfile_uri) {
+        prefetch_waveform (ui, data->nextfile_uri);
     }
+
+    g_free (basename);
+    g_free (filename);
 }
 
 /* This function is called when a "tag" message is posted on the bus. */
-static void tag_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
+static void tag_cb (GstBus *bus, GstMessage *msg, DeckUI *ui) {
+    /* tags of the queued file are shown by the time it becomes active */
+    if (audio_chain_from_bus (ui->deck, bus) != ui->deck->active) {
+        return;
+    }
+
     if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_TAG) {
         GstTagList *tags = NULL;
         gchar *title, *artist, *tagstring;
@@ -472,7 +724,7 @@ static void tag_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
         /* only update when we got a meaningful tag */
         if (!(0 == g_strcmp0 (title, "Unknown") &&
                 0 == g_strcmp0 (artist, "Unknown"))) {
-            update_taglabel(data, tagstring);
+            update_taglabel(ui, tagstring);
         }
 
         g_free(title);
@@ -501,73 +753,116 @@ static GtkWidget* create_mainwindow(void) {
 
 
 
-/* Initialise a single instance */
-static GtkWidget* init_player(CustomData *data, guint decknumber, int autoconnect) {
-    GtkWidget *playerUI;
-    GstBus *bus;
+/* The deck's controls. Its pipelines are built meanwhile, see init_deck(). */
+static GtkWidget* init_player(DeckUI *ui, CustomData *data, guint decknumber) {
+    ui->deck = data;
+    data->user_data = ui;
+    time_display_init (&ui->time, data);
 
+    return create_player_ui (ui, decknumber);
+}
 
-    init_audio(data, decknumber, autoconnect);
+/* Once the deck's pipelines are there */
+static void init_deck(DeckUI *ui) {
+    /* The deck watches both buses for the state machine, we only want the tags */
+    deck_init (ui->deck);
+    g_signal_connect (G_OBJECT (ui->deck->active->bus), "message::tag", (GCallback)tag_cb, ui);
+    g_signal_connect (G_OBJECT (ui->deck->standby->bus), "message::tag", (GCallback)tag_cb, ui);
+}
 
-    /* Create the GUI */
-    playerUI = create_player_ui (data, decknumber);
+/* List the last folders in the file choosers, after the window is up:
+ * each folder is read in the background, but its files still come in
+ * on the main loop
+ */
+static gboolean populate_browsers_cb(DeckUI *ui) {
+    for (guint i = 0; i < num_decks; i++) {
+        if (NULL == ui[i].filechooser) {
+            continue;
+        }
 
-    /* Instruct the bus to emit signals for each received message, and connect to the interesting signals */
-    bus = gst_element_get_bus (data->pipeline);
-    gst_bus_add_signal_watch (bus);
-    g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)error_cb, data);
-    g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback)eos_cb, data);
-    g_signal_connect (G_OBJECT (bus), "message::state-changed", (GCallback)state_changed_cb, data);
-    g_signal_connect (G_OBJECT (bus), "message::tag", (GCallback)tag_cb, data);
-    gst_object_unref (bus);
+        if (NULL != ui[i].last_folder_uri) {
+            gtk_file_chooser_set_current_folder_uri (GTK_FILE_CHOOSER (ui[i].filechooser),
+                    ui[i].last_folder_uri);
+        } else {
+            gtk_file_chooser_set_current_folder (GTK_FILE_CHOOSER (ui[i].filechooser),
+                    g_get_home_dir());
+        }
 
-    /* Register a function that GLib will call every second */
-    g_timeout_add_seconds (1, (GSourceFunc)refresh_ui, data);
+        /* enable file selection signals */
+        g_signal_handler_unblock (ui[i].filechooser, ui[i].file_selection_signal_id);
+    }
 
-    return playerUI;
+    return FALSE;
 }
 
-static gboolean joystick_handler (GIOChannel *source, GIOCondition cond, CustomData *data) {
-#define JS_EVENT_BUTTON         0x01    /* button pressed/released */
-#define JS_EVENT_AXIS           0x02    /* joystick moved */
-#define JS_EVENT_INIT           0x80    /* initial state of device */
+/* The window's first frame: usable from here on */
+static gboolean first_frame_cb(GtkWidget *widget, cairo_t *cr, DeckUI *ui) {
+    g_signal_handlers_disconnect_by_func (widget, first_frame_cb, ui);
+    startup_report ("4deckradio");
 
-    int joyfd;
+    g_idle_add_full (G_PRIORITY_LOW, (GSourceFunc)populate_browsers_cb, ui, NULL);
+    return FALSE;
+}
 
-    struct js_event {
-        uint32_t time;    /* event timestamp in milliseconds */
-        int16_t value;    /* value */
-        uint8_t type;     /* event type */
-        uint8_t number;   /* axis/button number */
-    } e;
+/* Commands from the control socket, on the main loop */
+static void control_load_cb (CustomData *data, const gchar *uri, gboolean queue) {
+    DeckUI *ui = data->user_data;
 
-    joyfd = g_io_channel_unix_get_fd(source);
+    if (playlist_is_playlist (uri)) {
+        load_playlist (ui, uri, queue);
+    } else if (queue) {
+        g_print ("Next file URI: %s\n", uri);
+        deck_queue (data, uri);
+        prefetch_waveform (ui, uri);
+    } else {
+        gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+        gchar *basename = (NULL != filename) ?
+            g_filename_display_basename (filename) : g_strdup (uri);
+
+        g_print ("File URI: %s\n", uri);
+        update_taglabel (ui, basename);
+        deck_load (data, uri);
+        show_waveform (ui, uri);
+        g_free (basename);
+        g_free (filename);
+    }
+}
 
-    read(joyfd, &e, sizeof(struct js_event));
+static void control_stop_cb (CustomData *data) {
+    stop_cb (NULL, data->user_data);
+}
 
-    if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON) {
-        if (e.number < NUM_PLAYERS) {
-            if (e.value) {
-                audio_play_player (&data[e.number]);
-            } else {
-                stop_cb (NULL, &data[e.number]);
-            }
+static void joystick_stop (CustomData *data) {
+    stop_cb (NULL, data->user_data);
+}
+
+/* Runs on the input thread */
+static void joystick_button_cb (guint number, gboolean pressed, gint64 time, DeckUI *ui) {
+    if (number < num_decks) {
+        if (pressed) {
+            deck_play_async (ui[number].deck);
+        } else {
+            deck_stop_async (ui[number].deck, joystick_stop);
         }
-        g_print ("joystick button %d = %d\n", e.number, e.value);
+    } else if (pressed) {
+        /* the buttons after the decks fire the carts, that's just an atomic store */
+        cart_fire (number - num_decks);
     }
-
-    return TRUE;
 }
 
-static void keyboard_handler(CustomData *data) {
+static void keyboard_handler(DeckUI *ui) {
     g_print ("Keyboard interaction, calling handler\n");
-    if (audio_is_playing(data)) {
-        stop_cb (NULL, data);
+    if (deck_is_playing(ui->deck)) {
+        stop_cb (NULL, ui);
     } else {
-        audio_play_player (data);
+        deck_play (ui->deck);
     }
 }
 
+static void cart_keyboard_handler(gpointer index) {
+    cart_toggle (GPOINTER_TO_UINT (index));
+}
+
 static void _add_hotkey (const gchar *hotkey, GtkAccelGroup *accelgroup,
                 GCallback callback, gpointer user_data) {
         GClosure *keycallback;
@@ -583,93 +878,46 @@ static void _add_hotkey (const gchar *hotkey, GtkAccelGroup *accelgroup,
 }
 
 
-static void create_hotkeys(GtkWidget *main_window, CustomData *data) {
+static void create_hotkeys(GtkWidget *main_window, DeckUI *ui) {
     GtkAccelGroup *accelgroup;
 
     accelgroup = gtk_accel_group_new();
 
-    for (int i = 0; i < NUM_PLAYERS; i++) {
-        gchar *hotkey = g_strdup_printf("F%u", 9 + i);
+    /* F9 .. F12 for the first four decks, Shift-F1 .. Shift-F12 for the next */
+    for (guint i = 0; i < num_decks && i < DECK_HOTKEYS; i++) {
+        gchar *hotkey = (i < 4) ? g_strdup_printf("F%u", 9 + i) :
+                g_strdup_printf("<Shift>F%u", i - 3);
 
-        _add_hotkey (hotkey, accelgroup, G_CALLBACK (keyboard_handler), &data[i]);
+        _add_hotkey (hotkey, accelgroup, G_CALLBACK (keyboard_handler), &ui[i]);
         g_free (hotkey);
     }
 
-    /* Bind the quit_all callback to ctrl-q */
-    _add_hotkey ("<Control>q", accelgroup, G_CALLBACK (quit_all), data);
-
-
-    gtk_window_add_accel_group (GTK_WINDOW (main_window), accelgroup);
-}
-
-static GIOChannel* create_joystick(CustomData *data) {
-    GIOChannel *io_channel;
-    int joyfd = open ("/dev/input/js0", O_RDONLY);
+    /* Ctrl-F1 .. Ctrl-F12 start and stop the carts */
+    for (guint i = 0; i < cart_bank_size() && i < MAX_CART_HOTKEYS; i++) {
+        gchar *hotkey = g_strdup_printf("<Control>F%u", 1 + i);
 
-    if (-1 == joyfd) {
-        perror ("Couldn't open /dev/input/js0");
-        return NULL;
+        _add_hotkey (hotkey, accelgroup, G_CALLBACK (cart_keyboard_handler), GUINT_TO_POINTER (i));
+        g_free (hotkey);
     }
 
-    io_channel = g_io_channel_unix_new (joyfd);
-
-    g_io_channel_set_encoding (io_channel, NULL, NULL);
+    /* Bind the quit_all callback to ctrl-q */
+    _add_hotkey ("<Control>q", accelgroup, G_CALLBACK (quit_all), ui);
 
-    g_io_add_watch (io_channel, G_IO_IN | G_IO_PRI, (GIOFunc)joystick_handler, data);
 
-    return io_channel;
+    gtk_window_add_accel_group (GTK_WINDOW (main_window), accelgroup);
 }
 
-static gchar *dummyuri(void) {
-        return g_strdup_printf ("file:///");
-}
+/* Every joystick under /dev/input, including ones plugged in later */
+static InputThread* create_joystick(DeckUI *ui) {
+    InputThread *input = input_thread_new ((InputButtonFunc)joystick_button_cb, ui);
 
-static gchar* make_silence(void) {
-        const gchar silentwave[] = {0x52, 0x49, 0x46, 0x46, 0x24, 0x00, 0x00, 0x00, 0x57,
-                0x41, 0x56, 0x45, 0x66, 0x6D, 0x74, 0x20, 0x10, 0x00, 0x00, 0x00,
-                0x01, 0x00, 0x02, 0x00, 0x80, 0xBB, 0x00, 0x00, 0x00, 0xEE, 0x02,
-                0x00, 0x04, 0x00, 0x10, 0x00, 0x64, 0x61, 0x74, 0x61, 0x00, 0x00,
-                0x00, 0x00};
-        GError *error = NULL;
-        gchar *tmpfilename;
-        GIOChannel *outfile;
-        gsize bytes_written;
-
-        g_clear_error (&error);
-        gint fd = g_file_open_tmp (NULL, &tmpfilename, &error);
-
-        if (-1 == fd) {
-                g_print ("Unable to create tmp file: %s\n", error->message);
-                g_error_free (error);
-                return dummyuri();
-        }
+    input_thread_watch_dir (input, "/dev/input");
+    input_thread_start (input);
 
-        outfile = g_io_channel_unix_new (fd);
-
-        /* make it a binary channel */
-        if (G_IO_STATUS_NORMAL != g_io_channel_set_encoding (outfile, NULL, NULL)) {
-                g_print ("Unable to create tmpfile in binary mode\n");
-                return dummyuri();
-        }
-
-        g_print ("File is %lu\n", sizeof(*silentwave));
-
-        g_clear_error (&error);
-        if (G_IO_STATUS_NORMAL != g_io_channel_write_chars (outfile, &silentwave[0], sizeof(silentwave), &bytes_written, &error)) {
-                g_print ("Unable to write to tmpfile: %s\n", error->message);
-                g_error_free (error);
-                return dummyuri();
-        }
-
-        g_io_channel_shutdown (outfile, TRUE, NULL);
-        g_io_channel_unref (outfile);
-
-        close(fd);
-
-        return g_filename_to_uri (tmpfilename, NULL, NULL);
+    return input;
 }
 
-static void _configfile (CustomData *data, gboolean writemode) {
+static void _configfile (DeckUI *ui, gboolean writemode) {
     gchar *filename = g_strdup_printf("file://%s/.4deckradio", g_get_home_dir());
     g_print ("config file: %s\n", filename);
     GFile *file = g_file_new_for_uri (filename);
@@ -677,9 +925,9 @@ static void _configfile (CustomData *data, gboolean writemode) {
     if (TRUE == writemode) {
         /* Save the last folder locations to ~/.4deckradio */
         GString *configstring = g_string_new("");
-        for (int i=0; i < NUM_PLAYERS; i++) {
-            g_print ("deck %i folder %s\n", i, data[i].last_folder_uri);
-            g_string_append_printf (configstring, "%s\n", data[i].last_folder_uri);
+        for (guint i = 0; i < num_decks; i++) {
+            g_print ("deck %u folder %s\n", i, ui[i].last_folder_uri);
+            g_string_append_printf (configstring, "%s\n", ui[i].last_folder_uri);
         }
 
         g_file_replace_contents (file,
@@ -698,27 +946,29 @@ static void _configfile (CustomData *data, gboolean writemode) {
                 NULL,
                 NULL);
         if (NULL == inputstream) {
-            return;
+            goto out;
         }
 
         GDataInputStream *config = g_data_input_stream_new (G_INPUT_STREAM (inputstream));
 
         if (NULL == config) {
-            return;
+            g_object_unref (inputstream);
+            goto out;
         }
 
 
         GError *error = NULL;
 
-        for (int i = 0; i < NUM_PLAYERS; i++) {
+        for (guint i = 0; i < num_decks; i++) {
             gsize length;
-            data[i].last_folder_uri =
+            g_free (ui[i].last_folder_uri);
+            ui[i].last_folder_uri =
                 g_data_input_stream_read_line_utf8(config, &length, NULL, &error);
             if (NULL != error) {
                 g_print ("Error reading config file: %s\n", error->message);
             }
             g_clear_error (&error);
-            g_print ("Will use %s for deck %i\n", data[i].last_folder_uri, i);
+            g_print ("Will use %s for deck %u\n", ui[i].last_folder_uri, i);
         }
 
         g_input_stream_close (G_INPUT_STREAM (config), NULL, NULL);
@@ -726,28 +976,50 @@ static void _configfile (CustomData *data, gboolean writemode) {
         g_object_unref (config);
         g_object_unref (inputstream);
     }
+
+out:
     g_free (filename);
     g_object_unref (file);
 }
 
-static inline void load_configfile (CustomData *data) {
-    _configfile (data, FALSE);
+static inline void load_configfile (DeckUI *ui) {
+    _configfile (ui, FALSE);
 }
 
-static inline void save_configfile (CustomData *data) {
-    _configfile (data, TRUE);
+static inline void save_configfile (DeckUI *ui) {
+    _configfile (ui, TRUE);
 }
 
 
 int main(int argc, char *argv[]) {
-    CustomData data[NUM_PLAYERS];
+    CustomData *data;
+    DeckUI *ui;
     GtkWidget *main_window;
     GtkWidget *main_grid;
-    GIOChannel *io_joystick;
+    InputThread *input;
     GError *error = NULL;
 
     gboolean fullscreen = FALSE;
+    gint decks = DECK_DEFAULT_COUNT;
+    guint columns = 2;
     int autoconnect = 0;
+    gboolean use_engine = FALSE;
+    gboolean jack_stats = FALSE;
+    gboolean no_restore = FALSE;
+    gchar **carts = NULL;
+    gchar **library_dirs = NULL;
+    gdouble cue_threshold = WAVEFORM_DEFAULT_CUE_THRESHOLD;
+    gboolean accurate_seek = FALSE;
+    gint prebuffer_ms = AUDIO_DEFAULT_PREBUFFER_MS;
+    gint reconnect_s = DECK_DEFAULT_RECONNECT_S;
+    gchar *metrics_socket = NULL;
+    gchar *control_socket = NULL;
+    gint segue_ms = -1;
+    gint fade_ms = -1;
+    gchar *fade_curve = NULL;
+    gchar *resample = NULL;
+    EngineFadeCurve curve = ENGINE_FADE_EQUAL_POWER;
+    AudioInit *audio_init;
 
     GOptionEntry option_entries[] = {
         { "fullscreen", 'f', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
@@ -760,9 +1032,44 @@ int main(int argc, char *argv[]) {
             &yellow, "Background colour until 75\% elapsed", "#ffff00" },
         { "red", 'r', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
             &red, "Background colour until 100\% elapsed", "#ff0000" },
+        { "decks", 'n', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &decks, "Number of decks (4)", "N" },
+        { "cart", 'c', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_FILENAME_ARRAY,
+            &carts, "Keep FILE decoded in the cart bank (repeatable)", "FILE" },
+        { "library", 'l', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_FILENAME_ARRAY,
+            &library_dirs, "Search the audio files below DIR instead of browsing (repeatable)", "DIR" },
+        { "cue-threshold", 't', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_DOUBLE,
+            &cue_threshold, "Start and end files where they are louder than DB dBFS (-50)", "DB" },
+        { "accurate-seek", 'x', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
+            &accurate_seek, "Seek to the exact sample, with seek tables built in the background", NULL },
+        { "prebuffer", 'b', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &prebuffer_ms, "Hold MS of a network stream before playing it (1000)", "MS" },
+        { "reconnect", 'R', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &reconnect_s, "Keep reconnecting a stream that dropped on air for S seconds (30)", "S" },
+        { "engine", 'e', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
+            &use_engine, "Play all decks through a single jack client", NULL },
+        { "segue", 'o', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &segue_ms, "Start the next prerolled deck MS before the playing one ends (engine only)", "MS" },
+        { "fade", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &fade_ms, "Crossfade over MS, the whole overlap by default", "MS" },
+        { "fade-curve", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+            &fade_curve, "linear, equal-power or s-curve (equal-power)", "CURVE" },
+        { "resample", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+            &resample, "Resampler quality, low, medium or high, for all or per file, stream, "
+                "cart, analysis or deckN (medium)", "[CLASS=]QUALITY,..." },
+        { "no-restore", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
+            &no_restore, "Start with empty decks instead of the last session", NULL },
+        { "jack-stats", 's', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
+            &jack_stats, "Print jack xruns, DSP load and deck drift every few seconds", NULL },
+        { "metrics", 'm', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_FILENAME,
+            &metrics_socket, "Serve per-deck counters on the Unix socket SOCKET", "SOCKET" },
+        { "control", 'k', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_FILENAME,
+            &control_socket, "Take commands on the Unix socket SOCKET, as 4deckradiod does", "SOCKET" },
         { NULL, ' ', 0, 0, NULL, NULL, NULL }
     };
 
+    startup_mark ("before main");
+
     /* Initialize GTK */
     if ( gtk_init_with_args (&argc, &argv, NULL, option_entries, NULL, &error) != TRUE )
     {
@@ -774,29 +1081,95 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (decks < 1 || decks > DECK_MAX_COUNT) {
+        g_printerr ("Between 1 and %d decks, please\n", DECK_MAX_COUNT);
+        return 1;
+    }
+    num_decks = decks;
+
+    if (NULL != fade_curve && !engine_fade_curve_parse (fade_curve, &curve)) {
+        g_printerr ("Unknown fade curve: %s\n", fade_curve);
+        return 1;
+    }
+
+    if (NULL != resample && !resample_config_parse (resample)) {
+        g_printerr ("Unknown resampler quality: %s\n", resample);
+        return 1;
+    }
+
+    startup_mark ("gtk_init");
+
     /* Initialize GStreamer */
     gst_init (&argc, &argv);
+    startup_mark ("gst_init");
 
-    /* Initialize our data structure */
-    memset (&data, 0, sizeof (data));
+    /* Without the engine each deck gets its own jackaudiosink */
+    if (use_engine) {
+        engine_init (num_decks, autoconnect);
+    }
+
+    if (jack_stats) {
+        engine_stats_init ();
+    }
+
+    /* One clock for all deck pipelines, counting jack frames */
+    jackclock_init ();
+    startup_mark ("engine and clock");
+
+    /* The pipelines are built on other threads while we build the window */
+    data = g_new0 (CustomData, num_decks);
+    ui = g_new0 (DeckUI, num_decks);
+    all_decks = ui;
+    audio_init = audio_init_decks_start (data, num_decks, autoconnect);
+
+    /* Decode the carts in the background while we build the decks */
+    cart_bank_init (carts, autoconnect);
+
+    /* Overviews are analysed in the background, never on the GTK thread */
+    waveform_init ();
+    waveform_set_cue_threshold (cue_threshold);
+
+    if (accurate_seek) {
+        audio_set_accurate_seek (TRUE);
+        seektable_init ();
+    }
+
+    audio_set_prebuffer (MAX (prebuffer_ms, 0));
+    deck_set_reconnect_window (MAX (reconnect_s, 0));
+
+    /* Scanned and kept up to date in the background, searched from memory */
+    if (NULL != library_dirs) {
+        library_init (library_dirs, (LibraryChangedFunc)library_changed_cb, ui);
+    }
+
+    {
+        DeckCallbacks callbacks = { deck_state_cb, deck_error_cb, deck_swapped_cb,
+            deck_seeked_cb, deck_queued_cb };
+        deck_set_callbacks (&callbacks);
+    }
+    startup_mark ("background services");
 
     main_window = create_mainwindow();
 
     main_grid = gtk_grid_new();
 
     /* Load config */
-    load_configfile(data);
+    load_configfile(ui);
 
 
     gtk_grid_set_row_spacing (GTK_GRID (main_grid), 30);
     gtk_grid_set_column_spacing (GTK_GRID (main_grid), 30);
 
-    for (int i=0; i < NUM_PLAYERS; i++) {
-        GtkWidget *playerUI = init_player (&data[i], i, autoconnect);
-        data[i].mainwindow = main_window;
+    /* two columns for up to four decks, then as square as it gets */
+    while (columns * columns < num_decks) {
+        columns++;
+    }
 
-        /* two columns (i%2) in (i/2) rows */
-        gtk_grid_attach (GTK_GRID (main_grid), playerUI, i % 2, i / 2, 1, 1);
+    for (guint i = 0; i < num_decks; i++) {
+        GtkWidget *playerUI = init_player (&ui[i], &data[i], i);
+        ui[i].mainwindow = main_window;
+
+        gtk_grid_attach (GTK_GRID (main_grid), playerUI, i % columns, i / columns, 1, 1);
     }
 
     /* force main_grid to be homogeneous, so all player UIs remain stable
@@ -815,42 +1188,109 @@ int main(int argc, char *argv[]) {
     }
 
     gtk_widget_show_all (main_window);
+    g_signal_connect (G_OBJECT (main_window), "draw", G_CALLBACK (first_frame_cb), ui);
+    startup_mark ("window");
+
+    if (!audio_init_decks_finish (audio_init)) {
+        g_printerr ("Not all decks could be set up\n");
+    }
+    for (guint i = 0; i < num_decks; i++) {
+        init_deck (&ui[i]);
+    }
+    startup_mark ("pipelines");
+
+    /* Follow the decks' positions in step with the display's frames */
+    gtk_widget_add_tick_callback (main_window, (GtkTickCallback)ui_tick_cb, ui, NULL);
 
     {
-            /* ugly hack to expose the jack ports until jackaudiosink is fixed */
-            gchar *tmpfileuri = make_silence();
-
-            /* enable file selection signals */
-            for (int i=0; i < NUM_PLAYERS; i++) {
-                    g_signal_handler_unblock (data[i].filechooser,
-                                    data[i].file_selection_signal_id);
-                    audio_set_uri(&data[i], tmpfileuri);
-                    audio_pause_player(&data[i]);
+            /* ugly hack to expose the jack ports until jackaudiosink is fixed.
+             * The engine has its ports already, and its decks stay idle
+             * (no streaming threads) until something is loaded.
+             */
+            gchar *tmpfileuri = engine_is_running () ? NULL : audio_make_silence();
+
+            for (guint i = 0; i < num_decks; i++) {
+                    if (NULL != tmpfileuri) {
+                            deck_load(&data[i], tmpfileuri);
+                    }
             }
 
             g_free (tmpfileuri);
     }
 
+    /* Every deck prerolls what it had last time, all at once */
+    session_init ("4deckradio", data, num_decks, !no_restore,
+            (SessionRestoredFunc)session_restored_cb, ui);
+    startup_mark ("session");
+
+
+    /* Scraped on a thread of its own, from the decks' atomic counters */
+    if (NULL != metrics_socket) {
+        metrics_init (metrics_socket, data, num_decks);
+    }
+
+    if (jack_stats) {
+        jackclock_report_start (data, num_decks);
+    }
+
+    /* Segues by the engine, the F-keys still start any deck by hand */
+    if (segue_ms >= 0) {
+        segue_init (data, num_decks, segue_ms, (fade_ms >= 0) ? fade_ms : segue_ms, curve);
+    }
+
+    /* The same commands as the buttons, from other programs */
+    if (NULL != control_socket) {
+        ControlCallbacks callbacks = { control_load_cb, control_stop_cb };
+
+        control_init (control_socket, data, num_decks, &callbacks);
+    }
 
-    create_hotkeys(main_window, data);
+    create_hotkeys(main_window, ui);
 
-    io_joystick = create_joystick(data);
+    input = create_joystick(ui);
+    startup_mark ("controls");
 
     /* Start the GTK main loop. We will not regain control until gtk_main_quit is called. */
     gtk_main ();
 
-    if (NULL != io_joystick) {
-        g_io_channel_shutdown (io_joystick, FALSE, NULL);
-        g_io_channel_unref (io_joystick);
-    }
+    /* no more deck commands from here on */
+    input_thread_free (input);
+    control_shutdown ();
+    metrics_shutdown ();
+    segue_shutdown ();
+    schedule_shutdown ();
+    session_shutdown ();
+
 
+    save_configfile (ui);
 
-    save_configfile (data);
+    /* Stop the process callback before the rings and carts go away */
+    engine_stats_free ();
+    engine_free ();
+    waveform_shutdown ();
+    seektable_shutdown ();
+    library_shutdown ();
 
     /* Free resources */
-    for (int i=0; i < NUM_PLAYERS; i++) {
-        gst_element_set_state (data[i].pipeline, GST_STATE_NULL);
-        gst_object_unref (data[i].pipeline);
+    for (guint i = 0; i < num_decks; i++) {
+        deck_free (&data[i]);
+        deck_print_stats (&data[i]);
+        free_audio (&data[i]);
+        waveform_free (ui[i].waveform);
+        g_free (ui[i].waveform_uri);
+        g_free (ui[i].last_folder_uri);
     }
+
+    jackclock_shutdown ();
+    g_free (ui);
+    all_decks = NULL;
+    g_free (data);
+    cart_bank_free ();
+    g_strfreev (carts);
+    g_strfreev (library_dirs);
+    g_free (metrics_socket);
+    g_free (control_socket);
+    g_free (fade_curve);
+    g_free (resample);
     return 0;
 }
@@ -15,31 +15,95 @@
         GST_CLOCK_TIME_IS_VALID (t) ? \
         (guint) ((((GstClockTime)(t)) / GST_SECOND) % 60) : 99
 
+#define HMS_TENTHS_FORMAT HMS_TIME_FORMAT ".%u"
 
-/* Structure to contain all our information, so we can pass it around */
-typedef struct _CustomData {
-    GstElement *pipeline;           /* Our one and only pipeline */
+#define HMS_TENTHS_ARGS(t) \
+        HMS_TIME_ARGS(t), \
+        GST_CLOCK_TIME_IS_VALID (t) ? \
+        (guint) ((((GstClockTime)(t)) / (GST_SECOND / 10)) % 10) : 9
+
+
+/* Decks are allocated at startup, --decks picks how many */
+#define DECK_DEFAULT_COUNT 4
+#define DECK_MAX_COUNT 64
+
+/* States of the per-deck state machine, see deck.c */
+typedef enum {
+    DECK_EMPTY,                     /* Nothing loaded yet */
+    DECK_STOPPED,                   /* Pipeline is in READY */
+    DECK_LOADING,                   /* Prerolling, waiting for ASYNC_DONE */
+    DECK_PAUSED,                    /* Prerolled, ready to play */
+    DECK_STARTING,                  /* Waiting for PLAYING */
+    DECK_PLAYING,
+    DECK_PAUSING,                   /* Waiting for PAUSED */
+    DECK_STOPPING,                  /* Waiting for READY */
+    DECK_ERROR,                     /* Last transition failed or timed out */
+    DECK_NUM_STATES
+} DeckState;
+
+/* Time spent in a state before taking a given edge */
+typedef struct _DeckEdgeStats {
+    guint count;
+    gint64 total_us;
+    gint64 max_us;
+} DeckEdgeStats;
+
+
+/* One decoding chain: uridecodebin ! audioconvert ! volume ! audioresample ! sink.
+ * The sink is a jackaudiosink, or an appsink feeding the engine (engine.c).
+ */
+typedef struct _AudioChain {
+    GstElement *pipeline;
     GstElement *audioconvert;
+    GstElement *volume;             /* Loudness normalisation of the current file */
     GstElement *audioresample;
     GstElement *uridecodebin;
-    GstElement *jackaudiosink;
+    GstElement *audiosink;
+    struct _EngineSlot *slot;       /* Only set in engine mode */
+    guint deck;                     /* Index of the deck it belongs to */
+    struct _SeekTable *seektable;   /* Of the current file, for its parser */
+    struct _ChainMetrics *metrics;
+    GstBus *bus;                    /* Bus of the pipeline, used to tell the chains apart */
 
-    GtkWidget *slider;              /* Slider widget to keep track of current position */
-    GtkWidget *taglabel;
-    GtkWidget *timelabel;
-    GtkWidget *playPauseButton;
-    GtkWidget *filechooser;
-    GtkWidget *mainwindow;
-
-    gchar *nextfile_uri;            /* URI of the next audio file/URL to play */
-    gchar *last_folder_uri;         /* URI of the last selected folder */
-    gulong slider_update_signal_id; /* Signal ID for the slider update signal */
+    GstState state;                 /* Current state of the pipeline */
+    gchar *uri;                     /* What's loaded, main loop only */
+    gboolean is_network_stream;     /* Current URI might not be a local file */
+    gint64 cue_in;                  /* First audible sample, in nanoseconds */
+    gint64 cue_out;                 /* Where the audio ends, GST_CLOCK_TIME_NONE if unknown */
+    gboolean cues_unknown;          /* Not analysed yet, cues may still move */
+    gint pending_jobs;              /* Jobs queued for this chain on the deck worker */
+    guint loads_pending;            /* Queued jobs that haven't given the pipeline uri yet, main loop only */
+} AudioChain;
 
-    gulong file_selection_signal_id;
+/* One deck: its two chains and its state machine. Nothing in here is
+ * specific to a user interface, see daemon.c and mygstreamer.c.
+ */
+typedef struct _CustomData {
+    AudioChain *active;             /* The chain we are listening to */
+    AudioChain *standby;            /* Prerolls nextfile_uri while the active chain plays */
+    guint decknumber;
 
-    GstState state;                 /* Current state of the pipeline */
+    gchar *nextfile_uri;            /* URI of the next audio file/URL to play */
+    struct _Playlist *playlist;     /* Played through, NULL for single files */
+    gboolean next_from_playlist;    /* nextfile_uri is the playlist's next entry */
     gint64 duration;                /* Duration of the clip, in nanoseconds */
-    gboolean is_network_stream;	    /* Current URI might not be a local file */
+
+    DeckState deckstate;            /* Where the deck state machine is */
+    GMutex input_lock;              /* Guards deckstate, active, nextfile_uri and cues from the input thread */
+    guint state_serial;             /* Bumped on every deckstate change */
+    gint64 state_since;             /* Monotonic time deckstate was entered */
+    guint timeout_id;               /* Puts the deck into DECK_ERROR if a transition hangs */
+    gboolean play_when_ready;       /* Start playing as soon as prerolling is done */
+    gint64 swapped_at;              /* Monotonic time of the stop/EOS that swapped, 0 once settled */
+    gint queued_seeks;              /* Seeks not yet run by the worker */
+    gint64 stream_lost;             /* Monotonic time the stream on air dropped, 0 if it didn't */
+    guint reconnects;               /* Attempts since then */
+    guint reconnect_id;             /* Next attempt */
+    gint64 rebuffering_since;       /* The stream on air ran dry and is held in PAUSED */
+    GThreadPool *worker;            /* Runs this deck's blocking state changes */
+    DeckEdgeStats edges[DECK_NUM_STATES][DECK_NUM_STATES];
+    struct _DeckMetrics *metrics;   /* Shared with both chains, see metrics.c */
+    gpointer user_data;             /* Whatever drives the deck, for the callbacks */
 } CustomData;
 
 #endif /* _MYGSTREAMER_H */
@@ -0,0 +1,226 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <glib.h>
+#include "playlist.h"
+
+/*
+ * Playlists are never read as a whole. A Playlist is the name of the file
+ * and the offset of the next line in it; playlist_next() maps the file,
+ * reads on from there until it finds an entry and unmaps it again. So a
+ * deck holds a list of any length in constant memory, and the first entry
+ * is there after a line or two, however long the rest is.
+ *
+ * Entries are resolved as they are taken: relative paths against the
+ * playlist's folder, and local files that don't exist (any more) are
+ * skipped.
+ *
+ * M3U and M3U8: a path or URI per line, # starts a comment or #EXTINF.
+ * PLS: the FileN= lines in the order they appear, the rest of the
+ * [playlist] section is ignored. Only local playlist files are read.
+ */
+
+typedef enum {
+    PLAYLIST_M3U,
+    PLAYLIST_PLS
+} PlaylistFormat;
+
+struct _Playlist {
+    gchar *uri;
+    gchar *filename;
+    gchar *dir;                     /* Relative entries are below it */
+    PlaylistFormat format;
+    gsize offset;                   /* Of the next line to read */
+    gsize last_offset;              /* Of the last entry handed out */
+    guint position;                 /* Entries handed out */
+};
+
+static const gchar *m3u_suffixes[] = { ".m3u", ".m3u8" };
+static const gchar *pls_suffixes[] = { ".pls" };
+
+static gboolean has_suffix(const gchar *uri, const gchar **suffixes, guint n) {
+    gsize length = strlen (uri);
+
+    for (guint i = 0; i < n; i++) {
+        gsize suffix = strlen (suffixes[i]);
+
+        if (length > suffix && 0 == g_ascii_strcasecmp (uri + length - suffix, suffixes[i])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Going by the name, like the file chooser does */
+gboolean playlist_is_playlist(const gchar *uri) {
+    return has_suffix (uri, m3u_suffixes, G_N_ELEMENTS (m3u_suffixes)) ||
+            has_suffix (uri, pls_suffixes, G_N_ELEMENTS (pls_suffixes));
+}
+
+/* Only looks at the file's name, nothing is read until playlist_next().
+ * NULL if uri isn't a local file.
+ */
+Playlist* playlist_open(const gchar *uri) {
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+    Playlist *playlist;
+
+    if (NULL == filename || !g_file_test (filename, G_FILE_TEST_IS_REGULAR)) {
+        g_free (filename);
+        return NULL;
+    }
+
+    playlist = g_new0 (Playlist, 1);
+    playlist->uri = g_strdup (uri);
+    playlist->filename = filename;
+    playlist->dir = g_path_get_dirname (filename);
+    playlist->format = has_suffix (uri, pls_suffixes, G_N_ELEMENTS (pls_suffixes)) ?
+        PLAYLIST_PLS : PLAYLIST_M3U;
+
+    return playlist;
+}
+
+/* The entry on a line, without surrounding blanks, or NULL if there is none */
+static gchar* parse_line(Playlist *playlist, const gchar *line, gsize length) {
+    /* UTF-8 byte order mark, some editors write it */
+    if (length >= 3 && 0 == memcmp (line, "\xef\xbb\xbf", 3)) {
+        line += 3;
+        length -= 3;
+    }
+
+    while (length > 0 && g_ascii_isspace (*line)) {
+        line++;
+        length--;
+    }
+    while (length > 0 && g_ascii_isspace (line[length - 1])) {
+        length--;
+    }
+
+    if (PLAYLIST_M3U == playlist->format) {
+        if (0 == length || '#' == line[0]) {
+            return NULL;
+        }
+        return g_strndup (line, length);
+    }
+
+    /* FileN=entry */
+    if (length > 4 && 0 == g_ascii_strncasecmp (line, "file", 4)) {
+        gsize i = 4;
+
+        while (i < length && g_ascii_isdigit (line[i])) {
+            i++;
+        }
+        if (i > 4 && i < length && '=' == line[i]) {
+            return g_strndup (line + i + 1, length - i - 1);
+        }
+    }
+    return NULL;
+}
+
+/* The URI of an entry, NULL if it's a local file that isn't there */
+static gchar* resolve(Playlist *playlist, const gchar *entry) {
+    gchar *path, *uri;
+
+    if (NULL != strstr (entry, "://")) {
+        if (!g_str_has_prefix (entry, "file://")) {
+            return g_strdup (entry);
+        }
+        path = g_filename_from_uri (entry, NULL, NULL);
+    } else if (g_path_is_absolute (entry)) {
+        path = g_strdup (entry);
+    } else {
+        path = g_build_filename (playlist->dir, entry, NULL);
+    }
+
+    if (NULL == path || !g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+        g_printerr ("%s: skipping %s, no such file\n", playlist->filename, entry);
+        g_free (path);
+        return NULL;
+    }
+
+    uri = g_filename_to_uri (path, NULL, NULL);
+    g_free (path);
+    return uri;
+}
+
+/* The URI of the next entry, NULL at the end of the list */
+gchar* playlist_next(Playlist *playlist) {
+    GMappedFile *file = g_mapped_file_new (playlist->filename, FALSE, NULL);
+    const gchar *contents;
+    gsize length;
+    gchar *uri = NULL;
+
+    if (NULL == file) {
+        return NULL;
+    }
+    contents = g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+
+    /* an empty file maps to NULL */
+    while (NULL == uri && NULL != contents && playlist->offset < length) {
+        const gchar *line = contents + playlist->offset;
+        const gchar *end = memchr (line, '\n', length - playlist->offset);
+        gsize start = playlist->offset;
+        gsize line_length = (NULL != end) ? (gsize)(end - line) : length - start;
+        gchar *entry;
+
+        playlist->offset += line_length + (NULL != end);
+        entry = parse_line (playlist, line, line_length);
+        if (NULL == entry) {
+            continue;
+        }
+
+        uri = resolve (playlist, entry);
+        if (NULL != uri) {
+            playlist->last_offset = start;
+            playlist->position++;
+        }
+        g_free (entry);
+    }
+
+    g_mapped_file_unref (file);
+    return uri;
+}
+
+/* Hand out the last entry again on the next playlist_next(). One level. */
+void playlist_unread(Playlist *playlist) {
+    if (playlist->position > 0 && playlist->offset != playlist->last_offset) {
+        playlist->offset = playlist->last_offset;
+        playlist->position--;
+    }
+}
+
+/* Entries handed out so far */
+guint playlist_get_position(Playlist *playlist) {
+    return playlist->position;
+}
+
+/* Where the next entry is read from, to come back to it later */
+gsize playlist_get_offset(Playlist *playlist) {
+    return playlist->offset;
+}
+
+/* Carry on from offset, as given by playlist_get_offset(), with position
+ * entries handed out before
+ */
+void playlist_set_cursor(Playlist *playlist, gsize offset, guint position) {
+    playlist->offset = offset;
+    playlist->last_offset = offset;
+    playlist->position = position;
+}
+
+const gchar* playlist_get_uri(Playlist *playlist) {
+    return playlist->uri;
+}
+
+void playlist_free(Playlist *playlist) {
+    if (NULL == playlist) {
+        return;
+    }
+
+    g_free (playlist->uri);
+    g_free (playlist->filename);
+    g_free (playlist->dir);
+    g_free (playlist);
+}
@@ -0,0 +1,21 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _PLAYLIST_H
+#define _PLAYLIST_H
+
+/* A cursor into an M3U or PLS file, see playlist.c */
+typedef struct _Playlist Playlist;
+
+gboolean playlist_is_playlist(const gchar *uri);
+Playlist* playlist_open(const gchar *uri);
+gchar* playlist_next(Playlist *playlist);
+void playlist_unread(Playlist *playlist);
+guint playlist_get_position(Playlist *playlist);
+gsize playlist_get_offset(Playlist *playlist);
+void playlist_set_cursor(Playlist *playlist, gsize offset, guint position);
+const gchar* playlist_get_uri(Playlist *playlist);
+void playlist_free(Playlist *playlist);
+
+#endif /* _PLAYLIST_H */
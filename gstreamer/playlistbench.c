@@ -0,0 +1,162 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "playlist.h"
+
+/*
+ * Playlist benchmark.
+ *
+ * Writes an M3U and a PLS playlist with --entries lines to the temp dir,
+ * all pointing at one empty file next to them, and reads each the way a
+ * deck does: the time to the first entry, the time per entry after that,
+ * and how much the process grew while walking the whole list.
+ *
+ *     ./4deckradio-playlistbench --entries 100000
+ */
+
+/* In kB, from /proc/self/status */
+static guint status_field(const gchar *name) {
+    gchar *contents = NULL;
+    guint value = 0;
+
+    if (g_file_get_contents ("/proc/self/status", &contents, NULL, NULL)) {
+        gchar *line = strstr (contents, name);
+
+        if (NULL != line) {
+            value = (guint)strtoul (line + strlen (name), NULL, 10);
+        }
+    }
+
+    g_free (contents);
+    return value;
+}
+
+static gboolean write_playlist(const gchar *path, gboolean pls, guint entries) {
+    GString *out = g_string_sized_new (entries * 24);
+    gboolean ok;
+
+    if (pls) {
+        g_string_append (out, "[playlist]\n");
+    } else {
+        g_string_append (out, "#EXTM3U\n");
+    }
+
+    for (guint i = 1; i <= entries; i++) {
+        if (pls) {
+            g_string_append_printf (out, "File%u=entry.flac\nTitle%u=Entry %u\nLength%u=-1\n",
+                    i, i, i, i);
+        } else {
+            g_string_append_printf (out, "#EXTINF:-1,Entry %u\nentry.flac\n", i);
+        }
+    }
+
+    if (pls) {
+        g_string_append_printf (out, "NumberOfEntries=%u\nVersion=2\n", entries);
+    }
+
+    ok = g_file_set_contents (path, out->str, out->len, NULL);
+    g_string_free (out, TRUE);
+    return ok;
+}
+
+static void run(const gchar *path, guint entries) {
+    gchar *uri = g_filename_to_uri (path, NULL, NULL);
+    gint64 start, first, end;
+    guint rss_before, rss_after;
+    Playlist *playlist;
+    gchar *entry;
+    guint n = 1;
+
+    start = g_get_monotonic_time ();
+    playlist = playlist_open (uri);
+    entry = (NULL != playlist) ? playlist_next (playlist) : NULL;
+    first = g_get_monotonic_time ();
+
+    if (NULL == entry) {
+        g_printerr ("No entries in %s\n", path);
+        playlist_free (playlist);
+        g_free (uri);
+        return;
+    }
+    g_free (entry);
+
+    rss_before = status_field ("VmRSS:");
+    while (NULL != (entry = playlist_next (playlist))) {
+        g_free (entry);
+        n++;
+    }
+    end = g_get_monotonic_time ();
+    rss_after = status_field ("VmRSS:");
+
+    g_print ("%-4s %8u entries  first %8.3f ms  then %6.2f us/entry  rss %+d kB\n",
+            g_str_has_suffix (path, ".pls") ? "pls" : "m3u", n,
+            (first - start) / 1000.0, (gdouble)(end - first) / MAX (n - 1, 1),
+            (gint)rss_after - (gint)rss_before);
+
+    if (n != entries) {
+        g_printerr ("Expected %u entries\n", entries);
+    }
+
+    playlist_free (playlist);
+    g_free (uri);
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar *dir, *target, *m3u, *pls;
+
+    gint entries = 100000;
+
+    GOptionEntry option_entries[] = {
+        { "entries", 'n', 0, G_OPTION_ARG_INT,
+            &entries, "Length of the playlists (100000)", "N" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- reading very long playlists");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    dir = g_dir_make_tmp ("4deckradio-playlistbench-XXXXXX", &error);
+    if (NULL == dir) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+
+    target = g_build_filename (dir, "entry.flac", NULL);
+    m3u = g_build_filename (dir, "list.m3u", NULL);
+    pls = g_build_filename (dir, "list.pls", NULL);
+
+    if (g_file_set_contents (target, "", 0, NULL) &&
+            write_playlist (m3u, FALSE, MAX (entries, 1)) &&
+            write_playlist (pls, TRUE, MAX (entries, 1))) {
+        run (m3u, MAX (entries, 1));
+        run (pls, MAX (entries, 1));
+    } else {
+        g_printerr ("Couldn't write the playlists to %s\n", dir);
+    }
+
+    g_unlink (m3u);
+    g_unlink (pls);
+    g_unlink (target);
+    g_rmdir (dir);
+
+    g_free (m3u);
+    g_free (pls);
+    g_free (target);
+    g_free (dir);
+    return 0;
+}
@@ -0,0 +1,425 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include "dsp.h"
+#include "resample.h"
+
+/*
+ * Resampler quality profiles, and the polyphase resampler the engine uses
+ * for decoders that don't run at the jack rate.
+ *
+ * A profile sets the filter length, the cutoff and the Kaiser window of
+ * the engine's resampler, and the quality of audioresample where a chain
+ * has no engine slot (jackaudiosink mode, carts, loudness analysis). The
+ * profile of a chain comes from what it decodes (file, stream, cart,
+ * analysis), unless its deck has one of its own:
+ *
+ *     --resample stream=low,file=high,deck3=medium
+ *
+ * For rate_in to rate_out, reduced to L/M, the filter bank holds L phases
+ * of windowed sinc, one per fractional position an output frame can fall
+ * on. A bank only depends on the rates and the profile, so all decks share
+ * it; the banks for 44.1 and 48 kHz are built when the engine starts, the
+ * odd ones on first use. Each resampler only keeps its input history.
+ */
+
+#define RESAMPLE_MAX_PHASES 1024        /* L, 11025 -> 48000 needs 640 */
+#define RESAMPLE_MAX_DOWN 4             /* Widest rate_in / rate_out */
+#define RESAMPLE_MAX_DECKS 64          /* DECK_MAX_COUNT */
+
+typedef struct _ResampleProfile {
+    const gchar *name;
+    guint half;                     /* Taps each side of the centre, even */
+    gdouble cutoff;                 /* Fraction of the lower Nyquist */
+    gdouble beta;                   /* Of the Kaiser window */
+    gint gst_quality;               /* audioresample's, 0 to 10 */
+} ResampleProfile;
+
+static const ResampleProfile profiles[RESAMPLE_N_QUALITIES] = {
+    { "low", 8, 0.86, 5.0, 1 },
+    { "medium", 16, 0.92, 7.0, 4 },     /* audioresample's default */
+    { "high", 32, 0.96, 9.0, 8 },
+};
+
+static const gchar *class_names[RESAMPLE_N_CLASSES] = {
+    "file", "stream", "cart", "analysis"
+};
+
+/* Sample rates the engine takes from a decoder */
+static const guint common_rates[] = {
+    8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000, 88200, 96000, 176400, 192000
+};
+
+typedef struct _ResampleBank {
+    guint rate_in;
+    guint rate_out;
+    ResampleQuality quality;
+    guint phases;                   /* L */
+    guint step;                     /* M */
+    guint taps;
+    gfloat *coeffs;                 /* phases rows of taps */
+} ResampleBank;
+
+struct _Resampler {
+    const ResampleBank *bank;       /* NULL while the rates match */
+    guint rate_in;
+    guint rate_out;
+    ResampleQuality quality;
+    gfloat *left;                   /* Input not used up yet, deinterleaved */
+    gfloat *right;
+    guint size;
+    guint fill;
+    guint phase;                    /* Of the next output frame, 0 to L - 1 */
+};
+
+static ResampleQuality class_quality[RESAMPLE_N_CLASSES] = {
+    RESAMPLE_MEDIUM, RESAMPLE_MEDIUM, RESAMPLE_MEDIUM, RESAMPLE_MEDIUM
+};
+static gint deck_quality[RESAMPLE_MAX_DECKS];  /* Quality + 1, 0 if the class decides */
+
+static GMutex banks_lock;
+static GPtrArray *banks;            /* Kept for the life of the process */
+
+static gboolean quality_parse(const gchar *name, ResampleQuality *quality) {
+    for (guint i = 0; i < RESAMPLE_N_QUALITIES; i++) {
+        if (0 == strcmp (name, profiles[i].name)) {
+            *quality = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Comma separated: CLASS=PROFILE, deckN=PROFILE or a bare PROFILE for all
+ * classes. FALSE if anything in it made no sense.
+ */
+gboolean resample_config_parse(const gchar *spec) {
+    gchar **items = g_strsplit (spec, ",", -1);
+    gboolean ok = TRUE;
+
+    for (guint i = 0; NULL != items[i]; i++) {
+        gchar *item = g_strstrip (items[i]);
+        gchar *value = strchr (item, '=');
+        ResampleQuality quality;
+
+        if (NULL == value) {
+            if (!quality_parse (item, &quality)) {
+                ok = FALSE;
+                continue;
+            }
+            for (guint c = 0; c < RESAMPLE_N_CLASSES; c++) {
+                class_quality[c] = quality;
+            }
+            continue;
+        }
+
+        *value++ = '\0';
+        if (!quality_parse (value, &quality)) {
+            ok = FALSE;
+        } else if (g_str_has_prefix (item, "deck")) {
+            gchar *end;
+            guint64 deck = g_ascii_strtoull (item + strlen ("deck"), &end, 10);
+
+            if ('\0' != *end || deck < 1 || deck > RESAMPLE_MAX_DECKS) {
+                ok = FALSE;
+            } else {
+                deck_quality[deck - 1] = quality + 1;
+            }
+        } else {
+            guint c;
+
+            for (c = 0; c < RESAMPLE_N_CLASSES; c++) {
+                if (0 == strcmp (item, class_names[c])) {
+                    class_quality[c] = quality;
+                    break;
+                }
+            }
+            ok = ok && (c < RESAMPLE_N_CLASSES);
+        }
+    }
+
+    g_strfreev (items);
+    return ok;
+}
+
+/* deck counts from 0, -1 for chains that don't belong to one */
+ResampleQuality resample_get_quality(gint deck, ResampleClass klass) {
+    if (deck >= 0 && deck < RESAMPLE_MAX_DECKS && 0 != deck_quality[deck]) {
+        return deck_quality[deck] - 1;
+    }
+    return class_quality[klass];
+}
+
+gint resample_get_gst_quality(ResampleQuality quality) {
+    return profiles[quality].gst_quality;
+}
+
+const gchar* resample_quality_get_name(ResampleQuality quality) {
+    return profiles[quality].name;
+}
+
+static guint gcd(guint a, guint b) {
+    while (0 != b) {
+        guint t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+gboolean resample_supported(guint rate_in, guint rate_out) {
+    if (0 == rate_in || 0 == rate_out || rate_in > RESAMPLE_MAX_DOWN * rate_out) {
+        return FALSE;
+    }
+    return rate_out / gcd (rate_in, rate_out) <= RESAMPLE_MAX_PHASES;
+}
+
+/* For the caps of the engine's appsink: rate_out first, so it's what a
+ * decoder that can choose picks, then everything else we can resample
+ */
+gchar* resample_get_rates(guint rate_out) {
+    GString *rates = g_string_new (NULL);
+
+    g_string_append_printf (rates, "%u", rate_out);
+    for (guint i = 0; i < G_N_ELEMENTS (common_rates); i++) {
+        if (common_rates[i] != rate_out && resample_supported (common_rates[i], rate_out)) {
+            g_string_append_printf (rates, ", %u", common_rates[i]);
+        }
+    }
+
+    return g_string_free (rates, FALSE);
+}
+
+/* Zeroth order modified Bessel function of the first kind */
+static gdouble bessel_i0(gdouble x) {
+    gdouble sum = 1, term = 1;
+
+    for (guint k = 1; k < 50 && term > 1e-12 * sum; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static ResampleBank* bank_new(guint rate_in, guint rate_out, ResampleQuality quality) {
+    const ResampleProfile *profile = &profiles[quality];
+    ResampleBank *bank = g_new0 (ResampleBank, 1);
+    guint g = gcd (rate_in, rate_out);
+    gdouble ratio = (gdouble)rate_out / rate_in;
+    gdouble fc = profile->cutoff * MIN (1.0, ratio);
+    gdouble i0_beta = bessel_i0 (profile->beta);
+    guint half = profile->half;
+
+    /* going down, the filter gets as much longer as the passband narrows */
+    if (ratio < 1.0) {
+        half = 2 * (guint)ceil (half / ratio / 2);
+    }
+
+    bank->rate_in = rate_in;
+    bank->rate_out = rate_out;
+    bank->quality = quality;
+    bank->phases = rate_out / g;
+    bank->step = rate_in / g;
+    bank->taps = 2 * half;
+    bank->coeffs = g_new (gfloat, bank->phases * bank->taps);
+
+    for (guint p = 0; p < bank->phases; p++) {
+        gfloat *row = bank->coeffs + p * bank->taps;
+        gdouble frac = (gdouble)p / bank->phases;
+        gdouble sum = 0;
+
+        for (guint k = 0; k < bank->taps; k++) {
+            gdouble x = k - (half - 1.0) - frac;
+            gdouble u = x / half;
+            gdouble w = (fabs (u) < 1.0) ?
+                    bessel_i0 (profile->beta * sqrt (1.0 - u * u)) / i0_beta : 0.0;
+            gdouble s = (0.0 == x) ? 1.0 : sin (G_PI * fc * x) / (G_PI * fc * x);
+
+            row[k] = (gfloat)(fc * s * w);
+            sum += row[k];
+        }
+
+        /* unity gain at DC on every phase */
+        for (guint k = 0; k < bank->taps; k++) {
+            row[k] = (gfloat)(row[k] / sum);
+        }
+    }
+
+    return bank;
+}
+
+static const ResampleBank* get_bank(guint rate_in, guint rate_out, ResampleQuality quality) {
+    ResampleBank *bank = NULL;
+
+    g_mutex_lock (&banks_lock);
+    if (NULL == banks) {
+        banks = g_ptr_array_new ();
+    }
+
+    for (guint i = 0; i < banks->len; i++) {
+        ResampleBank *b = g_ptr_array_index (banks, i);
+
+        if (b->rate_in == rate_in && b->rate_out == rate_out && b->quality == quality) {
+            bank = b;
+            break;
+        }
+    }
+
+    if (NULL == bank) {
+        bank = bank_new (rate_in, rate_out, quality);
+        g_ptr_array_add (banks, bank);
+    }
+    g_mutex_unlock (&banks_lock);
+
+    return bank;
+}
+
+/* Build the banks most decoders will need before any streaming thread
+ * asks for them
+ */
+void resample_prepare(guint rate_out) {
+    const guint rates[] = { 44100, 48000 };
+
+    for (guint i = 0; i < G_N_ELEMENTS (rates); i++) {
+        if (rates[i] == rate_out || !resample_supported (rates[i], rate_out)) {
+            continue;
+        }
+        for (guint q = 0; q < RESAMPLE_N_QUALITIES; q++) {
+            get_bank (rates[i], rate_out, q);
+        }
+    }
+}
+
+Resampler* resampler_new(void) {
+    return g_new0 (Resampler, 1);
+}
+
+void resampler_free(Resampler *resampler) {
+    if (NULL == resampler) {
+        return;
+    }
+    g_free (resampler->left);
+    g_free (resampler->right);
+    g_free (resampler);
+}
+
+static void reserve(Resampler *resampler, guint frames) {
+    if (frames > resampler->size) {
+        resampler->size = frames;
+        resampler->left = g_renew (gfloat, resampler->left, frames);
+        resampler->right = g_renew (gfloat, resampler->right, frames);
+    }
+}
+
+/* Forget the history, the next input starts a new stream */
+void resampler_reset(Resampler *resampler) {
+    resampler->fill = 0;
+    resampler->phase = 0;
+
+    if (NULL != resampler->bank) {
+        /* centres the first output frame on the first input frame */
+        guint lead = resampler->bank->taps / 2 - 1;
+
+        reserve (resampler, lead);
+        memset (resampler->left, 0, lead * sizeof (gfloat));
+        memset (resampler->right, 0, lead * sizeof (gfloat));
+        resampler->fill = lead;
+    }
+}
+
+/* Cheap if nothing changed, otherwise resets */
+void resampler_configure(Resampler *resampler, guint rate_in, guint rate_out,
+        ResampleQuality quality) {
+    if (rate_in == resampler->rate_in && rate_out == resampler->rate_out &&
+            quality == resampler->quality) {
+        return;
+    }
+
+    resampler->rate_in = rate_in;
+    resampler->rate_out = rate_out;
+    resampler->quality = quality;
+    resampler->bank = (rate_in == rate_out || !resample_supported (rate_in, rate_out)) ?
+            NULL : get_bank (rate_in, rate_out, quality);
+    resampler_reset (resampler);
+}
+
+/* How many frames resampler_process() may return for n in, and
+ * resampler_drain() after that
+ */
+guint resampler_get_max_out(Resampler *resampler, guint n) {
+    const ResampleBank *bank = resampler->bank;
+
+    if (NULL == bank) {
+        return n;
+    }
+    return (guint)((guint64)(resampler->fill + n + bank->taps / 2) * bank->phases /
+            bank->step) + 1;
+}
+
+static guint run(Resampler *resampler, gfloat *out) {
+    const ResampleBank *bank = resampler->bank;
+    guint pos = 0, n = 0;
+
+    while (pos + bank->taps <= resampler->fill) {
+        dsp_dot_stereo (resampler->left + pos, resampler->right + pos,
+                bank->coeffs + resampler->phase * bank->taps, bank->taps, out + 2 * n);
+        n++;
+
+        resampler->phase += bank->step;
+        pos += resampler->phase / bank->phases;
+        resampler->phase %= bank->phases;
+    }
+
+    pos = MIN (pos, resampler->fill);
+    memmove (resampler->left, resampler->left + pos, (resampler->fill - pos) * sizeof (gfloat));
+    memmove (resampler->right, resampler->right + pos, (resampler->fill - pos) * sizeof (gfloat));
+    resampler->fill -= pos;
+
+    return n;
+}
+
+/* n interleaved stereo frames in, the frames due so far out. out holds
+ * at least resampler_get_max_out() frames. Copies if the rates match.
+ */
+guint resampler_process(Resampler *resampler, const gfloat *in, guint n, gfloat *out) {
+    if (NULL == resampler->bank) {
+        memcpy (out, in, 2 * n * sizeof (gfloat));
+        return n;
+    }
+
+    reserve (resampler, resampler->fill + n);
+    for (guint i = 0; i < n; i++) {
+        resampler->left[resampler->fill + i] = in[2 * i];
+        resampler->right[resampler->fill + i] = in[2 * i + 1];
+    }
+    resampler->fill += n;
+
+    return run (resampler, out);
+}
+
+/* At the end of the stream: what's still in the history, into out, which
+ * holds at least resampler_get_max_out (resampler, 0) frames
+ */
+guint resampler_drain(Resampler *resampler, gfloat *out) {
+    guint tail;
+    guint n;
+
+    if (NULL == resampler->bank) {
+        return 0;
+    }
+
+    tail = resampler->bank->taps / 2;
+    reserve (resampler, resampler->fill + tail);
+    memset (resampler->left + resampler->fill, 0, tail * sizeof (gfloat));
+    memset (resampler->right + resampler->fill, 0, tail * sizeof (gfloat));
+    resampler->fill += tail;
+
+    n = run (resampler, out);
+    resampler_reset (resampler);
+    return n;
+}
@@ -0,0 +1,43 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+typedef enum {
+    RESAMPLE_LOW,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_HIGH,
+    RESAMPLE_N_QUALITIES
+} ResampleQuality;
+
+/* What is being decoded, each has its own default quality */
+typedef enum {
+    RESAMPLE_CLASS_FILE,
+    RESAMPLE_CLASS_STREAM,
+    RESAMPLE_CLASS_CART,
+    RESAMPLE_CLASS_ANALYSIS,
+    RESAMPLE_N_CLASSES
+} ResampleClass;
+
+typedef struct _Resampler Resampler;
+
+gboolean resample_config_parse(const gchar *spec);
+ResampleQuality resample_get_quality(gint deck, ResampleClass klass);
+gint resample_get_gst_quality(ResampleQuality quality);
+const gchar* resample_quality_get_name(ResampleQuality quality);
+gboolean resample_supported(guint rate_in, guint rate_out);
+gchar* resample_get_rates(guint rate_out);
+void resample_prepare(guint rate_out);
+
+Resampler* resampler_new(void);
+void resampler_free(Resampler *resampler);
+void resampler_configure(Resampler *resampler, guint rate_in, guint rate_out,
+        ResampleQuality quality);
+void resampler_reset(Resampler *resampler);
+guint resampler_get_max_out(Resampler *resampler, guint n);
+guint resampler_process(Resampler *resampler, const gfloat *in, guint n, gfloat *out);
+guint resampler_drain(Resampler *resampler, gfloat *out);
+
+#endif /* _RESAMPLE_H */
@@ -0,0 +1,186 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <glib.h>
+#include "dsp.h"
+#include "resample.h"
+
+/*
+ * Resampler benchmark, CPU against quality.
+ *
+ * Runs the engine's resampler (see resample.c) over --seconds of noise
+ * per rate pair and quality profile, and prints its CPU time per deck as
+ * a share of one core and how many decks that leaves room for. Next to it
+ * is what the profile sounds like: the signal to noise ratio of a 1 kHz
+ * tone and of one at 80% of the lower Nyquist frequency, and going down,
+ * how far a tone just above the new Nyquist frequency is suppressed.
+ *
+ *     ./4deckradio-resamplebench --seconds 600 --rate 48000
+ */
+
+#define RESAMPLEBENCH_BUFFER_FRAMES 1024
+#define RESAMPLEBENCH_SKIP_FRAMES 256   /* Left out of the tone measurements */
+
+static inline gdouble thread_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One second of a tone at f, both channels. Returns the frames out. */
+static guint resample_tone(guint rate_in, guint rate_out, ResampleQuality quality,
+        gdouble f, gfloat **out) {
+    Resampler *resampler = resampler_new ();
+    gfloat *in = g_new (gfloat, 2 * rate_in);
+    guint n;
+
+    for (guint i = 0; i < rate_in; i++) {
+        in[2 * i] = in[2 * i + 1] = (gfloat)sin (2 * G_PI * f * i / rate_in);
+    }
+
+    resampler_configure (resampler, rate_in, rate_out, quality);
+    *out = g_new (gfloat, 2 * resampler_get_max_out (resampler, rate_in));
+    n = resampler_process (resampler, in, rate_in, *out);
+    n += resampler_drain (resampler, *out + 2 * n);
+
+    resampler_free (resampler);
+    g_free (in);
+    return n;
+}
+
+/* Against the same tone made at rate_out, in dB */
+static gdouble tone_snr(guint rate_in, guint rate_out, ResampleQuality quality, gdouble f) {
+    gfloat *out;
+    guint n = resample_tone (rate_in, rate_out, quality, f, &out);
+    gdouble signal = 0, noise = 0;
+
+    for (guint j = RESAMPLEBENCH_SKIP_FRAMES; j + RESAMPLEBENCH_SKIP_FRAMES < n; j++) {
+        gdouble ref = sin (2 * G_PI * f * j / rate_out);
+
+        signal += ref * ref;
+        noise += (out[2 * j] - ref) * (out[2 * j] - ref);
+    }
+
+    g_free (out);
+    return 10 * log10 (signal / MAX (noise, 1e-30));
+}
+
+/* Level of a full scale tone 5% above the new Nyquist frequency, in dB */
+static gdouble alias_level(guint rate_in, guint rate_out, ResampleQuality quality) {
+    gfloat *out;
+    guint n = resample_tone (rate_in, rate_out, quality, 0.525 * rate_out, &out);
+    gdouble power = 0;
+    guint count = 0;
+
+    for (guint j = RESAMPLEBENCH_SKIP_FRAMES; j + RESAMPLEBENCH_SKIP_FRAMES < n; j++) {
+        power += out[2 * j] * out[2 * j];
+        count++;
+    }
+
+    g_free (out);
+    return 10 * log10 (MAX (power / MAX (count, 1), 1e-30) / 0.5);
+}
+
+/* In percent of one core per deck */
+static gdouble cpu_load(guint rate_in, guint rate_out, ResampleQuality quality, gdouble seconds) {
+    Resampler *resampler = resampler_new ();
+    gfloat *in = g_new (gfloat, 2 * RESAMPLEBENCH_BUFFER_FRAMES);
+    gfloat *out;
+    guint64 frames = (guint64)(seconds * rate_in);
+    gdouble start, used;
+
+    for (guint i = 0; i < 2 * RESAMPLEBENCH_BUFFER_FRAMES; i++) {
+        in[i] = (gfloat)(rand () / (gdouble)RAND_MAX - 0.5);
+    }
+
+    resampler_configure (resampler, rate_in, rate_out, quality);
+    out = g_new (gfloat, 2 * resampler_get_max_out (resampler, RESAMPLEBENCH_BUFFER_FRAMES));
+
+    start = thread_seconds ();
+    for (guint64 done = 0; done < frames; done += RESAMPLEBENCH_BUFFER_FRAMES) {
+        resampler_process (resampler, in, RESAMPLEBENCH_BUFFER_FRAMES, out);
+    }
+    used = thread_seconds () - start;
+
+    resampler_free (resampler);
+    g_free (in);
+    g_free (out);
+    return 100.0 * used / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar **rates;
+
+    gchar *rate_list = NULL;
+    gdouble seconds = 600;
+    gint rate_out = 48000;
+
+    GOptionEntry option_entries[] = {
+        { "rates", 'i', 0, G_OPTION_ARG_STRING,
+            &rate_list, "Source rates (44100,48000,22050,96000)", "LIST" },
+        { "rate", 'r', 0, G_OPTION_ARG_INT,
+            &rate_out, "The jack rate (48000)", "HZ" },
+        { "seconds", 's', 0, G_OPTION_ARG_DOUBLE,
+            &seconds, "Audio per rate and quality (600)", "S" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- resampler CPU per deck against quality");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    rates = g_strsplit ((NULL != rate_list) ? rate_list : "44100,48000,22050,96000", ",", -1);
+    seconds = MAX (seconds, 1);
+
+    g_print ("kernels %s, %.0f s of audio per run\n", dsp_get_kernels (), seconds);
+    g_print ("%-16s %-7s %8s %11s %9s %9s %8s\n", "rates", "quality", "%/deck", "decks/core",
+            "snr 1k", "snr high", "alias");
+
+    for (guint i = 0; NULL != rates[i]; i++) {
+        guint rate_in = (guint)g_ascii_strtoull (rates[i], NULL, 10);
+        gdouble high = 0.4 * MIN (rate_in, (guint)rate_out);
+
+        if (!resample_supported (rate_in, rate_out)) {
+            g_printerr ("Can't resample %s to %d Hz\n", rates[i], rate_out);
+            continue;
+        }
+
+        for (guint q = 0; q < RESAMPLE_N_QUALITIES; q++) {
+            gdouble load = cpu_load (rate_in, rate_out, q, seconds);
+            gchar *alias = (rate_in > (guint)rate_out) ?
+                    g_strdup_printf ("%5.1f dB", alias_level (rate_in, rate_out, q)) :
+                    g_strdup ("-");
+
+            /* at the jack rate the engine doesn't resample at all */
+            if (rate_in == (guint)rate_out) {
+                g_print ("%6u -> %-6d  %-7s %8.3f %11s %9s %9s %8s\n", rate_in, rate_out,
+                        "bypass", load, "-", "-", "-", "-");
+                g_free (alias);
+                break;
+            }
+
+            g_print ("%6u -> %-6d  %-7s %8.3f %11.0f %6.1f dB %6.1f dB %8s\n",
+                    rate_in, rate_out, resample_quality_get_name (q), load,
+                    100.0 / MAX (load, 1e-3),
+                    tone_snr (rate_in, rate_out, q, 1000),
+                    tone_snr (rate_in, rate_out, q, high), alias);
+            g_free (alias);
+        }
+    }
+
+    g_strfreev (rates);
+    g_free (rate_list);
+    return 0;
+}
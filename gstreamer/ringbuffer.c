@@ -0,0 +1,89 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include "dsp.h"
+#include "ringbuffer.h"
+
+RingBuffer* ringbuffer_new(guint min_frames) {
+    RingBuffer *rb = g_new0 (RingBuffer, 1);
+
+    rb->capacity = 1;
+    while (rb->capacity < min_frames) {
+        rb->capacity <<= 1;
+    }
+
+    /* not cleared, frames are only ever read after they were written,
+     * so nothing is resident until the ring is used */
+    rb->data = g_new (gfloat, 2 * rb->capacity);
+
+    return rb;
+}
+
+/* Fault the ring in and keep it there, before the consumer first runs.
+ * Rings of decks that never play stay unbacked.
+ */
+void ringbuffer_lock(RingBuffer *rb) {
+    if (!rb->locked) {
+        /* the consumer runs in the jack process callback */
+        mlock (rb->data, 2 * rb->capacity * sizeof (gfloat));
+        rb->locked = TRUE;
+    }
+}
+
+void ringbuffer_free(RingBuffer *rb) {
+    if (rb->locked) {
+        munlock (rb->data, 2 * rb->capacity * sizeof (gfloat));
+    }
+    g_free (rb->data);
+    g_free (rb);
+}
+
+/* Frames available for reading. Callable from either side. */
+guint ringbuffer_fill(RingBuffer *rb) {
+    return (guint)g_atomic_int_get (&rb->write) - (guint)g_atomic_int_get (&rb->read);
+}
+
+/* Producer side: copy in as many frames as fit, returns how many did */
+guint ringbuffer_write(RingBuffer *rb, const gfloat *frames, guint n) {
+    guint w = (guint)rb->write;
+    guint space = rb->capacity - (w - (guint)g_atomic_int_get (&rb->read));
+    guint offset, first;
+
+    n = MIN (n, space);
+    offset = w & (rb->capacity - 1);
+    first = MIN (n, rb->capacity - offset);
+
+    memcpy (rb->data + 2 * offset, frames, 2 * first * sizeof (gfloat));
+    memcpy (rb->data, frames + 2 * first, 2 * (n - first) * sizeof (gfloat));
+
+    g_atomic_int_set (&rb->write, (gint)(w + n));
+
+    return n;
+}
+
+/* Consumer side: deinterleave up to n frames, adding them to left/right */
+guint ringbuffer_read_add(RingBuffer *rb, gfloat *left, gfloat *right, guint n) {
+    guint r = (guint)rb->read;
+    guint offset, first;
+
+    n = MIN (n, (guint)g_atomic_int_get (&rb->write) - r);
+    offset = r & (rb->capacity - 1);
+    first = MIN (n, rb->capacity - offset);
+
+    /* at most two runs, up to the end of the ring and from its start */
+    dsp_deinterleave_add (left, right, rb->data + 2 * offset, first);
+    dsp_deinterleave_add (left + first, right + first, rb->data, n - first);
+
+    g_atomic_int_set (&rb->read, (gint)(r + n));
+
+    return n;
+}
+
+/* Consumer side: throw away everything written so far */
+void ringbuffer_drop(RingBuffer *rb) {
+    g_atomic_int_set (&rb->read, g_atomic_int_get (&rb->write));
+}
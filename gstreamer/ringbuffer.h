@@ -0,0 +1,28 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _RINGBUFFER_H
+#define _RINGBUFFER_H
+
+/* Wait-free single producer, single consumer ring of interleaved stereo
+ * float frames. The counters only ever grow (and wrap), each one is stored
+ * by exactly one side.
+ */
+typedef struct _RingBuffer {
+    gfloat *data;
+    guint capacity;                 /* In frames, a power of two */
+    gint write;                     /* Frames written, stored by the producer */
+    gint read;                      /* Frames read, stored by the consumer */
+    gboolean locked;                /* Resident since ringbuffer_lock() */
+} RingBuffer;
+
+RingBuffer* ringbuffer_new(guint min_frames);
+void ringbuffer_lock(RingBuffer *rb);
+void ringbuffer_free(RingBuffer *rb);
+guint ringbuffer_fill(RingBuffer *rb);
+guint ringbuffer_write(RingBuffer *rb, const gfloat *frames, guint n);
+guint ringbuffer_read_add(RingBuffer *rb, gfloat *left, gfloat *right, guint n);
+void ringbuffer_drop(RingBuffer *rb);
+
+#endif /* _RINGBUFFER_H */
@@ -0,0 +1,313 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "control.h"
+#include "controlclient.h"
+
+/*
+ * Deck count scaling benchmark.
+ *
+ * Starts 4deckradiod with the engine and an increasing number of decks,
+ * and reports what the process costs: CPU, resident memory and threads,
+ * once with every deck idle and once with a file prerolled in each. Then
+ * it triggers the decks in turn over the control socket and times play
+ * to PLAYING. Needs a running jackd:
+ *
+ *     jackd -d dummy -r 48000 -p 256 &
+ *     ./4deckradio-scalebench --uri file:///music/song.flac --decks 4,8,16,32,64
+ */
+
+#define SCALEBENCH_START_TIMEOUT_US (10 * G_USEC_PER_SEC)
+#define SCALEBENCH_STATE_TIMEOUT_US (30 * G_USEC_PER_SEC)
+#define SCALEBENCH_POLL_US 500
+#define SCALEBENCH_REPLY_TIMEOUT_MS 5000
+
+typedef struct _Usage {
+    gdouble cpu_percent;
+    guint rss_kb;
+    guint threads;
+} Usage;
+
+typedef struct _Daemon {
+    GPid pid;
+    int fd;
+    guint32 serial;
+} Daemon;
+
+/* utime + stime, in clock ticks */
+static guint64 cpu_ticks(GPid pid) {
+    gchar *path = g_strdup_printf ("/proc/%d/stat", (int)pid);
+    gchar *contents = NULL;
+    guint64 utime = 0, stime = 0;
+
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        /* the command name may contain anything, skip past it */
+        gchar *fields = strrchr (contents, ')');
+
+        if (NULL != fields) {
+            sscanf (fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %"
+                    G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, &utime, &stime);
+        }
+    }
+
+    g_free (contents);
+    g_free (path);
+    return utime + stime;
+}
+
+static guint status_field(GPid pid, const gchar *name) {
+    gchar *path = g_strdup_printf ("/proc/%d/status", (int)pid);
+    gchar *contents = NULL;
+    guint value = 0;
+
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        gchar *line = strstr (contents, name);
+
+        if (NULL != line) {
+            value = (guint)strtoul (line + strlen (name), NULL, 10);
+        }
+    }
+
+    g_free (contents);
+    g_free (path);
+    return value;
+}
+
+static void measure_usage(GPid pid, gdouble seconds, Usage *usage) {
+    guint64 before = cpu_ticks (pid);
+
+    g_usleep ((gulong)(seconds * G_USEC_PER_SEC));
+
+    usage->cpu_percent = 100.0 * (cpu_ticks (pid) - before) /
+            sysconf (_SC_CLK_TCK) / seconds;
+    usage->rss_kb = status_field (pid, "VmRSS:");
+    usage->threads = status_field (pid, "Threads:");
+}
+
+static gboolean request(Daemon *daemon, ControlCommand command, guint deck,
+        const gchar *uri, ControlReply *reply) {
+    daemon->serial++;
+    return control_send (daemon->fd, daemon->serial, command, deck, 0, uri) &&
+            control_wait_reply (daemon->fd, daemon->serial, reply, SCALEBENCH_REPLY_TIMEOUT_MS) &&
+            CONTROL_OK == reply->status;
+}
+
+static gboolean wait_state(Daemon *daemon, guint deck, DeckState state) {
+    gint64 deadline = g_get_monotonic_time () + SCALEBENCH_STATE_TIMEOUT_US;
+    ControlReply reply;
+
+    while (g_get_monotonic_time () < deadline) {
+        if (!request (daemon, CONTROL_STATUS, deck, NULL, &reply) ||
+                DECK_ERROR == reply.deckstate) {
+            return FALSE;
+        }
+        if (state == reply.deckstate) {
+            return TRUE;
+        }
+        g_usleep (SCALEBENCH_POLL_US);
+    }
+
+    return FALSE;
+}
+
+static gboolean start_daemon(Daemon *daemon, const gchar *binary, guint ndecks,
+        const gchar *path) {
+    gchar *decks = g_strdup_printf ("%u", ndecks);
+    gchar *argv[] = { (gchar *)binary, "--engine", "--decks", decks,
+        "--control", (gchar *)path, NULL };
+    GError *error = NULL;
+    gint64 deadline;
+    gboolean ok;
+
+    ok = g_spawn_async (NULL, argv, NULL,
+            G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+            NULL, NULL, &daemon->pid, &error);
+    g_free (decks);
+
+    if (!ok) {
+        g_printerr ("Couldn't start %s: %s\n", binary, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    /* the socket shows up once the decks are built */
+    deadline = g_get_monotonic_time () + SCALEBENCH_START_TIMEOUT_US;
+    while ((daemon->fd = control_connect (path)) < 0) {
+        if (g_get_monotonic_time () > deadline ||
+                0 != waitpid (daemon->pid, NULL, WNOHANG)) {
+            g_printerr ("%s didn't come up with %u decks\n", binary, ndecks);
+            kill (daemon->pid, SIGKILL);
+            waitpid (daemon->pid, NULL, 0);
+            return FALSE;
+        }
+        g_usleep (10000);
+    }
+
+    daemon->serial = 0;
+    return TRUE;
+}
+
+static void stop_daemon(Daemon *daemon) {
+    close (daemon->fd);
+    kill (daemon->pid, SIGTERM);
+    waitpid (daemon->pid, NULL, 0);
+    g_spawn_close_pid (daemon->pid);
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank */
+static gdouble percentile(GArray *sorted, gdouble q) {
+    guint rank = (guint)ceil (q * sorted->len);
+
+    return g_array_index (sorted, gdouble, CLAMP (rank, 1, sorted->len) - 1);
+}
+
+/* Press play on the decks in turn, until PLAYING */
+static GArray* trigger_latency(Daemon *daemon, guint ndecks, guint runs) {
+    GArray *results = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    ControlReply reply;
+
+    for (guint r = 0; r < runs; r++) {
+        guint deck = r % ndecks;
+        gint64 start = g_get_monotonic_time ();
+        gdouble ms;
+
+        if (!request (daemon, CONTROL_PLAY, deck, NULL, &reply) ||
+                !wait_state (daemon, deck, DECK_PLAYING)) {
+            continue;
+        }
+        ms = (g_get_monotonic_time () - start) / 1000.0;
+        g_array_append_val (results, ms);
+
+        /* stop rewinds to the cue-in and prerolls again */
+        request (daemon, CONTROL_STOP, deck, NULL, &reply);
+        wait_state (daemon, deck, DECK_PAUSED);
+    }
+
+    g_array_sort (results, compare_doubles);
+    return results;
+}
+
+static void run(const gchar *binary, guint ndecks, const gchar *uri, gdouble seconds,
+        guint runs, const gchar *path) {
+    Daemon daemon;
+    Usage idle, loaded;
+    GArray *latency;
+    ControlReply reply;
+    gboolean prerolled = TRUE;
+
+    if (!start_daemon (&daemon, binary, ndecks, path)) {
+        return;
+    }
+
+    measure_usage (daemon.pid, seconds, &idle);
+
+    if (NULL == uri) {
+        g_print ("%5u  %6.2f %8u %7u\n", ndecks, idle.cpu_percent, idle.rss_kb, idle.threads);
+        stop_daemon (&daemon);
+        return;
+    }
+
+    for (guint d = 0; d < ndecks; d++) {
+        prerolled = request (&daemon, CONTROL_LOAD, d, uri, &reply) && prerolled;
+    }
+    for (guint d = 0; d < ndecks && prerolled; d++) {
+        prerolled = wait_state (&daemon, d, DECK_PAUSED);
+    }
+    if (!prerolled) {
+        g_printerr ("Not all %u decks prerolled %s\n", ndecks, uri);
+    }
+
+    measure_usage (daemon.pid, seconds, &loaded);
+    latency = trigger_latency (&daemon, ndecks, runs);
+
+    g_print ("%5u  %6.2f %8u %7u  %6.2f %8u %7u", ndecks,
+            idle.cpu_percent, idle.rss_kb, idle.threads,
+            loaded.cpu_percent, loaded.rss_kb, loaded.threads);
+    if (latency->len > 0) {
+        g_print ("  %7.2f %7.2f %7.2f\n", percentile (latency, 0.50),
+                percentile (latency, 0.99),
+                g_array_index (latency, gdouble, latency->len - 1));
+    } else {
+        g_print ("  no deck started\n");
+    }
+
+    g_array_free (latency, TRUE);
+    stop_daemon (&daemon);
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar **counts;
+    gchar *path;
+
+    gchar *binary = NULL;
+    gchar *uri = NULL;
+    gchar *decks = NULL;
+    gdouble seconds = 5;
+    gint runs = 20;
+
+    GOptionEntry option_entries[] = {
+        { "daemon", 'd', 0, G_OPTION_ARG_FILENAME,
+            &binary, "The daemon to run (./4deckradiod)", "PATH" },
+        { "uri", 'u', 0, G_OPTION_ARG_STRING,
+            &uri, "File to load into every deck, only idle decks are measured without it", "URI" },
+        { "decks", 'n', 0, G_OPTION_ARG_STRING,
+            &decks, "Deck counts to try (4,8,16,32,64)", "N,N,..." },
+        { "seconds", 's', 0, G_OPTION_ARG_DOUBLE,
+            &seconds, "How long to sample the CPU time (5)", "S" },
+        { "runs", 'r', 0, G_OPTION_ARG_INT,
+            &runs, "Decks triggered per count (20)", "N" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- cost of a deck, from 4 to 64 of them");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    path = g_strdup_printf ("%s/4deckradio-scalebench-%d.control", g_get_tmp_dir (), (int)getpid ());
+    counts = g_strsplit ((NULL != decks) ? decks : "4,8,16,32,64", ",", -1);
+
+    g_print ("              idle                      loaded               play to PLAYING ms\n");
+    g_print ("decks   cpu%%   rss kB threads    cpu%%   rss kB threads      p50     p99     max\n");
+    for (guint i = 0; NULL != counts[i]; i++) {
+        gint n = atoi (counts[i]);
+
+        if (n < 1 || n > DECK_MAX_COUNT) {
+            g_printerr ("Skipping %s decks\n", counts[i]);
+            continue;
+        }
+        run ((NULL != binary) ? binary : "./4deckradiod", n, uri, MAX (seconds, 0.1),
+                MAX (runs, 1), path);
+    }
+
+    g_strfreev (counts);
+    g_free (path);
+    g_free (binary);
+    g_free (uri);
+    g_free (decks);
+    return 0;
+}
@@ -0,0 +1,178 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "deck.h"
+#include "engine.h"
+#include "schedule.h"
+
+/*
+ * Starts at a wall clock time, for the news joins and the time signal.
+ * Engine mode only.
+ *
+ * The deck prerolls as soon as its file is loaded. A second before the
+ * time its pipeline goes to PLAYING with the engine slot held, and the
+ * engine's process callback lets the first frame out so that it reaches
+ * the outputs at the requested time, to the sample (see engine.c). Every
+ * start is logged with its error, for the audit.
+ *
+ * One start per deck, a new one replaces the old. Anything that moves
+ * the deck meanwhile (stop, eject, play by hand) calls it off.
+ */
+
+#define SCHEDULE_ARM_LEAD_MS 1000
+#define SCHEDULE_POLL_MS 50
+#define SCHEDULE_GIVE_UP_US (5 * G_USEC_PER_SEC)
+
+typedef struct _ScheduledStart {
+    CustomData *data;
+    gint64 wall_us;                 /* When the first frame is due, g_get_real_time() */
+    EngineSlot *slot;               /* Set once armed */
+    guint timeout_id;
+} ScheduledStart;
+
+static GHashTable *starts;          /* CustomData -> ScheduledStart, main loop only */
+
+static void start_free(ScheduledStart *start) {
+    if (0 != start->timeout_id) {
+        g_source_remove (start->timeout_id);
+    }
+    g_free (start);
+}
+
+/* HH:MM:SS.uuuuuu local time */
+static gchar* format_time(gint64 wall_us) {
+    GDateTime *time = g_date_time_new_from_unix_local (wall_us / G_USEC_PER_SEC);
+    gchar *hms = g_date_time_format (time, "%H:%M:%S");
+    gchar *formatted = g_strdup_printf ("%s.%06d", hms, (int)(wall_us % G_USEC_PER_SEC));
+
+    g_free (hms);
+    g_date_time_unref (time);
+    return formatted;
+}
+
+static void report(ScheduledStart *start, const gchar *what) {
+    gchar *due = format_time (start->wall_us);
+
+    g_print ("Deck %u: start at %s %s\n", start->data->decknumber + 1, due, what);
+    g_free (due);
+}
+
+static gboolean poll_cb(ScheduledStart *start) {
+    gint64 started = engine_slot_get_start_time (start->slot);
+
+    if (started < 0) {
+        if (g_get_real_time () - start->wall_us < SCHEDULE_GIVE_UP_US) {
+            return TRUE;
+        }
+        report (start, "didn't happen");
+    } else {
+        gchar *actual = format_time (started);
+        gchar *what = g_strdup_printf ("happened at %s, %+.3f ms off", actual,
+                (started - start->wall_us) / 1000.0);
+
+        report (start, what);
+        g_free (what);
+        g_free (actual);
+    }
+
+    /* removes this timeout too */
+    g_hash_table_remove (starts, start->data);
+    return FALSE;
+}
+
+static gboolean arm_cb(ScheduledStart *start) {
+    CustomData *data = start->data;
+
+    start->timeout_id = 0;
+
+    if (DECK_PAUSED != data->deckstate || NULL == data->active->slot ||
+            !engine_slot_start_at (data->active->slot, start->wall_us)) {
+        report (start, "cancelled, the deck isn't prerolled");
+        g_hash_table_remove (starts, data);
+        return FALSE;
+    }
+
+    start->slot = data->active->slot;
+    start->timeout_id = g_timeout_add (SCHEDULE_POLL_MS, (GSourceFunc)poll_cb, start);
+    deck_play (data);
+
+    return FALSE;
+}
+
+/* Start the deck so its first frame is heard at wall_us (microseconds,
+ * like g_get_real_time). The deck has to be loading or prerolled, and
+ * stay so until then.
+ */
+gboolean schedule_start(CustomData *data, gint64 wall_us) {
+    ScheduledStart *start;
+    gint64 lead_ms = (wall_us - g_get_real_time ()) / 1000 - SCHEDULE_ARM_LEAD_MS;
+
+    if (!engine_is_running ()) {
+        g_printerr ("Deck %u: timed starts need the engine (--engine)\n", data->decknumber + 1);
+        return FALSE;
+    }
+
+    if ((DECK_PAUSED != data->deckstate && DECK_LOADING != data->deckstate) ||
+            wall_us <= g_get_real_time ()) {
+        return FALSE;
+    }
+
+    if (NULL == starts) {
+        starts = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)start_free);
+    }
+
+    start = g_new0 (ScheduledStart, 1);
+    start->data = data;
+    start->wall_us = wall_us;
+    start->timeout_id = g_timeout_add ((guint)MAX (lead_ms, 0), (GSourceFunc)arm_cb, start);
+    g_hash_table_replace (starts, data, start);
+
+    report (start, "scheduled");
+    return TRUE;
+}
+
+void schedule_cancel(CustomData *data) {
+    ScheduledStart *start = (NULL != starts) ? g_hash_table_lookup (starts, data) : NULL;
+
+    if (NULL == start) {
+        return;
+    }
+
+    /* too late to call it off, but it still gets its audit line */
+    if (NULL != start->slot && engine_slot_get_start_time (start->slot) >= 0) {
+        poll_cb (start);
+        return;
+    }
+
+    if (NULL != start->slot) {
+        engine_slot_cancel_start (start->slot);
+    }
+    report (start, "cancelled");
+    g_hash_table_remove (starts, data);
+}
+
+/* From the deck state machine, after every state change */
+void schedule_deck_changed(CustomData *data) {
+    ScheduledStart *start = (NULL != starts) ? g_hash_table_lookup (starts, data) : NULL;
+
+    if (NULL == start) {
+        return;
+    }
+
+    /* armed, it's playing but held; before that it waits prerolled */
+    if (NULL != start->slot ? !deck_is_playing (data) :
+            (DECK_PAUSED != data->deckstate && DECK_LOADING != data->deckstate)) {
+        schedule_cancel (data);
+    }
+}
+
+void schedule_shutdown(void) {
+    if (NULL != starts) {
+        g_hash_table_destroy (starts);
+        starts = NULL;
+    }
+}
@@ -0,0 +1,13 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+gboolean schedule_start(CustomData *data, gint64 wall_us);
+void schedule_cancel(CustomData *data);
+void schedule_deck_changed(CustomData *data);
+void schedule_shutdown(void);
+
+#endif /* _SCHEDULE_H */
@@ -0,0 +1,443 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include <gst/gst.h>
+#if GST_VERSION_MAJOR != (0)
+#include <gst/app/gstappsink.h>
+#endif
+#include "seektable.h"
+
+/*
+ * Seek latency and seek error benchmark.
+ *
+ * Every file is decoded once from start to end as the reference. Then
+ * the same random positions are seeked to in three modes:
+ *
+ *     keyframe   what the decks do by default (KEY_UNIT | SNAP)
+ *     accurate   ACCURATE, the parser only knows what it has seen so far
+ *     table      ACCURATE, with the cached seek table in the parser's index
+ *
+ * Latency is flushing seek to the first buffer prerolled. The error is
+ * where that buffer really is in the reference (found by matching the
+ * samples) minus where we asked to go. Everything runs at 8 kHz mono to
+ * keep the matching cheap, so errors are good to 125 us.
+ *
+ *     ./4deckradio-seekbench --seeks 100 corpus/song.mp3 corpus/song.m4a ...
+ */
+
+#define SEEKBENCH_RATE 8000
+#define SEEKBENCH_MATCH_FRAMES 256      /* Compared against the reference */
+#define SEEKBENCH_SEARCH_S 10           /* How far off a seek may land */
+#define SEEKBENCH_MARGIN_S 2            /* Kept clear of the end */
+#define SEEKBENCH_SILENCE 1e-6          /* Mean square below that can't be matched */
+#define SEEKBENCH_TABLE_TIMEOUT_US (120 * G_USEC_PER_SEC)
+
+typedef enum {
+    MODE_KEYFRAME,
+    MODE_ACCURATE,
+    MODE_TABLE,
+    NUM_MODES
+} Mode;
+
+static const gchar *mode_names[NUM_MODES] = {
+    "keyframe", "accurate", "table"
+};
+
+/* Per extension and mode */
+typedef struct _Stats {
+    GArray *latency;                /* gdouble ms */
+    GArray *error;                  /* gdouble ms, absolute */
+    guint failed;
+    guint unmatched;                /* Landed in silence, or too far off */
+} Stats;
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank */
+static gdouble percentile(GArray *sorted, gdouble q) {
+    guint rank = (guint)ceil (q * sorted->len);
+
+    return g_array_index (sorted, gdouble, CLAMP (rank, 1, sorted->len) - 1);
+}
+
+#if GST_VERSION_MAJOR != (0)
+#if GST_CHECK_VERSION (1, 10, 0)
+static void deep_element_added_cb(GstBin *bin, GstBin *sub_bin, GstElement *element,
+        SeekTable *table) {
+    seektable_watch_parser (table, element);
+}
+
+static void table_notify(gpointer table, GClosure *closure) {
+    seektable_unref (table);
+}
+#endif
+
+static GstElement* open_pipeline(const gchar *uri, SeekTable *table, GstElement **sink) {
+    GstElement *pipeline, *decoder;
+    GError *error = NULL;
+    gchar *description;
+
+    description = g_strdup_printf ("uridecodebin name=decoder ! audioconvert ! audioresample ! "
+            "audio/x-raw, format=(string)%s, rate=(int)%d, channels=(int)1 ! "
+            "appsink name=sink sync=false",
+            G_BYTE_ORDER == G_BIG_ENDIAN ? "F32BE" : "F32LE", SEEKBENCH_RATE);
+    pipeline = gst_parse_launch (description, &error);
+    g_free (description);
+    if (NULL == pipeline) {
+        g_printerr ("Couldn't create pipeline: %s\n", error->message);
+        g_clear_error (&error);
+        return NULL;
+    }
+
+    decoder = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+    g_object_set (decoder, "uri", uri, NULL);
+    gst_object_unref (decoder);
+
+#if GST_CHECK_VERSION (1, 10, 0)
+    if (NULL != table) {
+        g_signal_connect_data (pipeline, "deep-element-added",
+                G_CALLBACK (deep_element_added_cb), seektable_ref (table),
+                table_notify, 0);
+    }
+#endif
+
+    *sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    return pipeline;
+}
+
+static void append_sample(GArray *samples, GstSample *sample) {
+    GstBuffer *buffer = gst_sample_get_buffer (sample);
+    GstMapInfo map;
+
+    if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        g_array_append_vals (samples, map.data, map.size / sizeof (gfloat));
+        gst_buffer_unmap (buffer, &map);
+    }
+}
+
+/* The whole file, decoded straight through */
+static GArray* decode_reference(const gchar *uri) {
+    GArray *samples = g_array_new (FALSE, FALSE, sizeof (gfloat));
+    GstElement *sink, *pipeline = open_pipeline (uri, NULL, &sink);
+    GstSample *sample;
+
+    if (NULL == pipeline) {
+        g_array_free (samples, TRUE);
+        return NULL;
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    while (NULL != (sample = gst_app_sink_pull_sample (GST_APP_SINK (sink)))) {
+        append_sample (samples, sample);
+        gst_sample_unref (sample);
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (sink);
+    gst_object_unref (pipeline);
+
+    return samples;
+}
+
+static SeekTable* wait_for_table(const gchar *uri) {
+    gint64 deadline = g_get_monotonic_time () + SEEKBENCH_TABLE_TIMEOUT_US;
+    SeekTable *table = seektable_lookup (uri);
+
+    if (NULL != table) {
+        return table;
+    }
+
+    seektable_request (uri);
+    while (seektable_is_pending (uri) && g_get_monotonic_time () < deadline) {
+        g_usleep (20 * 1000);
+    }
+
+    return seektable_lookup (uri);
+}
+
+/* Where in the reference the frames really are, within SEEKBENCH_SEARCH_S
+ * of expected. Sum of squared differences, the best offset wins. -1 if
+ * there is nothing to go by.
+ */
+static gint64 locate(GArray *reference, const gfloat *frames, gint64 expected) {
+    const gfloat *ref = (const gfloat *)reference->data;
+    gint64 first = MAX (0, expected - SEEKBENCH_SEARCH_S * SEEKBENCH_RATE);
+    gint64 last = MIN ((gint64)reference->len - SEEKBENCH_MATCH_FRAMES,
+            expected + SEEKBENCH_SEARCH_S * SEEKBENCH_RATE);
+    gint64 best = -1;
+    gdouble energy = 0, best_ssd = G_MAXDOUBLE;
+
+    for (guint i = 0; i < SEEKBENCH_MATCH_FRAMES; i++) {
+        energy += frames[i] * frames[i];
+    }
+    if (energy / SEEKBENCH_MATCH_FRAMES < SEEKBENCH_SILENCE) {
+        return -1;
+    }
+
+    for (gint64 pos = first; pos <= last; pos++) {
+        gdouble ssd = 0;
+
+        for (guint i = 0; i < SEEKBENCH_MATCH_FRAMES && ssd < best_ssd; i++) {
+            gdouble d = ref[pos + i] - frames[i];
+
+            ssd += d * d;
+        }
+        if (ssd < best_ssd) {
+            best_ssd = ssd;
+            best = pos;
+        }
+    }
+
+    /* anything but a near copy is a wrong guess */
+    return (best_ssd < 0.01 * energy) ? best : -1;
+}
+
+/* Samples from the seek on, at least SEEKBENCH_MATCH_FRAMES of them if
+ * the file has that much. Plays on if the prerolled buffer isn't enough,
+ * the preroll buffer is the first one appsink hands out again then.
+ */
+static GArray* collect(GstElement *pipeline, GstElement *sink, GstSample *preroll) {
+    GArray *samples = g_array_new (FALSE, FALSE, sizeof (gfloat));
+    GstSample *sample;
+
+    append_sample (samples, preroll);
+    if (samples->len >= SEEKBENCH_MATCH_FRAMES) {
+        return samples;
+    }
+
+    g_array_set_size (samples, 0);
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    while (samples->len < SEEKBENCH_MATCH_FRAMES &&
+            NULL != (sample = gst_app_sink_pull_sample (GST_APP_SINK (sink)))) {
+        append_sample (samples, sample);
+        gst_sample_unref (sample);
+    }
+    gst_element_set_state (pipeline, GST_STATE_PAUSED);
+    gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+
+    return samples;
+}
+
+static void run_mode(const gchar *uri, Mode mode, SeekTable *table, GArray *reference,
+        const GArray *targets, Stats *stats) {
+    GstSeekFlags flags = GST_SEEK_FLAG_FLUSH;
+    GstElement *sink, *pipeline;
+
+    pipeline = open_pipeline (uri, MODE_TABLE == mode ? table : NULL, &sink);
+    if (NULL == pipeline) {
+        stats->failed += targets->len;
+        return;
+    }
+
+    if (MODE_KEYFRAME == mode) {
+        flags |= GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_BEFORE;
+    } else {
+        flags |= GST_SEEK_FLAG_ACCURATE;
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_PAUSED);
+    if (GST_STATE_CHANGE_FAILURE == gst_element_get_state (pipeline, NULL, NULL,
+                GST_CLOCK_TIME_NONE)) {
+        stats->failed += targets->len;
+        goto out;
+    }
+
+    for (guint i = 0; i < targets->len; i++) {
+        gint64 target = g_array_index (targets, gint64, i);
+        gint64 start = g_get_monotonic_time ();
+        gdouble latency, error;
+        GstSample *preroll;
+        GArray *samples;
+        gint64 found;
+
+        if (!gst_element_seek_simple (pipeline, GST_FORMAT_TIME, flags, target)) {
+            stats->failed++;
+            continue;
+        }
+        preroll = gst_app_sink_pull_preroll (GST_APP_SINK (sink));
+        if (NULL == preroll) {
+            stats->failed++;
+            continue;
+        }
+        latency = (g_get_monotonic_time () - start) / 1000.0;
+        g_array_append_val (stats->latency, latency);
+
+        samples = collect (pipeline, sink, preroll);
+        gst_sample_unref (preroll);
+
+        found = (samples->len < SEEKBENCH_MATCH_FRAMES) ? -1 :
+            locate (reference, (const gfloat *)samples->data,
+                    gst_util_uint64_scale (target, SEEKBENCH_RATE, GST_SECOND));
+        g_array_free (samples, TRUE);
+
+        if (found < 0) {
+            stats->unmatched++;
+            continue;
+        }
+        error = fabs (found * 1000.0 / SEEKBENCH_RATE - target / (gdouble)GST_MSECOND);
+        g_array_append_val (stats->error, error);
+    }
+
+out:
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (sink);
+    gst_object_unref (pipeline);
+}
+
+static Stats* get_stats(GHashTable *results, const gchar *filename, Mode mode) {
+    const gchar *dot = strrchr (filename, '.');
+    gchar *ext = g_ascii_strdown (NULL != dot ? dot + 1 : "?", -1);
+    gchar *key = g_strdup_printf ("%-5s %s", ext, mode_names[mode]);
+    Stats *stats = g_hash_table_lookup (results, key);
+
+    if (NULL == stats) {
+        stats = g_new0 (Stats, 1);
+        stats->latency = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        stats->error = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        g_hash_table_insert (results, key, stats);
+    } else {
+        g_free (key);
+    }
+
+    g_free (ext);
+    return stats;
+}
+
+static void free_stats(Stats *stats) {
+    g_array_free (stats->latency, TRUE);
+    g_array_free (stats->error, TRUE);
+    g_free (stats);
+}
+
+static void bench_file(const gchar *filename, guint seeks, GHashTable *results) {
+    gchar *uri = gst_filename_to_uri (filename, NULL);
+    GArray *reference, *targets;
+    SeekTable *table;
+    gint64 length;
+    GRand *rand;
+
+    reference = decode_reference (uri);
+    length = (NULL != reference) ?
+        (gint64)reference->len - SEEKBENCH_MARGIN_S * SEEKBENCH_RATE : 0;
+    if (length <= 0) {
+        g_printerr ("Skipping %s, can't decode or too short\n", filename);
+        if (NULL != reference) {
+            g_array_free (reference, TRUE);
+        }
+        g_free (uri);
+        return;
+    }
+
+    table = wait_for_table (uri);
+
+    /* same positions for every mode, and every run */
+    rand = g_rand_new_with_seed (g_str_hash (filename));
+    targets = g_array_new (FALSE, FALSE, sizeof (gint64));
+    for (guint i = 0; i < seeks; i++) {
+        gint64 target = gst_util_uint64_scale (g_rand_int_range (rand, 0, (gint32)length),
+                GST_SECOND, SEEKBENCH_RATE);
+
+        g_array_append_val (targets, target);
+    }
+    g_rand_free (rand);
+
+    for (Mode m = 0; m < NUM_MODES; m++) {
+        if (MODE_TABLE == m && NULL == table) {
+            continue;
+        }
+        run_mode (uri, m, table, reference, targets, get_stats (results, filename, m));
+    }
+
+    g_print ("%s: %.1f s, %s\n", filename, reference->len / (gdouble)SEEKBENCH_RATE,
+            NULL != table ? "seek table" : "no seek table");
+
+    if (NULL != table) {
+        seektable_unref (table);
+    }
+    g_array_free (targets, TRUE);
+    g_array_free (reference, TRUE);
+    g_free (uri);
+}
+
+static void print_stats(const gchar *key, Stats *stats) {
+    if (0 == stats->latency->len) {
+        g_print ("%-14s no seeks succeeded (%u failed)\n", key, stats->failed);
+        return;
+    }
+
+    g_array_sort (stats->latency, compare_doubles);
+    g_print ("%-14s n=%-5u latency p50 %7.2f  p90 %7.2f  max %7.2f ms", key,
+            stats->latency->len, percentile (stats->latency, 0.50),
+            percentile (stats->latency, 0.90),
+            g_array_index (stats->latency, gdouble, stats->latency->len - 1));
+
+    if (0 != stats->error->len) {
+        g_array_sort (stats->error, compare_doubles);
+        g_print ("  error p50 %7.2f  p90 %7.2f  max %7.2f ms",
+                percentile (stats->error, 0.50), percentile (stats->error, 0.90),
+                g_array_index (stats->error, gdouble, stats->error->len - 1));
+    }
+    g_print ("  (%u unmatched, %u failed)\n", stats->unmatched, stats->failed);
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    GHashTable *results;
+    GList *keys;
+    gint seeks = 50;
+
+    GOptionEntry option_entries[] = {
+        { "seeks", 'n', 0, G_OPTION_ARG_INT,
+            &seeks, "Seeks per file and mode (50)", "N" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("FILE... - seek latency and accuracy");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (argc < 2) {
+        g_printerr ("No files given\n");
+        return 1;
+    }
+
+    gst_init (&argc, &argv);
+    seektable_init ();
+
+    results = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)free_stats);
+    for (gint i = 1; i < argc; i++) {
+        bench_file (argv[i], MAX (1, seeks), results);
+    }
+
+    keys = g_list_sort (g_hash_table_get_keys (results), (GCompareFunc)strcmp);
+    for (GList *l = keys; NULL != l; l = l->next) {
+        print_stats (l->data, g_hash_table_lookup (results, l->data));
+    }
+    g_list_free (keys);
+
+    g_hash_table_destroy (results);
+    seektable_shutdown ();
+
+    return 0;
+}
+#else
+int main(int argc, char *argv[]) {
+    g_printerr ("The seek benchmark needs GStreamer 1.x\n");
+    return 1;
+}
+#endif
@@ -0,0 +1,392 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/base/gstbaseparse.h>
+#include "seektable.h"
+
+/*
+ * Seek tables for --accurate-seek.
+ *
+ * Parsers (mpegaudioparse, aacparse, flacparse, ... anything built on
+ * GstBaseParse) seek through an index of their own, which only covers
+ * what they have parsed so far. Without it an accurate seek into a VBR
+ * MP3 or a long ADTS stream means scanning from the start of the file.
+ *
+ * So every file loaded or queued is parsed once in the background, as
+ * fast as the disk allows and without decoding, and the parser's output
+ * (frame start offset and timestamp) is sampled every SEEKTABLE_INTERVAL.
+ * The result is cached under ~/.cache/4deckradio/seektables, named after
+ * a hash of path, size and mtime. When a deck's pipeline creates a parser
+ * for the file, the table goes into the parser's index before it seeks.
+ *
+ * Demuxers with an index of their own (qtdemux for .m4a) or a bisecting
+ * seek (oggdemux) have no GstBaseParse, and don't get a table.
+ *
+ * Cache file: a SeekTableHeader, then nentries SeekTableEntries sorted by
+ * time.
+ */
+
+#define SEEKTABLE_MAGIC "4DST"
+#define SEEKTABLE_VERSION 1
+#define SEEKTABLE_INTERVAL GST_SECOND
+#define SEEKTABLE_MAX_THREADS 2
+
+typedef struct _SeekTableHeader {
+    gchar magic[4];
+    guint32 version;
+    guint64 size;                       /* Of the audio file, to spot stale entries */
+    gint64 mtime;
+    guint32 nentries;
+    guint32 reserved;
+} SeekTableHeader;
+
+typedef struct _SeekTableEntry {
+    guint64 time;                       /* Stream time of a frame */
+    guint64 offset;                     /* Where the frame starts, as the parser counts */
+} SeekTableEntry;
+
+struct _SeekTable {
+    gint refcount;
+    GMappedFile *file;
+    const SeekTableHeader *header;
+    const SeekTableEntry *entries;
+};
+
+/* What the background pass collects, on the streaming thread */
+typedef struct _SeekTableBuilder {
+    GArray *entries;
+    GstClockTime next;
+    gint parser_found;
+} SeekTableBuilder;
+
+static GThreadPool *pool;
+static GHashTable *pending;             /* URIs queued or being parsed */
+static GMutex pending_lock;
+static gint cancel;
+
+/* Where the table of uri lives. NULL for anything but local files. */
+static gchar* cache_path(const gchar *uri, GStatBuf *st) {
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+    gchar *key, *hash, *path;
+
+    if (NULL == filename || 0 != g_stat (filename, st)) {
+        g_free (filename);
+        return NULL;
+    }
+
+    key = g_strdup_printf ("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT,
+            filename, (gint64)st->st_size, (gint64)st->st_mtime);
+    hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+    path = g_build_filename (g_get_user_cache_dir (), "4deckradio", "seektables", hash, NULL);
+
+    g_free (hash);
+    g_free (key);
+    g_free (filename);
+
+    return path;
+}
+
+SeekTable* seektable_lookup(const gchar *uri) {
+    GStatBuf st;
+    gchar *path = cache_path (uri, &st);
+    GMappedFile *file;
+    const SeekTableHeader *header;
+    gsize length;
+    SeekTable *table;
+
+    if (NULL == path) {
+        return NULL;
+    }
+
+    file = g_mapped_file_new (path, FALSE, NULL);
+    g_free (path);
+    if (NULL == file) {
+        return NULL;
+    }
+
+    length = g_mapped_file_get_length (file);
+    header = (const SeekTableHeader *)g_mapped_file_get_contents (file);
+
+    if (length < sizeof (SeekTableHeader) ||
+            0 != memcmp (header->magic, SEEKTABLE_MAGIC, 4) ||
+            SEEKTABLE_VERSION != header->version ||
+            (guint64)st.st_size != header->size || (gint64)st.st_mtime != header->mtime ||
+            sizeof (SeekTableHeader) + header->nentries * sizeof (SeekTableEntry) != length) {
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    table = g_new0 (SeekTable, 1);
+    table->refcount = 1;
+    table->file = file;
+    table->header = header;
+    table->entries = (const SeekTableEntry *)(header + 1);
+
+    return table;
+}
+
+SeekTable* seektable_ref(SeekTable *table) {
+    g_atomic_int_inc (&table->refcount);
+    return table;
+}
+
+void seektable_unref(SeekTable *table) {
+    if (NULL != table && g_atomic_int_dec_and_test (&table->refcount)) {
+        g_mapped_file_unref (table->file);
+        g_free (table);
+    }
+}
+
+#if GST_CHECK_VERSION (1, 10, 0)
+/* The parser's first buffer: it has gone to PAUSED and set up a fresh
+ * index, fill it in
+ */
+static GstPadProbeReturn index_probe(GstPad *pad, GstPadProbeInfo *info, SeekTable *table) {
+    GstElement *parser = gst_pad_get_parent_element (pad);
+
+    for (guint i = 0; i < table->header->nentries; i++) {
+        gst_base_parse_add_index_entry (GST_BASE_PARSE (parser),
+                table->entries[i].offset, table->entries[i].time, TRUE, TRUE);
+    }
+    gst_object_unref (parser);
+
+    return GST_PAD_PROBE_REMOVE;
+}
+#endif
+
+/* For "deep-element-added" handlers: if element is a parser, it gets
+ * table before anybody seeks
+ */
+void seektable_watch_parser(SeekTable *table, GstElement *element) {
+#if GST_CHECK_VERSION (1, 10, 0)
+    GstPad *pad;
+
+    if (NULL == table || !GST_IS_BASE_PARSE (element)) {
+        return;
+    }
+
+    pad = gst_element_get_static_pad (element, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)index_probe,
+            seektable_ref (table), (GDestroyNotify)seektable_unref);
+    gst_object_unref (pad);
+#endif
+}
+
+static gboolean write_cache(const gchar *uri, GArray *entries) {
+    GStatBuf st;
+    gchar *path = cache_path (uri, &st);
+    gchar *dir;
+    SeekTableHeader header;
+    GByteArray *contents;
+    gboolean ok;
+
+    if (NULL == path) {
+        return FALSE;
+    }
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SEEKTABLE_MAGIC, 4);
+    header.version = SEEKTABLE_VERSION;
+    header.size = st.st_size;
+    header.mtime = st.st_mtime;
+    header.nentries = entries->len;
+
+    contents = g_byte_array_new ();
+    g_byte_array_append (contents, (const guint8 *)&header, sizeof (header));
+    g_byte_array_append (contents, (const guint8 *)entries->data,
+            entries->len * sizeof (SeekTableEntry));
+
+    dir = g_path_get_dirname (path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    /* written to a temporary file and renamed, readers never see half of it */
+    ok = g_file_set_contents (path, (const gchar *)contents->data, contents->len, NULL);
+
+    g_byte_array_free (contents, TRUE);
+    g_free (path);
+
+    return ok;
+}
+
+#if !GST_CHECK_VERSION (1, 10, 0)
+static GArray* build(const gchar *uri) {
+    return NULL;
+}
+#else
+/* Sample the parser's output: one keyframe per SEEKTABLE_INTERVAL */
+static GstPadProbeReturn parser_buffer_probe(GstPad *pad, GstPadProbeInfo *info,
+        SeekTableBuilder *builder) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    SeekTableEntry entry;
+
+    if (!GST_BUFFER_PTS_IS_VALID (buffer) || !GST_BUFFER_OFFSET_IS_VALID (buffer) ||
+            GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) ||
+            GST_BUFFER_PTS (buffer) < builder->next) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    entry.time = GST_BUFFER_PTS (buffer);
+    entry.offset = GST_BUFFER_OFFSET (buffer);
+    g_array_append_val (builder->entries, entry);
+    builder->next = entry.time + SEEKTABLE_INTERVAL;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void deep_element_added_cb(GstBin *bin, GstBin *sub_bin, GstElement *element,
+        SeekTableBuilder *builder) {
+    GstPad *pad;
+
+    /* the first parser is the one that seeks in the file */
+    if (!GST_IS_BASE_PARSE (element) ||
+            !g_atomic_int_compare_and_exchange (&builder->parser_found, FALSE, TRUE)) {
+        return;
+    }
+
+    pad = gst_element_get_static_pad (element, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+            (GstPadProbeCallback)parser_buffer_probe, builder, NULL);
+    gst_object_unref (pad);
+}
+
+/* Parse uri without decoding it and collect the table */
+static GArray* build(const gchar *uri) {
+    GstElement *pipeline, *source;
+    GstBus *bus;
+    GError *error = NULL;
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+    gboolean ok = FALSE;
+    SeekTableBuilder builder;
+
+    pipeline = gst_parse_launch ("filesrc name=source ! parsebin ! fakesink sync=false", &error);
+    if (NULL == pipeline) {
+        g_printerr ("Couldn't create seek table parser: %s\n", error->message);
+        g_clear_error (&error);
+        g_free (filename);
+        return NULL;
+    }
+
+    memset (&builder, 0, sizeof (builder));
+    builder.entries = g_array_new (FALSE, FALSE, sizeof (SeekTableEntry));
+    g_signal_connect (pipeline, "deep-element-added", G_CALLBACK (deep_element_added_cb), &builder);
+
+    source = gst_bin_get_by_name (GST_BIN (pipeline), "source");
+    g_object_set (source, "location", filename, NULL);
+    bus = gst_element_get_bus (pipeline);
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+    while (!g_atomic_int_get (&cancel)) {
+        GstMessage *msg = gst_bus_timed_pop_filtered (bus, 100 * GST_MSECOND,
+                GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+
+        if (NULL == msg) {
+            continue;
+        }
+
+        if (GST_MESSAGE_ERROR == GST_MESSAGE_TYPE (msg)) {
+            gst_message_parse_error (msg, &error, NULL);
+            g_printerr ("Couldn't build the seek table of %s: %s\n", uri, error->message);
+            g_clear_error (&error);
+        } else {
+            ok = TRUE;
+        }
+        gst_message_unref (msg);
+        break;
+    }
+
+    /* the probe is gone with the streaming threads */
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (bus);
+    gst_object_unref (source);
+    gst_object_unref (pipeline);
+    g_free (filename);
+
+    if (!ok || g_atomic_int_get (&cancel) || 0 == builder.entries->len) {
+        g_array_free (builder.entries, TRUE);
+        return NULL;
+    }
+
+    return builder.entries;
+}
+#endif
+
+static void build_worker(gchar *uri, gpointer unused) {
+    gint64 start = g_get_monotonic_time ();
+    GArray *entries = build (uri);
+
+    if (NULL != entries) {
+        if (write_cache (uri, entries)) {
+            g_print ("Seek table of %s: %u entries in %.0f ms\n", uri, entries->len,
+                    (g_get_monotonic_time () - start) / 1000.0);
+        }
+        g_array_free (entries, TRUE);
+    }
+
+    g_mutex_lock (&pending_lock);
+    g_hash_table_remove (pending, uri);
+    g_mutex_unlock (&pending_lock);
+
+    g_free (uri);
+}
+
+void seektable_init(void) {
+    guint threads = CLAMP (g_get_num_processors () / 2, 1, SEEKTABLE_MAX_THREADS);
+
+    pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    pool = g_thread_pool_new ((GFunc)build_worker, NULL, threads, FALSE, NULL);
+}
+
+void seektable_shutdown(void) {
+    if (NULL == pool) {
+        return;
+    }
+
+    /* drop what's queued, cut the running passes short */
+    g_atomic_int_set (&cancel, TRUE);
+    g_thread_pool_free (pool, TRUE, TRUE);
+    pool = NULL;
+
+    g_hash_table_destroy (pending);
+    pending = NULL;
+}
+
+/* Build the table of uri in the background, unless that's already under
+ * way or pointless. It's used from the next load on.
+ */
+void seektable_request(const gchar *uri) {
+    if (NULL == pool || !g_str_has_prefix (uri, "file://")) {
+        return;
+    }
+
+    g_mutex_lock (&pending_lock);
+    if (g_hash_table_contains (pending, uri)) {
+        g_mutex_unlock (&pending_lock);
+        return;
+    }
+    g_hash_table_add (pending, g_strdup (uri));
+    g_mutex_unlock (&pending_lock);
+
+    g_thread_pool_push (pool, g_strdup (uri), NULL);
+}
+
+/* TRUE while the table of uri is queued or being built */
+gboolean seektable_is_pending(const gchar *uri) {
+    gboolean result;
+
+    if (NULL == pool) {
+        return FALSE;
+    }
+
+    g_mutex_lock (&pending_lock);
+    result = g_hash_table_contains (pending, uri);
+    g_mutex_unlock (&pending_lock);
+
+    return result;
+}
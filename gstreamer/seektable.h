@@ -0,0 +1,20 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _SEEKTABLE_H
+#define _SEEKTABLE_H
+
+/* A cached time -> byte index of a file, mapped read-only */
+typedef struct _SeekTable SeekTable;
+
+void seektable_init(void);
+void seektable_shutdown(void);
+SeekTable* seektable_lookup(const gchar *uri);
+void seektable_request(const gchar *uri);
+gboolean seektable_is_pending(const gchar *uri);
+SeekTable* seektable_ref(SeekTable *table);
+void seektable_unref(SeekTable *table);
+void seektable_watch_parser(SeekTable *table, GstElement *element);
+
+#endif /* _SEEKTABLE_H */
@@ -0,0 +1,209 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "deck.h"
+#include "engine.h"
+#include "segue.h"
+
+/*
+ * Auto-segue between decks, engine mode only.
+ *
+ * While a deck plays, the next deck along with a file prerolled is lined
+ * up behind it. About a second before the segue point, overlap_ms ahead
+ * of the outgoing file's cue-out, the incoming deck is started with its
+ * engine slot held: the pipeline goes to PLAYING and fills the ring, and
+ * the engine's process callback lets it in on the exact frame the
+ * outgoing deck gets there (see engine.c). The fade happens in the mix,
+ * nothing on the main loop touches a volume element.
+ *
+ * Only one segue is lined up at a time. Stopping the outgoing deck before
+ * the segue point starts the incoming one right away, stopping the
+ * incoming deck calls the segue off.
+ */
+
+#define SEGUE_ARM_LEAD_MS 1000
+#define SEGUE_POLL_MS 100
+
+typedef struct _Segue {
+    gboolean enabled;
+    CustomData *decks;
+    guint ndecks;
+    guint overlap_ms;
+    guint fade_ms;
+    EngineFadeCurve curve;
+
+    CustomData *out;                /* The pair lined up, NULL if none */
+    CustomData *in;
+    gboolean armed;                 /* Handed to the engine */
+    AudioChain *spent;              /* Outgoing chain of the last segue, still audible */
+    guint timeout_id;
+} Segue;
+
+static Segue segue;
+
+static gint64 ms_to_frames(guint ms) {
+    return (gint64)ms * engine_get_rate () / 1000;
+}
+
+/* Cue-out of the deck's file, in frames. -1 if unknown. */
+static gint64 cue_out_frames(CustomData *data) {
+    gint64 position, duration;
+
+    if (GST_CLOCK_TIME_IS_VALID (data->active->cue_out)) {
+        duration = data->active->cue_out;
+    } else {
+        deck_get_status (data, &position, &duration);
+        if (duration < 0) {
+            return -1;
+        }
+    }
+
+    return (gint64)gst_util_uint64_scale_int (duration, engine_get_rate (), GST_SECOND);
+}
+
+static void unwatch(void) {
+    if (0 != segue.timeout_id) {
+        g_source_remove (segue.timeout_id);
+        segue.timeout_id = 0;
+    }
+    segue.out = NULL;
+    segue.in = NULL;
+    segue.armed = FALSE;
+}
+
+static void arm(void) {
+    EngineSlot *out = segue.out->active->slot;
+    EngineSlot *in = segue.in->active->slot;
+    gint64 position = engine_slot_get_position (out);
+    gint64 end = cue_out_frames (segue.out);
+    gint64 at;
+
+    if (position < 0 || end < 0) {
+        return;
+    }
+
+    at = end - ms_to_frames (segue.overlap_ms);
+    if (at - position > ms_to_frames (SEGUE_ARM_LEAD_MS)) {
+        return;
+    }
+
+    engine_slot_hold (in);
+    if (!engine_segue_arm (out, in, at, (guint)ms_to_frames (segue.fade_ms), segue.curve)) {
+        engine_slot_release (in);
+        return;
+    }
+
+    segue.armed = TRUE;
+    deck_play (segue.in);
+}
+
+static void line_up(void);
+
+static gboolean poll_cb(gpointer unused) {
+    if (!segue.armed) {
+        arm ();
+        return TRUE;
+    }
+
+    if (ENGINE_SEGUE_BEGUN == engine_segue_get_state ()) {
+        g_print ("Deck %u: segued into deck %u\n", segue.out->decknumber + 1,
+                segue.in->decknumber + 1);
+        segue.spent = segue.out->active;
+        segue.timeout_id = 0;
+        unwatch ();
+        line_up ();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The first playing deck followed by a prerolled one */
+static void line_up(void) {
+    for (guint i = 0; i < segue.ndecks; i++) {
+        CustomData *out = &segue.decks[i];
+
+        if (DECK_PLAYING != out->deckstate || out->active == segue.spent ||
+                NULL == out->active->slot || out->active->is_network_stream) {
+            continue;
+        }
+
+        for (guint j = 1; j < segue.ndecks; j++) {
+            CustomData *in = &segue.decks[(i + j) % segue.ndecks];
+
+            if (DECK_PAUSED == in->deckstate && NULL != in->active->slot) {
+                segue.out = out;
+                segue.in = in;
+                segue.timeout_id = g_timeout_add (SEGUE_POLL_MS, poll_cb, NULL);
+                return;
+            }
+        }
+    }
+}
+
+/* Auto-segue between the decks with the engine running: start the next
+ * deck overlap_ms before the playing one ends, fading over fade_ms.
+ */
+gboolean segue_init(CustomData *decks, guint ndecks, guint overlap_ms, guint fade_ms,
+        EngineFadeCurve curve) {
+    if (!engine_is_running ()) {
+        g_printerr ("Auto-segue needs the engine (--engine)\n");
+        return FALSE;
+    }
+
+    segue.decks = decks;
+    segue.ndecks = ndecks;
+    segue.overlap_ms = overlap_ms;
+    segue.fade_ms = fade_ms;
+    segue.curve = curve;
+    segue.enabled = TRUE;
+
+    line_up ();
+    return TRUE;
+}
+
+void segue_shutdown(void) {
+    if (!segue.enabled) {
+        return;
+    }
+
+    engine_segue_cancel ();
+    unwatch ();
+    segue.enabled = FALSE;
+}
+
+/* From the deck state machine, after every state change */
+void segue_deck_changed(CustomData *data) {
+    gboolean called_off = FALSE;
+
+    if (!segue.enabled) {
+        return;
+    }
+
+    if (data == segue.out) {
+        called_off = (DECK_PLAYING != data->deckstate);
+    } else if (data == segue.in) {
+        /* once armed, the segue starts the deck itself */
+        called_off = segue.armed ? !deck_is_playing (data) : (DECK_PAUSED != data->deckstate);
+    }
+
+    if (called_off) {
+        /* an outgoing deck stopped early lets the incoming one go right away */
+        engine_segue_cancel ();
+        unwatch ();
+    }
+
+    /* the faded out chain is done with once its deck moves on */
+    if (DECK_PLAYING != data->deckstate &&
+            (data->active == segue.spent || data->standby == segue.spent)) {
+        segue.spent = NULL;
+    }
+
+    if (NULL == segue.out) {
+        line_up ();
+    }
+}
@@ -0,0 +1,15 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _SEGUE_H
+#define _SEGUE_H
+
+#include "engine.h"
+
+gboolean segue_init(CustomData *decks, guint ndecks, guint overlap_ms, guint fade_ms,
+        EngineFadeCurve curve);
+void segue_shutdown(void);
+void segue_deck_changed(CustomData *data);
+
+#endif /* _SEGUE_H */
@@ -0,0 +1,446 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "deck.h"
+#include "session.h"
+#include "startup.h"
+
+/*
+ * The session journal: what every deck had loaded, where it was, what it
+ * had queued, its cues and the playlist it was playing through, so that a
+ * crash or an accidental quit doesn't leave the presenter re-browsing and
+ * re-cueing four decks off air.
+ *
+ * The journal is a text file in the cache dir with one line per record,
+ * appended whenever a deck changes and every SESSION_POSITION_MS while
+ * one plays. Every line ends with a checksum of itself and the last good
+ * line of a deck wins, so a line torn by a crash costs only that record.
+ * The main loop formats the lines; a writer thread appends and syncs
+ * them, and once SESSION_COMPACT_RECORDS have piled up writes the latest
+ * line of each deck to a new file that is renamed over the journal.
+ *
+ * At startup all decks are restored at once, each prerolling on its own
+ * worker, and the time from process start until the last one is ready
+ * is reported. A deck that was playing comes back paused at its position:
+ * going on air is the presenter's call.
+ */
+
+#define SESSION_POSITION_MS 2000
+#define SESSION_COMPACT_RECORDS 1000
+#define SESSION_FIELDS 11
+
+typedef struct _Session {
+    gchar *path;
+    CustomData *decks;
+    guint ndecks;
+
+    /* Main loop only */
+    gchar **queued;                 /* Last line handed to the writer, per deck */
+    gboolean *dirty;
+    gboolean *restoring;            /* Still prerolling what the journal had */
+    guint nrestoring;
+    guint nrestored;                /* Prerolled fine */
+    guint nready;                   /* Restores done, fine or not */
+    gint64 restore_start;
+    guint idle_id;
+    guint timer_id;
+
+    /* Writer thread only, once it runs */
+    gchar **latest;                 /* Last line written, per deck */
+    guint appended;                 /* Since the last compaction */
+    int fd;
+
+    GAsyncQueue *lines;             /* To the writer */
+    GThread *writer;
+} Session;
+
+static Session session = { NULL };
+static gchar stop_line;             /* Tells the writer to finish */
+
+/* deck, state, position, cue-in, cue-out, next-from-playlist, playlist
+ * offset, playlist position, URI, queued URI, playlist URI, checksum
+ */
+static gchar* format_record(guint deck, const DeckSession *s) {
+    gchar *uri = g_strescape (NULL != s->uri ? s->uri : "", NULL);
+    gchar *next_uri = g_strescape (NULL != s->next_uri ? s->next_uri : "", NULL);
+    gchar *playlist_uri = g_strescape (NULL != s->playlist_uri ? s->playlist_uri : "", NULL);
+    gchar *body, *line;
+
+    body = g_strdup_printf ("%u\t%s\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%"
+            G_GINT64_FORMAT "\t%d\t%" G_GSIZE_FORMAT "\t%u\t%s\t%s\t%s",
+            deck, deck_state_get_name (s->state), s->position, s->cue_in, s->cue_out,
+            s->next_from_playlist ? 1 : 0, s->playlist_offset, s->playlist_position,
+            uri, next_uri, playlist_uri);
+    line = g_strdup_printf ("%s\t%08x\n", body, g_str_hash (body));
+
+    g_free (body);
+    g_free (playlist_uri);
+    g_free (next_uri);
+    g_free (uri);
+    return line;
+}
+
+static DeckState parse_state(const gchar *name) {
+    for (int i = 0; i < DECK_NUM_STATES; i++) {
+        if (0 == strcmp (name, deck_state_get_name (i))) {
+            return i;
+        }
+    }
+    return DECK_EMPTY;
+}
+
+static gchar* parse_uri(const gchar *field) {
+    return ('\0' == *field) ? NULL : g_strcompress (field);
+}
+
+/* A line without its newline. FALSE if it's torn or garbled. */
+static gboolean parse_record(gchar *line, guint *deck, DeckSession *s) {
+    gchar *sum = strrchr (line, '\t');
+    gchar **fields;
+    gboolean ok;
+
+    if (NULL == sum || 8 != strlen (sum + 1)) {
+        return FALSE;
+    }
+
+    *sum = '\0';
+    ok = ((guint)strtoul (sum + 1, NULL, 16) == g_str_hash (line));
+    fields = g_strsplit (line, "\t", -1);
+    *sum = '\t';
+
+    if (!ok || SESSION_FIELDS != g_strv_length (fields)) {
+        g_strfreev (fields);
+        return FALSE;
+    }
+
+    memset (s, 0, sizeof (*s));
+    *deck = (guint)strtoul (fields[0], NULL, 10);
+    s->state = parse_state (fields[1]);
+    s->position = g_ascii_strtoll (fields[2], NULL, 10);
+    s->cue_in = g_ascii_strtoll (fields[3], NULL, 10);
+    s->cue_out = g_ascii_strtoll (fields[4], NULL, 10);
+    s->next_from_playlist = (0 != atoi (fields[5]));
+    s->playlist_offset = (gsize)g_ascii_strtoull (fields[6], NULL, 10);
+    s->playlist_position = (guint)strtoul (fields[7], NULL, 10);
+    s->uri = parse_uri (fields[8]);
+    s->next_uri = parse_uri (fields[9]);
+    s->playlist_uri = parse_uri (fields[10]);
+
+    g_strfreev (fields);
+    return TRUE;
+}
+
+/* The last good record of every deck, and its line */
+static void read_journal(DeckSession *sessions, gchar **lines) {
+    gchar *contents = NULL;
+    gchar *line, *end;
+
+    if (!g_file_get_contents (session.path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    /* whatever follows the last newline was torn off by a crash */
+    for (line = contents; NULL != (end = strchr (line, '\n')); line = end + 1) {
+        DeckSession record;
+        guint deck;
+
+        *end = '\0';
+        if (!parse_record (line, &deck, &record)) {
+            continue;
+        }
+
+        if (deck < session.ndecks) {
+            deck_session_clear (&sessions[deck]);
+            sessions[deck] = record;
+            g_free (lines[deck]);
+            lines[deck] = g_strdup_printf ("%s\n", line);
+        } else {
+            deck_session_clear (&record);
+        }
+    }
+
+    g_free (contents);
+}
+
+static void open_journal(void) {
+    session.fd = g_open (session.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (session.fd < 0) {
+        g_printerr ("Couldn't open the session journal %s: %s\n", session.path,
+                g_strerror (errno));
+    }
+}
+
+/* The latest line of every deck in a new file, renamed over the journal */
+static void compact(void) {
+    GString *contents = g_string_new (NULL);
+
+    for (guint i = 0; i < session.ndecks; i++) {
+        if (NULL != session.latest[i]) {
+            g_string_append (contents, session.latest[i]);
+        }
+    }
+
+    if (!g_file_set_contents (session.path, contents->str, contents->len, NULL)) {
+        g_printerr ("Couldn't write the session journal %s\n", session.path);
+    }
+    g_string_free (contents, TRUE);
+
+    /* the old file is gone, go on with the new one */
+    if (session.fd >= 0) {
+        close (session.fd);
+    }
+    open_journal ();
+    session.appended = 0;
+}
+
+static void append(const GString *batch) {
+    gsize done = 0;
+
+    if (session.fd < 0 || 0 == batch->len) {
+        return;
+    }
+
+    while (done < batch->len) {
+        gssize n = write (session.fd, batch->str + done, batch->len - done);
+
+        if (n < 0 && EINTR == errno) {
+            continue;
+        } else if (n < 0) {
+            g_printerr ("Couldn't write the session journal: %s\n", g_strerror (errno));
+            return;
+        }
+        done += n;
+    }
+
+    /* on disk before the next change is taken */
+    fdatasync (session.fd);
+}
+
+static gpointer writer_thread(gpointer unused) {
+    GString *batch = g_string_new (NULL);
+    gboolean stop = FALSE;
+
+    while (!stop) {
+        gchar *line = g_async_queue_pop (session.lines);
+
+        /* whatever piled up meanwhile goes out with a single write */
+        g_string_truncate (batch, 0);
+        do {
+            guint deck;
+
+            if (&stop_line == line) {
+                stop = TRUE;
+                break;
+            }
+
+            deck = (guint)strtoul (line, NULL, 10);
+            g_string_append (batch, line);
+            g_free (session.latest[deck]);
+            session.latest[deck] = line;
+            session.appended++;
+        } while (NULL != (line = g_async_queue_try_pop (session.lines)));
+
+        append (batch);
+        if (session.appended >= SESSION_COMPACT_RECORDS) {
+            compact ();
+        }
+    }
+
+    g_string_free (batch, TRUE);
+    return NULL;
+}
+
+static void record(guint deck) {
+    DeckSession s;
+    gchar *line;
+
+    deck_get_session (&session.decks[deck], &s);
+    line = format_record (deck, &s);
+    deck_session_clear (&s);
+
+    /* a paused deck looks the same every time */
+    if (0 == g_strcmp0 (line, session.queued[deck])) {
+        g_free (line);
+        return;
+    }
+
+    g_free (session.queued[deck]);
+    session.queued[deck] = g_strdup (line);
+    g_async_queue_push (session.lines, line);
+}
+
+/* A deck being restored keeps its old record until it's ready */
+static void record_dirty(void) {
+    for (guint i = 0; i < session.ndecks; i++) {
+        if (session.dirty[i] && !session.restoring[i]) {
+            session.dirty[i] = FALSE;
+            record (i);
+        }
+    }
+}
+
+static gboolean idle_cb(gpointer unused) {
+    session.idle_id = 0;
+    record_dirty ();
+    return FALSE;
+}
+
+static gboolean position_cb(gpointer unused) {
+    for (guint i = 0; i < session.ndecks; i++) {
+        if (deck_is_playing (&session.decks[i])) {
+            session.dirty[i] = TRUE;
+        }
+    }
+    record_dirty ();
+    return TRUE;
+}
+
+static void report_ready(void) {
+    gint64 age = startup_process_age ();
+    gint64 restoring = g_get_monotonic_time () - session.restore_start;
+
+    if (age >= 0) {
+        g_print ("Session: %u of %u decks ready %.0f ms after process start, "
+                "restored in %.0f ms\n", session.nrestored, session.nready,
+                age / 1000.0, restoring / 1000.0);
+    } else {
+        g_print ("Session: %u of %u decks ready, restored in %.0f ms\n",
+                session.nrestored, session.nready, restoring / 1000.0);
+    }
+}
+
+/* Called by the deck state machine whenever something worth keeping
+ * changed. Cheap, the record is taken when the main loop is idle.
+ */
+void session_deck_changed(CustomData *data) {
+    guint deck = data->decknumber;
+
+    if (NULL == session.lines) {
+        return;
+    }
+
+    if (session.restoring[deck] && DECK_LOADING != data->deckstate) {
+        session.restoring[deck] = FALSE;
+        session.nready++;
+        if (DECK_PAUSED == data->deckstate) {
+            session.nrestored++;
+        }
+        if (session.nready == session.nrestoring) {
+            report_ready ();
+        }
+    }
+
+    session.dirty[deck] = TRUE;
+    if (0 == session.idle_id) {
+        session.idle_id = g_idle_add_full (G_PRIORITY_LOW, idle_cb, NULL, NULL);
+    }
+}
+
+/* Journal the decks to the cache dir under name, one journal per
+ * program. With restore, first load every deck as the journal had it and
+ * call func for it. Call after the decks are set up.
+ */
+void session_init(const gchar *name, CustomData *decks, guint ndecks, gboolean restore,
+        SessionRestoredFunc func, gpointer user_data) {
+    DeckSession *sessions = g_new0 (DeckSession, ndecks);
+    gchar *filename = g_strdup_printf ("%s.session", name);
+    gchar *dir;
+
+    session.path = g_build_filename (g_get_user_cache_dir (), "4deckradio", filename, NULL);
+    g_free (filename);
+    dir = g_path_get_dirname (session.path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    session.decks = decks;
+    session.ndecks = ndecks;
+    session.queued = g_new0 (gchar *, ndecks);
+    session.dirty = g_new0 (gboolean, ndecks);
+    session.restoring = g_new0 (gboolean, ndecks);
+    session.latest = g_new0 (gchar *, ndecks);
+    session.fd = -1;
+
+    if (restore) {
+        read_journal (sessions, session.latest);
+    }
+
+    /* start from the good records only, without whatever a crash tore */
+    compact ();
+
+    session.lines = g_async_queue_new ();
+    session.writer = g_thread_new ("session", writer_thread, NULL);
+
+    for (guint i = 0; i < ndecks; i++) {
+        if (NULL != sessions[i].uri) {
+            session.restoring[i] = TRUE;
+            session.nrestoring++;
+        }
+    }
+
+    /* every deck prerolls on its own worker, so they all load at once */
+    session.restore_start = g_get_monotonic_time ();
+    for (guint i = 0; i < ndecks; i++) {
+        if (session.restoring[i]) {
+            deck_restore (&decks[i], &sessions[i]);
+            if (NULL != func) {
+                func (&decks[i], user_data);
+            }
+        }
+        deck_session_clear (&sessions[i]);
+    }
+    g_free (sessions);
+
+    session.timer_id = g_timeout_add (SESSION_POSITION_MS, position_cb, NULL);
+    g_print ("Session journal %s, %u decks to restore\n", session.path, session.nrestoring);
+}
+
+/* Before the decks go away. Journals where they were left. */
+void session_shutdown(void) {
+    if (NULL == session.lines) {
+        return;
+    }
+
+    if (0 != session.idle_id) {
+        g_source_remove (session.idle_id);
+        session.idle_id = 0;
+    }
+    g_source_remove (session.timer_id);
+    session.timer_id = 0;
+
+    for (guint i = 0; i < session.ndecks; i++) {
+        session.dirty[i] = TRUE;
+    }
+    record_dirty ();
+
+    g_async_queue_push (session.lines, &stop_line);
+    g_thread_join (session.writer);
+    session.writer = NULL;
+    g_async_queue_unref (session.lines);
+    session.lines = NULL;
+
+    if (session.fd >= 0) {
+        close (session.fd);
+        session.fd = -1;
+    }
+
+    for (guint i = 0; i < session.ndecks; i++) {
+        g_free (session.queued[i]);
+        g_free (session.latest[i]);
+    }
+    g_free (session.queued);
+    g_free (session.latest);
+    g_free (session.dirty);
+    g_free (session.restoring);
+    g_free (session.path);
+    session.path = NULL;
+}
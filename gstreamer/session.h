@@ -0,0 +1,18 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _SESSION_H
+#define _SESSION_H
+
+/* Called on the main loop for every deck brought back from the journal,
+ * right after deck_restore()
+ */
+typedef void (*SessionRestoredFunc) (CustomData *data, gpointer user_data);
+
+void session_init(const gchar *name, CustomData *decks, guint ndecks, gboolean restore,
+        SessionRestoredFunc func, gpointer user_data);
+void session_deck_changed(CustomData *data);
+void session_shutdown(void);
+
+#endif /* _SESSION_H */
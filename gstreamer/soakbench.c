@@ -0,0 +1,640 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <dirent.h>
+#include <errno.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "audio.h"
+#include "deck.h"
+#include "metrics.h"
+#include "timedisplay.h"
+
+/*
+ * Soak test: days of playout in minutes.
+ *
+ * The decks play into fakesinks that don't wait for the clock (see
+ * audio_set_null_sink()), so a track is through as fast as it decodes.
+ * A random schedule loads, queues, plays, seeks, pauses and stops them,
+ * and the queued files are swapped in at the end of the active ones.
+ * Every --interval the test samples the resident size, the heap in use,
+ * the blocks malloc handed out and not yet got back, the allocations per
+ * second and the open file descriptors and threads. Past --warmup it
+ * fits a line through each against the audio played so far, and fails
+ * if one grows by more than its budget per day of audio, or if the file
+ * descriptors or threads end up above the most there were in the warmup.
+ *
+ * Next to it, every 20 ms each deck's time display is worked out by
+ * time_display_update(), the code refresh_ui() in mygstreamer.c runs on
+ * every frame. Every allocation it makes on this thread fails the test
+ * too, except on the frames that had to ask a pipeline for its position
+ * after a seek or state change. The widget updates refresh_ui() does
+ * with the result (GTK and Pango) aren't run here, so not covered.
+ *
+ *     ./4deckradio-soakbench --minutes 30 /music/a.flac /music/b.mp3 ...
+ */
+
+#define SOAK_FRAME_MS 20
+#define SOAK_SECONDS_PER_DAY (24 * 60 * 60)
+
+/* Every allocation is counted on its way into glibc's malloc. The blocks
+ * still out are the ones allocated and not freed, whatever the arenas
+ * hold on to.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static guint64 allocations;
+static guint64 frees;
+static __thread guint64 thread_allocations;
+
+static inline void count_allocation(void) {
+    __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+    thread_allocations++;
+}
+
+static inline void count_free(void) {
+    __atomic_fetch_add (&frees, 1, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    count_allocation ();
+    return __libc_malloc (size);
+}
+
+void* calloc(size_t n, size_t size) {
+    count_allocation ();
+    return __libc_calloc (n, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+    if (NULL == ptr) {
+        count_allocation ();
+    } else if (0 == size) {
+        count_free ();
+    }
+    return __libc_realloc (ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    count_allocation ();
+    return __libc_memalign (alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign (alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    void *p = memalign (alignment, size);
+
+    if (NULL == p) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+void free(void *ptr) {
+    if (NULL != ptr) {
+        count_free ();
+    }
+    __libc_free (ptr);
+}
+
+typedef struct _Sample {
+    gdouble wall;                   /* Seconds since the start */
+    gdouble played;                 /* Seconds of audio through the sinks */
+    guint64 allocations;
+    gdouble rss_kb;
+    gdouble heap_kb;
+    gdouble blocks;
+    guint fds;
+    guint threads;
+} Sample;
+
+typedef struct _Soak {
+    CustomData *decks;
+    guint ndecks;
+    gchar **uris;
+    guint nuris;
+    GRand *rand;
+    gdouble actions;                /* Per second, over all decks */
+    gdouble pending;                /* Actions due, carried from frame to frame */
+
+    gint64 start;
+    gssize played_ns;               /* Added to by the sink probes */
+    GArray *samples;
+    TimeDisplay *displays;          /* One per deck */
+    guint64 frame_allocations;
+    guint frames;                   /* Counted, without the ones that queried */
+    guint errors;
+    guint counts[6];
+} Soak;
+
+typedef enum {
+    ACTION_LOAD,
+    ACTION_QUEUE,
+    ACTION_PLAY,
+    ACTION_SEEK,
+    ACTION_PAUSE,
+    ACTION_STOP
+} Action;
+
+static const gchar *action_names[] = { "load", "queue", "play", "seek", "pause", "stop" };
+
+/* Out of 100, plays win so the decks spend their time playing */
+static const guint action_weights[] = { 15, 20, 35, 15, 5, 10 };
+
+static gchar* write_wav(guint rate, guint seconds, gdouble freq) {
+    guint32 frames = rate * seconds;
+    guint32 datasize = frames * 4;
+    GByteArray *wav = g_byte_array_sized_new (44 + datasize);
+    guint32 u32;
+    guint16 u16;
+    gchar *filename, *uri;
+    GError *error = NULL;
+    gint fd;
+
+#define PUT(bytes, n) g_byte_array_append (wav, (const guint8 *)(bytes), n)
+#define PUT32(v) (u32 = GUINT32_TO_LE (v), PUT (&u32, 4))
+#define PUT16(v) (u16 = GUINT16_TO_LE (v), PUT (&u16, 2))
+    PUT ("RIFF", 4); PUT32 (36 + datasize); PUT ("WAVE", 4);
+    PUT ("fmt ", 4); PUT32 (16); PUT16 (1); PUT16 (2);
+    PUT32 (rate); PUT32 (rate * 4); PUT16 (4); PUT16 (16);
+    PUT ("data", 4); PUT32 (datasize);
+
+    for (guint32 i = 0; i < frames; i++) {
+        gint16 sample = (gint16)(16384 * sin (2 * G_PI * freq * i / rate));
+
+        PUT16 ((guint16)sample);
+        PUT16 ((guint16)sample);
+    }
+#undef PUT16
+#undef PUT32
+#undef PUT
+
+    fd = g_file_open_tmp ("4deckradio-soak-XXXXXX.wav", &filename, &error);
+    if (-1 == fd) {
+        g_printerr ("Unable to create tmp file: %s\n", error->message);
+        g_error_free (error);
+        exit (1);
+    }
+    close (fd);
+
+    if (!g_file_set_contents (filename, (const gchar *)wav->data, wav->len, &error)) {
+        g_printerr ("Unable to write %s: %s\n", filename, error->message);
+        g_error_free (error);
+        exit (1);
+    }
+
+    uri = g_filename_to_uri (filename, NULL, NULL);
+    g_byte_array_free (wav, TRUE);
+    g_free (filename);
+    return uri;
+}
+
+static void remove_wav(gchar *uri) {
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+
+    g_unlink (filename);
+    g_free (filename);
+}
+
+/* Counts the audio that reaches a sink, on its streaming thread */
+#if GST_VERSION_MAJOR == (0)
+static gboolean played_probe(GstPad *pad, GstBuffer *buffer, Soak *soak) {
+    if (GST_BUFFER_DURATION_IS_VALID (buffer)) {
+        g_atomic_pointer_add (&soak->played_ns, (gssize)GST_BUFFER_DURATION (buffer));
+    }
+    return TRUE;
+}
+#else
+static GstPadProbeReturn played_probe(GstPad *pad, GstPadProbeInfo *info, Soak *soak) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    if (GST_BUFFER_DURATION_IS_VALID (buffer)) {
+        g_atomic_pointer_add (&soak->played_ns, (gssize)GST_BUFFER_DURATION (buffer));
+    }
+    return GST_PAD_PROBE_OK;
+}
+#endif
+
+static void watch_sink(Soak *soak, AudioChain *chain) {
+    GstPad *pad = gst_element_get_static_pad (chain->audiosink, "sink");
+
+#if GST_VERSION_MAJOR == (0)
+    gst_pad_add_buffer_probe (pad, G_CALLBACK (played_probe), soak);
+#else
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+            (GstPadProbeCallback)played_probe, soak, NULL);
+#endif
+    gst_object_unref (pad);
+}
+
+static guint count_fds(void) {
+    DIR *dir = opendir ("/proc/self/fd");
+    struct dirent *entry;
+    guint n = 0;
+
+    if (NULL == dir) {
+        return 0;
+    }
+
+    while (NULL != (entry = readdir (dir))) {
+        if ('.' != entry->d_name[0]) {
+            n++;
+        }
+    }
+    closedir (dir);
+
+    /* not counting the one opendir() held */
+    return n - 1;
+}
+
+static guint status_field(const gchar *contents, const gchar *name) {
+    const gchar *line = strstr (contents, name);
+
+    return (NULL != line) ? (guint)strtoul (line + strlen (name), NULL, 10) : 0;
+}
+
+static void take_sample(Soak *soak, Sample *sample) {
+    gchar *contents = NULL;
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 heap = mallinfo2 ();
+#else
+    struct mallinfo heap = mallinfo ();
+#endif
+
+    memset (sample, 0, sizeof (*sample));
+    sample->wall = (g_get_monotonic_time () - soak->start) / 1e6;
+    sample->played = (gssize)g_atomic_pointer_get (&soak->played_ns) / 1e9;
+    sample->allocations = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+    sample->blocks = (gdouble)(sample->allocations - __atomic_load_n (&frees, __ATOMIC_RELAXED));
+    sample->heap_kb = ((gdouble)heap.uordblks + heap.hblkhd) / 1024;
+    sample->fds = count_fds ();
+
+    if (g_file_get_contents ("/proc/self/status", &contents, NULL, NULL)) {
+        sample->rss_kb = status_field (contents, "VmRSS:");
+        sample->threads = status_field (contents, "Threads:");
+    }
+    g_free (contents);
+}
+
+static void print_sample(const Sample *sample, const Sample *last) {
+    gdouble seconds = sample->wall - last->wall;
+
+    g_print ("%8.0f %10.2f %10.0f %10.0f %10.0f %11.0f %5u %7u\n",
+            sample->wall, sample->played / 3600, sample->rss_kb, sample->heap_kb,
+            sample->blocks, (sample->allocations - last->allocations) / MAX (seconds, 1e-3),
+            sample->fds, sample->threads);
+}
+
+/* Least squares slope of y against the audio played, per second of it */
+static gdouble slope(GArray *samples, guint from, gsize offset) {
+    gdouble n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for (guint i = from; i < samples->len; i++) {
+        const Sample *sample = &g_array_index (samples, Sample, i);
+        gdouble x = sample->played;
+        gdouble y = G_STRUCT_MEMBER (gdouble, sample, offset);
+
+        n++;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    if (n < 2 || n * sxx - sx * sx <= 0) {
+        return 0;
+    }
+
+    return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+static Action pick_action(Soak *soak) {
+    gint r = g_rand_int_range (soak->rand, 0, 100);
+
+    for (guint a = 0; a < G_N_ELEMENTS (action_weights); a++) {
+        r -= action_weights[a];
+        if (r < 0) {
+            return a;
+        }
+    }
+
+    return ACTION_PLAY;
+}
+
+static void run_action(Soak *soak) {
+    CustomData *data = &soak->decks[g_rand_int_range (soak->rand, 0, soak->ndecks)];
+    const gchar *uri = soak->uris[g_rand_int_range (soak->rand, 0, soak->nuris)];
+    Action action = pick_action (soak);
+    gint64 position, duration;
+
+    switch (action) {
+        case ACTION_LOAD:
+            deck_load (data, uri);
+            break;
+        case ACTION_QUEUE:
+            if (DECK_EMPTY == data->deckstate) {
+                deck_load (data, uri);
+            } else {
+                deck_queue (data, uri);
+            }
+            break;
+        case ACTION_PLAY:
+            deck_play (data);
+            break;
+        case ACTION_SEEK:
+            deck_get_status (data, &position, &duration);
+            if (duration > 0) {
+                deck_seek (data, g_rand_double (soak->rand) * duration / GST_SECOND);
+            }
+            break;
+        case ACTION_PAUSE:
+            if (deck_is_playing (data)) {
+                deck_pause (data);
+            }
+            break;
+        case ACTION_STOP:
+            deck_stop (data);
+            break;
+    }
+
+    soak->counts[action]++;
+}
+
+/* What the player works out for every deck on every frame, see refresh_ui() */
+static void frame(Soak *soak) {
+    guint64 before = thread_allocations;
+    guint changed = 0;
+
+    for (guint i = 0; i < soak->ndecks; i++) {
+        changed |= time_display_update (&soak->displays[i]);
+    }
+
+    /* asking the pipeline builds a query */
+    if (changed & TIME_DISPLAY_QUERIED) {
+        return;
+    }
+
+    soak->frame_allocations += thread_allocations - before;
+    soak->frames++;
+}
+
+static gboolean frame_cb(Soak *soak) {
+    frame (soak);
+
+    for (soak->pending += soak->actions * SOAK_FRAME_MS / 1000; soak->pending >= 1;
+            soak->pending--) {
+        run_action (soak);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean sample_cb(Soak *soak) {
+    Sample sample;
+
+    take_sample (soak, &sample);
+    print_sample (&sample, &g_array_index (soak->samples, Sample, soak->samples->len - 1));
+    g_array_append_val (soak->samples, sample);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean quit_cb(GMainLoop *loop) {
+    g_main_loop_quit (loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void error_cb(CustomData *data, const gchar *message) {
+    Soak *soak = data->user_data;
+
+    soak->errors++;
+}
+
+/* Wherever the player reads the position again */
+static void moved_cb(CustomData *data) {
+    Soak *soak = data->user_data;
+
+    time_display_invalidate (&soak->displays[data->decknumber]);
+}
+
+static void swapped_cb(CustomData *data, const gchar *uri) {
+    moved_cb (data);
+}
+
+/* Whether the growth from sample from on is within budget per day of
+ * audio, printed either way
+ */
+static gboolean check_growth(Soak *soak, guint from, const gchar *name, gsize offset,
+        gdouble budget) {
+    gdouble per_day = slope (soak->samples, from, offset) * SOAK_SECONDS_PER_DAY;
+    gboolean ok = per_day <= budget;
+
+    g_print ("%-8s %+12.0f per day of audio, budget %.0f  %s\n", name, per_day, budget,
+            ok ? "ok" : "FAIL");
+    return ok;
+}
+
+/* Whether the count ends up no higher than the most it reached up to
+ * sample from. Thread pools come and go, so not the count at from.
+ */
+static gboolean check_count(Soak *soak, guint from, const gchar *name, gsize offset) {
+    Sample *last = &g_array_index (soak->samples, Sample, soak->samples->len - 1);
+    guint before = 0;
+    guint after = G_STRUCT_MEMBER (guint, last, offset);
+    gboolean ok;
+
+    for (guint i = 0; i <= from; i++) {
+        before = MAX (before, G_STRUCT_MEMBER (guint, &g_array_index (soak->samples, Sample, i),
+                    offset));
+    }
+    ok = after <= before;
+
+    g_print ("%-8s %12u at most in the warmup, %u at the end  %s\n", name, before, after,
+            ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    static const DeckCallbacks callbacks = { moved_cb, error_cb, swapped_cb, moved_cb, NULL };
+    GOptionContext *context;
+    GError *error = NULL;
+    GMainLoop *loop;
+    Soak soak;
+    Sample first;
+    gboolean ok = TRUE;
+    gboolean generated;
+    guint from;
+    gint swaps = 0;
+    const Sample *last;
+
+    gint ndecks = DECK_DEFAULT_COUNT;
+    gdouble minutes = 30;
+    gint interval = 10;
+    gint warmup = 60;
+    gdouble actions = 10;
+    gint seed = 0;
+    gdouble rss_budget = 8192;
+    gdouble heap_budget = 4096;
+    gdouble block_budget = 1000;
+
+    GOptionEntry option_entries[] = {
+        { "decks", 'n', 0, G_OPTION_ARG_INT,
+            &ndecks, "Decks (4)", "N" },
+        { "minutes", 'm', 0, G_OPTION_ARG_DOUBLE,
+            &minutes, "How long to run (30)", "M" },
+        { "interval", 'i', 0, G_OPTION_ARG_INT,
+            &interval, "Seconds between samples (10)", "S" },
+        { "warmup", 'w', 0, G_OPTION_ARG_INT,
+            &warmup, "Seconds left out of the fit, while the caches fill (60)", "S" },
+        { "actions", 'a', 0, G_OPTION_ARG_DOUBLE,
+            &actions, "Random commands per second, over all decks (10)", "N" },
+        { "seed", 's', 0, G_OPTION_ARG_INT,
+            &seed, "For the schedule, 0 picks one", "N" },
+        { "rss-budget", 0, 0, G_OPTION_ARG_DOUBLE,
+            &rss_budget, "Resident kB a day of audio may add (8192)", "KB" },
+        { "heap-budget", 0, 0, G_OPTION_ARG_DOUBLE,
+            &heap_budget, "Heap kB a day of audio may add (4096)", "KB" },
+        { "block-budget", 0, 0, G_OPTION_ARG_DOUBLE,
+            &block_budget, "Unfreed blocks a day of audio may add (1000)", "N" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("[FILE...] - days of random playout, watching for leaks");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    gst_init (&argc, &argv);
+
+    memset (&soak, 0, sizeof (soak));
+    soak.ndecks = CLAMP (ndecks, 1, DECK_MAX_COUNT);
+    soak.actions = MAX (actions, 0);
+    if (0 == seed) {
+        seed = g_random_int_range (1, G_MAXINT);
+    }
+    soak.rand = g_rand_new_with_seed ((guint32)seed);
+    interval = MAX (interval, 1);
+
+    /* without files, tones at rates that keep the resampler busy */
+    generated = (argc < 2);
+    if (generated) {
+        soak.nuris = 3;
+        soak.uris = g_new0 (gchar *, soak.nuris + 1);
+        soak.uris[0] = write_wav (44100, 30, 440.0);
+        soak.uris[1] = write_wav (48000, 90, 523.25);
+        soak.uris[2] = write_wav (22050, 180, 659.25);
+    } else {
+        soak.nuris = argc - 1;
+        soak.uris = g_new0 (gchar *, soak.nuris + 1);
+        for (guint i = 0; i < soak.nuris; i++) {
+            soak.uris[i] = gst_uri_is_valid (argv[i + 1]) ? g_strdup (argv[i + 1]) :
+                gst_filename_to_uri (argv[i + 1], NULL);
+        }
+    }
+
+    audio_set_null_sink (TRUE);
+    deck_set_callbacks (&callbacks);
+
+    soak.decks = g_new0 (CustomData, soak.ndecks);
+    soak.displays = g_new0 (TimeDisplay, soak.ndecks);
+    for (guint i = 0; i < soak.ndecks; i++) {
+        if (0 != init_audio (&soak.decks[i], i, FALSE)) {
+            return 1;
+        }
+        soak.decks[i].user_data = &soak;
+        deck_init (&soak.decks[i]);
+        time_display_init (&soak.displays[i], &soak.decks[i]);
+        watch_sink (&soak, soak.decks[i].active);
+        watch_sink (&soak, soak.decks[i].standby);
+    }
+
+    g_print ("%u decks, %u files, %.1f commands per second, seed %d, %.0f minutes\n",
+            soak.ndecks, soak.nuris, soak.actions, seed, minutes);
+    g_print ("%8s %10s %10s %10s %10s %11s %5s %7s\n", "seconds", "audio h", "rss kB",
+            "heap kB", "blocks", "allocs/s", "fds", "threads");
+
+    soak.samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+    soak.start = g_get_monotonic_time ();
+    take_sample (&soak, &first);
+    g_array_append_val (soak.samples, first);
+
+    loop = g_main_loop_new (NULL, FALSE);
+    g_timeout_add (SOAK_FRAME_MS, (GSourceFunc)frame_cb, &soak);
+    g_timeout_add_seconds (interval, (GSourceFunc)sample_cb, &soak);
+    g_timeout_add_seconds ((guint)MAX (minutes * 60, interval), (GSourceFunc)quit_cb, loop);
+    g_main_loop_run (loop);
+
+    /* the fit starts after the warmup, from at least two samples */
+    for (from = 0; from + 2 < soak.samples->len; from++) {
+        if (g_array_index (soak.samples, Sample, from).wall >= warmup) {
+            break;
+        }
+    }
+    last = &g_array_index (soak.samples, Sample, soak.samples->len - 1);
+
+    g_print ("\n%.1f hours of audio in %.1f minutes (%.0fx), %u errors\n",
+            last->played / 3600, last->wall / 60, last->played / MAX (last->wall, 1e-3),
+            soak.errors);
+    for (guint a = 0; a < G_N_ELEMENTS (soak.counts); a++) {
+        g_print ("%s%s %u", (0 == a) ? "" : ",", action_names[a], soak.counts[a]);
+    }
+    for (guint i = 0; i < soak.ndecks; i++) {
+        swaps += g_atomic_int_get (&soak.decks[i].metrics->swaps);
+    }
+    g_print (", %d swaps\n", swaps);
+
+    if (last->played <= g_array_index (soak.samples, Sample, from).played) {
+        g_printerr ("No audio played after the warmup, nothing to fit\n");
+        ok = FALSE;
+    }
+
+    ok &= check_growth (&soak, from, "rss kB", G_STRUCT_OFFSET (Sample, rss_kb), rss_budget);
+    ok &= check_growth (&soak, from, "heap kB", G_STRUCT_OFFSET (Sample, heap_kb), heap_budget);
+    ok &= check_growth (&soak, from, "blocks", G_STRUCT_OFFSET (Sample, blocks), block_budget);
+    ok &= check_count (&soak, from, "fds", G_STRUCT_OFFSET (Sample, fds));
+    ok &= check_count (&soak, from, "threads", G_STRUCT_OFFSET (Sample, threads));
+
+    g_print ("%-8s %12" G_GUINT64_FORMAT " in %u frames  %s\n", "frame", soak.frame_allocations,
+            soak.frames, (0 == soak.frame_allocations) ? "ok" : "FAIL");
+    ok &= (0 == soak.frame_allocations);
+
+    for (guint i = 0; i < soak.ndecks; i++) {
+        deck_free (&soak.decks[i]);
+        free_audio (&soak.decks[i]);
+    }
+    g_free (soak.decks);
+    g_free (soak.displays);
+
+    if (generated) {
+        for (guint i = 0; i < soak.nuris; i++) {
+            remove_wav (soak.uris[i]);
+        }
+    }
+    g_strfreev (soak.uris);
+    g_array_free (soak.samples, TRUE);
+    g_rand_free (soak.rand);
+    g_main_loop_unref (loop);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/*
+ * Startup benchmark.
+ *
+ * Starts the player or the daemon --runs times, with an empty cache dir
+ * and --no-restore, reads the startup trace it prints (see startup.c) and
+ * stops it again. Prints the median of every phase, the median and worst
+ * time to ready, and fails if the median is over --budget:
+ *
+ *     jackd -d dummy -r 48000 -p 256 &
+ *     ./4deckradio-startbench --program ./4deckradio --budget 300
+ */
+
+#define STARTBENCH_TIMEOUT_MS 20000
+
+typedef struct _Phase {
+    gchar *name;
+    GArray *ms;                     /* gdouble, one per run */
+} Phase;
+
+static GPtrArray *phases;           /* Phase, in the order they're printed */
+static GArray *totals;              /* gdouble */
+
+static Phase* get_phase(const gchar *name) {
+    Phase *phase;
+
+    for (guint i = 0; i < phases->len; i++) {
+        phase = g_ptr_array_index (phases, i);
+        if (0 == strcmp (phase->name, name)) {
+            return phase;
+        }
+    }
+
+    phase = g_new0 (Phase, 1);
+    phase->name = g_strdup (name);
+    phase->ms = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    g_ptr_array_add (phases, phase);
+    return phase;
+}
+
+/* "Startup:   name   12.3 ms" or "Startup: program ready after 212.4 ms".
+ * TRUE on the last one.
+ */
+static gboolean parse_line(gchar *line) {
+    gchar *ms, *name;
+    gdouble value;
+
+    if (!g_str_has_prefix (line, "Startup: ") || !g_str_has_suffix (line, " ms")) {
+        return FALSE;
+    }
+
+    line[strlen (line) - 3] = '\0';
+    ms = strrchr (line, ' ');
+    if (NULL == ms) {
+        return FALSE;
+    }
+    value = g_ascii_strtod (ms + 1, NULL);
+    *ms = '\0';
+
+    if (NULL != strstr (line, " ready after")) {
+        g_array_append_val (totals, value);
+        return TRUE;
+    }
+
+    name = g_strstrip (line + strlen ("Startup: "));
+    g_array_append_val (get_phase (name)->ms, value);
+    return FALSE;
+}
+
+/* Read the child's output until the trace is complete. FALSE if it never
+ * was.
+ */
+static gboolean read_trace(int fd) {
+    GString *buffer = g_string_new (NULL);
+    gint64 deadline = g_get_monotonic_time () + STARTBENCH_TIMEOUT_MS * 1000;
+    gboolean done = FALSE;
+    gchar chunk[4096];
+
+    while (!done) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        gint64 left = (deadline - g_get_monotonic_time ()) / 1000;
+        gchar *end;
+        gssize n;
+
+        if (left <= 0 || poll (&pfd, 1, (int)left) <= 0) {
+            if (left > 0 && EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        n = read (fd, chunk, sizeof (chunk));
+        if (n <= 0) {
+            break;
+        }
+        g_string_append_len (buffer, chunk, n);
+
+        while (!done && NULL != (end = strchr (buffer->str, '\n'))) {
+            *end = '\0';
+            done = parse_line (buffer->str);
+            g_string_erase (buffer, 0, end - buffer->str + 1);
+        }
+    }
+
+    g_string_free (buffer, TRUE);
+    return done;
+}
+
+static gboolean run(gchar **argv, gchar **envp) {
+    GError *error = NULL;
+    GPid pid;
+    gint out;
+    gboolean ok;
+
+    if (!g_spawn_async_with_pipes (NULL, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD,
+                NULL, NULL, &pid, NULL, &out, NULL, &error)) {
+        g_printerr ("Couldn't start %s: %s\n", argv[0], error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    ok = read_trace (out);
+    if (!ok) {
+        g_printerr ("%s printed no startup trace\n", argv[0]);
+    }
+
+    close (out);
+    kill (pid, SIGTERM);
+    waitpid (pid, NULL, 0);
+    g_spawn_close_pid (pid);
+    return ok;
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+static gdouble median(GArray *values) {
+    g_array_sort (values, compare_doubles);
+    return g_array_index (values, gdouble, values->len / 2);
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar *cache, *socket, *decks;
+    gchar **envp;
+    gdouble p50, worst;
+    guint ok = 0;
+    int status;
+
+    gchar *program = NULL;
+    gint runs = 10;
+    gint ndecks = 4;
+    gdouble budget = 300;
+    gboolean engine = FALSE;
+
+    GOptionEntry option_entries[] = {
+        { "program", 'p', 0, G_OPTION_ARG_FILENAME,
+            &program, "4deckradio or 4deckradiod (./4deckradiod)", "PATH" },
+        { "runs", 'r', 0, G_OPTION_ARG_INT,
+            &runs, "How many times to start it (10)", "N" },
+        { "decks", 'n', 0, G_OPTION_ARG_INT,
+            &ndecks, "Number of decks (4)", "N" },
+        { "engine", 'e', 0, G_OPTION_ARG_NONE,
+            &engine, "Start it with --engine", NULL },
+        { "budget", 'b', 0, G_OPTION_ARG_DOUBLE,
+            &budget, "Fail if the median time to ready is over MS (300)", "MS" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- time from exec to a usable player");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    /* no old session to restore, and the user's journal stays alone */
+    cache = g_dir_make_tmp ("4deckradio-startbench-XXXXXX", &error);
+    if (NULL == cache) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    envp = g_environ_setenv (g_get_environ (), "XDG_CACHE_HOME", cache, TRUE);
+    socket = g_build_filename (cache, "control", NULL);
+    decks = g_strdup_printf ("%d", CLAMP (ndecks, 1, 64));
+
+    {
+        gchar *child_argv[] = { (NULL != program) ? program : "./4deckradiod",
+            "--no-restore", "--decks", decks, "--control", socket,
+            engine ? "--engine" : NULL, NULL };
+
+        phases = g_ptr_array_new ();
+        totals = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+        for (gint i = 0; i < MAX (runs, 1); i++) {
+            ok += run (child_argv, envp) ? 1 : 0;
+        }
+    }
+
+    if (0 == ok) {
+        status = 1;
+    } else {
+        for (guint i = 0; i < phases->len; i++) {
+            Phase *phase = g_ptr_array_index (phases, i);
+
+            g_print ("%-28s %8.1f ms\n", phase->name, median (phase->ms));
+        }
+
+        p50 = median (totals);
+        worst = g_array_index (totals, gdouble, totals->len - 1);
+        g_print ("ready after %.1f ms (median of %u), worst %.1f ms, budget %.0f ms\n",
+                p50, ok, worst, budget);
+        status = (p50 > budget) ? 1 : 0;
+    }
+
+    for (guint i = 0; i < phases->len; i++) {
+        Phase *phase = g_ptr_array_index (phases, i);
+
+        g_array_free (phase->ms, TRUE);
+        g_free (phase->name);
+        g_free (phase);
+    }
+    g_ptr_array_free (phases, TRUE);
+    g_array_free (totals, TRUE);
+
+    /* the journal and whatever else the runs left */
+    {
+        gchar *journal = g_build_filename (cache, "4deckradio", NULL);
+        GDir *dir = g_dir_open (journal, 0, NULL);
+        const gchar *name;
+
+        while (NULL != dir && NULL != (name = g_dir_read_name (dir))) {
+            gchar *path = g_build_filename (journal, name, NULL);
+
+            g_unlink (path);
+            g_free (path);
+        }
+        if (NULL != dir) {
+            g_dir_close (dir);
+        }
+        g_rmdir (journal);
+        g_free (journal);
+    }
+    g_unlink (socket);
+    g_rmdir (cache);
+
+    g_strfreev (envp);
+    g_free (socket);
+    g_free (decks);
+    g_free (cache);
+    g_free (program);
+    return status;
+}
@@ -0,0 +1,12 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _STARTUP_H
+#define _STARTUP_H
+
+gint64 startup_process_age(void);
+void startup_mark(const gchar *phase);
+void startup_report(const gchar *program);
+
+#endif /* _STARTUP_H */
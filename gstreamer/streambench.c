@@ -0,0 +1,500 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "control.h"
+#include "controlclient.h"
+
+/*
+ * Network stream benchmark.
+ *
+ * Serves a file from 127.0.0.1 the way Icecast does, looped, without a
+ * Content-Length and paced at the stream's bit rate after an initial
+ * burst. Starts 4deckradiod with one deck, plays the stream on it and
+ * breaks the connection again and again, timing how long the deck takes
+ * to get back to PLAYING:
+ *
+ *     slow-start  the server answers a connection only after --delay ms,
+ *                 timed from LOAD to PLAYING, next to a normal start
+ *     drop        the server closes the connection on air
+ *     stall       the connection on air goes quiet, so this includes the
+ *                 time it takes the deck to notice
+ *
+ * Needs a running jackd:
+ *
+ *     jackd -d dummy -r 48000 -p 256 &
+ *     ./4deckradio-streambench --file song.mp3 --kbps 128
+ */
+
+#define STREAMBENCH_START_TIMEOUT_US (10 * G_USEC_PER_SEC)
+#define STREAMBENCH_STATE_TIMEOUT_US (60 * G_USEC_PER_SEC)
+#define STREAMBENCH_POLL_US 2000
+#define STREAMBENCH_REPLY_TIMEOUT_MS 5000
+#define STREAMBENCH_BURST_S 2           /* Sent right away, as Icecast's burst-size */
+#define STREAMBENCH_TICK_US 50000
+
+typedef enum {
+    FAULT_NONE,
+    FAULT_SLOW_START,
+    FAULT_DROP,
+    FAULT_STALL,
+    FAULT_NUM
+} Fault;
+
+static const gchar *fault_names[FAULT_NUM] = {
+    "start", "slow-start", "drop", "stall"
+};
+
+typedef struct _Server {
+    int listenfd;
+    guint16 port;
+    gchar *content;                 /* The file, looped */
+    gsize length;
+    const gchar *content_type;
+    guint bytes_per_second;
+    gint delay_ms;                  /* Held back before the next answer */
+    gint generation;                /* Bumped by every drop or stall */
+    gint stalling;                  /* What the last bump was */
+    gint stop;
+} Server;
+
+typedef struct _Daemon {
+    GPid pid;
+    int fd;
+    guint32 serial;
+} Daemon;
+
+static Server server;
+
+static gboolean send_all(int fd, const gchar *data, gsize length) {
+    while (length > 0) {
+        ssize_t written = send (fd, data, length, MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return FALSE;
+        }
+        data += written;
+        length -= written;
+    }
+    return TRUE;
+}
+
+/* Send length bytes of the looped file, starting at *offset */
+static gboolean send_content(int fd, gsize *offset, gsize length) {
+    while (length > 0) {
+        gsize chunk = MIN (length, server.length - *offset);
+
+        if (!send_all (fd, server.content + *offset, chunk)) {
+            return FALSE;
+        }
+        *offset = (*offset + chunk) % server.length;
+        length -= chunk;
+    }
+    return TRUE;
+}
+
+/* The request itself doesn't matter, wait for its end */
+static gboolean read_request(int fd) {
+    gchar buffer[4096];
+    gsize length = 0;
+
+    while (length < sizeof (buffer) - 1) {
+        ssize_t got = recv (fd, buffer + length, sizeof (buffer) - 1 - length, 0);
+
+        if (got <= 0) {
+            return FALSE;
+        }
+        length += got;
+        buffer[length] = '\0';
+        if (NULL != strstr (buffer, "\r\n\r\n")) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Holds a stalled connection open until the client gives up on it */
+static void wait_for_close(int fd) {
+    gchar buffer[256];
+
+    while (!g_atomic_int_get (&server.stop)) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        if (poll (&pfd, 1, 100) > 0 && recv (fd, buffer, sizeof (buffer), 0) <= 0) {
+            return;
+        }
+    }
+}
+
+static gpointer connection_thread(gpointer fdp) {
+    int fd = GPOINTER_TO_INT (fdp);
+    gint generation = g_atomic_int_get (&server.generation);
+    gint delay = (gint)g_atomic_int_and ((guint *)&server.delay_ms, 0);
+    gsize offset = 0;
+    gchar *header;
+    gint64 next;
+    gboolean ok;
+
+    if (!read_request (fd)) {
+        close (fd);
+        return NULL;
+    }
+
+    if (delay > 0) {
+        g_usleep ((gulong)delay * 1000);
+    }
+
+    header = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "icy-name: 4deckradio-streambench\r\n"
+            "Cache-Control: no-cache\r\n\r\n", server.content_type);
+    ok = send_all (fd, header, strlen (header)) &&
+            send_content (fd, &offset, (gsize)server.bytes_per_second * STREAMBENCH_BURST_S);
+    g_free (header);
+
+    next = g_get_monotonic_time ();
+    while (ok && !g_atomic_int_get (&server.stop)) {
+        if (generation != g_atomic_int_get (&server.generation)) {
+            if (g_atomic_int_get (&server.stalling)) {
+                wait_for_close (fd);
+            }
+            break;
+        }
+
+        next += STREAMBENCH_TICK_US;
+        ok = send_content (fd, &offset,
+                (gsize)server.bytes_per_second * STREAMBENCH_TICK_US / G_USEC_PER_SEC);
+        if (next > g_get_monotonic_time ()) {
+            g_usleep (next - g_get_monotonic_time ());
+        }
+    }
+
+    close (fd);
+    return NULL;
+}
+
+static gpointer accept_thread(gpointer unused) {
+    while (!g_atomic_int_get (&server.stop)) {
+        struct pollfd pfd = { server.listenfd, POLLIN, 0 };
+        int fd;
+
+        if (poll (&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        fd = accept (server.listenfd, NULL, NULL);
+        if (fd >= 0) {
+            g_thread_unref (g_thread_new ("connection", connection_thread, GINT_TO_POINTER (fd)));
+        }
+    }
+    return NULL;
+}
+
+static gboolean start_server(void) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof (addr);
+
+    server.listenfd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listenfd < 0) {
+        perror ("Couldn't create the server socket");
+        return FALSE;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if (0 != bind (server.listenfd, (struct sockaddr *)&addr, sizeof (addr)) ||
+            0 != listen (server.listenfd, 16) ||
+            0 != getsockname (server.listenfd, (struct sockaddr *)&addr, &addrlen)) {
+        perror ("Couldn't listen on 127.0.0.1");
+        close (server.listenfd);
+        return FALSE;
+    }
+
+    server.port = ntohs (addr.sin_port);
+    return TRUE;
+}
+
+static const gchar* guess_content_type(const gchar *file) {
+    if (g_str_has_suffix (file, ".mp3")) {
+        return "audio/mpeg";
+    } else if (g_str_has_suffix (file, ".ogg") || g_str_has_suffix (file, ".opus")) {
+        return "application/ogg";
+    } else if (g_str_has_suffix (file, ".aac")) {
+        return "audio/aac";
+    } else if (g_str_has_suffix (file, ".flac")) {
+        return "audio/flac";
+    }
+    return "application/octet-stream";
+}
+
+static gboolean request(Daemon *daemon, ControlCommand command, const gchar *uri,
+        ControlReply *reply) {
+    daemon->serial++;
+    return control_send (daemon->fd, daemon->serial, command, 0, 0, uri) &&
+            control_wait_reply (daemon->fd, daemon->serial, reply, STREAMBENCH_REPLY_TIMEOUT_MS) &&
+            CONTROL_OK == reply->status;
+}
+
+/* Until the deck is in state (TRUE), or not in it any more (FALSE) */
+static gboolean wait_state(Daemon *daemon, DeckState state, gboolean in) {
+    gint64 deadline = g_get_monotonic_time () + STREAMBENCH_STATE_TIMEOUT_US;
+    ControlReply reply;
+
+    while (g_get_monotonic_time () < deadline) {
+        if (!request (daemon, CONTROL_STATUS, NULL, &reply) ||
+                DECK_ERROR == reply.deckstate) {
+            return FALSE;
+        }
+        if ((state == reply.deckstate) == in) {
+            return TRUE;
+        }
+        g_usleep (STREAMBENCH_POLL_US);
+    }
+
+    return FALSE;
+}
+
+static gboolean start_daemon(Daemon *daemon, const gchar *binary, const gchar *path,
+        const gchar *prebuffer) {
+    gchar *argv[] = { (gchar *)binary, "--engine", "--decks", "1",
+        "--control", (gchar *)path, "--prebuffer", (gchar *)prebuffer, NULL };
+    GError *error = NULL;
+    gint64 deadline;
+
+    if (!g_spawn_async (NULL, argv, NULL,
+                G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+                NULL, NULL, &daemon->pid, &error)) {
+        g_printerr ("Couldn't start %s: %s\n", binary, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    deadline = g_get_monotonic_time () + STREAMBENCH_START_TIMEOUT_US;
+    while ((daemon->fd = control_connect (path)) < 0) {
+        if (g_get_monotonic_time () > deadline ||
+                0 != waitpid (daemon->pid, NULL, WNOHANG)) {
+            g_printerr ("%s didn't come up\n", binary);
+            kill (daemon->pid, SIGKILL);
+            waitpid (daemon->pid, NULL, 0);
+            return FALSE;
+        }
+        g_usleep (10000);
+    }
+
+    daemon->serial = 0;
+    return TRUE;
+}
+
+static void stop_daemon(Daemon *daemon) {
+    close (daemon->fd);
+    kill (daemon->pid, SIGTERM);
+    waitpid (daemon->pid, NULL, 0);
+    g_spawn_close_pid (daemon->pid);
+}
+
+/* LOAD and PLAY, until PLAYING. Milliseconds, negative if it never got there. */
+static gdouble time_start(Daemon *daemon, const gchar *uri, gint delay_ms) {
+    ControlReply reply;
+    gint64 start;
+
+    request (daemon, CONTROL_STOP, NULL, &reply);
+    wait_state (daemon, DECK_STOPPED, TRUE);
+
+    g_atomic_int_set (&server.delay_ms, delay_ms);
+    start = g_get_monotonic_time ();
+    if (!request (daemon, CONTROL_LOAD, uri, &reply) ||
+            !request (daemon, CONTROL_PLAY, NULL, &reply) ||
+            !wait_state (daemon, DECK_PLAYING, TRUE)) {
+        return -1;
+    }
+
+    return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+/* Break the connection on air, until PLAYING again */
+static gdouble time_recovery(Daemon *daemon, Fault fault, gdouble on_air) {
+    gint64 start;
+
+    if (!wait_state (daemon, DECK_PLAYING, TRUE)) {
+        return -1;
+    }
+    g_usleep ((gulong)(on_air * G_USEC_PER_SEC));
+
+    start = g_get_monotonic_time ();
+    g_atomic_int_set (&server.stalling, FAULT_STALL == fault);
+    g_atomic_int_inc (&server.generation);
+
+    /* the deck notices, reconnects and prebuffers */
+    if (!wait_state (daemon, DECK_PLAYING, FALSE) ||
+            !wait_state (daemon, DECK_PLAYING, TRUE)) {
+        return -1;
+    }
+
+    return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank */
+static gdouble percentile(GArray *sorted, gdouble q) {
+    guint rank = (guint)ceil (q * sorted->len);
+
+    return g_array_index (sorted, gdouble, CLAMP (rank, 1, sorted->len) - 1);
+}
+
+static void print_results(Fault fault, GArray *results, guint failed) {
+    if (0 == results->len) {
+        g_print ("%-10s  no deck got to PLAYING (%u failed)\n", fault_names[fault], failed);
+        return;
+    }
+
+    g_array_sort (results, compare_doubles);
+    g_print ("%-10s  n=%-4u p50 %8.1f  p90 %8.1f  max %8.1f ms  (%u failed)\n",
+            fault_names[fault], results->len, percentile (results, 0.50),
+            percentile (results, 0.90),
+            g_array_index (results, gdouble, results->len - 1), failed);
+}
+
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GError *error = NULL;
+    GThread *thread;
+    GArray *results[FAULT_NUM];
+    guint failed[FAULT_NUM];
+    Daemon daemon;
+    gchar *path, *uri, *prebuffer;
+
+    gchar *binary = NULL;
+    gchar *file = NULL;
+    gint kbps = 128;
+    gint runs = 10;
+    gint delay_ms = 2000;
+    gint prebuffer_ms = 1000;
+    gdouble on_air = 3;
+
+    GOptionEntry option_entries[] = {
+        { "daemon", 'd', 0, G_OPTION_ARG_FILENAME,
+            &binary, "The daemon to run (./4deckradiod)", "PATH" },
+        { "file", 'f', 0, G_OPTION_ARG_FILENAME,
+            &file, "Compressed audio file to serve as the stream", "FILE" },
+        { "kbps", 'b', 0, G_OPTION_ARG_INT,
+            &kbps, "Bit rate of the file, the server paces it (128)", "KBPS" },
+        { "runs", 'r', 0, G_OPTION_ARG_INT,
+            &runs, "Rounds of each fault (10)", "N" },
+        { "delay", 'w', 0, G_OPTION_ARG_INT,
+            &delay_ms, "How long a slow start keeps the deck waiting (2000)", "MS" },
+        { "prebuffer", 'p', 0, G_OPTION_ARG_INT,
+            &prebuffer_ms, "Passed on to the daemon (1000)", "MS" },
+        { "on-air", 's', 0, G_OPTION_ARG_DOUBLE,
+            &on_air, "Seconds of playing before each fault (3)", "S" },
+        { NULL, ' ', 0, 0, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new ("- how quickly a stream deck starts and recovers");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (NULL == file) {
+        g_printerr ("Which file? Use --file\n");
+        return 1;
+    }
+    if (!g_file_get_contents (file, &server.content, &server.length, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    if (0 == server.length || kbps < 1) {
+        g_printerr ("Nothing to stream\n");
+        return 1;
+    }
+    server.content_type = guess_content_type (file);
+    server.bytes_per_second = (guint)kbps * 1000 / 8;
+
+    if (!start_server ()) {
+        return 1;
+    }
+    thread = g_thread_new ("accept", accept_thread, NULL);
+
+    uri = g_strdup_printf ("http://127.0.0.1:%u/stream", server.port);
+    path = g_strdup_printf ("%s/4deckradio-streambench-%d.control", g_get_tmp_dir (), (int)getpid ());
+    prebuffer = g_strdup_printf ("%d", MAX (prebuffer_ms, 0));
+
+    if (!start_daemon (&daemon, (NULL != binary) ? binary : "./4deckradiod", path, prebuffer)) {
+        return 1;
+    }
+
+    for (guint f = 0; f < FAULT_NUM; f++) {
+        results[f] = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        failed[f] = 0;
+    }
+
+    for (gint r = 0; r < MAX (runs, 1); r++) {
+        for (guint f = 0; f < FAULT_NUM; f++) {
+            gdouble ms;
+
+            switch (f) {
+                case FAULT_NONE:
+                    ms = time_start (&daemon, uri, 0);
+                    break;
+                case FAULT_SLOW_START:
+                    ms = time_start (&daemon, uri, delay_ms);
+                    break;
+                default:
+                    ms = time_recovery (&daemon, f, MAX (on_air, 0));
+                    break;
+            }
+
+            if (ms < 0) {
+                failed[f]++;
+            } else {
+                g_array_append_val (results[f], ms);
+            }
+        }
+    }
+
+    g_print ("%s at %d kbps, prebuffer %d ms, slow starts held %d ms\n",
+            file, kbps, prebuffer_ms, delay_ms);
+    for (guint f = 0; f < FAULT_NUM; f++) {
+        print_results (f, results[f], failed[f]);
+        g_array_free (results[f], TRUE);
+    }
+
+    stop_daemon (&daemon);
+    g_atomic_int_set (&server.stop, TRUE);
+    g_thread_join (thread);
+    close (server.listenfd);
+
+    g_free (server.content);
+    g_free (prebuffer);
+    g_free (path);
+    g_free (uri);
+    g_free (binary);
+    g_free (file);
+    return 0;
+}
@@ -0,0 +1,186 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "mygstreamer.h"
+#include "deck.h"
+#include "timedisplay.h"
+
+/*
+ * The position, colour and text of a deck's time display, worked out on
+ * every frame. The pipeline is only asked for its position after a
+ * discontinuity (see time_display_invalidate()); in between, the position
+ * is moved on by the pipeline clock. Steady frames don't allocate, which
+ * soakbench.c checks on this very code. Whatever the caller does with the
+ * result, such as updating widgets, is up to it.
+ */
+
+#define TIME_DISPLAY_RETRY_US (100 * 1000)
+
+void time_display_init(TimeDisplay *display, CustomData *deck) {
+    memset (display, 0, sizeof (*display));
+    display->deck = deck;
+    display->position_running = GST_CLOCK_TIME_NONE;
+    display->tenths = -1;
+}
+
+/* Forget the position, it's re-read from the pipeline on the next frame */
+void time_display_invalidate(TimeDisplay *display) {
+    display->position_valid = FALSE;
+    display->resync_at = 0;
+}
+
+/* Running time of the pipeline, if it's playing */
+static GstClockTime get_running_time(CustomData *deck) {
+    GstClock *clock;
+    GstClockTime now;
+
+    if (DECK_PLAYING != deck->deckstate) {
+        return GST_CLOCK_TIME_NONE;
+    }
+
+    clock = gst_element_get_clock (deck->active->pipeline);
+    if (NULL == clock) {
+        return GST_CLOCK_TIME_NONE;
+    }
+
+    now = gst_clock_get_time (clock);
+    gst_object_unref (clock);
+
+    return now - gst_element_get_base_time (deck->active->pipeline);
+}
+
+/* Query position (and duration, if we don't know it yet) after a
+ * discontinuity. Returns FALSE if the pipeline couldn't tell us.
+ */
+static gboolean resync_position(TimeDisplay *display, guint *changed) {
+    CustomData *deck = display->deck;
+    GstFormat fmt = GST_FORMAT_TIME;
+    gint64 current = -1;
+
+    /* If we didn't know it yet, query the stream duration */
+    if (!GST_CLOCK_TIME_IS_VALID (deck->duration)) {
+#if GST_VERSION_MAJOR == (0)
+        if (!gst_element_query_duration (deck->active->pipeline, &fmt, &deck->duration))
+#else
+        if (!gst_element_query_duration (deck->active->pipeline, fmt, &deck->duration))
+#endif
+        {
+            g_printerr ("Could not query current duration.\n");
+        } else {
+            *changed |= TIME_DISPLAY_DURATION;
+        }
+    }
+
+#if GST_VERSION_MAJOR == (0)
+    if (!gst_element_query_position (deck->active->pipeline, &fmt, &current))
+#else
+    if (!gst_element_query_position (deck->active->pipeline, fmt, &current))
+#endif
+    {
+        return FALSE;
+    }
+
+    display->position = current;
+    display->position_running = get_running_time (deck);
+    display->position_valid = TRUE;
+    display->tenths = -1;
+
+    return TRUE;
+}
+
+/* Where the deck is now: the last queried position, moved on by the
+ * pipeline clock while playing. No round-trip into the pipeline.
+ */
+static gint64 current_position(TimeDisplay *display) {
+    GstClockTime running;
+
+    if (!GST_CLOCK_TIME_IS_VALID (display->position_running)) {
+        return display->position;
+    }
+
+    running = get_running_time (display->deck);
+    if (!GST_CLOCK_TIME_IS_VALID (running) || running < display->position_running) {
+        return display->position;
+    }
+
+    return display->position + (running - display->position_running);
+}
+
+/* Work out what the display shows now. Returns the TIME_DISPLAY_* flags
+ * of what changed, 0 if it stays as it is.
+ */
+guint time_display_update(TimeDisplay *display) {
+    CustomData *deck = display->deck;
+    TimeDisplayColor color = TIME_DISPLAY_PLAIN;
+    guint changed = 0;
+    gint64 current;
+    gint64 end;
+    gint64 tenths;
+
+    /* Nothing to show unless we are in the PAUSED or PLAYING states */
+    if (deck->active->state < GST_STATE_PAUSED) {
+        return 0;
+    }
+
+    if (!display->position_valid) {
+        gint64 now = g_get_monotonic_time ();
+
+        /* don't hammer a pipeline that can't answer yet */
+        if (now < display->resync_at) {
+            return 0;
+        }
+        display->resync_at = now + TIME_DISPLAY_RETRY_US;
+
+        changed |= TIME_DISPLAY_QUERIED;
+        if (!resync_position (display, &changed)) {
+            return changed;
+        }
+    }
+
+    current = current_position (display);
+    if (GST_CLOCK_TIME_IS_VALID (deck->duration) && !deck->active->is_network_stream) {
+        current = MIN (current, deck->duration);
+    }
+
+    /* the deck moves on at cue-out, that's what's left to play */
+    end = deck->duration;
+    if (GST_CLOCK_TIME_IS_VALID (deck->active->cue_out) && GST_CLOCK_TIME_IS_VALID (end)) {
+        end = MIN (end, deck->active->cue_out);
+    }
+
+    if (DECK_PLAYING == deck->deckstate) {
+        GstClockTimeDiff remaining = end - current;
+
+        if (remaining < 0.5 * end) {
+            if (remaining < 0.25 * end) {
+                color = TIME_DISPLAY_RED;
+            } else {
+                color = TIME_DISPLAY_YELLOW;
+            }
+        } else {
+            color = TIME_DISPLAY_GREEN;
+        }
+    }
+
+    /* Only redraw if what it shows changes */
+    tenths = current / (GST_SECOND / 10);
+    if (tenths == display->tenths && color == display->color) {
+        return changed;
+    }
+
+    if (tenths / 10 != display->tenths / 10) {
+        changed |= TIME_DISPLAY_SECONDS;
+    }
+
+    display->current = current;
+    display->tenths = tenths;
+    display->color = color;
+    deck_format_time (display->text, sizeof (display->text), current, MAX (0, end - current),
+            deck->duration);
+
+    return changed | TIME_DISPLAY_TEXT;
+}
@@ -0,0 +1,41 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _TIMEDISPLAY_H
+#define _TIMEDISPLAY_H
+
+typedef enum {
+    TIME_DISPLAY_PLAIN,             /* Not playing */
+    TIME_DISPLAY_GREEN,             /* Less than half of it played */
+    TIME_DISPLAY_YELLOW,            /* Less than three quarters */
+    TIME_DISPLAY_RED
+} TimeDisplayColor;
+
+/* What time_display_update() changed */
+enum {
+    TIME_DISPLAY_DURATION = 1 << 0, /* The deck's duration just became known */
+    TIME_DISPLAY_SECONDS = 1 << 1,  /* current moved to another second */
+    TIME_DISPLAY_TEXT = 1 << 2,     /* text or color changed */
+    TIME_DISPLAY_QUERIED = 1 << 3   /* Asked the pipeline, which allocates */
+};
+
+/* One deck's time display, carried from frame to frame */
+typedef struct _TimeDisplay {
+    CustomData *deck;
+    gboolean position_valid;        /* position is current, see time_display_update() */
+    gint64 position;                /* Stream position at the last query */
+    GstClockTime position_running;  /* Pipeline running time of that query, if playing */
+    gint64 resync_at;               /* Don't query again before this monotonic time */
+
+    gint64 current;                 /* Where the deck is, as shown */
+    gint64 tenths;                  /* Of current, -1 after a query */
+    TimeDisplayColor color;
+    gchar text[DECK_TIME_LENGTH];   /* See deck_format_time() */
+} TimeDisplay;
+
+void time_display_init(TimeDisplay *display, CustomData *deck);
+void time_display_invalidate(TimeDisplay *display);
+guint time_display_update(TimeDisplay *display);
+
+#endif /* _TIMEDISPLAY_H */
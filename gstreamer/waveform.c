@@ -0,0 +1,478 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#if GST_VERSION_MAJOR != (0)
+#include <gst/app/gstappsink.h>
+#endif
+#include "waveform.h"
+
+/*
+ * Waveform overviews for the deck sliders.
+ *
+ * A small thread pool decodes files as fast as it can (an appsink without
+ * sync, never one of the playing pipelines) and reduces them to peak/RMS
+ * bins of WAVEFORM_BIN_US each. Coarser levels are built by halving until
+ * fewer than WAVEFORM_MIN_BINS are left. The result goes to a cache file
+ * under ~/.cache/4deckradio/waveforms, named after a hash of path, size
+ * and mtime, so any file seen before is one mmap away.
+ *
+ * The same pass finds the cue points: every finest bin also gets its peak
+ * in dBFS (WAVEFORM_DB_STEPS per dB below full scale), so the cue-in and
+ * cue-out for any --cue-threshold are a scan over one byte per bin.
+ *
+ * Cache file: a WaveformHeader, then the levels one after another, finest
+ * first, as WaveformBin arrays, then the nbins[0] peak levels.
+ */
+
+#define WAVEFORM_MAGIC "4DWF"
+#define WAVEFORM_VERSION 2
+#define WAVEFORM_BIN_US 10000           /* Finest resolution, 10 ms */
+#define WAVEFORM_MIN_BINS 256
+#define WAVEFORM_MAX_LEVELS 16
+#define WAVEFORM_MAX_THREADS 2
+#define WAVEFORM_DB_STEPS 2                     /* Peak levels in 0.5 dB steps */
+
+typedef struct _WaveformHeader {
+    gchar magic[4];
+    guint32 version;
+    guint64 size;                       /* Of the audio file, to spot stale entries */
+    gint64 mtime;
+    guint32 bin_us;
+    guint32 nlevels;
+    guint32 nbins[WAVEFORM_MAX_LEVELS];
+} WaveformHeader;
+
+struct _Waveform {
+    GMappedFile *file;
+    const WaveformHeader *header;
+    const WaveformBin *levels[WAVEFORM_MAX_LEVELS];
+    const guint8 *peak_db;              /* -dBFS * WAVEFORM_DB_STEPS per finest bin */
+};
+
+typedef struct _WaveformJob {
+    gchar *uri;
+    WaveformReadyFunc func;
+    gpointer user_data;
+} WaveformJob;
+
+static GThreadPool *pool;
+static GHashTable *pending;             /* URIs queued or being analysed */
+static GMutex pending_lock;
+static gint cancel;
+static gdouble cue_threshold = WAVEFORM_DEFAULT_CUE_THRESHOLD;
+
+/* Where the overview of uri lives. NULL for anything but local files. */
+static gchar* cache_path(const gchar *uri, GStatBuf *st) {
+    gchar *filename = g_filename_from_uri (uri, NULL, NULL);
+    gchar *key, *hash, *dir, *path;
+
+    if (NULL == filename || 0 != g_stat (filename, st)) {
+        g_free (filename);
+        return NULL;
+    }
+
+    key = g_strdup_printf ("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT,
+            filename, (gint64)st->st_size, (gint64)st->st_mtime);
+    hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+
+    dir = g_build_filename (g_get_user_cache_dir (), "4deckradio", "waveforms", NULL);
+    path = g_build_filename (dir, hash, NULL);
+
+    g_free (dir);
+    g_free (hash);
+    g_free (key);
+    g_free (filename);
+
+    return path;
+}
+
+Waveform* waveform_lookup(const gchar *uri) {
+    GStatBuf st;
+    gchar *path = cache_path (uri, &st);
+    GMappedFile *file;
+    const WaveformHeader *header;
+    const gchar *contents;
+    gsize length, offset;
+    Waveform *waveform;
+
+    if (NULL == path) {
+        return NULL;
+    }
+
+    file = g_mapped_file_new (path, FALSE, NULL);
+    g_free (path);
+    if (NULL == file) {
+        return NULL;
+    }
+
+    contents = g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+    header = (const WaveformHeader *)contents;
+
+    if (length < sizeof (WaveformHeader) ||
+            0 != memcmp (header->magic, WAVEFORM_MAGIC, 4) ||
+            WAVEFORM_VERSION != header->version ||
+            (guint64)st.st_size != header->size || (gint64)st.st_mtime != header->mtime ||
+            0 == header->nlevels || header->nlevels > WAVEFORM_MAX_LEVELS) {
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    waveform = g_new0 (Waveform, 1);
+    waveform->file = file;
+    waveform->header = header;
+
+    offset = sizeof (WaveformHeader);
+    for (guint i = 0; i < header->nlevels; i++) {
+        if (offset + header->nbins[i] * sizeof (WaveformBin) > length) {
+            waveform_free (waveform);
+            return NULL;
+        }
+        waveform->levels[i] = (const WaveformBin *)(contents + offset);
+        offset += header->nbins[i] * sizeof (WaveformBin);
+    }
+
+    if (offset + header->nbins[0] > length) {
+        waveform_free (waveform);
+        return NULL;
+    }
+    waveform->peak_db = (const guint8 *)(contents + offset);
+
+    return waveform;
+}
+
+void waveform_free(Waveform *waveform) {
+    if (NULL == waveform) {
+        return;
+    }
+
+    g_mapped_file_unref (waveform->file);
+    g_free (waveform);
+}
+
+/* The coarsest level that still has at least min_bins bins */
+const WaveformBin* waveform_get_bins(Waveform *waveform, guint min_bins, guint *nbins) {
+    guint level = 0;
+
+    while (level + 1 < waveform->header->nlevels &&
+            waveform->header->nbins[level + 1] >= min_bins) {
+        level++;
+    }
+
+    *nbins = waveform->header->nbins[level];
+    return waveform->levels[level];
+}
+
+gint64 waveform_get_duration(Waveform *waveform) {
+    return (gint64)waveform->header->nbins[0] * waveform->header->bin_us * GST_USECOND;
+}
+
+/* Anything quieter than db dBFS counts as silence for the cue points */
+void waveform_set_cue_threshold(gdouble db) {
+    cue_threshold = db;
+}
+
+/* Where the audio starts and ends, in nanoseconds. FALSE if it's silent
+ * from start to end.
+ */
+gboolean waveform_get_cues(Waveform *waveform, gint64 *cue_in, gint64 *cue_out) {
+    guint nbins = waveform->header->nbins[0];
+    guint8 audible = (guint8)CLAMP (lrint (-cue_threshold * WAVEFORM_DB_STEPS), 0, 255);
+    guint first = 0, last = nbins;
+
+    while (first < nbins && waveform->peak_db[first] > audible) {
+        first++;
+    }
+    if (first == nbins) {
+        return FALSE;
+    }
+    while (waveform->peak_db[last - 1] > audible) {
+        last--;
+    }
+
+    *cue_in = (gint64)first * waveform->header->bin_us * GST_USECOND;
+    *cue_out = (gint64)last * waveform->header->bin_us * GST_USECOND;
+    return TRUE;
+}
+
+static inline guint8 quantize(gdouble value) {
+    return (guint8)CLAMP (lrint (value * 255.0), 0, 255);
+}
+
+/* Halve a level: the louder peak, the combined RMS */
+static GArray* reduce(const GArray *finer) {
+    GArray *coarser = g_array_sized_new (FALSE, FALSE, sizeof (WaveformBin), finer->len / 2 + 1);
+
+    for (guint i = 0; i < finer->len; i += 2) {
+        const WaveformBin *a = &g_array_index (finer, WaveformBin, i);
+        const WaveformBin *b = (i + 1 < finer->len) ? a + 1 : a;
+        WaveformBin bin;
+
+        bin.peak = MAX (a->peak, b->peak);
+        bin.rms = (guint8)lrint (sqrt ((a->rms * a->rms + b->rms * b->rms) / 2.0));
+        g_array_append_val (coarser, bin);
+    }
+
+    return coarser;
+}
+
+static inline guint8 quantize_db(gdouble peak) {
+    gdouble db = 20 * log10 (MAX (peak, 1e-7));
+
+    return (guint8)CLAMP (lrint (-db * WAVEFORM_DB_STEPS), 0, 255);
+}
+
+static gboolean write_cache(const gchar *uri, GArray *bins, GArray *peak_db) {
+    GStatBuf st;
+    gchar *path = cache_path (uri, &st);
+    gchar *dir;
+    GArray *levels[WAVEFORM_MAX_LEVELS];
+    WaveformHeader header;
+    GByteArray *contents;
+    gboolean ok;
+
+    if (NULL == path) {
+        return FALSE;
+    }
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, WAVEFORM_MAGIC, 4);
+    header.version = WAVEFORM_VERSION;
+    header.size = st.st_size;
+    header.mtime = st.st_mtime;
+    header.bin_us = WAVEFORM_BIN_US;
+
+    levels[0] = bins;
+    header.nlevels = 1;
+    while (header.nlevels < WAVEFORM_MAX_LEVELS &&
+            levels[header.nlevels - 1]->len > WAVEFORM_MIN_BINS) {
+        levels[header.nlevels] = reduce (levels[header.nlevels - 1]);
+        header.nlevels++;
+    }
+
+    contents = g_byte_array_new ();
+    for (guint i = 0; i < header.nlevels; i++) {
+        header.nbins[i] = levels[i]->len;
+    }
+    g_byte_array_append (contents, (const guint8 *)&header, sizeof (header));
+    for (guint i = 0; i < header.nlevels; i++) {
+        g_byte_array_append (contents, (const guint8 *)levels[i]->data,
+                levels[i]->len * sizeof (WaveformBin));
+        if (i > 0) {
+            g_array_free (levels[i], TRUE);
+        }
+    }
+    g_byte_array_append (contents, (const guint8 *)peak_db->data, peak_db->len);
+
+    dir = g_path_get_dirname (path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    /* written to a temporary file and renamed, readers never see half of it */
+    ok = g_file_set_contents (path, (const gchar *)contents->data, contents->len, NULL);
+
+    g_byte_array_free (contents, TRUE);
+    g_free (path);
+
+    return ok;
+}
+
+#if GST_VERSION_MAJOR == (0)
+static GArray* analyse(const gchar *uri, GArray **peak_db) {
+    return NULL;
+}
+#else
+/* Decode uri to mono floats and reduce it to the finest level, plus the
+ * peak level of every bin
+ */
+static GArray* analyse(const gchar *uri, GArray **peak_db) {
+    GstElement *pipeline, *decoder, *sink;
+    GstBus *bus;
+    GArray *bins = g_array_new (FALSE, FALSE, sizeof (WaveformBin));
+    GArray *levels = g_array_new (FALSE, FALSE, sizeof (guint8));
+    GError *error = NULL;
+    gchar *description;
+    gboolean ok = TRUE;
+    guint bin_frames = 0;
+    guint frames = 0;
+    gfloat peak = 0;
+    gdouble sum = 0;
+
+    description = g_strdup_printf ("uridecodebin name=decoder ! audioconvert ! "
+            "audio/x-raw, format=(string)%s, channels=(int)1 ! appsink name=sink sync=false",
+            G_BYTE_ORDER == G_BIG_ENDIAN ? "F32BE" : "F32LE");
+    pipeline = gst_parse_launch (description, &error);
+    g_free (description);
+    if (NULL == pipeline) {
+        g_printerr ("Couldn't create waveform decoder: %s\n", error->message);
+        g_clear_error (&error);
+        g_array_free (bins, TRUE);
+        g_array_free (levels, TRUE);
+        return NULL;
+    }
+
+    decoder = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    g_object_set (decoder, "uri", uri, NULL);
+    bus = gst_element_get_bus (pipeline);
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+    while (!g_atomic_int_get (&cancel)) {
+        GstSample *sample = gst_app_sink_try_pull_sample (GST_APP_SINK (sink),
+                100 * GST_MSECOND);
+        GstMessage *msg;
+
+        if (NULL != sample) {
+            GstBuffer *buffer = gst_sample_get_buffer (sample);
+            GstMapInfo map;
+
+            if (0 == bin_frames) {
+                gint rate = 0;
+
+                gst_structure_get_int (gst_caps_get_structure (
+                            gst_sample_get_caps (sample), 0), "rate", &rate);
+                bin_frames = MAX (1, (guint)((gint64)rate * WAVEFORM_BIN_US / G_USEC_PER_SEC));
+            }
+
+            if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+                const gfloat *samples = (const gfloat *)map.data;
+
+                for (gsize i = 0; i < map.size / sizeof (gfloat); i++) {
+                    peak = MAX (peak, fabsf (samples[i]));
+                    sum += samples[i] * samples[i];
+
+                    if (++frames == bin_frames) {
+                        WaveformBin bin = { quantize (peak), quantize (sqrt (sum / frames)) };
+                        guint8 level = quantize_db (peak);
+
+                        g_array_append_val (bins, bin);
+                        g_array_append_val (levels, level);
+                        frames = 0;
+                        peak = 0;
+                        sum = 0;
+                    }
+                }
+                gst_buffer_unmap (buffer, &map);
+            }
+            gst_sample_unref (sample);
+            continue;
+        }
+
+        if (gst_app_sink_is_eos (GST_APP_SINK (sink))) {
+            break;
+        }
+
+        msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+        if (NULL != msg) {
+            gst_message_parse_error (msg, &error, NULL);
+            g_printerr ("Couldn't analyse %s: %s\n", uri, error->message);
+            g_clear_error (&error);
+            gst_message_unref (msg);
+            ok = FALSE;
+            break;
+        }
+    }
+
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (bus);
+    gst_object_unref (sink);
+    gst_object_unref (decoder);
+    gst_object_unref (pipeline);
+
+    if (!ok || g_atomic_int_get (&cancel) || 0 == bins->len) {
+        g_array_free (bins, TRUE);
+        g_array_free (levels, TRUE);
+        return NULL;
+    }
+
+    *peak_db = levels;
+    return bins;
+}
+#endif
+
+static gboolean ready_cb(WaveformJob *job) {
+    if (NULL != job->func) {
+        job->func (job->uri, job->user_data);
+    }
+
+    g_free (job->uri);
+    g_free (job);
+
+    return FALSE;
+}
+
+static void analysis_worker(WaveformJob *job, gpointer unused) {
+    gint64 start = g_get_monotonic_time ();
+    GArray *peak_db = NULL;
+    GArray *bins = analyse (job->uri, &peak_db);
+
+    if (NULL != bins) {
+        if (write_cache (job->uri, bins, peak_db)) {
+            g_print ("Waveform of %s: %.1f s of audio in %.0f ms\n", job->uri,
+                    bins->len * (WAVEFORM_BIN_US / 1e6),
+                    (g_get_monotonic_time () - start) / 1000.0);
+        }
+        g_array_free (bins, TRUE);
+        g_array_free (peak_db, TRUE);
+    }
+
+    g_mutex_lock (&pending_lock);
+    g_hash_table_remove (pending, job->uri);
+    g_mutex_unlock (&pending_lock);
+
+    g_idle_add ((GSourceFunc)ready_cb, job);
+}
+
+void waveform_init(void) {
+    guint threads = CLAMP (g_get_num_processors () / 2, 1, WAVEFORM_MAX_THREADS);
+
+    pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    pool = g_thread_pool_new ((GFunc)analysis_worker, NULL, threads, FALSE, NULL);
+}
+
+void waveform_shutdown(void) {
+    if (NULL == pool) {
+        return;
+    }
+
+    /* drop what's queued, cut the running analyses short */
+    g_atomic_int_set (&cancel, TRUE);
+    g_thread_pool_free (pool, TRUE, TRUE);
+    pool = NULL;
+
+    g_hash_table_destroy (pending);
+    pending = NULL;
+}
+
+/* Analyse uri in the background, unless that's already under way or
+ * pointless. func is called once the cache has been written.
+ */
+void waveform_request(const gchar *uri, WaveformReadyFunc func, gpointer user_data) {
+    WaveformJob *job;
+
+    if (NULL == pool || !g_str_has_prefix (uri, "file://")) {
+        return;
+    }
+
+    g_mutex_lock (&pending_lock);
+    if (g_hash_table_contains (pending, uri)) {
+        g_mutex_unlock (&pending_lock);
+        return;
+    }
+    g_hash_table_add (pending, g_strdup (uri));
+    g_mutex_unlock (&pending_lock);
+
+    job = g_new0 (WaveformJob, 1);
+    job->uri = g_strdup (uri);
+    job->func = func;
+    job->user_data = user_data;
+
+    g_thread_pool_push (pool, job, NULL);
+}
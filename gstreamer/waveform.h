@@ -0,0 +1,33 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _WAVEFORM_H
+#define _WAVEFORM_H
+
+/* Peaks below this many dBFS count as silence for the cue points */
+#define WAVEFORM_DEFAULT_CUE_THRESHOLD (-50.0)
+
+/* A cached overview, mapped read-only from the cache file */
+typedef struct _Waveform Waveform;
+
+/* One bin of an overview level, both scaled to 0..255 of full scale */
+typedef struct _WaveformBin {
+    guint8 peak;
+    guint8 rms;
+} WaveformBin;
+
+/* Called on the main loop once the analysis of uri is done */
+typedef void (*WaveformReadyFunc) (const gchar *uri, gpointer user_data);
+
+void waveform_init(void);
+void waveform_shutdown(void);
+Waveform* waveform_lookup(const gchar *uri);
+void waveform_request(const gchar *uri, WaveformReadyFunc func, gpointer user_data);
+const WaveformBin* waveform_get_bins(Waveform *waveform, guint min_bins, guint *nbins);
+gint64 waveform_get_duration(Waveform *waveform);
+void waveform_set_cue_threshold(gdouble db);
+gboolean waveform_get_cues(Waveform *waveform, gint64 *cue_in, gint64 *cue_out);
+void waveform_free(Waveform *waveform);
+
+#endif /* _WAVEFORM_H */